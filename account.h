@@ -34,7 +34,8 @@ typedef enum
 	LOGIN_SUCCESS,
 	INCORRECT_PASSWORD,
 	UNKNOWN_ACCOUNT,
-	ACCOUNT_IN_USE
+	ACCOUNT_IN_USE,
+	INVALID_TOKEN /* The session token in SID_RESUME was expired, or wasn't made here */
 } login_response_t;
 
 /* Log in.  The password can be calculated as, H(client_token . server_token . H(password)).  The tokens are 
@@ -0,0 +1,32 @@
+/* atomic */
+/* These are the few operations on shared numbers that are needed once more than one thread
+ * is sending (see worker.h): adding to a total that another thread might be adding to at the
+ * same time, keeping track of the highest a total has been, and making sure that what one
+ * thread wrote is seen by another in the order it was written.
+ *
+ * They're GCC's builtins (which clang has too), since C89 doesn't have anything like them.
+ * They work on any integer up to the size of a pointer. */
+
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+/* Add to, or take away from, a number all at once.  These return the new value. */
+#define ATOMIC_ADD(number, amount) __sync_add_and_fetch(&(number), (amount))
+#define ATOMIC_SUB(number, amount) __sync_sub_and_fetch(&(number), (amount))
+
+/* Raise a number to the given value, if it's lower; "value" is only looked at once */
+#define ATOMIC_MAX(number, value) \
+	do \
+	{ \
+		__typeof__(number) atomic_value = (value); \
+		__typeof__(number) atomic_seen = (number); \
+		while(atomic_seen < atomic_value && !__sync_bool_compare_and_swap(&(number), atomic_seen, atomic_value)) \
+			atomic_seen = (number); \
+	} while(0)
+
+/* Nothing written before this is seen after anything written after it, and nothing read
+ * after it is read before anything read before it */
+#define ATOMIC_BARRIER() __sync_synchronize()
+
+#endif
+
@@ -0,0 +1,488 @@
+/* broadcast */
+/* This module sends chat to everybody in a room.  Sending each message the moment it comes
+ * in costs a write() per person in the room per message, which adds up fast in a busy room.
+ * Instead, messages are held back until the end of the trip through the select() loop (or a
+ * little longer, if the room is busy), then each person gets everything that's waiting in a
+ * single writev().  The messages are only encoded once for everybody (twice, if some people
+ * get numbers instead of names; see user_send_chatevents()).
+ *
+ * How long a room's messages can wait is up to the room (see room_set_batch_window()), but
+ * they only wait that long when the room is busy; the wait shrinks along with the number of
+ * messages per second, down to nothing, so a quiet room doesn't pay for the batching.
+ *
+ * Joins and leaves that are waiting (see presence.h) go out before a new message is held
+ * back, and the messages that are waiting go out before anybody joins or leaves, so nobody
+ * hears from somebody they haven't been told is there, or from before they got there. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#include "intern.h"
+#include "presence.h"
+#include "room.h"
+#include "types.h"
+#include "user.h"
+#include "worker.h"
+
+#include "broadcast.h"
+
+/* The starting size of the arrays; they double when they run out of space */
+#define STARTING_PENDING 16
+#define STARTING_MESSAGES 8
+
+struct _broadcast_t;
+
+/* Some of the people in a room, for one worker to send the room's messages to.  Most rooms
+ * only have one; see BROADCAST_SPLIT. */
+typedef struct
+{
+	struct _broadcast_t *broadcast;
+	user_t **users;
+	size_t count;
+
+	/* The number of writev() calls it took to send to them */
+	size_t writes;
+} slice_t;
+
+typedef struct _broadcast_t
+{
+	/* The room, and where it sits in the pending array */
+	room_t *room;
+	size_t index;
+
+	/* When the wait is over */
+	struct timeval due;
+
+	/* The messages, and when each one came in.  Each message holds a reference to its
+	 * (interned) username, and its own copy of the text. */
+	outgoing_chatevent_t *messages;
+	struct timeval *arrived;
+	size_t count;
+	size_t size;
+
+	/* Everybody in the room, once it's being sent, and the slices they're split into */
+	user_t **users;
+	slice_t *slices;
+	size_t slice_count;
+} broadcast_t;
+
+/* The rooms with something waiting.  Each one's messages hold a reference to it, so the room
+ * can't be reclaimed out from under them. */
+static room_t **pending = NULL;
+static size_t pending_count = 0;
+static size_t pending_size = 0;
+
+/* The rooms whose wait is over, while they're being sent */
+static broadcast_t **due = NULL;
+static size_t due_size = 0;
+
+/* The totals, for statistics */
+static uint32_t total_messages = 0;
+static uint32_t total_batches = 0;
+static uint32_t total_writes = 0;
+static uint32_t total_unbatched = 0;
+static uint32_t total_split = 0;
+static double total_wait = 0;
+static double longest_wait = 0;
+
+/* The number of microseconds between two times */
+static long microseconds_between(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+}
+
+/* Count a message toward how busy the room is, and return the number of microseconds a
+ * batch started now should wait */
+static long get_wait(room_t *room, struct timeval *now)
+{
+	uint32_t rate;
+
+	if(room->rate_second != now->tv_sec)
+	{
+		room->last_rate = (room->rate_second == now->tv_sec - 1) ? room->current_rate : 0;
+		room->current_rate = 0;
+		room->rate_second = now->tv_sec;
+	}
+	room->current_rate++;
+
+	/* Whichever second was busier; the current one might only be a few milliseconds old */
+	rate = room->last_rate > room->current_rate ? room->last_rate : room->current_rate;
+	if(rate >= BROADCAST_BUSY_RATE)
+		rate = BROADCAST_BUSY_RATE;
+
+	return (long) room->batch_window * 1000 * rate / BROADCAST_BUSY_RATE;
+}
+
+/* Hold back a message for everybody in the room */
+void broadcast_message(room_t *room, chatevent_subtype_t subtype, char *from, char *message)
+{
+	broadcast_t *broadcast;
+	struct timeval now;
+	long wait;
+	char *copy;
+
+	/* Whoever's joined or left so far has to be announced before this */
+	presence_flush(room);
+
+	gettimeofday(&now, NULL);
+	wait = get_wait(room, &now);
+
+	broadcast = room->broadcast;
+	if(broadcast == NULL)
+	{
+		broadcast = malloc(sizeof(broadcast_t));
+		assert(broadcast); /* Out of memory */
+
+		broadcast->due.tv_sec = now.tv_sec + (now.tv_usec + wait) / 1000000;
+		broadcast->due.tv_usec = (now.tv_usec + wait) % 1000000;
+
+		broadcast->size = STARTING_MESSAGES;
+		broadcast->count = 0;
+		broadcast->messages = malloc(STARTING_MESSAGES * sizeof(outgoing_chatevent_t));
+		broadcast->arrived = malloc(STARTING_MESSAGES * sizeof(struct timeval));
+		assert(broadcast->messages && broadcast->arrived); /* Out of memory */
+
+		if(pending_count == pending_size)
+		{
+			pending_size = pending_size ? pending_size << 1 : STARTING_PENDING;
+			pending = realloc(pending, pending_size * sizeof(room_t *));
+			assert(pending); /* Out of memory */
+		}
+		broadcast->room = room_hold(room);
+		broadcast->index = pending_count;
+		pending[pending_count++] = room;
+
+		room->broadcast = broadcast;
+	}
+	else if(broadcast->count == broadcast->size)
+	{
+		broadcast->size <<= 1;
+		broadcast->messages = realloc(broadcast->messages, broadcast->size * sizeof(outgoing_chatevent_t));
+		broadcast->arrived = realloc(broadcast->arrived, broadcast->size * sizeof(struct timeval));
+		assert(broadcast->messages && broadcast->arrived); /* Out of memory */
+	}
+
+	copy = malloc(strlen(message) + 1);
+	assert(copy); /* Out of memory */
+	strcpy(copy, message);
+
+	chatevent_begin(&broadcast->messages[broadcast->count], subtype, intern_hold(from), copy);
+	broadcast->arrived[broadcast->count] = now;
+	broadcast->count++;
+
+	total_messages++;
+	total_unbatched += room_get_count(room);
+}
+
+/* Take the room's waiting messages from it, so it can start holding back new ones.  The
+ * last room in the pending array is moved into its place. */
+static broadcast_t *take(room_t *room)
+{
+	broadcast_t *broadcast = room->broadcast;
+
+	pending_count--;
+	pending[broadcast->index] = pending[pending_count];
+	pending[broadcast->index]->broadcast->index = broadcast->index;
+	room->broadcast = NULL;
+
+	return broadcast;
+}
+
+/* Split the people in the room into slices, one for each worker that'll send to them.  That's
+ * just one, unless the room's big enough to be split (see BROADCAST_SPLIT) and "split" is
+ * set. */
+static void slice(broadcast_t *broadcast, BOOLEAN split)
+{
+	size_t users_count;
+	size_t count = 1;
+	size_t i;
+
+	broadcast->users = room_get_users(broadcast->room, &users_count);
+
+	if(split && users_count >= BROADCAST_SPLIT * 2)
+	{
+		count = users_count / BROADCAST_SPLIT;
+		if(count > worker_get_count())
+			count = worker_get_count();
+	}
+
+	broadcast->slices = malloc(count * sizeof(slice_t));
+	assert(broadcast->slices); /* Out of memory */
+	broadcast->slice_count = count;
+
+	for(i = 0; i < count; i++)
+	{
+		broadcast->slices[i].broadcast = broadcast;
+		broadcast->slices[i].users = broadcast->users + users_count * i / count;
+		broadcast->slices[i].count = users_count * (i + 1) / count - users_count * i / count;
+		broadcast->slices[i].writes = 0;
+	}
+}
+
+/* Send the messages to everybody in a slice.  This can be done by any worker (see worker.h),
+ * so it doesn't touch anything but the messages and the people in the slice.  Returns the
+ * number of messages times the number of people they went to. */
+static size_t fan_out(void *argument)
+{
+	slice_t *slice = (slice_t *) argument;
+	size_t i;
+
+	for(i = 0; i < slice->count; i++)
+		slice->writes += user_send_chatevents(slice->users[i], slice->broadcast->messages, slice->broadcast->count);
+
+	return slice->count * slice->broadcast->count;
+}
+
+/* Send the messages of each of the rooms that have been taken.  If there are enough of them,
+ * or one is big enough to be split, they're sent by the workers, all at the same time. */
+static void send_taken(broadcast_t **taken, size_t count)
+{
+	BOOLEAN parallel = worker_get_count() > 1 && count >= WORKER_MIN_ROOMS;
+	broadcast_t *broadcast;
+	size_t i;
+	size_t j;
+
+	for(i = 0; i < count; i++)
+	{
+		slice(taken[i], worker_get_count() > 1);
+		if(taken[i]->slice_count > 1)
+			parallel = TRUE;
+	}
+
+	if(!parallel)
+	{
+		for(i = 0; i < count; i++)
+			fan_out(&taken[i]->slices[0]);
+		return;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		broadcast = taken[i];
+
+		if(broadcast->slice_count == 1)
+		{
+			/* The workers can't give names their numbers (see intern.h), so that's done
+			 * first, in case anybody in the room wants them */
+			for(j = 0; j < broadcast->count; j++)
+				intern_get_id(broadcast->messages[j].event.username);
+			worker_add(broadcast->room, fan_out, &broadcast->slices[0]);
+		}
+		else
+		{
+			/* Every slice sends the same packets, so they're encoded before any of them start
+			 * (which gives the names their numbers, too).  The room's own worker gets the
+			 * first slice. */
+			for(j = 0; j < broadcast->count; j++)
+				chatevent_encode(&broadcast->messages[j]);
+			for(j = 0; j < broadcast->slice_count; j++)
+				worker_add_to((broadcast->room->worker + j) % worker_get_count(), fan_out, &broadcast->slices[j]);
+			total_split++;
+		}
+	}
+	worker_finish();
+}
+
+/* Add the messages that were sent to the totals, then free them */
+static void finish(broadcast_t *broadcast)
+{
+	struct timeval now;
+	double wait;
+	size_t i;
+
+	gettimeofday(&now, NULL);
+	total_batches++;
+	for(i = 0; i < broadcast->slice_count; i++)
+		total_writes += broadcast->slices[i].writes;
+
+	for(i = 0; i < broadcast->count; i++)
+	{
+		wait = microseconds_between(&broadcast->arrived[i], &now) / 1000000.0;
+		total_wait += wait;
+		if(wait > longest_wait)
+			longest_wait = wait;
+
+		intern_release(broadcast->messages[i].event.username);
+		free(broadcast->messages[i].event.text);
+		chatevent_end(&broadcast->messages[i]);
+	}
+
+	room_release(broadcast->room);
+
+	free(broadcast->users);
+	free(broadcast->slices);
+	free(broadcast->messages);
+	free(broadcast->arrived);
+	free(broadcast);
+}
+
+/* Send the room's waiting messages right now, if it has any */
+void broadcast_flush(room_t *room)
+{
+	broadcast_t *broadcast;
+
+	if(room->broadcast == NULL)
+		return;
+
+	broadcast = take(room);
+	send_taken(&broadcast, 1);
+	finish(broadcast);
+}
+
+/* Send the waiting messages of every room whose wait is over */
+void broadcast_flush_due()
+{
+	struct timeval now;
+	size_t due_count = 0;
+	size_t i;
+
+	gettimeofday(&now, NULL);
+
+	/* Taking a room moves the last one into its place, so go backwards */
+	for(i = pending_count; i > 0; i--)
+	{
+		if(microseconds_between(&now, &pending[i - 1]->broadcast->due) <= 0)
+		{
+			if(due_count == due_size)
+			{
+				due_size = due_size ? due_size << 1 : STARTING_PENDING;
+				due = realloc(due, due_size * sizeof(broadcast_t *));
+				assert(due); /* Out of memory */
+			}
+			due[due_count++] = take(pending[i - 1]);
+		}
+	}
+
+	send_taken(due, due_count);
+
+	for(i = 0; i < due_count; i++)
+		finish(due[i]);
+}
+
+/* If a room's wait will be over before the given timeout, shorten the timeout to when it
+ * will be */
+void broadcast_get_timeout(struct timeval *timeout)
+{
+	struct timeval now;
+	long left;
+	size_t i;
+
+	gettimeofday(&now, NULL);
+
+	for(i = 0; i < pending_count; i++)
+	{
+		left = microseconds_between(&now, &pending[i]->broadcast->due);
+		if(left < 0)
+			left = 0;
+
+		if(left < timeout->tv_sec * 1000000L + timeout->tv_usec)
+		{
+			timeout->tv_sec = left / 1000000;
+			timeout->tv_usec = left % 1000000;
+		}
+	}
+}
+
+/* Get the totals so far.  This is for statistics. */
+void broadcast_get_totals(uint32_t *messages, uint32_t *batches, uint32_t *writes, uint32_t *unbatched, uint32_t *split, double *total_wait_ret, double *longest_wait_ret)
+{
+	*messages = total_messages;
+	*batches = total_batches;
+	*writes = total_writes;
+	*unbatched = total_unbatched;
+	*split = total_split;
+	*total_wait_ret = total_wait;
+	*longest_wait_ret = longest_wait;
+}
+
+/* One room, over socketpairs, that keeps doubling in size, with one message at a time.  Set
+ * WORKER_COUNT (see worker.h) to the number of workers to try. */
+/*
+#include <stdio.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "room_directory.h"
+
+#define BENCHMARK_MOST 8192
+#define BENCHMARK_SECONDS 2
+
+static double now()
+{
+	struct timeval time;
+
+	gettimeofday(&time, NULL);
+	return time.tv_sec + time.tv_usec / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	static int readers[BENCHMARK_MOST];
+	struct in_addr address;
+	struct rlimit limit;
+	room_t *room;
+	user_t *user;
+	char buffer[65536];
+	char name[32];
+	int ends[2];
+	double start;
+	double sending;
+	double sent;
+	size_t people = 0;
+	size_t size;
+	size_t i;
+
+	limit.rlim_cur = limit.rlim_max = BENCHMARK_MOST * 2 + 64;
+	if(setrlimit(RLIMIT_NOFILE, &limit) < 0)
+	{
+		printf("This needs to be able to open %u files\n", (unsigned int) limit.rlim_cur);
+		return 1;
+	}
+
+	worker_initialize();
+	room_directory_initialize();
+	room = room_directory_create("Huge");
+	room_set_batch_window(room, 0);
+	address.s_addr = 0;
+
+	for(size = 256; size <= BENCHMARK_MOST; size <<= 1)
+	{
+		for(; people < size; people++)
+		{
+			socketpair(AF_UNIX, SOCK_STREAM, 0, ends);
+			readers[people] = ends[1];
+
+			sprintf(name, "person%u", (unsigned int) people);
+			user = create_user(ends[0], address);
+			set_username(user, name);
+			room_add_user(room, user);
+		}
+
+		sending = 0;
+		sent = 0;
+		start = now();
+		while(now() - start < BENCHMARK_SECONDS)
+		{
+			broadcast_message(room, EID_TALK, room_get_name(room), "Hello, everybody in the room!");
+			sending -= now();
+			broadcast_flush_due();
+			sending += now();
+			sent += people;
+
+			for(i = 0; i < people; i++)
+				while(recv(readers[i], buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+					;
+		}
+
+		printf("%5u people, %2u workers: %6.0f microseconds a message, %.0f delivered per second\n", (unsigned int) people, (unsigned int) worker_get_count(), sending / (sent / people) * 1000000, sent / sending);
+	}
+
+	return 0;
+}
+*/
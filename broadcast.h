@@ -0,0 +1,73 @@
+/* broadcast */
+/* This module sends chat to everybody in a room.  Sending each message the moment it comes
+ * in costs a write() per person in the room per message, which adds up fast in a busy room.
+ * Instead, messages are held back until the end of the trip through the select() loop (or a
+ * little longer, if the room is busy), then each person gets everything that's waiting in a
+ * single writev().  The messages are only encoded once for everybody (twice, if some people
+ * get numbers instead of names; see user_send_chatevents()).
+ *
+ * How long a room's messages can wait is up to the room (see room_set_batch_window()), but
+ * they only wait that long when the room is busy; the wait shrinks along with the number of
+ * messages per second, down to nothing, so a quiet room doesn't pay for the batching.
+ *
+ * The rooms whose wait is over are sent by their workers, on more than one core (see
+ * worker.h).  A room with tens of thousands of people in it would keep one worker busy while
+ * the rest sat idle, so a room with at least twice BROADCAST_SPLIT people is split into
+ * slices of at least that many, each sent by a different worker.  Each person is in just one
+ * slice, and everybody's messages go out in the order they came in, the same as if one
+ * worker had sent them all.  A smaller room isn't worth splitting, since waking another
+ * worker costs about as much as sending to a few hundred people.
+ *
+ * Joins and leaves that are waiting (see presence.h) go out before a new message is held
+ * back, and the messages that are waiting go out before anybody joins or leaves, so nobody
+ * hears from somebody they haven't been told is there, or from before they got there. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#ifndef _BROADCAST_H_
+#define _BROADCAST_H_
+
+#include <stdint.h>
+
+#include <sys/time.h>
+
+#include "room.h"
+#include "types.h"
+
+/* The most milliseconds a room's messages wait, when the room is busy, unless the room says
+ * otherwise */
+#define BROADCAST_WINDOW 1
+/* The most that a room can say */
+#define BROADCAST_MAX_WINDOW 100
+/* The number of messages a second that makes a room busy enough to wait the whole window.  A
+ * room with half as many waits half as long, and so on. */
+#define BROADCAST_BUSY_RATE 1000
+
+/* The fewest people each worker sends a room's messages to, when the room's split between
+ * them; a room with fewer than twice this many is sent by one worker */
+#define BROADCAST_SPLIT 1024
+
+/* Hold back a message for everybody in the room.  "from" has to be interned (see
+ * chatevent_begin()); the message is copied. */
+void broadcast_message(room_t *room, chatevent_subtype_t subtype, char *from, char *message);
+
+/* Send the room's waiting messages right now, if it has any.  A big room is split between
+ * the workers, like it would be at the end of the select() loop. */
+void broadcast_flush(room_t *room);
+/* Send the waiting messages of every room whose wait is over.  This should be called at the
+ * end of every trip through the select() loop; it only looks at the rooms that have
+ * something waiting.  If there are enough of them, they're sent by the workers, on more than
+ * one core (see worker.h). */
+void broadcast_flush_due();
+/* If a room's wait will be over before the given timeout, shorten the timeout to when it
+ * will be, so select() wakes up in time to send it */
+void broadcast_get_timeout(struct timeval *timeout);
+
+/* Get the totals so far: messages, the number of batches they went out in, the number of
+ * writev() calls it took, the number of write() calls it would have taken to send each one
+ * to everybody as it came in, the number of batches that were split between the workers,
+ * and the seconds the messages spent waiting (in total, and the longest any one waited).
+ * This is for statistics. */
+void broadcast_get_totals(uint32_t *messages, uint32_t *batches, uint32_t *writes, uint32_t *unbatched, uint32_t *split, double *total_wait, double *longest_wait);
+
+#endif
+
@@ -1,8 +1,10 @@
+#include <ctype.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <termios.h>
 #include <time.h>
@@ -16,98 +18,209 @@
 #include <sys/types.h>
 
 #include "account.h"
+#include "compression.h"
 #include "output.h"
 #include "packet_buffer.h"
+#include "protocol.h"
 #include "room.h"
+#include "tls.h"
 #include "types.h"
 
 uint32_t client_token;
 uint32_t server_token;
 
 #define MAX_STRING 256
+/* The most of a room list that's displayed at once; display_message() can only take so much */
+#define MAX_LIST 768
+
+/* The number of seconds to wait for the list of channels before connecting */
+#define UDP_TIMEOUT 3
+
+/* Where the session token from the last login is kept (see SID_SESSION_TOKEN) */
+#define TOKEN_FILE "client.token"
 
 
 char username[MAX_STRING];
 char password[MAX_STRING];
 char channel[MAX_STRING];
 
+/* The server, as "host:port", so a session token is only used with the server it came from */
+char server_name[MAX_STRING];
+
+/* Whether we sent a SID_RESUME, and haven't heard back yet */
+BOOLEAN resuming = FALSE;
+
+/* The room the last SID_REQUEST_ROOM_LIST was for, or blank if it was for the list of rooms */
+char requested_room[MAX_STRING];
+
+/* Used to inflate SID_COMPRESSED packets, if the server sends any */
+compression_t *compression;
+
+/* The names the server has given numbers to (see SID_INTRODUCE_NAME), indexed by number */
+char **names = NULL;
+uint32_t names_size = 0;
+
 /* Send out an error packet to the specified user, with the specified error text. */
 void send_error(int s, char *error_text)
 {
-	packet_buffer_t *packet = create_buffer(SID_ERROR);
-	add_ntstring(packet, error_text);
-	send_buffer(packet, s);
-	destroy_buffer(packet);
+	error_message_packet_t error;
+
+	error.description = error_text;
+	send_error_message(s, &error);
 }
 
 void send_chat(char *command, int s)
 {
-	packet_buffer_t *out;
+	chatcommand_packet_t chatcommand;
 
-	out = create_buffer(SID_CHATCOMMAND);
-	add_ntstring(out, command);
-
-	send_buffer(out, s);
-	destroy_buffer(out);
+	chatcommand.command = command;
+	send_chatcommand(s, &chatcommand);
 }
 
-void process_SID_NULL(packet_buffer_t *packet, int s)
+/* Send a SID_LOGIN with the username and password we were given */
+void send_login_request(int s)
 {
-	/* display_message(ERROR_DEBUG, "Received keep-alive"); */
+	login_packet_t login;
+	uint8_t password_hash[HASH_LENGTH];
+
+	password_hash_twice(password, client_token, server_token, password_hash);
+	login.password = password_hash;
+	login.username = username;
+	send_login(s, &login);
 }
 
-void process_SID_SERVER_INFORMATION(packet_buffer_t *packet, int s)
+void process_SID_SERVER_INFORMATION(server_information_packet_t *packet, int s)
 {
-	char *string_buffer = malloc(get_length(packet));
-	packet_buffer_t *response;
-	uint8_t password_hash[HASH_LENGTH];
+	server_token = packet->server_token;
 
-	/* (uint32_t) server_token -- Used when hashing the password
-	 * (uint32_t) version_useable -- If this is 0, this version is too old to connect and
-	 *   has to be updated. 
-	 * (ntstring) authentication hash type (should be "sha1")
-	 * (ntstring) country -- This can be blank
-	 * (ntstring) operating_system -- This can be blank */
-	server_token = read_next_int32(packet);
-	read_next_int32(packet);
-	read_next_ntstring(packet, string_buffer, get_length(packet) - 1);
-	read_next_ntstring(packet, string_buffer, get_length(packet) - 1);
-	read_next_ntstring(packet, string_buffer, get_length(packet) - 1);
+	if(packet->version_useable & PROTOCOL_DEFLATE)
+		display_message(ERROR_DEBUG, "Server will compress big packets");
+	if(packet->version_useable & PROTOCOL_NAME_IDS)
+		display_message(ERROR_DEBUG, "Server will send numbers instead of names");
+	if(packet->version_useable & PROTOCOL_PRESENCE)
+		display_message(ERROR_DEBUG, "Server will batch up joins and leaves");
 
 	set_display_header("Received server information");
 
+	/* If we're logging back in with a session token, the answer's already on its way */
+	if(resuming)
+	{
+		display_message(ERROR_NOTICE, "Received server information; waiting to hear about the session token");
+		return;
+	}
+
 	display_message(ERROR_NOTICE, "Received server information; attempting to log in");
 
-	
-	/* (uint32_t[5]) password -- Hash of the client token, server token, and password's hash.  If a 
-	 *  hash is used that is less than 160-bit, it's padded with anything.  If a hash is used
-	 *  that's longer than 160-bit, it's truncated.  The formula is H(ct, st, H(pass)).
-	 * (ntstring) username */
-	response = create_buffer(SID_LOGIN);
-	password_hash_twice(password, client_token, server_token, password_hash);
-	add_bytes(response, password_hash, 20);
-	add_ntstring(response, username);
-	send_buffer(response, s);
-	destroy_buffer(response);
+	send_login_request(s);
+}
+
+/* Keep the session token for next time.  It's as good as a password (until it expires), so
+ * only we can read it. */
+void process_SID_SESSION_TOKEN(session_token_packet_t *packet, int s)
+{
+	FILE *file;
+	int fd = open(TOKEN_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	int i;
+
+	if(fd < 0 || (file = fdopen(fd, "w")) == NULL)
+	{
+		display_message(ERROR_WARNING, "Couldn't save the session token [%s]", strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return;
+	}
+
+	fprintf(file, "%s\n%s\n%u\n", server_name, username, packet->expires);
+	for(i = 0; i < HASH_LENGTH; i++)
+		fprintf(file, "%02x", packet->token[i]);
+	fprintf(file, "\n");
+	fclose(file);
+
+	display_message(ERROR_DEBUG, "Saved a session token for next time");
+}
+
+/* Read one line of the token file, without the newline.  Returns FALSE if it isn't there. */
+BOOLEAN read_token_line(FILE *file, char *buffer)
+{
+	char *newline;
+
+	if(fgets(buffer, MAX_STRING, file) == NULL)
+		return FALSE;
+
+	newline = strchr(buffer, '\n');
+	if(newline)
+		*newline = '\0';
 
-	free(string_buffer);
+	return TRUE;
+}
+
+/* If there's a session token for this server and username that hasn't expired, send it in a
+ * SID_RESUME, along with the channel to go back to.  This goes right behind the client
+ * information, so logging in and joining take one round trip.  Returns FALSE if there's no
+ * token to send. */
+BOOLEAN send_resume_request(int s)
+{
+	resume_packet_t resume;
+	uint8_t token[HASH_LENGTH];
+	char line[MAX_STRING];
+	FILE *file;
+	unsigned int byte;
+	BOOLEAN found;
+	int i;
+
+	file = fopen(TOKEN_FILE, "r");
+	if(file == NULL)
+		return FALSE;
+
+	found = read_token_line(file, line) && !strcmp(line, server_name) && read_token_line(file, line) && !strcmp(line, username) && read_token_line(file, line);
+	if(found)
+	{
+		resume.expires = strtoul(line, NULL, 10);
+		found = resume.expires > time(NULL) && read_token_line(file, line) && strlen(line) == HASH_LENGTH * 2;
+	}
+	for(i = 0; found && i < HASH_LENGTH; i++)
+	{
+		found = sscanf(line + i * 2, "%2x", &byte) == 1;
+		token[i] = byte;
+	}
+	fclose(file);
+
+	if(!found)
+		return FALSE;
+
+	resume.token = token;
+	resume.username = username;
+	resume.room_name = channel;
+	send_resume(s, &resume);
+
+	return TRUE;
 }
 
-void process_SID_LOGIN_RESPONSE(packet_buffer_t *packet, int s)
+void process_SID_LOGIN_RESPONSE(login_response_packet_t *packet, int s)
 {
 	login_response_t result;
 	char *buffer;
 
-	packet_buffer_t *create;
-	uint8_t create_password_buffer[20];
+	create_packet_t create;
+	uint8_t create_password_buffer[HASH_LENGTH];
 
-	result = read_next_int32(packet);
+	result = packet->result;
+
+	/* If we were logging back in with a session token, we already asked for the channel */
+	if(resuming && result == LOGIN_SUCCESS)
+	{
+		resuming = FALSE;
+		display_message(ERROR_NOTICE, "Logged back in with the session token");
+		set_display_header("Log in successful");
+		return;
+	}
+	resuming = FALSE;
 
 	switch(result)
 	{
 		case LOGIN_SUCCESS:
 
-			buffer = malloc(get_length(packet) + 5);
+			buffer = malloc(strlen(channel) + 7);
 
 			display_message(ERROR_NOTICE, "Logged in successfully; attempting to join channel '%s'", channel);
 			set_display_header("Log in successful");
@@ -130,14 +243,9 @@ void process_SID_LOGIN_RESPONSE(packet_buffer_t *packet, int s)
 			display_message(ERROR_NOTICE, "Account not found, attempting to create it");
 			password_hash_once(password, create_password_buffer);
 
-	/* (uint32_t[5]) password -- Hash of the client's password only, without the tokens.  For 
-	 *  information on storing hashes of different sizes, see SID_LOGIN
-	 * (ntstring) username */
-			create = create_buffer(SID_CREATE);
-			add_bytes(create, create_password_buffer, 20);
-			add_ntstring(create, username);
-			send_buffer(create, s);
-			destroy_buffer(create);
+			create.password = create_password_buffer;
+			create.username = username;
+			send_create(s, &create);
 			
 			break;
 
@@ -145,6 +253,11 @@ void process_SID_LOGIN_RESPONSE(packet_buffer_t *packet, int s)
 			set_display_header("Account already in use");
 			display_error(ERROR_NOTICE, "Account is already in use by somebody else, please select another");
 			break;
+
+		case INVALID_TOKEN:
+			display_message(ERROR_NOTICE, "Session token didn't work; attempting to log in");
+			send_login_request(s);
+			break;
 	
 		default:
 			display_error(ERROR_ERROR, "Unknown login result code: %d", result);
@@ -152,35 +265,17 @@ void process_SID_LOGIN_RESPONSE(packet_buffer_t *packet, int s)
 
 }
 
-void process_SID_CREATE_RESPONSE(packet_buffer_t *packet, int s)
+void process_SID_CREATE_RESPONSE(create_response_packet_t *packet, int s)
 {
-	create_response_t result;
-	char *username_buffer = malloc(get_length(packet));
-	packet_buffer_t *response;
-	uint8_t password_hash[HASH_LENGTH];
-
-
-	/* (uint32_t) result -- see create_response_t in account.h for result codes. 
-	 * (ntstring) username */
-	result = read_next_int32(packet);
-	read_next_ntstring(packet, username_buffer, get_length(packet) - 1);
+	create_response_t result = packet->result;
 
 	switch(result)
 	{
 		case CREATE_SUCCESS:
 			set_display_header("New account created");
-			display_message(ERROR_NOTICE, "Account '%s' successfully created!", username_buffer);
-
-	/* (uint32_t[5]) password -- Hash of the client token, server token, and password's hash.  If a 
-	 *  hash is used that is less than 160-bit, it's padded with anything.  If a hash is used
-	 *  that's longer than 160-bit, it's truncated.  The formula is H(ct, st, H(pass)).
-	 * (ntstring) username */
-			response = create_buffer(SID_LOGIN);
-			password_hash_twice(password, client_token, server_token, password_hash);
-			add_bytes(response, password_hash, 20);
-			add_ntstring(response, username);
-			send_buffer(response, s);
-			destroy_buffer(response);
+			display_message(ERROR_NOTICE, "Account '%s' successfully created!", packet->username);
+
+			send_login_request(s);
 
 			break;
 
@@ -207,33 +302,90 @@ void process_SID_CREATE_RESPONSE(packet_buffer_t *packet, int s)
 		default:
 			display_error(ERROR_CRITICAL, "Unknown CREATE_RESPONSE code: %d", result);
 	}
+}
+
+void process_SID_ROOM_LIST(room_list_packet_t *packet, int s)
+{
+	char list[MAX_LIST];
+	size_t length = 0;
+	uint16_t i;
+
+	/* Put them all on one line, as long as they fit */
+	list[0] = '\0';
+	for(i = 0; i < packet->names_count && length + strlen(packet->names[i]) + 3 < MAX_LIST; i++)
+		length += sprintf(list + length, i ? ", %s" : "%s", packet->names[i]);
 
-	free(username_buffer);
+	if(*requested_room)
+		display_message(ERROR_NOTICE, "Users in %s (%u): %s", requested_room, packet->names_count, list);
+	else
+		display_message(ERROR_NOTICE, "Rooms (%u): %s", packet->names_count, list);
 }
 
-void process_SID_ROOM_LIST(packet_buffer_t *packet, int s)
+/* Ask for the users in a room, or (if room is blank) the list of rooms */
+void send_room_list_request(int s, char *room)
 {
-	send_error(s, "SID_ROOM_LIST Not implemented yet..");
+	request_room_list_packet_t request;
+
+	strncpy(requested_room, room, MAX_STRING - 1);
+	request.room_name = room;
+	send_request_room_list(s, &request);
 }
 
-void process_SID_CHATEVENT(packet_buffer_t *packet, int s)
+void process_SID_CHATEVENT(chatevent_packet_t *packet, int s)
 {
-	chatevent_subtype_t subtype;
-	char *username_buffer = malloc(get_length(packet));
-	char *text_buffer = malloc(get_length(packet));
-	
-	/* (uint32_t) subtype -- the subtype of the event.  See the enum below for a list.
-	 * (ntstring) username  -- The username of the person who caused the event, if 
-	 *  applicable
-	 * (ntstring) text -- The text of the event, if applicable */
-	subtype = read_next_int32(packet);
-	read_next_ntstring(packet, username_buffer, get_length(packet) - 1);
-	read_next_ntstring(packet, text_buffer, get_length(packet) - 1);
-
-	display_channel_event(subtype, username_buffer, text_buffer, NULL, !strcmp(username_buffer, username));
-
-	free(username_buffer);
-	free(text_buffer);
+	display_channel_event(packet->subtype, packet->username, packet->text, NULL, !strcmp(packet->username, username));
+}
+
+void process_SID_INTRODUCE_NAME(introduce_name_packet_t *packet, int s)
+{
+	uint32_t new_size;
+
+	if(packet->id >= names_size)
+	{
+		for(new_size = names_size ? names_size : 32; new_size <= packet->id; new_size <<= 1)
+			;
+		names = realloc(names, new_size * sizeof(char *));
+		memset(names + names_size, 0, (new_size - names_size) * sizeof(char *));
+		names_size = new_size;
+	}
+
+	free(names[packet->id]);
+	names[packet->id] = malloc(strlen(packet->name) + 1);
+	strcpy(names[packet->id], packet->name);
+}
+
+/* Look up a name the server gave a number to.  If it never did, it's a server bug, but it's
+ * not worth dropping the connection over. */
+char *get_name(uint32_t id)
+{
+	if(id >= names_size || names[id] == NULL)
+	{
+		display_message(ERROR_WARNING, "Server used a number it never gave a name (%u)", id);
+		return "(unknown)";
+	}
+
+	return names[id];
+}
+
+void process_SID_CHATEVENT_ID(chatevent_id_packet_t *packet, int s)
+{
+	chatevent_packet_t event;
+
+	event.subtype = packet->subtype;
+	event.username = get_name(packet->username_id);
+	event.text = packet->text_id ? get_name(packet->text_id) : packet->text;
+
+	process_SID_CHATEVENT(&event, s);
+}
+
+void process_SID_PRESENCE(presence_packet_t *packet, int s)
+{
+	if(packet->flags & PRESENCE_QUIET)
+		display_message(ERROR_NOTICE, "This channel is too big to show who comes and goes; type /names to see who's here");
+	else if(packet->joined_count > packet->names_count)
+		display_message(ERROR_WARNING, "Server sent more joins than names (%u)", packet->joined_count);
+	else
+		display_presence(packet->names, packet->names_count, packet->joined_count, packet->flags & PRESENCE_EVERYBODY);
 }
 
 /* Connect to the remote server.  If this returns, the connection was successful. */
@@ -268,49 +420,156 @@ int do_connect(char *host, int port)
 	return s;
 }
 
+/* Ask the server for the list of channels over UDP, and print it.  This happens before
+ * connecting, so it just goes to stdout.  If there's no answer in UDP_TIMEOUT seconds, we
+ * give up on it, but still try to connect. */
+void print_channels(char *host, int port)
+{
+	struct sockaddr_in serv_addr;
+	struct hostent *server;
+	struct timeval timeout;
+	fd_set select_set;
+	uint8_t request[5] = { 0xFF, SID_REQUEST_ROOM_LIST, 5, 0, '\0' };
+	uint8_t answer[MAX_PACKET];
+	ssize_t length;
+	packet_buffer_t *packet;
+	room_list_packet_t list;
+	uint16_t i;
+	int s;
+
+	server = gethostbyname(host);
+	if(server == NULL)
+		return;
+
+	memset(&serv_addr, '\0', sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+	serv_addr.sin_port = htons(port);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	if(s < 0)
+		return;
+
+	sendto(s, request, sizeof(request), 0, (struct sockaddr *) &serv_addr, sizeof(serv_addr));
+
+	FD_ZERO(&select_set);
+	FD_SET(s, &select_set);
+	timeout.tv_sec = UDP_TIMEOUT;
+	timeout.tv_usec = 0;
+
+	length = -1;
+	if(select(s + 1, &select_set, NULL, NULL, &timeout) > 0)
+		length = recv(s, answer, sizeof(answer), 0);
+	close(s);
+
+	/* It has to be exactly one SID_ROOM_LIST */
+	if(length < 4 || answer[0] != 0xFF || answer[1] != SID_ROOM_LIST || (answer[2] | (answer[3] << 8)) != length)
+	{
+		printf("Couldn't get the list of channels from the server\n");
+		return;
+	}
+
+	packet = create_buffer_data(SID_ROOM_LIST, length - 4, answer + 4);
+	if(decode_room_list(packet, &list))
+	{
+		printf("Channels:");
+		for(i = 0; i < list.names_count; i++)
+			printf(i ? ", %s" : " %s", list.names[i]);
+		printf(list.names_count ? "\n" : " (none)\n");
+		free_room_list(&list);
+	}
+	destroy_buffer(packet);
+}
+
 BOOLEAN process_next_packet(int s)
 {
 	packet_buffer_t *packet;
-	char *string_buffer;
+	packet_buffer_t *compressed;
+	protocol_packet_t decoded;
+	BOOLEAN valid = TRUE;
 
-	packet = read_buffer(s);
+	packet = read_buffer(s, NULL);
 
 	if(packet == (packet_buffer_t *) -1)
 	{
 		display_error(ERROR_EMERGENCY, "Connection closed [%s]", strerror(errno));
 		return FALSE;
 	}
+	else if(packet == NULL)
+	{
+		return TRUE;
+	}
+
+	/* Big packets might be compressed; if so, handle what's inside of them instead */
+	if(get_code(packet) == SID_COMPRESSED)
+	{
+		compressed = packet;
+		packet = decompress_buffer(compression, compressed);
+		destroy_buffer(compressed);
 
-	/* Allocate room for storing strings */
-	string_buffer = malloc(get_length(packet));
+		if(packet == NULL)
+		{
+			display_error(ERROR_EMERGENCY, "Server sent a corrupt compressed packet");
+			return FALSE;
+		}
+	}
 
-	/* This is the heart of the packet process */
+	/* This is the heart of the packet process.  Each packet is decoded into its struct (see
+	 * protocol.h) before it's handled; if it doesn't decode, it's malformed. */
 	switch(get_code(packet))
 	{
 		case SID_NULL:
-			process_SID_NULL(packet, s);
+			/* display_message(ERROR_DEBUG, "Received keep-alive"); */
 			break;
 		/* Server -> Client packets (We want to process these) */
 		case SID_SERVER_INFORMATION:
-			process_SID_SERVER_INFORMATION(packet, s);
+			if((valid = decode_server_information(packet, &decoded.server_information)))
+				process_SID_SERVER_INFORMATION(&decoded.server_information, s);
 			break;
 		case SID_LOGIN_RESPONSE:
-			process_SID_LOGIN_RESPONSE(packet, s);
+			if((valid = decode_login_response(packet, &decoded.login_response)))
+				process_SID_LOGIN_RESPONSE(&decoded.login_response, s);
 			break;
 		case SID_CREATE_RESPONSE:
-			process_SID_CREATE_RESPONSE(packet, s);
+			if((valid = decode_create_response(packet, &decoded.create_response)))
+				process_SID_CREATE_RESPONSE(&decoded.create_response, s);
 			break;
 		case SID_ROOM_LIST:
-			process_SID_ROOM_LIST(packet, s);
+			if((valid = decode_room_list(packet, &decoded.room_list)))
+			{
+				process_SID_ROOM_LIST(&decoded.room_list, s);
+				free_room_list(&decoded.room_list);
+			}
 			break;
 		case SID_CHATEVENT:
-			process_SID_CHATEVENT(packet, s);
+			if((valid = decode_chatevent(packet, &decoded.chatevent)))
+				process_SID_CHATEVENT(&decoded.chatevent, s);
+			break;
+		case SID_INTRODUCE_NAME:
+			if((valid = decode_introduce_name(packet, &decoded.introduce_name)))
+				process_SID_INTRODUCE_NAME(&decoded.introduce_name, s);
+			break;
+		case SID_CHATEVENT_ID:
+			if((valid = decode_chatevent_id(packet, &decoded.chatevent_id)))
+				process_SID_CHATEVENT_ID(&decoded.chatevent_id, s);
+			break;
+		case SID_PRESENCE:
+			if((valid = decode_presence(packet, &decoded.presence)))
+			{
+				process_SID_PRESENCE(&decoded.presence, s);
+				free_presence(&decoded.presence);
+			}
+			break;
+		case SID_SESSION_TOKEN:
+			if((valid = decode_session_token(packet, &decoded.session_token)))
+				process_SID_SESSION_TOKEN(&decoded.session_token, s);
 			break;
 
 
 		/* This packet can go either way */
 		case SID_ERROR:
-			display_message(ERROR_ERROR, "Server sent an error; message was, '%s'", read_next_ntstring(packet, string_buffer, get_length(packet)));
+			if((valid = decode_error_message(packet, &decoded.error_message)))
+				display_message(ERROR_ERROR, "Server sent an error; message was, '%s'", decoded.error_message.description);
 			break;
 
 		/* Client -> Server packets (We shouldn't get these */ 
@@ -319,6 +578,7 @@ BOOLEAN process_next_packet(int s)
 		case SID_CREATE:
 		case SID_REQUEST_ROOM_LIST:
 		case SID_CHATCOMMAND:
+		case SID_RESUME:
 
 			send_error(s, "Server isn't allowed to send that");
 			break;
@@ -327,7 +587,12 @@ BOOLEAN process_next_packet(int s)
 			send_error(s, "You sent an unknown packet!");
 	}
 
-	free(string_buffer);
+	if(!valid)
+	{
+		display_message(ERROR_WARNING, "Received a malformed packet (code 0x%02x)", get_code(packet));
+		send_error(s, "You sent a malformed packet!");
+	}
+
 	destroy_buffer(packet);
 
 	return TRUE;
@@ -339,6 +604,11 @@ BOOLEAN do_select(int s)
 	int select_ret;
 	char *typed_string;
 
+	/* If there's something that's been decrypted, but not read yet, select() won't see it
+	 * (see tls.h) */
+	if(tls_has_pending(s))
+		return process_next_packet(s);
+
 	/* We need to wait on stdin and s */
 	FD_SET(s, &select_set);
 	FD_SET(fileno(stdin), &select_set);
@@ -361,7 +631,11 @@ BOOLEAN do_select(int s)
 			/* They typed a character; let the interface process it */
 			typed_string = read_next();
 
-			if(typed_string)
+			/* /names is handled here, with SID_REQUEST_ROOM_LIST; everything else goes to the
+			 * server as a command */
+			if(typed_string && !strncmp(typed_string, "/names", 6) && (typed_string[6] == '\0' || typed_string[6] == ' '))
+				send_room_list_request(s, typed_string[6] ? typed_string + 7 : "");
+			else if(typed_string)
 				send_chat(typed_string, s);
 		}
 
@@ -412,10 +686,11 @@ void read_string(char *buffer, char *default_value, BOOLEAN hide)
 int main(int argc, char *argv[])
 {
 	int s;
-	packet_buffer_t *packet;
+	client_information_packet_t client_information;
 
 	char hostname[MAX_STRING];
 	char port[MAX_STRING];
+	char use_tls[MAX_STRING];
 
 	srand(time(NULL));
 
@@ -423,31 +698,40 @@ int main(int argc, char *argv[])
 	read_string(hostname, "localhost", FALSE);
 	printf("Port [1024] --> ");
 	read_string(port, "1024", FALSE);
+	printf("Use TLS [no] --> ");
+	read_string(use_tls, "no", FALSE);
 	printf("Username [test] --> ");
 	read_string(username, "test", FALSE);
 	printf("Password [password] --> ");
 	read_string(password, "password", TRUE);
+	print_channels(hostname, atoi(port));
 	printf("Channel [My Channel] --> ");
 	read_string(channel, "My Channel", FALSE);
 
 	initialize_display();
 
 	s = do_connect(hostname, atoi(port));
+	if(tolower(use_tls[0]) == 'y')
+	{
+		tls_initialize_client();
+		if(!tls_connect(s, hostname))
+			display_error(ERROR_EMERGENCY, "Couldn't start TLS with %s", hostname);
+		display_message(ERROR_NOTICE, "Connection is encrypted");
+	}
+	compression = compression_create();
 
-	packet = create_buffer(SID_CLIENT_INFORMATION);
-	 /* (uint32_t) client_token -- Used when hashing the password
-	 * (uint32_t) current_time -- Used to calculate time differences, if that ever comes up 
-	 * (uint32_t) client_version -- Could be used for upgrades and stuff
-	 * (ntstring) country -- Could be used for localized information.  Can be blank. 
-	 * (ntstring) operating_system -- Why not?  Can be blank. */
-	add_int32(packet, client_token = rand());
-	add_int32(packet, time(NULL));
-	add_int32(packet, 0);
-	add_ntstring(packet, "Canada");
-	add_ntstring(packet, "Linux");
+	client_information.client_token = client_token = rand();
+	client_information.current_time = time(NULL);
+	client_information.client_version = PROTOCOL_DEFLATE | PROTOCOL_NAME_IDS | PROTOCOL_PRESENCE | PROTOCOL_RESUME;
+	client_information.country = "Canada";
+	client_information.operating_system = "Linux";
 	display_message(ERROR_NOTICE, "Sending client information");
-	send_buffer(packet, s);
-	destroy_buffer(packet);
+	send_client_information(s, &client_information);
+
+	/* If we logged in here before, try to skip straight back in */
+	sprintf(server_name, "%.200s:%d", hostname, atoi(port));
+	if((resuming = send_resume_request(s)))
+		display_message(ERROR_NOTICE, "Sending session token");
 
 
 	while(do_select(s))
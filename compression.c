@@ -0,0 +1,340 @@
+/* compression */
+/* This module compresses packets with deflate (zlib).  Each connection that asks for it
+ * gets its own deflate stream, which is kept for the life of the connection.  Only packets
+ * over COMPRESSION_THRESHOLD bytes are compressed. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "atomic.h"
+#include "compression.h"
+#include "cputime.h"
+#include "packet_buffer.h"
+#include "types.h"
+
+/* The size of the deflate window (2^12 = 4kb) and how much memory deflate gets for its
+ * state.  These are a lot smaller than zlib's defaults (32kb and 256kb per stream), since
+ * there could be thousands of connections, and packets are never more than MAX_PACKET
+ * bytes anyway.  Both ends have to agree on the window size. */
+#define COMPRESSION_WINDOW_BITS 12
+#define COMPRESSION_MEMORY_LEVEL 5
+
+/* Deflate can make incompressible data a little bigger.  Packets that would be too big to
+ * send if that happened aren't compressed. */
+#define COMPRESSION_SLACK 64
+
+struct _compression_t
+{
+	/* These are NULL until the first packet is compressed or decompressed */
+	z_stream *deflater;
+	z_stream *inflater;
+};
+
+/* Totals for every connection, for statistics.  More than one thread can be compressing at
+ * once (see worker.h), so they're only added to all at once (see atomic.h). */
+static uint32_t total_packets = 0;
+static size_t total_raw_bytes = 0;
+static size_t total_compressed_bytes = 0;
+/* In microseconds of each thread's own CPU time (see cputime.h) */
+static size_t total_cpu = 0;
+
+/* Create the compression state for a new connection */
+compression_t *compression_create()
+{
+	compression_t *new_compression = malloc(sizeof(compression_t));
+	assert(new_compression); /* Out of memory */
+
+	new_compression->deflater = NULL;
+	new_compression->inflater = NULL;
+
+	return new_compression;
+}
+
+/* Free the compression state, and everything zlib allocated for it */
+void compression_destroy(compression_t *compression)
+{
+	if(compression->deflater)
+	{
+		deflateEnd(compression->deflater);
+		free(compression->deflater);
+	}
+	if(compression->inflater)
+	{
+		inflateEnd(compression->inflater);
+		free(compression->inflater);
+	}
+	free(compression);
+}
+
+/* Compress a packet for sending.  If it's too small to be worth it, NULL is returned, and
+ * the original packet should be sent.  Otherwise, a new SID_COMPRESSED packet is returned;
+ * it has to be sent (every compressed packet depends on the ones before it), and it has to
+ * be destroyed. */
+packet_buffer_t *compress_buffer(compression_t *compression, packet_buffer_t *packet)
+{
+	uint8_t output[MAX_PACKET];
+	uint16_t length = get_length(packet);
+	packet_buffer_t *compressed;
+	size_t start;
+	int result;
+
+	if(length < COMPRESSION_THRESHOLD || length > MAX_PACKET - 4 - COMPRESSION_SLACK)
+		return NULL;
+
+	start = cputime_get();
+
+	if(compression->deflater == NULL)
+	{
+		compression->deflater = malloc(sizeof(z_stream));
+		assert(compression->deflater); /* Out of memory */
+		memset(compression->deflater, 0, sizeof(z_stream));
+
+		result = deflateInit2(compression->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, COMPRESSION_WINDOW_BITS, COMPRESSION_MEMORY_LEVEL, Z_DEFAULT_STRATEGY);
+		assert(result == Z_OK); /* Out of memory */
+	}
+
+	/* A sync flush makes sure the other side can inflate this whole packet without waiting
+	 * for the next one */
+	compression->deflater->next_in = get_buffer(packet);
+	compression->deflater->avail_in = length;
+	compression->deflater->next_out = output;
+	compression->deflater->avail_out = MAX_PACKET - 4;
+
+	result = deflate(compression->deflater, Z_SYNC_FLUSH);
+	assert(result == Z_OK);
+	/* If this fails, COMPRESSION_SLACK isn't big enough */
+	assert(compression->deflater->avail_in == 0 && compression->deflater->avail_out > 0);
+
+	compressed = create_buffer_data(SID_COMPRESSED, (MAX_PACKET - 4) - compression->deflater->avail_out, output);
+
+	ATOMIC_ADD(total_cpu, cputime_get() - start);
+	ATOMIC_ADD(total_packets, 1);
+	ATOMIC_ADD(total_raw_bytes, length);
+	ATOMIC_ADD(total_compressed_bytes, get_length(compressed));
+
+	return compressed;
+}
+
+/* Decompress a received SID_COMPRESSED packet, and return the packet that was inside of it.
+ * If it's corrupt, NULL is returned, and the connection can't be trusted anymore.  The
+ * returned packet has to be destroyed. */
+packet_buffer_t *decompress_buffer(compression_t *compression, packet_buffer_t *packet)
+{
+	uint8_t output[MAX_PACKET];
+	uint16_t length;
+	int result;
+
+	if(compression->inflater == NULL)
+	{
+		compression->inflater = malloc(sizeof(z_stream));
+		assert(compression->inflater); /* Out of memory */
+		memset(compression->inflater, 0, sizeof(z_stream));
+
+		result = inflateInit2(compression->inflater, COMPRESSION_WINDOW_BITS);
+		assert(result == Z_OK); /* Out of memory */
+	}
+
+	compression->inflater->next_in = get_buffer(packet) + 4;
+	compression->inflater->avail_in = get_length(packet) - 4;
+	compression->inflater->next_out = output;
+	compression->inflater->avail_out = MAX_PACKET;
+
+	result = inflate(compression->inflater, Z_SYNC_FLUSH);
+	if(result != Z_OK || compression->inflater->avail_in != 0)
+		return NULL;
+
+	/* There has to be exactly one whole packet inside */
+	length = MAX_PACKET - compression->inflater->avail_out;
+	if(length < 4 || output[0] != 0xFF || (output[2] | (output[3] << 8)) != length)
+		return NULL;
+
+	return create_buffer_data(output[1], length - 4, output + 4);
+}
+
+/* Save where the connection's streams are, for handing it off to a new server.  All the
+ * other end still needs from a stream is the last window's worth of what went through it,
+ * so that's all that's saved. */
+BOOLEAN compression_save(compression_t *compression, packet_buffer_t *record)
+{
+#if ZLIB_VERNUM >= 0x1290
+	uint8_t window[1 << COMPRESSION_WINDOW_BITS];
+	uInt length;
+
+	add_int8(record, compression->deflater != NULL);
+	if(compression->deflater)
+	{
+		length = sizeof(window);
+		deflateGetDictionary(compression->deflater, window, &length);
+		add_int16(record, length);
+		add_bytes(record, window, length);
+	}
+
+	add_int8(record, compression->inflater != NULL);
+	if(compression->inflater)
+	{
+		length = sizeof(window);
+		inflateGetDictionary(compression->inflater, window, &length);
+		add_int16(record, length);
+		add_bytes(record, window, length);
+	}
+
+	return TRUE;
+#else
+	/* Older versions of zlib can't say what's in the window */
+	return FALSE;
+#endif
+}
+
+/* Read one stream out of a saved record: whether it was started, and if it was, its window.
+ * Returns FALSE if it isn't there. */
+static BOOLEAN read_window(packet_buffer_t *record, BOOLEAN *started, uint8_t *window, uint16_t *length)
+{
+	if(!can_read_int8(record))
+		return FALSE;
+	*started = read_next_int8(record) ? TRUE : FALSE;
+	if(*started == FALSE)
+		return TRUE;
+
+	if(!can_read_int16(record))
+		return FALSE;
+	*length = read_next_int16(record);
+	if(*length > (1 << COMPRESSION_WINDOW_BITS) || !can_read_bytes(record, *length))
+		return FALSE;
+	read_next_bytes(record, window, *length);
+
+	return TRUE;
+}
+
+/* Pick up the connection's streams where compression_save() left them */
+compression_t *compression_restore(packet_buffer_t *record)
+{
+	compression_t *compression;
+	uint8_t deflate_window[1 << COMPRESSION_WINDOW_BITS];
+	uint8_t inflate_window[1 << COMPRESSION_WINDOW_BITS];
+	uint16_t deflate_length;
+	uint16_t inflate_length;
+	BOOLEAN deflating;
+	BOOLEAN inflating;
+	int result;
+
+	if(!read_window(record, &deflating, deflate_window, &deflate_length) || !read_window(record, &inflating, inflate_window, &inflate_length))
+		return NULL;
+
+	compression = compression_create();
+
+	/* The other end already got the zlib header from the old server, so the streams carry on
+	 * as raw deflate, which is all that comes after the header anyway */
+	if(deflating)
+	{
+		compression->deflater = malloc(sizeof(z_stream));
+		assert(compression->deflater); /* Out of memory */
+		memset(compression->deflater, 0, sizeof(z_stream));
+
+		result = deflateInit2(compression->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -COMPRESSION_WINDOW_BITS, COMPRESSION_MEMORY_LEVEL, Z_DEFAULT_STRATEGY);
+		assert(result == Z_OK); /* Out of memory */
+		deflateSetDictionary(compression->deflater, deflate_window, deflate_length);
+	}
+
+	if(inflating)
+	{
+		compression->inflater = malloc(sizeof(z_stream));
+		assert(compression->inflater); /* Out of memory */
+		memset(compression->inflater, 0, sizeof(z_stream));
+
+		result = inflateInit2(compression->inflater, -COMPRESSION_WINDOW_BITS);
+		assert(result == Z_OK); /* Out of memory */
+		inflateSetDictionary(compression->inflater, inflate_window, inflate_length);
+	}
+
+	return compression;
+}
+
+/* Get the totals for every connection so far: the number of packets compressed, the bytes
+ * before and after compression, and the CPU time spent doing it.  This is for statistics. */
+void compression_get_totals(uint32_t *packets, size_t *raw_bytes, size_t *compressed_bytes, double *cpu_seconds)
+{
+	*packets = total_packets;
+	*raw_bytes = total_raw_bytes;
+	*compressed_bytes = total_compressed_bytes;
+	*cpu_seconds = total_cpu / 1000000.0;
+}
+
+/*
+#include <stdio.h>
+#include "protocol.h"
+
+static void benchmark(char *description, packet_buffer_t *packet, int iterations)
+{
+	compression_t *sender;
+	compression_t *receiver;
+	packet_buffer_t *compressed;
+	packet_buffer_t *decompressed;
+	uint32_t packets;
+	size_t raw_bytes, compressed_bytes, last_raw, last_compressed;
+	double cpu_seconds, last_cpu;
+	int i;
+
+	compression_get_totals(&packets, &last_raw, &last_compressed, &last_cpu);
+
+	for(i = 0; i < iterations; i++)
+	{
+		sender = compression_create();
+		receiver = compression_create();
+
+		compressed = compress_buffer(sender, packet);
+		if(compressed == NULL)
+		{
+			printf("%-28s %5u bytes, too small to compress\n", description, get_length(packet));
+			compression_destroy(sender);
+			compression_destroy(receiver);
+			break;
+		}
+		decompressed = decompress_buffer(receiver, compressed);
+		assert(decompressed && get_length(decompressed) == get_length(packet) && !memcmp(get_buffer(decompressed), get_buffer(packet), get_length(packet)));
+		destroy_buffer(compressed);
+		destroy_buffer(decompressed);
+
+		compression_destroy(sender);
+		compression_destroy(receiver);
+	}
+
+	if(i == iterations)
+	{
+		compression_get_totals(&packets, &raw_bytes, &compressed_bytes, &cpu_seconds);
+		raw_bytes -= last_raw;
+		compressed_bytes -= last_compressed;
+		cpu_seconds -= last_cpu;
+		printf("%-28s %5u bytes -> %5u, ratio %5.2f, %6.2f us of CPU each\n", description, get_length(packet), (unsigned int) (compressed_bytes / iterations), (double) raw_bytes / compressed_bytes, cpu_seconds * 1000000 / iterations);
+	}
+
+	destroy_buffer(packet);
+}
+
+int main(int argc, char *argv[])
+{
+	room_list_packet_t room_list;
+	chatevent_packet_t chatevent;
+	char *names[300];
+	char name[32];
+	int i;
+
+	for(i = 0; i < 300; i++)
+	{
+		sprintf(name, "user%d_%c%c", rand() % 10000, 'a' + rand() % 26, 'a' + rand() % 26);
+		names[i] = strdup(name);
+	}
+	room_list.names = names;
+	room_list.names_count = 300;
+	benchmark("SID_ROOM_LIST, 300 names", encode_room_list(&room_list), 1000);
+
+	chatevent.subtype = EID_INFO;
+	chatevent.username = "test";
+	chatevent.text = "If the channel parameter is given, it joins the specified channel.  The channel is created if it doesn't already exist.  If no parameter is given, it leaves chat.  This is create channel, join channel, and leave chat all rolled up into one.";
+	benchmark("SID_CHATEVENT, /help join", encode_chatevent(&chatevent), 1000);
+
+	return 0;
+}
+*/
@@ -0,0 +1,64 @@
+/* compression */
+/* This module compresses packets with deflate (zlib).  Each connection that asks for it
+ * (see PROTOCOL_DEFLATE in protocol.h) gets its own deflate stream, which is kept for the
+ * life of the connection, so every packet is compressed with everything before it as the
+ * dictionary.  That's what makes long lists of similar names compress well, and it's why
+ * /who and /rooms send a few long lines instead of one line per name (see info_list_t in
+ * server.c).
+ *
+ * Only packets over COMPRESSION_THRESHOLD bytes are compressed; small chat lines go out
+ * exactly as before, so they don't pay the CPU cost.  A compressed packet is sent as a
+ * SID_COMPRESSED packet, whose data is the next chunk of the deflate stream; inflating it
+ * gives back exactly one complete packet, header and all.
+ *
+ * The zlib state is only allocated when the first big packet is sent (or received), since
+ * most connections never have one. */
+/* NOTE: These functions are NOT thread-safe, except that different connections can compress
+ * from different threads at the same time (see worker.h). */
+
+#ifndef _COMPRESSION_H_
+#define _COMPRESSION_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "packet_buffer.h"
+#include "types.h"
+
+/* Packets (including the header) this long or longer are compressed */
+#define COMPRESSION_THRESHOLD 256
+
+/* The compression state for one connection.  It's defined in compression.c, since nobody
+ * else should need to see zlib. */
+typedef struct _compression_t compression_t;
+
+/* Create the compression state for a new connection */
+compression_t *compression_create();
+/* Free the compression state, and everything zlib allocated for it */
+void compression_destroy(compression_t *compression);
+
+/* Compress a packet for sending.  If it's too small to be worth it, NULL is returned, and
+ * the original packet should be sent.  Otherwise, a new SID_COMPRESSED packet is returned;
+ * it has to be sent (every compressed packet depends on the ones before it), and it has to
+ * be destroyed. */
+packet_buffer_t *compress_buffer(compression_t *compression, packet_buffer_t *packet);
+/* Decompress a received SID_COMPRESSED packet, and return the packet that was inside of it.
+ * If it's corrupt, NULL is returned, and the connection can't be trusted anymore.  The
+ * returned packet has to be destroyed. */
+packet_buffer_t *decompress_buffer(compression_t *compression, packet_buffer_t *packet);
+
+/* Save where the connection's streams are into a record, for handing it off to a new server
+ * (see handoff.h).  Only the last window's worth of each stream is saved, since that's all
+ * the other end is still using.  Returns FALSE if it can't be done (zlib has to be 1.2.9 or
+ * newer), in which case the connection can't be handed off. */
+BOOLEAN compression_save(compression_t *compression, packet_buffer_t *record);
+/* Pick up the streams that compression_save() saved, reading them from the record.
+ * Returns NULL if the record is corrupt. */
+compression_t *compression_restore(packet_buffer_t *record);
+
+/* Get the totals for every connection so far: the number of packets compressed, the bytes
+ * before and after compression, and the CPU time spent doing it.  This is for statistics. */
+void compression_get_totals(uint32_t *packets, size_t *raw_bytes, size_t *compressed_bytes, double *cpu_seconds);
+
+#endif
+
@@ -0,0 +1,25 @@
+/* cputime */
+/* This module measures the CPU time that the calling thread has used (see cputime.h). */
+
+/* clock_gettime() is hidden by _POSIX_SOURCE, which only asks for the first POSIX.  This has
+ * to come before any of the includes. */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stddef.h>
+#include <time.h>
+
+#include "cputime.h"
+
+/* Get the CPU time the calling thread has used so far */
+size_t cputime_get()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec now;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+	return (size_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#else
+	return (size_t) ((double) clock() * 1000000 / CLOCKS_PER_SEC);
+#endif
+}
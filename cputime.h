@@ -0,0 +1,19 @@
+/* cputime */
+/* This module measures the CPU time that the calling thread has used.  clock() counts every
+ * thread in the process, so once the workers are compressing at the same time (see
+ * worker.h), timing anything with it counts whatever they were all doing in between.
+ *
+ * Where there's no clock for each thread (CLOCK_THREAD_CPUTIME_ID), it falls back to
+ * clock(), which is only right while one thread is busy. */
+
+#ifndef _CPUTIME_H_
+#define _CPUTIME_H_
+
+#include <stddef.h>
+
+/* Get the CPU time the calling thread has used so far, in microseconds.  Only the difference
+ * between two of these on the same thread means anything.  It's a size_t, so the
+ * differences can be added up with ATOMIC_ADD() (see atomic.h). */
+size_t cputime_get();
+
+#endif
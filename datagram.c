@@ -0,0 +1,370 @@
+/* datagram */
+/* This module answers room list requests that come in over UDP, on the same port number as
+ * the server's TCP socket.  Requests are read and answered in batches, the answers are the
+ * cached SID_ROOM_LIST packets, and each source address is rate limited so we can't be used
+ * to amplify a flood.  See datagram.h for the details. */
+
+/* recvmmsg() and sendmmsg() are Linux extensions, and they're hidden unless we ask for them.
+ * This has to come before any of the includes. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "datagram.h"
+#include "output.h"
+#include "packet_buffer.h"
+#include "room.h"
+#include "room_directory.h"
+#include "types.h"
+
+/* The biggest request we bother reading.  A request is a header and a room name, so anything
+ * bigger than this can't be one; it's truncated, then ignored. */
+#define DATAGRAM_REQUEST_SIZE (4 + MAX_ROOM_LENGTH + 16)
+
+/* The size of the socket's receive buffer */
+#define DATAGRAM_BUFFER_SIZE (1024 * 1024)
+
+/* How many answer bytes a source address has left, and when that was worked out */
+typedef struct
+{
+	struct in_addr ip;
+	time_t last;
+	uint32_t allowance;
+} datagram_source_t;
+
+/* The sources, hashed by address.  The hash is seeded randomly when the socket is opened, so
+ * nobody can pick addresses that knock a victim's slot out of the table (and so reset its
+ * allowance) on purpose. */
+static datagram_source_t sources[DATAGRAM_SOURCES];
+static uint32_t source_seed;
+
+/* The answer for a room that doesn't exist.  This never changes, so it's only encoded once. */
+static packet_buffer_t *empty_list = NULL;
+
+/* Totals, for statistics */
+static uint32_t total_requests = 0;
+static uint32_t total_batches = 0;
+static uint32_t total_answered = 0;
+static uint32_t total_limited = 0;
+static uint32_t total_ignored = 0;
+
+/* Open the UDP socket on the given port, and return it */
+int datagram_open(int port)
+{
+	struct sockaddr_in address;
+	int buffer_size = DATAGRAM_BUFFER_SIZE;
+	int s;
+
+	memset(&address, '\0', sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = INADDR_ANY;
+	address.sin_port = htons(port);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	if(s < 0)
+		display_error(ERROR_EMERGENCY, "Error opening datagram socket [%s]", strerror(errno));
+
+	if(bind(s, (struct sockaddr *) &address, sizeof(address)) < 0)
+		display_error(ERROR_EMERGENCY, "Error binding datagram socket [%s]", strerror(errno));
+
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
+	/* Requests come in bursts, and every one that doesn't fit in the buffer is lost; the
+	 * kernel may cap this lower */
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+	memset(sources, '\0', sizeof(sources));
+	source_seed = rand();
+
+	return s;
+}
+
+/* Take the given number of bytes out of the source's allowance, topping it up first for the
+ * time that's gone by.  Returns FALSE if it doesn't have that many left. */
+static BOOLEAN take_allowance(struct in_addr ip, uint16_t bytes, time_t now)
+{
+	datagram_source_t *source = &sources[((((uint32_t) ip.s_addr ^ source_seed) * 2654435761U) >> 16) & (DATAGRAM_SOURCES - 1)];
+
+	if(source->last == 0 || source->ip.s_addr != ip.s_addr)
+	{
+		source->ip = ip;
+		source->last = now;
+		source->allowance = DATAGRAM_BURST;
+	}
+	else if(now > source->last)
+	{
+		if((now - source->last) >= DATAGRAM_BURST / DATAGRAM_BYTES_PER_SECOND)
+			source->allowance = DATAGRAM_BURST;
+		else
+			source->allowance += (now - source->last) * DATAGRAM_BYTES_PER_SECOND;
+
+		if(source->allowance > DATAGRAM_BURST)
+			source->allowance = DATAGRAM_BURST;
+		source->last = now;
+	}
+
+	if(source->allowance < bytes)
+		return FALSE;
+
+	source->allowance -= bytes;
+
+	return TRUE;
+}
+
+/* Work out the answer to one request.  Returns the packet to send back (which must NOT be
+ * destroyed; it belongs to whoever cached it), or NULL if the request should be dropped. */
+static packet_buffer_t *answer_request(uint8_t *data, ssize_t length, BOOLEAN truncated, struct sockaddr_in *from, time_t now)
+{
+	char *room_name = (char *) data + 4;
+	room_t *room;
+	packet_buffer_t *answer;
+
+	/* It has to be exactly one SID_REQUEST_ROOM_LIST, with exactly one string in it */
+	if(truncated || length < 5 || data[0] != 0xFF || data[1] != SID_REQUEST_ROOM_LIST || (data[2] | (data[3] << 8)) != length || data[length - 1] != '\0' || strlen(room_name) != length - 5)
+	{
+		total_ignored++;
+		return NULL;
+	}
+
+	if(*room_name == '\0')
+	{
+		answer = room_directory_get_room_list();
+	}
+	else
+	{
+		room = room_directory_find(room_name);
+		if(room && room_get_count(room) > 0)
+		{
+			answer = room_get_user_list(room);
+		}
+		else
+		{
+			if(empty_list == NULL)
+				empty_list = room_encode_name_list(NULL, 0);
+			answer = empty_list;
+		}
+	}
+
+	if(!take_allowance(from->sin_addr, get_length(answer), now))
+	{
+		total_limited++;
+		return NULL;
+	}
+
+	return answer;
+}
+
+#ifdef __linux__
+
+/* Read and answer every request waiting on the socket, a batch at a time: one recvmmsg() to
+ * read the batch, and one sendmmsg() to answer it.  The answers are sent straight out of the
+ * cached packets, without being copied. */
+void datagram_process(int s)
+{
+	struct mmsghdr requests[DATAGRAM_BATCH];
+	struct mmsghdr answers[DATAGRAM_BATCH];
+	struct iovec request_vectors[DATAGRAM_BATCH];
+	struct iovec answer_vectors[DATAGRAM_BATCH];
+	struct sockaddr_in from[DATAGRAM_BATCH];
+	uint8_t buffers[DATAGRAM_BATCH][DATAGRAM_REQUEST_SIZE];
+	packet_buffer_t *answer;
+	int received;
+	int answer_count;
+	int sent;
+	int result;
+	int i;
+	time_t now;
+
+	do
+	{
+		for(i = 0; i < DATAGRAM_BATCH; i++)
+		{
+			request_vectors[i].iov_base = buffers[i];
+			request_vectors[i].iov_len = DATAGRAM_REQUEST_SIZE;
+
+			memset(&requests[i], '\0', sizeof(struct mmsghdr));
+			requests[i].msg_hdr.msg_name = &from[i];
+			requests[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			requests[i].msg_hdr.msg_iov = &request_vectors[i];
+			requests[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		received = recvmmsg(s, requests, DATAGRAM_BATCH, 0, NULL);
+		if(received <= 0)
+			break;
+
+		total_batches++;
+		total_requests += received;
+		now = time(NULL);
+
+		answer_count = 0;
+		for(i = 0; i < received; i++)
+		{
+			answer = answer_request(buffers[i], requests[i].msg_len, (requests[i].msg_hdr.msg_flags & MSG_TRUNC) != 0, &from[i], now);
+			if(answer == NULL)
+				continue;
+
+			answer_vectors[answer_count].iov_base = get_buffer(answer);
+			answer_vectors[answer_count].iov_len = get_length(answer);
+
+			memset(&answers[answer_count], '\0', sizeof(struct mmsghdr));
+			answers[answer_count].msg_hdr.msg_name = &from[i];
+			answers[answer_count].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			answers[answer_count].msg_hdr.msg_iov = &answer_vectors[answer_count];
+			answers[answer_count].msg_hdr.msg_iovlen = 1;
+			answer_count++;
+		}
+
+		/* sendmmsg() can stop partway (if the socket buffer fills up); whatever's left over
+		 * is dropped, like any other lost datagram */
+		for(sent = 0; sent < answer_count; sent += result)
+		{
+			result = sendmmsg(s, answers + sent, answer_count - sent, 0);
+			if(result <= 0)
+				break;
+		}
+		total_answered += sent;
+	}
+	while(received == DATAGRAM_BATCH);
+}
+
+#else
+
+/* Read and answer every request waiting on the socket.  Without recvmmsg() and sendmmsg(),
+ * it's one system call each way per request. */
+void datagram_process(int s)
+{
+	struct sockaddr_in from;
+	socklen_t from_length;
+	uint8_t buffer[DATAGRAM_REQUEST_SIZE + 1];
+	packet_buffer_t *answer;
+	ssize_t length;
+	int i;
+	time_t now = time(NULL);
+
+	total_batches++;
+
+	for(i = 0; i < DATAGRAM_BATCH; i++)
+	{
+		from_length = sizeof(from);
+		length = recvfrom(s, buffer, sizeof(buffer), 0, (struct sockaddr *) &from, &from_length);
+		if(length < 0)
+			break;
+
+		total_requests++;
+
+		/* Reading one byte more than a request can be tells us it was too big */
+		answer = answer_request(buffer, length, length > DATAGRAM_REQUEST_SIZE, &from, now);
+		if(answer && sendto(s, get_buffer(answer), get_length(answer), 0, (struct sockaddr *) &from, from_length) > 0)
+			total_answered++;
+	}
+}
+
+#endif
+
+/* Get the totals so far.  This is for statistics. */
+void datagram_get_totals(uint32_t *requests, uint32_t *batches, uint32_t *answered, uint32_t *limited, uint32_t *ignored)
+{
+	*requests = total_requests;
+	*batches = total_batches;
+	*answered = total_answered;
+	*limited = total_limited;
+	*ignored = total_ignored;
+}
+
+/*
+#include <stdio.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+
+int main(int argc, char *argv[])
+{
+	int source_count;
+	int request_count;
+	int *sockets;
+	struct sockaddr_in server;
+	struct sockaddr_in source;
+	uint8_t request[5] = { 0xFF, SID_REQUEST_ROOM_LIST, 5, 0, 0 };
+	uint8_t answer[MAX_PACKET];
+	struct timeval start, end, now;
+	double seconds;
+	int sent = 0;
+	int answered = 0;
+	int window;
+	int i;
+
+	if(argc < 4)
+	{
+		fprintf(stderr, "Usage: %s <port> <sources> <requests>\n", argv[0]);
+		return 1;
+	}
+	source_count = atoi(argv[2]);
+	request_count = atoi(argv[3]);
+
+	memset(&server, '\0', sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = htonl(0x7f000001);
+	server.sin_port = htons(atoi(argv[1]));
+
+	sockets = malloc(source_count * sizeof(int));
+	for(i = 0; i < source_count; i++)
+	{
+		memset(&source, '\0', sizeof(source));
+		source.sin_family = AF_INET;
+		source.sin_addr.s_addr = htonl(0x7f010000 + i);
+		sockets[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		if(bind(sockets[i], (struct sockaddr *) &source, sizeof(source)) < 0)
+		{
+			perror("bind");
+			return 1;
+		}
+		fcntl(sockets[i], F_SETFL, fcntl(sockets[i], F_GETFL) | O_NONBLOCK);
+	}
+
+	gettimeofday(&start, NULL);
+	end = start;
+
+	while(answered < request_count)
+	{
+		window = 0;
+		for(i = 0; i < source_count && sent < request_count && sent - answered < 4096; i++, sent++)
+			if(sendto(sockets[i], request, sizeof(request), 0, (struct sockaddr *) &server, sizeof(server)) > 0)
+				window++;
+
+		for(i = 0; i < source_count; i++)
+			while(recv(sockets[i], answer, sizeof(answer), 0) > 0)
+			{
+				answered++;
+				window++;
+				gettimeofday(&end, NULL);
+			}
+
+		if(window == 0)
+		{
+			gettimeofday(&now, NULL);
+			if(now.tv_sec - end.tv_sec > 1)
+				break;
+		}
+	}
+
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	printf("%d requests from %d sources, %d answered in %.2f seconds: %.0f queries per second\n", sent, source_count, answered, seconds, answered / seconds);
+
+	return 0;
+}
+*/
+
@@ -0,0 +1,53 @@
+/* datagram */
+/* This module answers room list requests that come in over UDP, on the same port number as
+ * the server's TCP socket.  That way, a client can get the list of rooms (or the users in a
+ * room) before it connects, or without connecting at all.
+ *
+ * A request is a datagram holding exactly one SID_REQUEST_ROOM_LIST packet, header and all,
+ * and the answer is a datagram holding exactly one SID_ROOM_LIST packet.  Anything else is
+ * silently ignored; answering garbage with an error would just make us a better reflector.
+ *
+ * The answers are the same cached packets the TCP side uses (see
+ * room_directory_get_room_list() and room_get_user_list()), so an answer is never encoded
+ * more than once between changes.  Requests are read, and answers are sent, in batches (with
+ * recvmmsg() and sendmmsg() where they exist), so a flood of requests costs a couple of
+ * system calls per batch instead of two per request.
+ *
+ * Since an answer can be a couple thousand times bigger than the request, each source
+ * address only gets so many bytes per second; after that, its requests are dropped.  That
+ * keeps anybody from using us to flood a third party with spoofed requests. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#ifndef _DATAGRAM_H_
+#define _DATAGRAM_H_
+
+#include <stdint.h>
+
+/* The most requests that are read (and answered) in one go */
+#define DATAGRAM_BATCH 64
+
+/* The number of answer bytes each source address gets per second, and the most it can save
+ * up.  A full room list is just under 10kb, so this is a few of them a second. */
+#define DATAGRAM_BYTES_PER_SECOND 32768
+#define DATAGRAM_BURST 65536
+
+/* The number of source addresses that are tracked for rate limiting.  If two sources land in
+ * the same slot, the newer one takes it over, so memory use is fixed no matter how many
+ * sources there are.  This has to be a power of 2. */
+#define DATAGRAM_SOURCES 4096
+
+/* Open the UDP socket on the given port, and return it.  It's non-blocking, since it's read
+ * until it runs dry. */
+int datagram_open(int port);
+
+/* Read and answer every request waiting on the socket.  This should be called when select()
+ * says the socket is readable. */
+void datagram_process(int s);
+
+/* Get the totals so far: requests read, the number of batches they came in, requests
+ * answered, requests dropped by the rate limit, and requests ignored because they weren't
+ * valid.  This is for statistics. */
+void datagram_get_totals(uint32_t *requests, uint32_t *batches, uint32_t *answered, uint32_t *limited, uint32_t *ignored);
+
+#endif
+
@@ -0,0 +1,133 @@
+/* epoch */
+/* This module frees things once no thread can still be looking at them, by keeping track of
+ * which epoch each reading thread started in (see epoch.h). */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "atomic.h"
+
+#include "epoch.h"
+
+/* Something that's been retired, and is waiting to be freed */
+typedef struct _retired_t
+{
+	void (*destroy)(void *);
+	void *object;
+	struct _retired_t *next;
+} retired_t;
+
+/* What each thread is doing: 0 if it isn't reading, or the epoch it started reading in,
+ * shifted left one, with the bottom bit set.  It's one word, so the main thread never sees
+ * half of it.  Each slot is padded out to its own cache line, so that a thread entering and
+ * leaving doesn't slow down the ones next to it. */
+typedef union
+{
+	volatile size_t state;
+	char padding[64];
+} slot_t;
+
+static slot_t slots[EPOCH_THREADS];
+
+/* The current epoch.  It's only moved along with the mutex held, but it's read without it. */
+static volatile size_t epoch = 0;
+
+/* What's been retired in each of the last three epochs (an epoch's list is epoch % 3), and
+ * the totals; these are only looked at with the mutex held */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static retired_t *limbo[3] = { NULL, NULL, NULL };
+static uint32_t total_retired = 0;
+static uint32_t total_freed = 0;
+static uint32_t total_advances = 0;
+
+/* Say that the thread is about to start reading.  Whatever it reads has to come after it's
+ * been marked, or else the epoch could move on twice without it being noticed. */
+void epoch_enter(size_t thread)
+{
+	assert(thread < EPOCH_THREADS);
+	assert(slots[thread].state == 0); /* They can't be nested */
+
+	slots[thread].state = (epoch << 1) | 1;
+	ATOMIC_BARRIER();
+}
+
+/* Say that the thread is done reading.  Everything it read has to come before it's marked. */
+void epoch_exit(size_t thread)
+{
+	assert(thread < EPOCH_THREADS);
+
+	ATOMIC_BARRIER();
+	slots[thread].state = 0;
+}
+
+/* Free something once no thread can still be looking at it */
+void epoch_retire(void (*destroy)(void *), void *object)
+{
+	retired_t *retired = malloc(sizeof(retired_t));
+
+	assert(retired); /* Out of memory */
+	retired->destroy = destroy;
+	retired->object = object;
+
+	pthread_mutex_lock(&mutex);
+	retired->next = limbo[epoch % 3];
+	limbo[epoch % 3] = retired;
+	total_retired++;
+	pthread_mutex_unlock(&mutex);
+}
+
+/* Move the epoch along, if everybody who's reading has seen the current one.  Whatever was
+ * retired two epochs ago was gone before anybody who's still reading started, so it's freed
+ * (its list is the one the next epoch will use). */
+void epoch_collect()
+{
+	retired_t *expired;
+	retired_t *next;
+	uint32_t freed = 0;
+	size_t state;
+	size_t i;
+
+	pthread_mutex_lock(&mutex);
+
+	ATOMIC_BARRIER();
+	for(i = 0; i < EPOCH_THREADS; i++)
+	{
+		state = slots[i].state;
+		if((state & 1) && (state >> 1) != epoch)
+		{
+			pthread_mutex_unlock(&mutex);
+			return;
+		}
+	}
+
+	epoch++;
+	total_advances++;
+	expired = limbo[(epoch + 1) % 3];
+	limbo[(epoch + 1) % 3] = NULL;
+
+	pthread_mutex_unlock(&mutex);
+
+	for(; expired; expired = next)
+	{
+		next = expired->next;
+		expired->destroy(expired->object);
+		free(expired);
+		freed++;
+	}
+
+	pthread_mutex_lock(&mutex);
+	total_freed += freed;
+	pthread_mutex_unlock(&mutex);
+}
+
+/* Get the totals so far */
+void epoch_get_totals(uint32_t *retired, uint32_t *freed, uint32_t *advances)
+{
+	pthread_mutex_lock(&mutex);
+	*retired = total_retired;
+	*freed = total_freed;
+	*advances = total_advances;
+	pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,56 @@
+/* epoch */
+/* This module decides when it's safe to free something that another thread might still be
+ * looking at.  Once more than one thread is sending (see worker.h), or looking people up (see
+ * user_directory.h), a user or a room can't just be freed the moment it's gone: some other
+ * thread might have found it a moment earlier, and still be using it.  Locking everything
+ * that reads them would make every send wait on every disconnect, so instead, nothing that
+ * reads them locks anything, and whatever's gone is "retired" instead of freed.
+ *
+ * Time is split into epochs.  Each thread that reads shared things says so when it starts
+ * (epoch_enter()), which marks it with the current epoch, and again when it's done
+ * (epoch_exit()); while it's in between, it can use anything it finds, without locking.
+ * Something that's retired is only gone for threads that come along later, so it's kept in
+ * a list for the epoch it was retired in.  The epoch only moves on once every thread that's
+ * in the middle of reading has seen the current one, so by the time it's moved on twice,
+ * nobody who could have found something retired before that can still be reading, and it
+ * can finally be freed.
+ *
+ * Entering and leaving are a couple of writes to the thread's own slot, so readers never
+ * wait for anybody.  The epoch is moved along by epoch_collect(), which the main thread
+ * calls at the end of every trip through the select() loop; the workers are only ever in
+ * the middle of reading while they're sending, so most trips move it along, and whatever was
+ * retired is freed two trips later.  Something is never freed before that, however long it
+ * takes, so a thread that's stuck holds up the freeing, but never makes it unsafe. */
+/* NOTE: These functions are thread-safe, but each thread has to use its own number (the main
+ * thread is 0, and each worker uses its own; see worker.h). */
+
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The most threads there can be, counting the main thread */
+#define EPOCH_THREADS 64
+
+/* Say that the given thread is about to start reading shared things, or that it's done.  These
+ * can't be nested.  Anything the thread found in between must not be used after it's done. */
+void epoch_enter(size_t thread);
+void epoch_exit(size_t thread);
+
+/* Free something (by calling "destroy" with it) once no thread can still be looking at it.
+ * It has to be gone already, so that no thread that enters from now on can find it. */
+void epoch_retire(void (*destroy)(void *), void *object);
+
+/* Move the epoch along, if every thread that's reading has seen the current one, and free
+ * whatever's been retired long enough.  The destroy functions are called by whichever thread
+ * calls this, which in the server is always the main thread, so they can use things that
+ * aren't thread-safe.  It shouldn't be called by a thread that's in the middle of reading. */
+void epoch_collect();
+
+/* Get the totals so far: the number of things retired, how many of those have been freed, and
+ * how many times the epoch has moved along.  This is for statistics. */
+void epoch_get_totals(uint32_t *retired, uint32_t *freed, uint32_t *advances);
+
+#endif
+
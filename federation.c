@@ -0,0 +1,996 @@
+/* federation */
+/* This module joins several servers together, so they act like one big one (see
+ * federation.h). */
+/* NOTE: These functions are NOT thread-safe. */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "outbox.h"
+#include "output.h"
+#include "packet_buffer.h"
+#include "protocol.h"
+#include "ring.h"
+#include "room.h"
+#include "room_directory.h"
+#include "table.h"
+#include "tls.h"
+#include "types.h"
+#include "user.h"
+#include "user_directory.h"
+
+#include "federation.h"
+
+/* The peers, in the order they were given */
+static peer_t peers[FEDERATION_MAX_PEERS];
+static size_t peer_count = 0;
+
+/* This server's node ID, and the port it's listening on */
+static uint32_t node_id;
+static int node_port;
+
+/* The secret that every server knows (see federation_load_key()) */
+static uint8_t key[FEDERATION_KEY_MAXIMUM];
+static size_t key_length = 0;
+
+/* Which end of a link answers a challenge.  This goes into the answer, so the server that
+ * connected can't just send the other one's answer back to it. */
+#define ROLE_DIALED 'D'
+#define ROLE_ACCEPTED 'A'
+
+/* A peer that's connected to this server, and been greeted, but hasn't answered this
+ * server's challenge yet.  This is kept with the user that the connection still is (see
+ * set_user_link_attempt()). */
+typedef struct _link_attempt_t
+{
+	peer_t *peer;
+	uint32_t node_id;
+	uint8_t challenge[PROTOCOL_HASH_LENGTH];
+} link_attempt_t;
+
+/* Everybody who's logged in on another server, by name.  Each value is a remote user (see
+ * create_remote_user()). */
+static table_t *remote_users;
+
+/* This server and every server whose link is up, for finding the home of each room */
+static ring_t *ring;
+
+/* Totals, for statistics */
+static uint32_t total_forwarded = 0;
+static uint32_t total_copies = 0;
+static uint32_t total_relayed = 0;
+
+/* Pick this server's node ID.  It only has to be different from every other server's, so
+ * the process ID is mixed in, in case two of them are started in the same second. */
+void federation_initialize(int port)
+{
+	node_id = ((uint32_t) rand() << 16) ^ (uint32_t) rand() ^ ((uint32_t) getpid() << 8) ^ (uint32_t) port;
+	node_port = port;
+	remote_users = table_create();
+	ring = ring_create();
+	ring_add(ring, node_id);
+
+	display_message(ERROR_DEBUG, "This server's node ID is %08x", node_id);
+}
+
+/* Read the secret that the servers share */
+BOOLEAN federation_load_key()
+{
+	FILE *file = fopen(FEDERATION_KEY, "r");
+
+	if(file == NULL)
+		return FALSE;
+
+	key_length = fread(key, 1, sizeof(key), file);
+	fclose(file);
+
+	/* Editors like to put a newline at the end, and the other servers' copies might not
+	 * have one */
+	if(key_length > 0 && key[key_length - 1] == '\n')
+		key_length--;
+
+	return key_length >= FEDERATION_KEY_MINIMUM;
+}
+
+/* Add a peer, given as "host:port" */
+BOOLEAN federation_add_peer(char *address)
+{
+	peer_t *peer;
+	struct hostent *host;
+	char *colon = strrchr(address, ':');
+
+	if(colon == NULL || atoi(colon + 1) <= 0 || peer_count == FEDERATION_MAX_PEERS)
+		return FALSE;
+
+	peer = &peers[peer_count];
+	peer->host = malloc(colon - address + 1);
+	assert(peer->host); /* Out of memory */
+	memcpy(peer->host, address, colon - address);
+	peer->host[colon - address] = '\0';
+	peer->port = atoi(colon + 1);
+
+	host = gethostbyname(peer->host);
+	if(host == NULL || host->h_addrtype != AF_INET)
+	{
+		free(peer->host);
+		return FALSE;
+	}
+	memcpy(&peer->ip, host->h_addr_list[0], sizeof(peer->ip));
+
+	peer->socket = -1;
+	peer->dialed = FALSE;
+	peer->greeted = FALSE;
+	peer->established = FALSE;
+	peer->node_id = 0;
+	peer->outbox = NULL;
+	peer->rooms = table_create();
+
+	peer_count++;
+
+	return TRUE;
+}
+
+/* Get this server's node ID */
+uint32_t federation_get_node_id()
+{
+	return node_id;
+}
+
+/* Get the number of peers, and each of them */
+size_t federation_get_peer_count()
+{
+	return peer_count;
+}
+peer_t *federation_get_peer(size_t index)
+{
+	assert(index < peer_count);
+	return &peers[index];
+}
+
+/* Send a packet over the link.  The packet isn't destroyed. */
+static void send_to_peer(peer_t *peer, packet_buffer_t *packet)
+{
+	outbox_send(peer->outbox, OUTBOX_CHAT, &packet, 1);
+}
+/* Send a packet to every peer whose link is up, then destroy it */
+static void send_to_all(packet_buffer_t *packet)
+{
+	size_t i;
+
+	for(i = 0; i < peer_count; i++)
+		if(peers[i].established)
+			send_to_peer(&peers[i], packet);
+
+	destroy_buffer(packet);
+}
+
+/* Make a hello, with a new challenge in it */
+static packet_buffer_t *create_hello(uint8_t *challenge)
+{
+	link_hello_packet_t hello;
+
+	if(RAND_bytes(challenge, PROTOCOL_HASH_LENGTH) != 1)
+		display_error(ERROR_EMERGENCY, "Couldn't come up with a challenge for a peer");
+
+	hello.node_id = node_id;
+	hello.port = node_port;
+	hello.version = FEDERATION_VERSION;
+	hello.challenge = challenge;
+
+	return encode_link_hello(&hello);
+}
+
+/* Work out the answer to a challenge, as the server with node ID prover would give it to the
+ * one with node ID verifier, from the given end of the link (ROLE_DIALED or
+ * ROLE_ACCEPTED).  The answer is an HMAC-SHA1, so it's PROTOCOL_HASH_LENGTH bytes. */
+static void answer_challenge(uint8_t *challenge, uint32_t prover, uint32_t verifier, uint8_t role, uint8_t *answer)
+{
+	uint8_t data[PROTOCOL_HASH_LENGTH + 4 + 4 + 1];
+
+	memcpy(data, challenge, PROTOCOL_HASH_LENGTH);
+	data[PROTOCOL_HASH_LENGTH + 0] = prover >> 24;
+	data[PROTOCOL_HASH_LENGTH + 1] = prover >> 16;
+	data[PROTOCOL_HASH_LENGTH + 2] = prover >> 8;
+	data[PROTOCOL_HASH_LENGTH + 3] = prover;
+	data[PROTOCOL_HASH_LENGTH + 4] = verifier >> 24;
+	data[PROTOCOL_HASH_LENGTH + 5] = verifier >> 16;
+	data[PROTOCOL_HASH_LENGTH + 6] = verifier >> 8;
+	data[PROTOCOL_HASH_LENGTH + 7] = verifier;
+	data[PROTOCOL_HASH_LENGTH + 8] = role;
+
+	HMAC(EVP_sha1(), key, key_length, data, sizeof(data), answer, NULL);
+}
+
+/* Whether an answer to a challenge is right.  The comparison takes the same time however
+ * much of it matches, like token_verify()'s. */
+static BOOLEAN check_answer(uint8_t *challenge, uint32_t prover, uint32_t verifier, uint8_t role, uint8_t *answer)
+{
+	uint8_t expected[PROTOCOL_HASH_LENGTH];
+
+	answer_challenge(challenge, prover, verifier, role, expected);
+
+	return CRYPTO_memcmp(expected, answer, PROTOCOL_HASH_LENGTH) == 0;
+}
+
+/* Start using a socket as the link to the peer */
+static void open_link(peer_t *peer, int socket, BOOLEAN dialed)
+{
+	peer->socket = socket;
+	peer->dialed = dialed;
+	peer->greeted = FALSE;
+	peer->established = FALSE;
+	peer->outbox = outbox_create(socket);
+}
+
+/* The link to the peer is established; tell it who's logged in here, and where they are */
+static void establish(peer_t *peer, uint32_t peer_node_id)
+{
+	link_login_packet_t login;
+	link_join_packet_t join;
+	packet_buffer_t *packet;
+	user_t **users;
+	size_t count;
+	size_t i;
+
+	peer->node_id = peer_node_id;
+	peer->established = TRUE;
+	ring_add(ring, peer_node_id);
+
+	users = user_directory_get_all(&count);
+	for(i = 0; i < count; i++)
+	{
+		login.ip = get_user_address(users[i]).s_addr;
+		login.username = get_username(users[i]);
+		packet = encode_link_login(&login);
+		send_to_peer(peer, packet);
+		destroy_buffer(packet);
+
+		if(get_user_room(users[i]))
+		{
+			join.username = get_username(users[i]);
+			join.room_name = get_user_room(users[i]);
+			packet = encode_link_join(&join);
+			send_to_peer(peer, packet);
+			destroy_buffer(packet);
+		}
+	}
+	free(users);
+
+	display_message(ERROR_NOTICE, "Link to %s:%d (node %08x) is up; told it about %u users", peer->host, peer->port, peer->node_id, (unsigned int) count);
+}
+
+/* Connect to every peer whose link is down */
+void federation_dial()
+{
+	struct sockaddr_in address;
+	packet_buffer_t *packet;
+	peer_t *peer;
+	size_t i;
+	int s;
+
+	for(i = 0; i < peer_count; i++)
+	{
+		peer = &peers[i];
+		if(peer->socket >= 0)
+			continue;
+
+		s = socket(AF_INET, SOCK_STREAM, 0);
+		if(s < 0)
+			return;
+
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr = peer->ip;
+		address.sin_port = htons(peer->port);
+
+		if(connect(s, (struct sockaddr *) &address, sizeof(address)) < 0)
+		{
+			display_message(ERROR_DEBUG, "Couldn't link to %s:%d [%s]; trying again later", peer->host, peer->port, strerror(errno));
+			close(s);
+			continue;
+		}
+
+		open_link(peer, s, TRUE);
+
+		packet = create_hello(peer->challenge);
+		send_to_peer(peer, packet);
+		destroy_buffer(packet);
+	}
+}
+
+/* Find the peer that a SID_LINK_HELLO came from */
+peer_t *federation_find_peer(struct in_addr ip, int port)
+{
+	size_t i;
+
+	for(i = 0; i < peer_count; i++)
+		if(peers[i].ip.s_addr == ip.s_addr && peers[i].port == port)
+			return &peers[i];
+
+	return NULL;
+}
+
+/* A peer connected to this server, and sent SID_LINK_HELLO */
+BOOLEAN federation_greet(user_t *user, peer_t *peer, link_hello_packet_t *hello)
+{
+	link_attempt_t *attempt;
+	link_auth_packet_t auth;
+	uint8_t answer[PROTOCOL_HASH_LENGTH];
+	packet_buffer_t *packet;
+
+	if(hello->node_id == node_id || get_user_link_attempt(user))
+		return FALSE;
+
+	attempt = malloc(sizeof(link_attempt_t));
+	assert(attempt); /* Out of memory */
+	attempt->peer = peer;
+	attempt->node_id = hello->node_id;
+	set_user_link_attempt(user, attempt);
+
+	packet = create_hello(attempt->challenge);
+	user_send(user, packet);
+	destroy_buffer(packet);
+
+	answer_challenge(hello->challenge, node_id, hello->node_id, ROLE_ACCEPTED, answer);
+	auth.answer = answer;
+	packet = encode_link_auth(&auth);
+	user_send(user, packet);
+	destroy_buffer(packet);
+
+	return TRUE;
+}
+
+/* Whether the user is a peer that's been greeted, and hasn't answered yet */
+BOOLEAN federation_is_linking(user_t *user)
+{
+	return get_user_link_attempt(user) != NULL;
+}
+
+/* The peer that connected to this server answered its challenge */
+BOOLEAN federation_accept(user_t *user, link_auth_packet_t *auth)
+{
+	link_attempt_t *attempt = get_user_link_attempt(user);
+	peer_t *peer = attempt->peer;
+	uint8_t *waiting;
+	size_t length;
+
+	if(!check_answer(attempt->challenge, attempt->node_id, node_id, ROLE_DIALED, auth->answer))
+	{
+		display_user_message(ERROR_WARNING, user, "Peer %s:%d didn't answer its challenge right (is its %s the same?); not linking to it", peer->host, peer->port, FEDERATION_KEY);
+		return FALSE;
+	}
+
+	if(peer->socket >= 0)
+	{
+		/* If both ends dialed at once, the link that was dialed by the lower node ID stays,
+		 * which both ends agree on.  Otherwise, the old link is from before the peer
+		 * restarted (with a new node ID), and it's dead. */
+		if(peer->dialed && (!peer->established || peer->node_id == attempt->node_id) && node_id < attempt->node_id)
+		{
+			display_user_message(ERROR_NOTICE, user, "Already linked to %s:%d; closing the second link", peer->host, peer->port);
+			return FALSE;
+		}
+
+		federation_drop(peer);
+	}
+
+	/* Anything the user hasn't been sent yet (the end of the hello, or the answer) goes out
+	 * over the link instead */
+	open_link(peer, get_socket(user), FALSE);
+	waiting = user_get_waiting(user, &length);
+	if(length)
+		outbox_restore(peer->outbox, waiting, length);
+
+	establish(peer, attempt->node_id);
+
+	return TRUE;
+}
+
+/* The hello from a peer that this server dialed arrived */
+BOOLEAN federation_hello(peer_t *peer, link_hello_packet_t *hello)
+{
+	if(!peer->dialed || peer->greeted)
+		return FALSE;
+
+	if(hello->node_id == node_id)
+	{
+		display_message(ERROR_WARNING, "Peer %s:%d is this server; not linking to it", peer->host, peer->port);
+		return FALSE;
+	}
+
+	if(hello->version != FEDERATION_VERSION)
+	{
+		display_message(ERROR_WARNING, "Peer %s:%d links with version %u, and this server uses %u; not linking to it", peer->host, peer->port, hello->version, FEDERATION_VERSION);
+		return FALSE;
+	}
+
+	peer->node_id = hello->node_id;
+	memcpy(peer->their_challenge, hello->challenge, PROTOCOL_HASH_LENGTH);
+	peer->greeted = TRUE;
+
+	return TRUE;
+}
+
+/* The answer to this server's challenge arrived from a peer that it dialed */
+BOOLEAN federation_auth(peer_t *peer, link_auth_packet_t *auth)
+{
+	link_auth_packet_t ours;
+	uint8_t answer[PROTOCOL_HASH_LENGTH];
+	packet_buffer_t *packet;
+
+	if(!peer->greeted)
+		return FALSE;
+
+	if(!check_answer(peer->challenge, peer->node_id, node_id, ROLE_ACCEPTED, auth->answer))
+	{
+		display_message(ERROR_WARNING, "Peer %s:%d didn't answer its challenge right (is its %s the same?); not linking to it", peer->host, peer->port, FEDERATION_KEY);
+		return FALSE;
+	}
+
+	answer_challenge(peer->their_challenge, node_id, peer->node_id, ROLE_DIALED, answer);
+	ours.answer = answer;
+	packet = encode_link_auth(&ours);
+	send_to_peer(peer, packet);
+	destroy_buffer(packet);
+
+	establish(peer, peer->node_id);
+
+	return TRUE;
+}
+
+/* Send a room's settings over the link */
+static void send_room(peer_t *peer, room_t *room)
+{
+	link_room_packet_t settings;
+	packet_buffer_t *packet;
+
+	settings.room_name = room_get_name(room);
+	settings.batch_window = room_get_batch_window(room);
+	packet = encode_link_room(&settings);
+	send_to_peer(peer, packet);
+	destroy_buffer(packet);
+}
+
+/* Count a remote user going into a room (joined is TRUE) or out of it */
+static void count_room(peer_t *peer, room_t *room, BOOLEAN joined)
+{
+	uint32_t *count = table_find(peer->rooms, room_get_name(room));
+
+	if(count == NULL)
+	{
+		count = malloc(sizeof(uint32_t));
+		assert(count); /* Out of memory */
+		*count = 0;
+		table_add(peer->rooms, room_get_name(room), count);
+
+		/* It's the peer's first user in the room, so if the room lives here, the peer needs
+		 * to know how it's set up */
+		if(federation_get_home(room_get_name(room)) == node_id)
+			send_room(peer, room);
+	}
+
+	if(joined)
+		(*count)++;
+	else
+		(*count)--;
+
+	if(*count == 0)
+	{
+		table_remove(peer->rooms, room_get_name(room));
+		free(count);
+	}
+}
+
+/* Take a remote user out of their room, and forget about them */
+static void remove_remote_user(user_t *user)
+{
+	room_t *room = get_current_room(user);
+
+	if(room)
+	{
+		count_room(get_user_peer(user), room, FALSE);
+		room_remove_user(room, user);
+	}
+
+	table_remove(remote_users, get_username(user));
+	user_retire(user);
+}
+
+/* Close the link to the peer, and take everybody on it out of their rooms */
+void federation_drop(peer_t *peer)
+{
+	user_t **users;
+	size_t count;
+	size_t i;
+
+	if(peer->established)
+	{
+		display_message(ERROR_NOTICE, "Link to %s:%d (node %08x) is down", peer->host, peer->port, peer->node_id);
+		ring_remove(ring, peer->node_id);
+	}
+
+	tls_close(peer->socket);
+	close(peer->socket);
+	outbox_destroy(peer->outbox);
+	peer->socket = -1;
+	peer->outbox = NULL;
+	peer->greeted = FALSE;
+	peer->established = FALSE;
+
+	users = (user_t **) get_values(remote_users, &count);
+	for(i = 0; i < count; i++)
+		if(get_user_peer(users[i]) == peer)
+			remove_remote_user(users[i]);
+	free(users);
+}
+
+/* Whether anything is waiting to be written to the peer */
+BOOLEAN federation_is_waiting(peer_t *peer)
+{
+	return peer->outbox && outbox_waiting(peer->outbox);
+}
+/* Write as much of what's waiting for the peer as the link will take */
+void federation_flush(peer_t *peer)
+{
+	outbox_flush(peer->outbox);
+}
+
+/* Tell the other servers that somebody logged in here */
+void federation_logged_in(user_t *user)
+{
+	link_login_packet_t login;
+
+	login.ip = get_user_address(user).s_addr;
+	login.username = get_username(user);
+	send_to_all(encode_link_login(&login));
+}
+/* Or logged out */
+void federation_logged_out(user_t *user)
+{
+	link_logout_packet_t logout;
+
+	logout.username = get_username(user);
+	send_to_all(encode_link_logout(&logout));
+}
+
+/* Tell the other servers where somebody here is now */
+void federation_joined(user_t *user)
+{
+	link_join_packet_t join;
+
+	join.username = get_username(user);
+	join.room_name = get_user_room(user) ? get_user_room(user) : "";
+	send_to_all(encode_link_join(&join));
+}
+
+/* Forward a message to each server that has somebody in the room, once */
+void federation_message(room_t *room, uint32_t subtype, char *from, char *message)
+{
+	link_chat_packet_t chat;
+	packet_buffer_t *packet = NULL;
+	size_t i;
+
+	for(i = 0; i < peer_count; i++)
+	{
+		if(!peers[i].established || table_find(peers[i].rooms, room_get_name(room)) == NULL)
+			continue;
+
+		/* It's only encoded if somebody needs it */
+		if(packet == NULL)
+		{
+			chat.subtype = subtype;
+			chat.room_name = room_get_name(room);
+			chat.username = from;
+			chat.text = message;
+			packet = encode_link_chat(&chat);
+			total_forwarded++;
+		}
+
+		send_to_peer(&peers[i], packet);
+		total_copies++;
+	}
+
+	if(packet)
+		destroy_buffer(packet);
+}
+
+/* Forward a whisper to a user on another server */
+void federation_whisper(user_t *to, char *from, char *message)
+{
+	link_whisper_packet_t whisper;
+	packet_buffer_t *packet;
+
+	whisper.username = from;
+	whisper.target = get_username(to);
+	whisper.text = message;
+	packet = encode_link_whisper(&whisper);
+	send_to_peer(get_user_peer(to), packet);
+	destroy_buffer(packet);
+}
+
+/* Get the node ID of the home of a room */
+uint32_t federation_get_home(char *room_name)
+{
+	return ring_find(ring, room_name);
+}
+
+/* Send a room's settings to every peer that has somebody in it */
+static void send_room_to_all(room_t *room)
+{
+	size_t i;
+
+	for(i = 0; i < peer_count; i++)
+		if(peers[i].established && table_find(peers[i].rooms, room_get_name(room)))
+			send_room(&peers[i], room);
+}
+
+/* Somebody here changed a room's settings.  If the room lives here, everybody else is told;
+ * otherwise, its home is, and it tells everybody else. */
+void federation_room_changed(room_t *room)
+{
+	uint32_t home = federation_get_home(room_get_name(room));
+	size_t i;
+
+	if(home == node_id)
+	{
+		send_room_to_all(room);
+		return;
+	}
+
+	for(i = 0; i < peer_count; i++)
+		if(peers[i].established && peers[i].node_id == home)
+			send_room(&peers[i], room);
+}
+
+/* A room's settings arrived from the peer */
+void federation_remote_room(peer_t *peer, char *room_name, uint16_t batch_window)
+{
+	room_t *room = room_directory_find(room_name);
+	uint32_t home = federation_get_home(room_name);
+
+	/* Nobody's in the room here (anymore), or the peer has a different idea of where the room
+	 * lives, which only happens for a moment when a link comes or goes */
+	if(room == NULL || (home != peer->node_id && home != node_id))
+		return;
+
+	room_set_batch_window(room, batch_window);
+
+	if(home == node_id)
+		send_room_to_all(room);
+}
+
+/* Find somebody who's logged in on another server */
+user_t *federation_find_user(char *username)
+{
+	return table_find(remote_users, username);
+}
+
+/* Somebody logged in on the peer */
+void federation_remote_login(peer_t *peer, char *username, struct in_addr ip)
+{
+	user_t *existing = table_find(remote_users, username);
+
+	if(existing)
+	{
+		/* It's already known (the peer is telling us again), or it's logged in on another
+		 * peer too, in which case the lower node ID keeps it, and the other peer lets its
+		 * user go when it hears about it */
+		if(get_user_peer(existing) == peer || get_user_peer(existing)->node_id < peer->node_id)
+			return;
+
+		remove_remote_user(existing);
+	}
+
+	table_add(remote_users, username, create_remote_user(username, ip, peer));
+}
+
+/* Somebody on the peer logged out */
+void federation_remote_logout(peer_t *peer, char *username)
+{
+	user_t *user = table_find(remote_users, username);
+
+	/* If it's somebody on another peer, this peer lost them in a tie, and it doesn't
+	 * matter */
+	if(user && get_user_peer(user) == peer)
+		remove_remote_user(user);
+}
+
+/* Somebody on the peer joined a room, or left chat */
+void federation_remote_join(peer_t *peer, char *username, char *room_name)
+{
+	user_t *user = table_find(remote_users, username);
+	room_t *room;
+
+	if(user == NULL || get_user_peer(user) != peer)
+		return;
+
+	room = get_current_room(user);
+	if(room)
+	{
+		count_room(peer, room, FALSE);
+		room_remove_user(room, user);
+	}
+
+	if(*room_name == '\0' || strlen(room_name) < MIN_ROOM_LENGTH || strlen(room_name) >= MAX_ROOM_LENGTH)
+	{
+		set_user_state(user, NOT_IN_CHANNEL);
+		return;
+	}
+
+	room = room_directory_find(room_name);
+	if(room == NULL)
+		room = room_directory_create(room_name);
+
+	set_user_state(user, JOINED_CHANNEL);
+	room_add_user(room, user);
+	count_room(peer, room, TRUE);
+}
+
+/* Get the totals so far.  This is for statistics. */
+void federation_get_totals(uint32_t *links, uint32_t *remote_count, uint32_t *forwarded, uint32_t *copies, uint32_t *relayed)
+{
+	size_t i;
+
+	*links = 0;
+	for(i = 0; i < peer_count; i++)
+		if(peers[i].established)
+			(*links)++;
+
+	*remote_count = remote_users ? table_get_count(remote_users) : 0;
+	*forwarded = total_forwarded;
+	*copies = total_copies;
+	*relayed = total_relayed;
+}
+/* Count a message that came in from another server */
+void federation_count_relayed()
+{
+	total_relayed++;
+}
+
+
+/* A harness for linking.  It starts HARNESS_SERVERS servers on localhost (./server, which
+ * reads FEDERATION_KEY from the current directory, like this does), linked to each other and
+ * to this program, which plays one more server.  It checks that each of them answers its
+ * challenge right when it links to this one, and then pretends to be somebody else at this
+ * program's address: once without the secret, once skipping the answer and going straight
+ * to a SID_LINK_LOGIN, and once as this server after a restart (with a new node ID), which
+ * should get the link.  Each server's log should also say that its links to the others are
+ * up.
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define HARNESS_SERVERS 3
+
+static int base_port;
+
+static pid_t start_server(int index)
+{
+	char arguments[HARNESS_SERVERS + 2][32];
+	char *server_argv[HARNESS_SERVERS + 4];
+	int count = 0;
+	int null;
+	int i;
+	pid_t pid;
+
+	sprintf(arguments[count++], "%d", base_port + index);
+	sprintf(arguments[count++], "0");
+	for(i = 0; i <= HARNESS_SERVERS; i++)
+		if(i != index)
+			sprintf(arguments[count++], "127.0.0.1:%d", base_port + i);
+
+	server_argv[0] = "./server";
+	for(i = 0; i < count; i++)
+		server_argv[i + 1] = arguments[i];
+	server_argv[count + 1] = NULL;
+
+	pid = fork();
+	if(pid == 0)
+	{
+		null = open("/dev/null", O_RDWR);
+		dup2(null, 0);
+		dup2(null, 1);
+		dup2(null, 2);
+		execv(server_argv[0], server_argv);
+		_exit(1);
+	}
+
+	return pid;
+}
+
+static int dial(int port)
+{
+	struct sockaddr_in address;
+	struct timeval timeout;
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	assert(connect(s, (struct sockaddr *) &address, sizeof(address)) == 0);
+
+	timeout.tv_sec = 5;
+	timeout.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	return s;
+}
+
+static packet_buffer_t *expect(int s, uint8_t code)
+{
+	packet_buffer_t *packet = read_buffer(s, NULL);
+
+	if(packet == NULL || packet == (packet_buffer_t *) -1)
+		return NULL;
+	if(get_code(packet) != code)
+	{
+		destroy_buffer(packet);
+		return NULL;
+	}
+
+	return packet;
+}
+
+static BOOLEAN hung_up(int s)
+{
+	uint8_t data[256];
+	ssize_t length;
+
+	while((length = recv(s, data, sizeof(data), 0)) > 0)
+		;
+
+	return length == 0;
+}
+
+static int greet(int port, uint8_t *challenge, link_hello_packet_t *hello, packet_buffer_t **packets)
+{
+	int s = dial(port);
+	packet_buffer_t *packet = create_hello(challenge);
+
+	send_buffer(packet, s);
+	destroy_buffer(packet);
+
+	packets[0] = expect(s, SID_LINK_HELLO);
+	packets[1] = packets[0] && decode_link_hello(packets[0], hello) ? expect(s, SID_LINK_AUTH) : NULL;
+	assert(packets[1]);
+
+	return s;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in address;
+	struct timeval timeout;
+	link_hello_packet_t hello;
+	link_auth_packet_t auth;
+	link_login_packet_t login;
+	packet_buffer_t *packets[2];
+	packet_buffer_t *packet;
+	uint8_t challenge[PROTOCOL_HASH_LENGTH];
+	uint8_t answer[PROTOCOL_HASH_LENGTH];
+	pid_t servers[HARNESS_SERVERS];
+	int links[HARNESS_SERVERS];
+	int listener;
+	int up = 0;
+	int s;
+	int i;
+
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <first port>\n", argv[0]);
+		return 1;
+	}
+	base_port = atoi(argv[1]);
+
+	federation_initialize(base_port + HARNESS_SERVERS);
+	if(!federation_load_key())
+	{
+		fprintf(stderr, "Put a secret of at least %d bytes in %s first\n", FEDERATION_KEY_MINIMUM, FEDERATION_KEY);
+		return 1;
+	}
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(base_port + HARNESS_SERVERS);
+	assert(bind(listener, (struct sockaddr *) &address, sizeof(address)) == 0);
+	assert(listen(listener, HARNESS_SERVERS) == 0);
+
+	for(i = 0; i < HARNESS_SERVERS; i++)
+	{
+		links[i] = -1;
+		servers[i] = start_server(i);
+	}
+
+	timeout.tv_sec = 5;
+	timeout.tv_usec = 0;
+	for(i = 0; i < HARNESS_SERVERS; i++)
+	{
+		s = accept(listener, NULL, NULL);
+		setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		packets[0] = expect(s, SID_LINK_HELLO);
+		if(packets[0] == NULL || !decode_link_hello(packets[0], &hello))
+			continue;
+
+		packet = create_hello(challenge);
+		send_buffer(packet, s);
+		destroy_buffer(packet);
+		answer_challenge(hello.challenge, node_id, hello.node_id, ROLE_ACCEPTED, answer);
+		auth.answer = answer;
+		send_link_auth(s, &auth);
+
+		packets[1] = expect(s, SID_LINK_AUTH);
+		if(packets[1] && decode_link_auth(packets[1], &auth) && check_answer(challenge, hello.node_id, node_id, ROLE_DIALED, auth.answer))
+		{
+			links[hello.port - base_port] = s;
+			up++;
+		}
+		destroy_buffer(packets[0]);
+		if(packets[1])
+			destroy_buffer(packets[1]);
+	}
+	fprintf(stderr, "%d of %d servers answered right (should be %d)\n", up, HARNESS_SERVERS, HARNESS_SERVERS);
+
+	key[0] ^= 1;
+	s = greet(base_port, challenge, &hello, packets);
+	decode_link_auth(packets[1], &auth);
+	fprintf(stderr, "Without the secret, its answer is %s (should be wrong)\n", check_answer(challenge, hello.node_id, node_id, ROLE_ACCEPTED, auth.answer) ? "right" : "wrong");
+	answer_challenge(hello.challenge, node_id, hello.node_id, ROLE_DIALED, answer);
+	auth.answer = answer;
+	send_link_auth(s, &auth);
+	fprintf(stderr, "Without the secret, %s (should be hung up on)\n", hung_up(s) ? "hung up on" : "STILL CONNECTED");
+	destroy_buffer(packets[0]);
+	destroy_buffer(packets[1]);
+	close(s);
+	key[0] ^= 1;
+
+	s = greet(base_port, challenge, &hello, packets);
+	login.ip = htonl(INADDR_LOOPBACK);
+	login.username = "test";
+	send_link_login(s, &login);
+	fprintf(stderr, "Skipping the answer, %s (should be hung up on)\n", hung_up(s) ? "hung up on" : "STILL CONNECTED");
+	destroy_buffer(packets[0]);
+	destroy_buffer(packets[1]);
+	close(s);
+
+	node_id ^= 1;
+	s = greet(base_port, challenge, &hello, packets);
+	decode_link_auth(packets[1], &auth);
+	fprintf(stderr, "After a restart, its answer is %s (should be right)\n", check_answer(challenge, hello.node_id, node_id, ROLE_ACCEPTED, auth.answer) ? "right" : "wrong");
+	answer_challenge(hello.challenge, node_id, hello.node_id, ROLE_DIALED, answer);
+	auth.answer = answer;
+	send_link_auth(s, &auth);
+	fprintf(stderr, "After a restart, the old link was %s (should be dropped)\n", links[0] >= 0 && hung_up(links[0]) ? "dropped" : "KEPT");
+	destroy_buffer(packets[0]);
+	destroy_buffer(packets[1]);
+	close(s);
+
+	for(i = 0; i < HARNESS_SERVERS; i++)
+	{
+		kill(servers[i], SIGTERM);
+		waitpid(servers[i], NULL, 0);
+	}
+
+	return 0;
+}
+*/
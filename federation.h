@@ -0,0 +1,200 @@
+/* federation */
+/* This module joins several servers together, so they act like one big one.  Each server is
+ * started with the addresses of the others (its peers), and keeps a link open to each of
+ * them.  A link is just a connection to the peer's usual port that starts with
+ * SID_LINK_HELLO instead of SID_CLIENT_INFORMATION, and then carries the SID_LINK_* packets
+ * (see types.h), framed like everything else.
+ *
+ * Every server tells the others who logs in and out, and who joins which room.  Somebody on
+ * another server is a remote user here (see create_remote_user()), who's in rooms like
+ * anybody else, so they show up in /who, room lists, and joins and leaves, but never has
+ * anything written to them.  Nobody can log in with a name that's logged in on any server.
+ *
+ * When somebody talks, their server sends the message once to each server that has somebody
+ * in the room, no matter how many people it has there, and that server hands it out to its
+ * own people.  A server only ever forwards what its own users say, so nothing goes around in
+ * circles, but that means every server has to be linked to every other one.
+ *
+ * Every room has a home server, picked with a consistent-hash ring of the servers whose
+ * links are up (see ring.h), so they all agree on it without asking each other, and only
+ * about 1/N of the rooms move when a server comes or goes.  The home keeps the room's
+ * settings (like /batch) the same everywhere.
+ *
+ * When two servers disagree (there are two links between them, or one name got logged in on
+ * both at once), the one with the lower node ID wins, which both of them can work out
+ * without asking each other.
+ *
+ * A link is only accepted from one of the addresses the server was given, and only once the
+ * other end proves that it knows the secret in FEDERATION_KEY, which every server has a copy
+ * of.  Each end puts a random challenge in its SID_LINK_HELLO, and the other end answers
+ * with SID_LINK_AUTH: an HMAC of the challenge, keyed with the secret.  The answer also
+ * covers both node IDs and which end is answering, so it can't be sent back to the server
+ * that made it, or used on another link.  The server that was connected to answers first,
+ * and nothing about the link changes (an old link to the same peer isn't even dropped) until
+ * the one that connected has answered it too.
+ *
+ * If a link goes down, everybody on the other end leaves their rooms, and it's tried again
+ * with each keepalive. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#ifndef _FEDERATION_H_
+#define _FEDERATION_H_
+
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#include "ring.h"
+#include "room.h"
+#include "table.h"
+#include "types.h"
+#include "user.h"
+
+/* The outbox is defined in outbox.c */
+struct _outbox_t;
+
+/* The most peers a server can have */
+#define FEDERATION_MAX_PEERS 16
+
+/* The version of the SID_LINK_* packets, which is sent in SID_LINK_HELLO.  This goes up
+ * whenever any of them changes, so two servers never misread each other; a link between
+ * different versions is closed as soon as the hellos cross.  The first links (version 1)
+ * didn't send one at all, so their hello is too short, and never gets that far. */
+#define FEDERATION_VERSION 3
+
+/* The file with the secret that the servers share, in the current directory.  Everything in
+ * it (except for a newline at the end) is the secret, which has to be at least
+ * FEDERATION_KEY_MINIMUM bytes, and only the first FEDERATION_KEY_MAXIMUM are used. */
+#define FEDERATION_KEY "federation.key"
+#define FEDERATION_KEY_MINIMUM 16
+#define FEDERATION_KEY_MAXIMUM 256
+
+/* Another server, and the link to it */
+typedef struct _peer_t
+{
+	/* Where the peer is, as it was given */
+	char *host;
+	int port;
+	struct in_addr ip;
+
+	/* The link, or -1 if it's down */
+	int socket;
+	/* Whether this server connected to the peer, rather than the other way around */
+	BOOLEAN dialed;
+	/* If it did, whether the peer's SID_LINK_HELLO has arrived, and the challenge that was in
+	 * it, which is answered once the peer has answered ours */
+	BOOLEAN greeted;
+	uint8_t their_challenge[PROTOCOL_HASH_LENGTH];
+	/* The challenge in this server's hello, if it dialed */
+	uint8_t challenge[PROTOCOL_HASH_LENGTH];
+	/* Whether both ends have answered each other's challenge.  Until they have, nothing else
+	 * goes over the link. */
+	BOOLEAN established;
+	/* The peer's node ID, once the link is established (or once its hello arrives, if this
+	 * server dialed) */
+	uint32_t node_id;
+
+	/* Whatever's waiting to be written to the link (see outbox.h) */
+	struct _outbox_t *outbox;
+
+	/* The number of the peer's users in each room, by room name (each value is a
+	 * uint32_t *), so a message only goes to the peers that need it */
+	table_t *rooms;
+} peer_t;
+
+/* Pick this server's node ID.  This has to be called before anything else. */
+void federation_initialize(int port);
+/* Read the secret that the servers share from FEDERATION_KEY.  This has to be done before
+ * any peers are dialed.  Returns FALSE if it isn't there, or it's too short. */
+BOOLEAN federation_load_key();
+/* Add a peer, given as "host:port".  Returns FALSE if it doesn't make sense, or there are
+ * already FEDERATION_MAX_PEERS. */
+BOOLEAN federation_add_peer(char *address);
+/* Get this server's node ID */
+uint32_t federation_get_node_id();
+
+/* Get the number of peers, and each of them.  select() should watch each one whose socket
+ * isn't -1, for reading, and for writing if federation_is_waiting(). */
+size_t federation_get_peer_count();
+peer_t *federation_get_peer(size_t index);
+
+/* Connect to every peer whose link is down.  This blocks until each one answers or refuses,
+ * so it's only done at startup and with each keepalive. */
+void federation_dial();
+
+/* Find the peer that a SID_LINK_HELLO came from, by the address it connected from and the
+ * port it says it's listening on.  Returns NULL if it isn't a peer. */
+peer_t *federation_find_peer(struct in_addr ip, int port);
+/* A peer connected to this server (as the user), and sent SID_LINK_HELLO.  The user is sent
+ * this server's hello, and the answer to the peer's challenge, and then the only thing they
+ * can send is their own answer (see federation_is_linking()).  Returns FALSE if the hello
+ * doesn't make sense (it's from this server), in which case the connection should be
+ * closed. */
+BOOLEAN federation_greet(user_t *user, peer_t *peer, link_hello_packet_t *hello);
+/* Whether the user is a peer that's been greeted, and hasn't answered yet */
+BOOLEAN federation_is_linking(user_t *user);
+/* The peer that connected to this server answered its challenge with SID_LINK_AUTH.  If the
+ * answer's right, the connection becomes the link to the peer.  If there's already a link
+ * to it, only the one that was made by the server with the lower node ID is kept.  If this
+ * one's kept, the peer is told who's logged in here (see user_directory.h) and where they
+ * are, and the user should be thrown away, without closing the socket.  Returns FALSE if
+ * the answer's wrong or the link isn't kept, in which case the connection should be
+ * closed. */
+BOOLEAN federation_accept(user_t *user, link_auth_packet_t *auth);
+/* The hello from a peer that this server dialed arrived.  Returns FALSE if it doesn't make
+ * sense (it's from this server, it's the second one, or the peer uses a different
+ * FEDERATION_VERSION), in which case the link should be dropped. */
+BOOLEAN federation_hello(peer_t *peer, link_hello_packet_t *hello);
+/* The answer to the challenge in the hello that this server sent when it dialed the peer
+ * arrived.  If it's right, the peer is sent the answer to its own challenge, and told who's
+ * logged in here (see user_directory.h) and where they are.  Returns FALSE if it's wrong,
+ * or it came before the peer's hello, in which case the link should be dropped. */
+BOOLEAN federation_auth(peer_t *peer, link_auth_packet_t *auth);
+/* Close the link to the peer, and take everybody on it out of their rooms */
+void federation_drop(peer_t *peer);
+
+/* Whether anything is waiting to be written to the peer */
+BOOLEAN federation_is_waiting(peer_t *peer);
+/* Write as much of what's waiting for the peer as the link will take */
+void federation_flush(peer_t *peer);
+
+/* Tell the other servers that somebody logged in here, or logged out */
+void federation_logged_in(user_t *user);
+void federation_logged_out(user_t *user);
+/* Tell the other servers that somebody here joined a room (or left chat, if they aren't in
+ * one now) */
+void federation_joined(user_t *user);
+/* Forward a message that somebody here said in the room (see room_message()) to each
+ * server that has somebody in it */
+void federation_message(room_t *room, uint32_t subtype, char *from, char *message);
+/* Forward a whisper to a user on another server (see federation_find_user()) */
+void federation_whisper(user_t *to, char *from, char *message);
+
+/* Get the node ID of the home of a room (see ring.h) */
+uint32_t federation_get_home(char *room_name);
+/* Somebody here changed a room's settings; pass them along to the other servers */
+void federation_room_changed(room_t *room);
+/* A room's settings arrived from the peer.  They're only used if the peer is the room's home,
+ * or this server is (in which case they're passed along). */
+void federation_remote_room(peer_t *peer, char *room_name, uint16_t batch_window);
+
+/* Find somebody who's logged in on another server, or NULL */
+user_t *federation_find_user(char *username);
+/* Somebody logged in on the peer.  If the name's already logged in on another peer, the one
+ * with the lower node ID keeps it.  Nobody here should have the name; when somebody does, the
+ * caller has to settle it first. */
+void federation_remote_login(peer_t *peer, char *username, struct in_addr ip);
+/* Somebody on the peer logged out */
+void federation_remote_logout(peer_t *peer, char *username);
+/* Somebody on the peer joined a room, or left chat if room_name is blank */
+void federation_remote_join(peer_t *peer, char *username, char *room_name);
+
+/* Get the totals so far: the links that are up, the users on other servers, the messages
+ * that were forwarded (and the number of copies that took), and the messages that came in
+ * from other servers.  This is for statistics. */
+void federation_get_totals(uint32_t *links, uint32_t *remote_users, uint32_t *forwarded, uint32_t *copies, uint32_t *relayed);
+/* Count a message that came in from another server and was handed out here */
+void federation_count_relayed();
+
+#endif
+
@@ -0,0 +1,579 @@
+/* handoff */
+/* This module upgrades the server without dropping anybody.  The old server hands the new
+ * one its listening sockets and every client's socket over a Unix socket (with SCM_RIGHTS),
+ * along with everything it knows about each user and room, then exits.
+ *
+ * Everything goes over as a series of records, which look just like packets (see
+ * packet_buffer.h).  A record that comes with a socket has it attached to its first byte. */
+/* NOTE: These functions are NOT thread-safe. */
+
+/* SO_PEERCRED (and struct ucred) is a Linux extension, and it's hidden unless we ask for it.
+ * This has to come before any of the includes. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "broadcast.h"
+#include "list.h"
+#include "output.h"
+#include "packet_buffer.h"
+#include "presence.h"
+#include "room.h"
+#include "room_directory.h"
+#include "tls.h"
+#include "token.h"
+#include "types.h"
+#include "user.h"
+#include "user_directory.h"
+
+#include "handoff.h"
+
+/* The most sockets that come with one record */
+#define MAX_SOCKETS 2
+
+/* The records, in the order they're sent */
+typedef enum
+{
+	/* New to old: (uint32_t) HANDOFF_VERSION */
+	HANDOFF_HELLO,
+	/* Old to new, with the listening socket and the datagram socket: (void) */
+	HANDOFF_SOCKETS,
+	/* Old to new, if it offers TLS: (bytes) the session ticket keys (see tls.h) */
+	HANDOFF_TLS,
+	/* Old to new: (bytes) the secret the session tokens are signed with (see token.h) */
+	HANDOFF_TOKEN,
+	/* Old to new, once per room with somebody in it: (ntstring) name, (uint16_t) batch
+	 * window */
+	HANDOFF_ROOM,
+	/* Old to new, once per user, with their socket: (ntstring) room (blank if they aren't in
+	 * one), then whatever user_save() saved */
+	HANDOFF_USER,
+	/* Old to new, for the last user, as many as it takes: (bytes) part of what was waiting
+	 * to be written to them */
+	HANDOFF_WAITING,
+	/* Old to new when it's all been sent, then new to old once it's all been taken: (void) */
+	HANDOFF_DONE
+} handoff_record_t;
+
+/* Don't die of SIGPIPE if the other server goes away partway through */
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+/* Fill in the address of the handoff socket for the port */
+static void get_address(int port, struct sockaddr_un *address)
+{
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+	sprintf(address->sun_path, HANDOFF_PATH, port);
+}
+
+/* Read exactly "length" bytes.  Returns FALSE if the connection closed first. */
+static BOOLEAN read_fully(int s, uint8_t *data, size_t length)
+{
+	ssize_t got;
+
+	while(length > 0)
+	{
+		got = read(s, data, length);
+		if(got <= 0)
+			return FALSE;
+		data += got;
+		length -= got;
+	}
+
+	return TRUE;
+}
+
+/* Send a record, with the given sockets attached.  Returns FALSE if the other server went
+ * away. */
+static BOOLEAN send_record(int s, packet_buffer_t *record, int *sockets, size_t socket_count)
+{
+	union
+	{
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int) * MAX_SOCKETS)];
+	} control;
+	struct msghdr message;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint8_t *data = get_buffer(record);
+	size_t length = get_length(record);
+	ssize_t sent;
+
+	assert(socket_count <= MAX_SOCKETS);
+
+	memset(&message, 0, sizeof(message));
+	iov.iov_base = data;
+	iov.iov_len = length;
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+
+	if(socket_count > 0)
+	{
+		memset(&control, 0, sizeof(control));
+		message.msg_control = &control;
+		message.msg_controllen = CMSG_SPACE(sizeof(int) * socket_count);
+
+		cmsg = CMSG_FIRSTHDR(&message);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * socket_count);
+		memcpy(CMSG_DATA(cmsg), sockets, sizeof(int) * socket_count);
+	}
+
+	/* The sockets go with the first part; if it only partly went, the rest follows */
+	sent = sendmsg(s, &message, SEND_FLAGS);
+	while(sent > 0 && (size_t) sent < length)
+	{
+		data += sent;
+		length -= sent;
+		sent = send(s, data, length, SEND_FLAGS);
+	}
+
+	return sent > 0;
+}
+
+/* Send a record with no sockets, then destroy it */
+static BOOLEAN send_and_destroy(int s, packet_buffer_t *record)
+{
+	BOOLEAN result = send_record(s, record, NULL, 0);
+
+	destroy_buffer(record);
+
+	return result;
+}
+
+/* Receive a record, along with any sockets that came with it (up to MAX_SOCKETS; the
+ * number is returned in socket_count).  Returns NULL if the connection closed, or what came
+ * in wasn't a record.  The record has to be destroyed. */
+static packet_buffer_t *receive_record(int s, int *sockets, size_t *socket_count)
+{
+	union
+	{
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int) * MAX_SOCKETS)];
+	} control;
+	struct msghdr message;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint8_t header[4];
+	ssize_t got;
+	size_t count;
+	uint16_t length;
+	packet_buffer_t *record;
+
+	memset(&message, 0, sizeof(message));
+	iov.iov_base = header;
+	iov.iov_len = sizeof(header);
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = &control;
+	message.msg_controllen = sizeof(control);
+
+	*socket_count = 0;
+
+	got = recvmsg(s, &message, 0);
+	if(got <= 0)
+		return NULL;
+
+	for(cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+	{
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if(count > MAX_SOCKETS - *socket_count)
+				count = MAX_SOCKETS - *socket_count;
+			memcpy(sockets + *socket_count, CMSG_DATA(cmsg), sizeof(int) * count);
+			*socket_count += count;
+		}
+	}
+
+	if(got < sizeof(header) && !read_fully(s, header + got, sizeof(header) - got))
+		return NULL;
+
+	length = header[2] | (header[3] << 8);
+	if(header[0] != 0xFF || length < 4)
+		return NULL;
+
+	record = create_buffer_length(header[1], length - 4);
+	if(!read_fully(s, get_buffer(record) + 4, length - 4))
+	{
+		destroy_buffer(record);
+		return NULL;
+	}
+
+	return record;
+}
+
+/* Start listening for a new server to hand off to.  The socket is only usable by this user
+ * (connecting to a Unix socket needs write permission on it), so it's made with the umask
+ * that gives it mode 0600.  This is before anything else can be listening, so there's no
+ * moment when it's open to everybody. */
+int handoff_open(int port)
+{
+	struct sockaddr_un address;
+	mode_t old_mask;
+	BOOLEAN bound;
+	int s;
+
+	get_address(port, &address);
+
+	/* If there's an old socket there, its server is gone (or it just handed off to us) */
+	unlink(address.sun_path);
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(s < 0)
+		return -1;
+
+	old_mask = umask(0177);
+	bound = bind(s, (struct sockaddr *) &address, sizeof(address)) == 0;
+	umask(old_mask);
+
+	if(!bound || listen(s, 1) < 0)
+	{
+		display_message(ERROR_WARNING, "Couldn't open the handoff socket %s [%s]; upgrades won't work", address.sun_path, strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+/* Send one user, with their socket, and everything that's waiting for them */
+static BOOLEAN give_user(int s, user_t *user)
+{
+	packet_buffer_t *record;
+	int socket = get_socket(user);
+	uint8_t *waiting;
+	size_t length;
+	size_t chunk;
+	BOOLEAN result;
+
+	record = create_buffer(HANDOFF_USER);
+	add_ntstring(record, get_user_room(user) ? get_user_room(user) : "");
+	if(!user_save(user, record))
+	{
+		display_message(ERROR_WARNING, "User %s [%s] can't be handed off, so they'll be disconnected", get_username(user), get_ip(user));
+		destroy_buffer(record);
+		return TRUE;
+	}
+
+	result = send_record(s, record, &socket, 1);
+	destroy_buffer(record);
+
+	waiting = user_get_waiting(user, &length);
+	for(; result && length > 0; waiting += chunk, length -= chunk)
+	{
+		chunk = length > HANDOFF_CHUNK ? HANDOFF_CHUNK : length;
+		record = create_buffer(HANDOFF_WAITING);
+		add_bytes(record, waiting, chunk);
+		result = send_and_destroy(s, record);
+	}
+
+	return result;
+}
+
+/* Whether the server on the other end of the handoff socket is running as the same user as
+ * this one.  Anybody else could take every client's socket.  The socket's mode already keeps
+ * them out; this is in case it's been changed, or the directory's shared. */
+static BOOLEAN is_same_user(int s)
+{
+#ifdef SO_PEERCRED
+	struct ucred credentials;
+	socklen_t length = sizeof(credentials);
+
+	if(getsockopt(s, SOL_SOCKET, SO_PEERCRED, &credentials, &length) < 0)
+		return FALSE;
+
+	return credentials.uid == getuid();
+#else
+	return TRUE;
+#endif
+}
+
+/* Hand everything off to the new server that's connecting to the handoff socket */
+BOOLEAN handoff_give(int handoff_socket, int listen_socket, int datagram_socket, list_t *new_users)
+{
+	int s;
+	int sockets[2];
+	size_t socket_count;
+	packet_buffer_t *record;
+	room_t **rooms;
+	size_t room_count;
+	user_t **new_user_list;
+	uint32_t new_user_count;
+	user_t **old_user_list;
+	size_t old_user_count;
+	BOOLEAN result;
+	struct timeval timeout;
+	size_t i;
+
+	s = accept(handoff_socket, NULL, NULL);
+	if(s < 0)
+		return FALSE;
+
+	if(!is_same_user(s))
+	{
+		display_message(ERROR_WARNING, "Somebody running as another user tried to take over; ignoring them");
+		close(s);
+		return FALSE;
+	}
+
+	/* Everybody waits while this goes on, so a new server that stops answering fails the
+	 * handoff, rather than hanging this one */
+	timeout.tv_sec = HANDOFF_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	record = receive_record(s, sockets, &socket_count);
+	if(record == NULL || get_code(record) != HANDOFF_HELLO || !can_read_int32(record) || read_next_int32(record) != HANDOFF_VERSION)
+	{
+		display_message(ERROR_WARNING, "A new server tried to take over, but it doesn't speak the same handoff version; ignoring it");
+		if(record)
+			destroy_buffer(record);
+		close(s);
+		return FALSE;
+	}
+	destroy_buffer(record);
+
+	display_message(ERROR_NOTICE, "Handing off to a new server");
+
+	/* Send everything that's being held back, so it isn't lost */
+	rooms = room_directory_get_live(&room_count);
+	for(i = 0; i < room_count; i++)
+	{
+		broadcast_flush(rooms[i]);
+		presence_flush(rooms[i]);
+	}
+
+	sockets[0] = listen_socket;
+	sockets[1] = datagram_socket;
+	record = create_buffer(HANDOFF_SOCKETS);
+	result = send_record(s, record, sockets, 2);
+	destroy_buffer(record);
+
+	/* The new server gets the ticket keys, so clients that have to reconnect (see
+	 * user_save()) don't have to do a full handshake */
+	if(result && tls_is_enabled())
+	{
+		record = create_buffer(HANDOFF_TLS);
+		tls_save_keys(record);
+		result = send_and_destroy(s, record);
+	}
+
+	/* And the session tokens it gave out still work */
+	if(result)
+	{
+		record = create_buffer(HANDOFF_TOKEN);
+		token_save_key(record);
+		result = send_and_destroy(s, record);
+	}
+
+	for(i = 0; result && i < room_count; i++)
+	{
+		record = create_buffer(HANDOFF_ROOM);
+		add_ntstring(record, room_get_name(rooms[i]));
+		add_int16(record, room_get_batch_window(rooms[i]));
+		result = send_and_destroy(s, record);
+	}
+	free(rooms);
+
+	new_user_list = (user_t **) list_get_array(new_users, &new_user_count);
+	for(i = 0; result && i < new_user_count; i++)
+		result = give_user(s, new_user_list[i]);
+	free(new_user_list);
+
+	old_user_list = user_directory_get_all(&old_user_count);
+	for(i = 0; result && i < old_user_count; i++)
+		result = give_user(s, old_user_list[i]);
+	free(old_user_list);
+
+	/* It's only taken over once it says so */
+	if(result)
+		result = send_and_destroy(s, create_buffer(HANDOFF_DONE));
+	if(result)
+	{
+		record = receive_record(s, sockets, &socket_count);
+		result = record != NULL && get_code(record) == HANDOFF_DONE;
+		if(record)
+			destroy_buffer(record);
+	}
+
+	if(result)
+		display_message(ERROR_NOTICE, "The new server has taken over %u users", (unsigned int) (new_user_count + old_user_count));
+	else
+		display_message(ERROR_WARNING, "The new server went away partway through the handoff; carrying on");
+
+	close(s);
+
+	return result;
+}
+
+/* Read a room record, and set the room up */
+static BOOLEAN take_room(packet_buffer_t *record)
+{
+	char name[MAX_ROOM_LENGTH + 1];
+	room_t *room;
+
+	if(!can_read_ntstring(record))
+		return FALSE;
+	read_next_ntstring(record, name, sizeof(name));
+	if(strlen(name) < MIN_ROOM_LENGTH || !can_read_int16(record))
+		return FALSE;
+
+	room = room_directory_find(name);
+	if(room == NULL)
+		room = room_directory_create(name);
+	room_set_batch_window(room, read_next_int16(record));
+
+	return TRUE;
+}
+
+/* Read a user record, and put them back where they were.  Returns the user, or NULL if the
+ * record is corrupt. */
+static user_t *take_user(packet_buffer_t *record, int socket, list_t *new_users)
+{
+	char room_name[MAX_ROOM_LENGTH + 1];
+	room_t *room = NULL;
+	user_t *user;
+
+	if(!can_read_ntstring(record))
+		return NULL;
+	read_next_ntstring(record, room_name, sizeof(room_name));
+	if(strlen(room_name) > 0 && (room = room_directory_find(room_name)) == NULL)
+		return NULL;
+
+	user = user_restore(socket, record);
+	if(user == NULL)
+		return NULL;
+
+	if(get_user_state(user) == CONNECTED || get_user_state(user) == SENT_CLIENT_INFORMATION)
+		list_add_end(new_users, user);
+	else
+		user_directory_add(get_username(user), user);
+
+	if(room)
+		room_restore_user(room, user);
+
+	return user;
+}
+
+/* If another server is already running on the port, take everything over from it */
+BOOLEAN handoff_take(int port, int *listen_socket, int *datagram_socket, list_t *new_users)
+{
+	struct sockaddr_un address;
+	int s;
+	int sockets[MAX_SOCKETS];
+	size_t socket_count;
+	packet_buffer_t *record;
+	user_t *user = NULL;
+	uint32_t user_count = 0;
+	uint16_t length;
+	uint8_t data[HANDOFF_CHUNK];
+	BOOLEAN done = FALSE;
+
+	get_address(port, &address);
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(s < 0)
+		return FALSE;
+
+	/* If nobody's there, there's nothing to take over */
+	if(connect(s, (struct sockaddr *) &address, sizeof(address)) < 0)
+	{
+		close(s);
+		return FALSE;
+	}
+
+	display_message(ERROR_NOTICE, "Taking over from the server that's already running on port %d", port);
+
+	record = create_buffer(HANDOFF_HELLO);
+	add_int32(record, HANDOFF_VERSION);
+	if(!send_and_destroy(s, record))
+		display_error(ERROR_EMERGENCY, "The old server went away before the handoff started");
+
+	record = receive_record(s, sockets, &socket_count);
+	if(record == NULL || get_code(record) != HANDOFF_SOCKETS || socket_count != 2)
+		display_error(ERROR_EMERGENCY, "The old server didn't hand off its sockets");
+	*listen_socket = sockets[0];
+	*datagram_socket = sockets[1];
+	destroy_buffer(record);
+
+	while(!done)
+	{
+		record = receive_record(s, sockets, &socket_count);
+		if(record == NULL)
+			display_error(ERROR_EMERGENCY, "The old server went away partway through the handoff");
+
+		switch(get_code(record))
+		{
+			case HANDOFF_TLS:
+				/* If the new server doesn't have a certificate, it doesn't need them */
+				if(tls_is_enabled() && !tls_restore_keys(record))
+					display_error(ERROR_EMERGENCY, "The old server handed off corrupt TLS keys");
+				break;
+
+			case HANDOFF_TOKEN:
+				if(!token_restore_key(record))
+					display_error(ERROR_EMERGENCY, "The old server handed off a corrupt token secret");
+				break;
+
+			case HANDOFF_ROOM:
+				if(!take_room(record))
+					display_error(ERROR_EMERGENCY, "The old server handed off a corrupt room");
+				break;
+
+			case HANDOFF_USER:
+				if(socket_count != 1 || (user = take_user(record, sockets[0], new_users)) == NULL)
+					display_error(ERROR_EMERGENCY, "The old server handed off a corrupt user");
+				user_count++;
+				break;
+
+			case HANDOFF_WAITING:
+				length = get_length(record) - 4;
+				if(user == NULL || length > HANDOFF_CHUNK)
+					display_error(ERROR_EMERGENCY, "The old server handed off output for nobody");
+				read_next_bytes(record, data, length);
+				user_restore_waiting(user, data, length);
+				break;
+
+			case HANDOFF_DONE:
+				done = TRUE;
+				break;
+
+			default:
+				display_error(ERROR_EMERGENCY, "The old server handed off something unexpected (%d)", get_code(record));
+		}
+
+		destroy_buffer(record);
+	}
+
+	/* Once the old server hears this, it's gone */
+	if(!send_and_destroy(s, create_buffer(HANDOFF_DONE)))
+		display_error(ERROR_EMERGENCY, "The old server went away at the end of the handoff");
+	close(s);
+
+	display_message(ERROR_NOTICE, "Took over %u users from the old server", user_count);
+
+	return TRUE;
+}
+
@@ -0,0 +1,60 @@
+/* handoff */
+/* This module upgrades the server without dropping anybody.  Every server listens on a Unix
+ * socket named after its port (see HANDOFF_PATH), which only the user it's running as can
+ * use.  When a new server is started on a port that's already being served, it connects to
+ * that socket instead of opening the port, and the old server hands it everything: the
+ * listening sockets and every client's socket (with SCM_RIGHTS, so they're never closed),
+ * each user's state, tokens and room, each room's settings, and whatever was still waiting
+ * to be written to each user.  Once the new server says it has everything, the old one
+ * exits, and the new one carries on from there.  The clients never notice.
+ *
+ * Everything that's being held back (chat, joins and leaves) is sent before the handoff,
+ * so none of it is lost.  Names that were being sent by number start over (see
+ * user_restore()), and so do the statistics.  If anything goes wrong before the new server
+ * says it has everything, the old server just keeps going.
+ *
+ * Connections that can't be handed off (see compression_save(), and TLS connections, whose
+ * encryption state belongs to OpenSSL) are closed when the old server exits; they'll just
+ * have to reconnect.  The TLS session ticket keys are handed off, so they can resume, and so
+ * is the secret for session tokens (see token.h), so clients can log back in with them. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+
+#include "list.h"
+#include "types.h"
+
+/* The name of the Unix socket, in the current directory; %d is the port */
+#define HANDOFF_PATH "server-%d.handoff"
+
+/* This goes up whenever what's handed off changes, so an old server never hands off to a
+ * new one that would misunderstand it */
+#define HANDOFF_VERSION 3
+
+/* The most bytes of waiting output that are handed off in one piece */
+#define HANDOFF_CHUNK 8192
+
+/* The most seconds the old server waits for the new one to send or take anything, before it
+ * gives up on the handoff and carries on */
+#define HANDOFF_TIMEOUT 5
+
+/* Start listening for a new server to hand off to, and return the socket.  This should be
+ * watched by select(), and handoff_give() called when it's readable.  Returns -1 if it
+ * couldn't be opened (in which case upgrades won't work, but nothing else is wrong). */
+int handoff_open(int port);
+
+/* Hand everything off to the new server that's connecting to the handoff socket.  Returns
+ * TRUE if it took over, in which case this server has to exit right away, without closing
+ * or writing to any of the sockets.  Returns FALSE if it didn't, in which case this server
+ * carries on as if nothing happened. */
+BOOLEAN handoff_give(int handoff_socket, int listen_socket, int datagram_socket, list_t *new_users);
+
+/* If another server is already running on the port, take everything over from it.  Returns
+ * TRUE if it did, in which case listen_socket and datagram_socket are set, and the users are
+ * back in their lists and rooms.  Returns FALSE if there's no server to take over from.  If
+ * the handoff fails partway through, this doesn't return at all. */
+BOOLEAN handoff_take(int port, int *listen_socket, int *datagram_socket, list_t *new_users);
+
+#endif
+
@@ -0,0 +1,229 @@
+/* intern */
+/* This module is a pool of shared, read-only strings.  Every distinct string (a username,
+ * a room name, etc.) is only ever stored once, no matter how many tables or structures
+ * refer to it.  Since there's only one copy, two interned strings are equal if and only if
+ * the pointers are equal, so there's no need for strcmp().  The hash of each string is
+ * calculated once, when it's interned, and stored alongside it. */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "atomic.h"
+#include "intern.h"
+
+/* The initial number of buckets in the pool.  This has to be a power of 2. */
+#define STARTING_BUCKETS 64
+/* The initial room for numbers that have been given back */
+#define STARTING_FREE_IDS 64
+
+/* A single string in the pool.  The string itself is stored immediately after the header,
+ * so a pointer to the string can be turned back into a pointer to its header. */
+typedef struct _interned_t
+{
+	struct _interned_t *next;
+	uint32_t hash;
+	uint32_t references;
+	/* The string's number (see intern_get_id()), or 0 if it hasn't been given one */
+	uint32_t id;
+	char string[1];
+} interned_t;
+
+/* The pool is a hashtable of interned_t chains */
+static interned_t **buckets = NULL;
+static size_t bucket_count = 0;
+static size_t string_count = 0;
+static size_t string_bytes = 0;
+
+/* Numbers that have been given back, to be handed out again before new ones are.  The next
+ * new one is next_id; 0 is never used. */
+static uint32_t *free_ids = NULL;
+static size_t free_id_count = 0;
+static size_t free_id_size = 0;
+static uint32_t next_id = 1;
+
+/* Turn a pointer to an interned string back into its header */
+static interned_t *get_header(char *interned)
+{
+	return (interned_t *) (interned - offsetof(interned_t, string));
+}
+
+/* Calculate the hash of a string.  This is FNV-1a, which is cheap and spreads short strings
+ * (like usernames) well. */
+static uint32_t hash_string(char *string)
+{
+	uint32_t hash = 2166136261U;
+
+	while(*string)
+	{
+		hash ^= (uint8_t) *string++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* Double the number of buckets, and move every string into its new bucket */
+static void grow_pool()
+{
+	size_t i;
+	size_t new_count = bucket_count ? bucket_count << 1 : STARTING_BUCKETS;
+	interned_t **new_buckets = calloc(new_count, sizeof(interned_t *));
+	interned_t *node;
+	interned_t *next;
+
+	assert(new_buckets); /* Out of memory */
+
+	for(i = 0; i < bucket_count; i++)
+	{
+		for(node = buckets[i]; node; node = next)
+		{
+			next = node->next;
+			node->next = new_buckets[node->hash & (new_count - 1)];
+			new_buckets[node->hash & (new_count - 1)] = node;
+		}
+	}
+
+	free(buckets);
+	buckets = new_buckets;
+	bucket_count = new_count;
+}
+
+/* Look up a string in the pool, given its hash */
+static interned_t *find_string(char *string, uint32_t hash)
+{
+	interned_t *node;
+
+	if(bucket_count == 0)
+		return NULL;
+
+	for(node = buckets[hash & (bucket_count - 1)]; node; node = node->next)
+		if(node->hash == hash && !strcmp(node->string, string))
+			return node;
+
+	return NULL;
+}
+
+/* Get the shared copy of the given string, adding it to the pool if it isn't there yet.
+ * This takes a reference to the string, which has to be given back with intern_release().
+ * The returned string must NOT be modified. */
+char *intern_string(char *string)
+{
+	uint32_t hash = hash_string(string);
+	interned_t *node = find_string(string, hash);
+	size_t size;
+
+	if(node == NULL)
+	{
+		if(string_count >= bucket_count)
+			grow_pool();
+
+		size = offsetof(interned_t, string) + strlen(string) + 1;
+		node = malloc(size);
+		assert(node); /* Out of memory */
+
+		node->hash = hash;
+		node->references = 0;
+		node->id = 0;
+		strcpy(node->string, string);
+
+		node->next = buckets[hash & (bucket_count - 1)];
+		buckets[hash & (bucket_count - 1)] = node;
+
+		string_count++;
+		string_bytes += size;
+	}
+
+	node->references++;
+
+	return node->string;
+}
+
+/* Take another reference to a string that's already interned */
+char *intern_hold(char *interned)
+{
+	/* Worker threads take references while they send chat (see intern.h) */
+	ATOMIC_ADD(get_header(interned)->references, 1);
+
+	return interned;
+}
+
+/* Give back a reference to an interned string.  When the last reference is released, the
+ * string is removed from the pool and freed. */
+void intern_release(char *interned)
+{
+	interned_t *node = get_header(interned);
+	interned_t **link;
+
+	assert(node->references > 0);
+	node->references--;
+
+	if(node->references == 0)
+	{
+		/* Unlink it from its bucket */
+		for(link = &buckets[node->hash & (bucket_count - 1)]; *link != node; link = &(*link)->next)
+			assert(*link);
+		*link = node->next;
+
+		string_count--;
+		string_bytes -= offsetof(interned_t, string) + strlen(node->string) + 1;
+
+		/* Its number can go to somebody else now */
+		if(node->id)
+		{
+			if(free_id_count == free_id_size)
+			{
+				free_id_size = free_id_size ? free_id_size << 1 : STARTING_FREE_IDS;
+				free_ids = realloc(free_ids, free_id_size * sizeof(uint32_t));
+				assert(free_ids); /* Out of memory */
+			}
+			free_ids[free_id_count++] = node->id;
+		}
+
+		free(node);
+	}
+}
+
+/* Find the shared copy of the given string, without taking a reference.  If the string
+ * isn't in the pool, then nothing can be using it, and NULL is returned. */
+char *intern_find(char *string)
+{
+	interned_t *node = find_string(string, hash_string(string));
+
+	return node ? node->string : NULL;
+}
+
+/* Get the hash of an interned string.  This was calculated when it was interned, so it's
+ * free. */
+uint32_t intern_get_hash(char *interned)
+{
+	return get_header(interned)->hash;
+}
+
+/* Get the number of an interned string.  Numbers are small, since they're reused once the
+ * string they belonged to is freed, and a string keeps its number for as long as it's in the
+ * pool.  Most strings never need one, so it's only handed out the first time this is
+ * called.  0 is never used. */
+uint32_t intern_get_id(char *interned)
+{
+	interned_t *node = get_header(interned);
+
+	if(node->id == 0)
+		node->id = free_id_count ? free_ids[--free_id_count] : next_id++;
+
+	return node->id;
+}
+
+/* Get the number of distinct strings in the pool, and the number of bytes they take up
+ * (including the pool's own overhead).  This is for statistics. */
+size_t intern_get_count()
+{
+	return string_count;
+}
+size_t intern_get_bytes()
+{
+	return string_bytes + (bucket_count * sizeof(interned_t *));
+}
+
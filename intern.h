@@ -0,0 +1,50 @@
+/* intern */
+/* This module is a pool of shared, read-only strings.  Every distinct string (a username,
+ * a room name, etc.) is only ever stored once, no matter how many tables or structures
+ * refer to it.  Since there's only one copy, two interned strings are equal if and only if
+ * the pointers are equal, so there's no need for strcmp().  The hash of each string is
+ * calculated once, when it's interned, and stored alongside it.
+ *
+ * Interned strings are reference counted; each intern_string() has to be matched with an
+ * intern_release(). */
+/* NOTE: These functions are NOT thread-safe.  The exceptions are intern_hold(), and
+ * intern_get_id() on a string that already has a number; the worker threads use those while
+ * they send chat (see worker.h), while nothing else is going on. */
+
+#ifndef _INTERN_H_
+#define _INTERN_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Get the shared copy of the given string, adding it to the pool if it isn't there yet.
+ * This takes a reference to the string, which has to be given back with intern_release().
+ * The returned string must NOT be modified. */
+char *intern_string(char *string);
+/* Take another reference to a string that's already interned */
+char *intern_hold(char *interned);
+/* Give back a reference to an interned string.  When the last reference is released, the
+ * string is removed from the pool and freed. */
+void intern_release(char *interned);
+
+/* Find the shared copy of the given string, without taking a reference.  If the string
+ * isn't in the pool, then nothing can be using it, and NULL is returned. */
+char *intern_find(char *string);
+
+/* Get the hash of an interned string.  This was calculated when it was interned, so it's
+ * free. */
+uint32_t intern_get_hash(char *interned);
+
+/* Get the number of an interned string.  Numbers are small, since they're reused once the
+ * string they belonged to is freed, and a string keeps its number for as long as it's in the
+ * pool (so anybody who wants to be sure a number still means the same string should hold a
+ * reference to it).  0 is never used. */
+uint32_t intern_get_id(char *interned);
+
+/* Get the number of distinct strings in the pool, and the number of bytes they take up
+ * (including the pool's own overhead).  This is for statistics. */
+size_t intern_get_count();
+size_t intern_get_bytes();
+
+#endif
+
@@ -1,39 +1,39 @@
 /* list */
 /* This module is an implementation of a linked list or vector.  It will basically be
- * used to store arbitrary-length lists.  This should be reasonably thread-safe, or at
- * lest thread-resistant. */
+ * used to store arbitrary-length lists.  Every operation holds the list's mutex, so it's
+ * safe to use the same list from several threads.  The list keeps track of its last
+ * element and its length, so adding to either end and counting are constant-time. */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "list.h"
 #include "types.h"
 
-/* Wait to obtain a lock on the list.  This provides some level of thread-protection, but isn't
- * immune to race conditions. */
-/* TODO: use mutex */
+/* Wait to obtain a lock on the list */
 static void list_lock(list_t *list)
 {
-	/* A busy-wait is, of course, extremely bad practice, and I should be shot for using it, but
-	 * it's the easiest way to do this */
-	while(list->locked)
-		;
-	list->locked = TRUE;
+	pthread_mutex_lock(&list->mutex);
 }
 /* Unlock the list */
 static void list_unlock(list_t *list)
 {
-	list->locked = FALSE;
+	pthread_mutex_unlock(&list->mutex);
 } 
 
 /* Create and return a new list */
 list_t *list_create()
 {
 	list_t *new_list = malloc(sizeof(list_t));
+	assert(new_list); /* Out of memory */
+
 	new_list->first = NULL;
-	new_list->locked = FALSE;
+	new_list->last = NULL;
+	new_list->count = 0;
+	pthread_mutex_init(&new_list->mutex, NULL);
 
 	return new_list;
 }
@@ -51,22 +51,26 @@ void list_destroy(list_t *list)
 		node = node->next;
 		free(old);
 	}
+	pthread_mutex_destroy(&list->mutex);
 	free(list);
 }
 
 /* Add a new entry to the beginning of the list */
 void list_add_beginning(list_t *list, void *value)
 {
-	list_member_t *new_node;
+	list_member_t *new_node = malloc(sizeof(list_member_t));
+	assert(new_node); /* Out of memory */
+
+	new_node->value = value;
 
 	/* Obtain a lock on writing to the list */
 	list_lock(list);
 
-	new_node = malloc(sizeof(list_member_t));
 	new_node->next = list->first;
-	new_node->value = value;
-
 	list->first = new_node;
+	if(list->last == NULL)
+		list->last = new_node;
+	list->count++;
 
 	/* Release our lock on writing to the list */
 	list_unlock(list);
@@ -74,33 +78,41 @@ void list_add_beginning(list_t *list, void *value)
 /* Add a new entry to the end of the list. */
 void list_add_end(list_t *list, void *value)
 {
-	list_member_t *node;
-	list_member_t *old = NULL;
-	list_member_t *new_node;
+	list_member_t *new_node = malloc(sizeof(list_member_t));
+	assert(new_node); /* Out of memory */
 
-	/* Obtain a lock on writing to the list */
-	list_lock(list);
-
-	new_node = malloc(sizeof(node));
 	new_node->value = value;
 	new_node->next = NULL;
 
-	node = list->first;
-	while(node)
-	{
-		old = node;
-		node = node->next;
-	}
+	/* Obtain a lock on writing to the list */
+	list_lock(list);
 
-	if(old)
-		old->next = new_node;
+	if(list->last)
+		list->last->next = new_node;
 	else
 		list->first = new_node;
+	list->last = new_node;
+	list->count++;
 
 	/* Release our lock on writing to the list */
 	list_unlock(list);
 }
 
+/* Unlink a node from the list, given the node before it (or NULL if it's the first one).  
+ * The list has to be locked when this is called.  The node isn't freed. */
+static void unlink_node(list_t *list, list_member_t *previous, list_member_t *node)
+{
+	if(previous)
+		previous->next = node->next;
+	else
+		list->first = node->next;
+
+	if(list->last == node)
+		list->last = previous;
+
+	list->count--;
+}
+
 /* Remove and return the first entry in the list.  If there are no entries, NULL is returned */
 void *list_remove_beginning(list_t *list)
 {
@@ -110,59 +122,53 @@ void *list_remove_beginning(list_t *list)
 	/* Obtain a lock on writing to the list */
 	list_lock(list);
 
-	if(list->first != NULL)
-	{
-		first = list->first;
-		list->first = first->next;
+	first = list->first;
+	if(first)
+		unlink_node(list, NULL, first);
 
+	/* Release our lock on writing to the list */
+	list_unlock(list);
+
+	if(first)
+	{
 		first_value = first->value;
 		free(first);
 	}
-
-	/* Release our lock on writing to the list */
-	list_unlock(list);
 	
 	return first_value;
 }
-/* Remove and return the last entry in the list.  If there are no entries, NULL is returned */
+/* Remove and return the last entry in the list.  If there are no entries, NULL is returned.
+ * The list is singly linked, so this has to walk it to find the new last element. */
 void *list_remove_end(list_t *list)
 {
 	void *value = NULL;
 	list_member_t *node;
 	list_member_t *old = NULL;
-	list_member_t *older = NULL;
 
 	/* Obtain a lock on writing to the list */
 	list_lock(list);
 
 	node = list->first;
-	while(node)
-	{
-		older = old;
-		old = node;
-		node = node->next;
-	}
-
-	if(old)
+	if(node)
 	{
-
-		/* Update older's next pointer to NULL, if possible */
-		if(older)
-			older->next = NULL;
-		else
+		while(node != list->last)
 		{
-			assert(old = list->first);
-			list->first = NULL;
+			old = node;
+			node = node->next;
 		}
 
-		/* Free old */
-		value = old->value;
-		free(old);
+		unlink_node(list, old, node);
 	}
 
 	/* Release our lock on writing to the list */
 	list_unlock(list);
 
+	if(node)
+	{
+		value = node->value;
+		free(node);
+	}
+
 	return value;
 }
 
@@ -170,7 +176,6 @@ void *list_remove_end(list_t *list)
  * actual memory that's supplied, not just equivalent */
 void *list_remove_value(list_t *list, void *value)
 {
-	void *return_value = NULL;
 	list_member_t *node;
 	list_member_t *old = NULL;
 
@@ -178,27 +183,24 @@ void *list_remove_value(list_t *list, void *value)
 	list_lock(list);
 
 	node = list->first;
-	while(node && return_value == NULL)
+	while(node && node->value != value)
 	{
-		if(value == node->value)
-		{
-			if(old)
-				old->next = node->next;
-			else
-				list->first = node->next;
-
-			return_value = value;
-		}
-
 		old = node;
 		node = node->next;
 	}
-	
+
+	if(node)
+		unlink_node(list, old, node);
 
 	/* Release our lock on writing to the list */
 	list_unlock(list);
 
-	return return_value;
+	if(node == NULL)
+		return NULL;
+
+	free(node);
+
+	return value;
 }
 
 /* Get the value at a certain index of the list.  If the element doesn't exist, NULL is returned */
@@ -211,13 +213,17 @@ void *list_get_element(list_t *list, uint32_t num)
 	/* Obtain a lock on writing to the list */
 	list_lock(list);
 
-	node = list->first;
-
-	for(i = 0; i < num && node; i++)
-		node = node->next;
+	if(num < list->count)
+	{
+		/* The last one is common enough to be worth skipping the walk for */
+		if(num == list->count - 1)
+			node = list->last;
+		else
+			for(i = 0, node = list->first; i < num; i++)
+				node = node->next;
 
-	if(node)
 		value = node->value;
+	}
 
 	/* Release our lock on writing to the list */
 	list_unlock(list);
@@ -229,39 +235,34 @@ void *list_get_element(list_t *list, uint32_t num)
 void *list_remove_element(list_t *list, uint32_t num)
 {
 	uint32_t i;
-	list_member_t *node;
+	list_member_t *node = NULL;
 	list_member_t *old = NULL;
 	void *value = NULL;
 
 	/* Obtain a lock on writing to the list */
 	list_lock(list);
 
-	if(num == 0 && list->first)
-	{
-		old = list->first;
-		value = list->first->value;
-		list->first = list->first->next;
-	}
-	else
+	if(num < list->count)
 	{
 		node = list->first;
-		for(i = 0; i < num && node; i++)
+		for(i = 0; i < num; i++)
 		{
 			old = node;
 			node = node->next;
 		}
 
-		if(node)
-		{
-			old->next = node->next;
-			value = node->value;
-			free(node);
-		}
+		unlink_node(list, old, node);
 	}
 
 	/* Release our lock on writing to the list */
 	list_unlock(list);
 
+	if(node)
+	{
+		value = node->value;
+		free(node);
+	}
+
 	return value;
 }
 
@@ -269,33 +270,31 @@ void *list_remove_element(list_t *list, uint32_t num)
 BOOLEAN list_contains(list_t *list, void *value)
 {
 	list_member_t *node;
+	BOOLEAN found = FALSE;
 
-	node = list->first;
-	while(node)
-	{
+	/* Obtain a lock on writing to the list */
+	list_lock(list);
+
+	for(node = list->first; node && !found; node = node->next)
 		if(node->value == value)
-			return TRUE;
-		node = node->next;
-	}
+			found = TRUE;
+
+	/* Release our lock on writing to the list */
+	list_unlock(list);
 
-	return FALSE;
+	return found;
 }
 
 /* Get the number of elements in the list */
-/* List has to be locked when this is called */
 uint32_t list_get_count(list_t *list)
 {
-	uint32_t i = 0;
-	list_member_t *node;
+	uint32_t count;
 
-	node = list->first;
-	while(node)
-	{
-		i++;
-		node = node->next;
-	}
+	list_lock(list);
+	count = list->count;
+	list_unlock(list);
 
-	return i;
+	return count;
 }
 
 /* Get the list as an array of void*'s.  The number returned is returned in the "num" parameter. 
@@ -309,11 +308,13 @@ void** list_get_array(list_t *list, uint32_t *num)
 	/* Obtain a lock on writing to the list */
 	list_lock(list);
 
-	*num = list_get_count(list);
-	array = malloc(*num * sizeof(void*));
+	*num = list->count;
+	/* Always allocate something, so that the caller can free() it either way */
+	array = malloc((*num ? *num : 1) * sizeof(void*));
+	assert(array); /* Out of memory */
 
 	node = list->first;
-	for(i = 0; i < *num && node; i++)
+	for(i = 0; i < *num; i++)
 	{
 		array[i] = node->value;
 		node = node->next;
@@ -343,7 +344,7 @@ void list_print(list_t *list)
 		printf("%3d. %8d [%p]\n", i, (int) node->value, node->next);
 		node = node->next;
 	}
-	printf(" ==> Elements: %d\n", list_get_count(list));
+	printf(" ==> Elements: %d\n", list->count);
 
 	/* Release our lock on writing to the list */
 	list_unlock(list);
@@ -353,7 +354,80 @@ void list_print(list_t *list)
 /**** TEST FUNCTIONS ****/
 
 
-/*static list_t *get_list()
+/*#include <sys/time.h>
+
+#define STRESS_THREADS 8
+#define STRESS_ITERATIONS 100000
+
+static void *stress_thread(void *param)
+{
+	list_t *list = (list_t *) param;
+	uint32_t i;
+	uint32_t removed = 0;
+
+	for(i = 0; i < STRESS_ITERATIONS; i++)
+	{
+		list_add_end(list, (void*) 1);
+		list_add_beginning(list, (void*) 1);
+		list_get_count(list);
+
+		if(list_remove_beginning(list))
+			removed++;
+		if(list_remove_end(list))
+			removed++;
+	}
+
+	return (void*) (size_t) removed;
+}
+
+static void stress_test()
+{
+	list_t *list = list_create();
+	pthread_t threads[STRESS_THREADS];
+	void *removed;
+	size_t total = 0;
+	int i;
+
+	for(i = 0; i < STRESS_THREADS; i++)
+		pthread_create(&threads[i], NULL, stress_thread, list);
+	for(i = 0; i < STRESS_THREADS; i++)
+	{
+		pthread_join(threads[i], &removed);
+		total += (size_t) removed;
+	}
+
+	printf("Stress test: %u threads, removed %u of %u, %u left (should be 0)\n", STRESS_THREADS, (unsigned int) total, STRESS_THREADS * STRESS_ITERATIONS * 2, list_get_count(list));
+	assert(total == STRESS_THREADS * STRESS_ITERATIONS * 2 && list_get_count(list) == 0 && list->first == NULL && list->last == NULL);
+
+	list_destroy(list);
+}
+
+static void benchmark(uint32_t count)
+{
+	list_t *list = list_create();
+	struct timeval start, end;
+	uint32_t i;
+	uint32_t num;
+	void **array;
+
+	gettimeofday(&start, NULL);
+	for(i = 0; i < count; i++)
+	{
+		list_add_end(list, (void*) (size_t) i);
+		list_get_count(list);
+	}
+	array = list_get_array(list, &num);
+	free(array);
+	while(list_remove_beginning(list) || list_get_count(list))
+		;
+	gettimeofday(&end, NULL);
+
+	printf("%u add_end + get_count, then drained: %.3f ms\n", count, ((end.tv_sec - start.tv_sec) * 1000.0) + ((end.tv_usec - start.tv_usec) / 1000.0));
+
+	list_destroy(list);
+}
+
+static list_t *get_list()
 {
 	list_t *list = list_create();
 
@@ -485,5 +559,11 @@ void list_print(list_t *list)
 	printf("Should be 0: %d\n", num);
 	free(test_list);
 
+	printf("\n\n=========================\n\n");
+	stress_test();
+	benchmark(1000);
+	benchmark(10000);
+	benchmark(100000);
+
 	return 0;
 }*/
@@ -1,11 +1,13 @@
 /* list */
 /* This module is an implementation of a linked list or vector.  It will basically be
- * used to store arbitrary-length lists.  This should be reasonably thread-safe, or at
- * lest thread-resistant. */
+ * used to store arbitrary-length lists.  Every operation holds the list's mutex, so it's
+ * safe to use the same list from several threads.  The list keeps track of its last
+ * element and its length, so adding to either end and counting are constant-time. */
 
 #ifndef _LIST_H_
 #define _LIST_H_
 
+#include <pthread.h>
 #include <sys/types.h>
 #include "types.h"
 
@@ -21,7 +23,9 @@ typedef struct _list_member_t
 typedef struct
 {
 	list_member_t *first;
-	BOOLEAN locked;
+	list_member_t *last;
+	uint32_t count;
+	pthread_mutex_t mutex;
 } list_t;
 
 /* Create and return a new list */
@@ -37,7 +41,8 @@ void list_add_end(list_t *list, void *data);
 
 /* Remove and return the first entry in the list.  If there are no entries, NULL is returned */
 void *list_remove_beginning(list_t *list);
-/* Remove and return the last entry in the list.  If there are no entries, NULL is returned */
+/* Remove and return the last entry in the list.  If there are no entries, NULL is returned.
+ * The list is singly linked, so this has to walk it to find the new last element. */
 void *list_remove_end(list_t *list);
 /* Remove a certain entry.  Note that this does pointer-comparison, so it has to be the same
  * actual memory that's supplied, not just equivalent */
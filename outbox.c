@@ -0,0 +1,448 @@
+/* outbox */
+/* This module is everything that's on its way to one connection.  Packets are written the
+ * moment they're sent, if the connection can take them; whatever it can't take waits in one
+ * queue per class, and the queues are emptied in order (control, then chat, then lists)
+ * whenever select() says the connection is ready for more. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "atomic.h"
+#include "compression.h"
+#include "output.h"
+#include "packet_buffer.h"
+#include "tls.h"
+#include "types.h"
+
+#include "outbox.h"
+
+/* The starting size of a queue; it doubles when it runs out of space */
+#define STARTING_QUEUE 16
+
+/* The packets of one class that are waiting, oldest first.  This is a circular array. */
+typedef struct
+{
+	packet_buffer_t **packets;
+	size_t first;
+	size_t count;
+	size_t size;
+	size_t bytes;
+} queue_t;
+
+struct _outbox_t
+{
+	int socket;
+
+	/* The connection's compression state, or NULL */
+	struct _compression_t *compression;
+
+	queue_t queues[OUTBOX_CLASSES];
+
+	/* The bytes that have been taken off of the queues (and compressed), and have to go out
+	 * before anything else.  This is NULL until something has to wait. */
+	uint8_t *wire;
+	size_t wire_start;
+	size_t wire_length;
+	size_t wire_size;
+
+	/* Set once the connection is broken, or shut down for falling behind; nothing else is
+	 * written to it after that */
+	BOOLEAN broken;
+};
+
+/* The totals, for statistics.  "waiting" and "waiting_bytes" are for every connection.
+ * Chat can be sent from more than one thread at once (see worker.h), so these are only
+ * changed all at once (see atomic.h). */
+static uint32_t total_packets[OUTBOX_CLASSES];
+static uint32_t total_queued[OUTBOX_CLASSES];
+static uint32_t total_waiting[OUTBOX_CLASSES];
+static size_t total_waiting_bytes[OUTBOX_CLASSES];
+static size_t peak_bytes[OUTBOX_CLASSES];
+static uint32_t total_jumped[OUTBOX_CLASSES];
+static uint32_t total_dropped = 0;
+
+/* Write as much as the socket will take right now, without waiting for it to take the rest.
+ * Returns what sendmsg() returns. */
+static ssize_t send_nowait(int socket, struct iovec *iov, size_t count)
+{
+	struct msghdr message;
+#ifndef MSG_DONTWAIT
+	int flags;
+	ssize_t result;
+	int saved_errno;
+#endif
+
+	/* TLS connections are written through OpenSSL (see tls.h) */
+	if(tls_is_secure(socket))
+		return tls_send_nowait(socket, iov, count);
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = iov;
+	message.msg_iovlen = count;
+
+#ifdef MSG_DONTWAIT
+	return sendmsg(socket, &message, MSG_DONTWAIT);
+#else
+	/* Reading still expects the socket to block, so it's only non-blocking for the send */
+	flags = fcntl(socket, F_GETFL);
+	fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+	result = sendmsg(socket, &message, 0);
+	saved_errno = errno;
+	fcntl(socket, F_SETFL, flags);
+	errno = saved_errno;
+
+	return result;
+#endif
+}
+
+/* Create the outbox for a new connection */
+outbox_t *outbox_create(int socket)
+{
+	outbox_t *new_outbox = malloc(sizeof(outbox_t));
+	assert(new_outbox); /* Out of memory */
+
+	memset(new_outbox, 0, sizeof(outbox_t));
+	new_outbox->socket = socket;
+
+	return new_outbox;
+}
+
+/* Throw away everything that's waiting */
+static void discard(outbox_t *outbox)
+{
+	queue_t *queue;
+	int class;
+
+	for(class = 0; class < OUTBOX_CLASSES; class++)
+	{
+		queue = &outbox->queues[class];
+		for(; queue->count > 0; queue->count--)
+		{
+			destroy_buffer(queue->packets[queue->first]);
+			queue->first = (queue->first + 1) % queue->size;
+			ATOMIC_SUB(total_waiting[class], 1);
+		}
+		ATOMIC_SUB(total_waiting_bytes[class], queue->bytes);
+		queue->bytes = 0;
+	}
+
+	outbox->wire_start = 0;
+	outbox->wire_length = 0;
+}
+
+/* Free the outbox, along with anything that never got written */
+void outbox_destroy(outbox_t *outbox)
+{
+	int class;
+
+	discard(outbox);
+
+	for(class = 0; class < OUTBOX_CLASSES; class++)
+		free(outbox->queues[class].packets);
+	free(outbox->wire);
+	free(outbox);
+}
+
+/* Start compressing the packets that haven't been written yet */
+void outbox_set_compression(outbox_t *outbox, struct _compression_t *compression)
+{
+	outbox->compression = compression;
+}
+
+/* Get the class a packet goes out in, from its code */
+outbox_class_t outbox_get_class(uint8_t code)
+{
+	switch(code)
+	{
+		case SID_NULL:
+		case SID_SERVER_INFORMATION:
+		case SID_LOGIN_RESPONSE:
+		case SID_CREATE_RESPONSE:
+		case SID_ERROR:
+			return OUTBOX_CONTROL;
+
+		case SID_ROOM_LIST:
+			return OUTBOX_BULK;
+
+		default:
+			return OUTBOX_CHAT;
+	}
+}
+
+/* The number of bytes waiting for this connection, in the queues and on the wire */
+static size_t get_waiting_bytes(outbox_t *outbox)
+{
+	size_t bytes = outbox->wire_length;
+	int class;
+
+	for(class = 0; class < OUTBOX_CLASSES; class++)
+		bytes += outbox->queues[class].bytes;
+
+	return bytes;
+}
+
+/* Add bytes to the end of the wire */
+static void wire_append(outbox_t *outbox, uint8_t *data, size_t length)
+{
+	/* Move what's left to the front first, so the wire doesn't creep forward forever */
+	if(outbox->wire_start > 0)
+	{
+		memmove(outbox->wire, outbox->wire + outbox->wire_start, outbox->wire_length);
+		outbox->wire_start = 0;
+	}
+
+	if(outbox->wire_length + length > outbox->wire_size)
+	{
+		while(outbox->wire_length + length > outbox->wire_size)
+			outbox->wire_size = outbox->wire_size ? outbox->wire_size << 1 : OUTBOX_WIRE_SIZE + MAX_PACKET;
+		outbox->wire = realloc(outbox->wire, outbox->wire_size);
+		assert(outbox->wire); /* Out of memory */
+	}
+
+	memcpy(outbox->wire + outbox->wire_length, data, length);
+	outbox->wire_length += length;
+}
+
+/* Copy a packet onto the end of its queue */
+static void queue_push(outbox_t *outbox, outbox_class_t class, packet_buffer_t *packet)
+{
+	queue_t *queue = &outbox->queues[class];
+	packet_buffer_t **packets;
+	size_t i;
+
+	if(queue->count == queue->size)
+	{
+		/* Unroll the circle into the new array, so it starts at the beginning again */
+		packets = malloc((queue->size ? queue->size << 1 : STARTING_QUEUE) * sizeof(packet_buffer_t *));
+		assert(packets); /* Out of memory */
+		for(i = 0; i < queue->count; i++)
+			packets[i] = queue->packets[(queue->first + i) % queue->size];
+		free(queue->packets);
+
+		queue->packets = packets;
+		queue->first = 0;
+		queue->size = queue->size ? queue->size << 1 : STARTING_QUEUE;
+	}
+
+	queue->packets[(queue->first + queue->count) % queue->size] = create_buffer_data(get_code(packet), get_length(packet) - 4, get_buffer(packet) + 4);
+	queue->count++;
+	queue->bytes += get_length(packet);
+
+	ATOMIC_ADD(total_queued[class], 1);
+	ATOMIC_ADD(total_waiting[class], 1);
+	ATOMIC_MAX(peak_bytes[class], ATOMIC_ADD(total_waiting_bytes[class], get_length(packet)));
+}
+
+/* Take packets off of the queues, first class first, compress them, and put them on the
+ * wire, until there are "limit" bytes there or the queues are empty */
+static void fill_wire(outbox_t *outbox, size_t limit)
+{
+	queue_t *queue;
+	packet_buffer_t *packet;
+	packet_buffer_t *compressed;
+	int class;
+	int lower;
+
+	for(class = 0; class < OUTBOX_CLASSES && outbox->wire_length < limit; class++)
+	{
+		queue = &outbox->queues[class];
+		while(queue->count > 0 && outbox->wire_length < limit)
+		{
+			packet = queue->packets[queue->first];
+			queue->first = (queue->first + 1) % queue->size;
+			queue->count--;
+			queue->bytes -= get_length(packet);
+			ATOMIC_SUB(total_waiting[class], 1);
+			ATOMIC_SUB(total_waiting_bytes[class], get_length(packet));
+
+			/* Count it if it's going ahead of something that was waiting in a lower class */
+			for(lower = class + 1; lower < OUTBOX_CLASSES; lower++)
+			{
+				if(outbox->queues[lower].count > 0)
+				{
+					ATOMIC_ADD(total_jumped[class], 1);
+					break;
+				}
+			}
+
+			compressed = outbox->compression ? compress_buffer(outbox->compression, packet) : NULL;
+			if(compressed)
+			{
+				wire_append(outbox, get_buffer(compressed), get_length(compressed));
+				destroy_buffer(compressed);
+			}
+			else
+			{
+				wire_append(outbox, get_buffer(packet), get_length(packet));
+			}
+			destroy_buffer(packet);
+		}
+	}
+}
+
+/* Give up on the connection.  If it's still open, it's shut down, so that reading from it
+ * notices and it's cleaned up like any other closed connection. */
+static void give_up(outbox_t *outbox, BOOLEAN shut_down)
+{
+	discard(outbox);
+	outbox->broken = TRUE;
+
+	if(shut_down)
+	{
+		shutdown(outbox->socket, 2);
+		ATOMIC_ADD(total_dropped, 1);
+	}
+}
+
+/* Send up to OUTBOX_GATHER packets of the given class */
+size_t outbox_send(outbox_t *outbox, outbox_class_t class, packet_buffer_t **packets, size_t count)
+{
+	struct iovec iov[OUTBOX_GATHER];
+	packet_buffer_t *compressed[OUTBOX_GATHER];
+	ssize_t written;
+	size_t i;
+
+	assert(count <= OUTBOX_GATHER);
+
+	if(outbox->broken || count == 0)
+		return 0;
+
+	ATOMIC_ADD(total_packets[class], count);
+
+	/* If something's already waiting, this has to wait its turn */
+	if(outbox_waiting(outbox))
+	{
+		for(i = 0; i < count; i++)
+			queue_push(outbox, class, packets[i]);
+
+		if(get_waiting_bytes(outbox) > OUTBOX_LIMIT)
+		{
+			display_message(ERROR_WARNING, "Socket %d has over %d bytes waiting to be written; shutting it down", outbox->socket, OUTBOX_LIMIT);
+			give_up(outbox, TRUE);
+		}
+
+		return 0;
+	}
+
+	/* Otherwise, write them right now */
+	for(i = 0; i < count; i++)
+	{
+		compressed[i] = outbox->compression ? compress_buffer(outbox->compression, packets[i]) : NULL;
+		iov[i].iov_base = get_buffer(compressed[i] ? compressed[i] : packets[i]);
+		iov[i].iov_len = get_length(compressed[i] ? compressed[i] : packets[i]);
+	}
+
+	written = send_nowait(outbox->socket, iov, count);
+	if(written < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		/* The connection's broken; reading from it will notice */
+		outbox->broken = TRUE;
+	}
+	else
+	{
+		if(written < 0)
+			written = 0;
+
+		/* Whatever didn't fit goes on the wire, since it's already compressed */
+		for(i = 0; i < count; i++)
+		{
+			if((size_t) written >= iov[i].iov_len)
+			{
+				written -= iov[i].iov_len;
+			}
+			else
+			{
+				wire_append(outbox, (uint8_t *) iov[i].iov_base + written, iov[i].iov_len - written);
+				written = 0;
+			}
+		}
+	}
+
+	for(i = 0; i < count; i++)
+		if(compressed[i])
+			destroy_buffer(compressed[i]);
+
+	return 1;
+}
+
+/* Whether anything is waiting to be written */
+BOOLEAN outbox_waiting(outbox_t *outbox)
+{
+	/* Nothing's ever left in the queues without something on the wire ahead of it (see
+	 * outbox_flush()), so the wire is all that has to be checked */
+	return outbox->wire_length > 0;
+}
+
+/* Write as much of what's waiting as the connection can take */
+void outbox_flush(outbox_t *outbox)
+{
+	struct iovec iov;
+	ssize_t written;
+
+	while(!outbox->broken)
+	{
+		if(outbox->wire_length == 0)
+			fill_wire(outbox, OUTBOX_WIRE_SIZE);
+		if(outbox->wire_length == 0)
+			return;
+
+		iov.iov_base = outbox->wire + outbox->wire_start;
+		iov.iov_len = outbox->wire_length;
+		written = send_nowait(outbox->socket, &iov, 1);
+
+		if(written < 0)
+		{
+			/* If it's just full, wait for select() to say it's ready again */
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				give_up(outbox, FALSE);
+			return;
+		}
+
+		outbox->wire_start += written;
+		outbox->wire_length -= written;
+		if(outbox->wire_length == 0)
+			outbox->wire_start = 0;
+	}
+}
+
+/* Get everything that's waiting, as the bytes that will go out, for handing off */
+uint8_t *outbox_get_waiting(outbox_t *outbox, size_t *length)
+{
+	fill_wire(outbox, (size_t) -1);
+
+	*length = outbox->wire_length;
+	return outbox->wire + outbox->wire_start;
+}
+
+/* Put bytes that were waiting in the old server back on the wire */
+void outbox_restore(outbox_t *outbox, uint8_t *data, size_t length)
+{
+	wire_append(outbox, data, length);
+}
+
+/* Get the totals so far for one class.  This is for statistics. */
+void outbox_get_totals(outbox_class_t class, uint32_t *packets, uint32_t *queued, uint32_t *waiting, size_t *waiting_bytes, size_t *peak_bytes_ret, uint32_t *jumped)
+{
+	*packets = total_packets[class];
+	*queued = total_queued[class];
+	*waiting = total_waiting[class];
+	*waiting_bytes = total_waiting_bytes[class];
+	*peak_bytes_ret = peak_bytes[class];
+	*jumped = total_jumped[class];
+}
+
+/* Get the number of connections that were shut down for falling too far behind */
+uint32_t outbox_get_dropped()
+{
+	return total_dropped;
+}
+
@@ -0,0 +1,104 @@
+/* outbox */
+/* This module is everything that's on its way to one connection.  Packets are written the
+ * moment they're sent, if the connection can take them; whatever it can't take waits here,
+ * and goes out when select() says the connection is ready for more, instead of the whole
+ * server waiting on one slow reader.
+ *
+ * What's waiting is kept in one queue per class (see outbox_class_t), and the queues are
+ * emptied in order: control packets (keepalives, errors, and answers to logging in) always
+ * go ahead of chat, and chat always goes ahead of lists, no matter how much was waiting
+ * first.  Only OUTBOX_WIRE_SIZE bytes at a time are taken off of the queues, so that's the
+ * longest a keepalive ever waits behind a room's worth of chat.  A packet that's been
+ * partly written is always finished before anything else, so nothing is ever cut in half.
+ *
+ * Packets are compressed (if the connection asked for it) as they're taken off of the
+ * queues, not as they're put on, since every compressed packet depends on the ones that
+ * were compressed before it, and the order they go out in isn't known until then.
+ *
+ * A connection with more than OUTBOX_LIMIT bytes waiting isn't reading what it's sent, so
+ * it's shut down (which select() sees as it closing, so it's cleaned up like any other). */
+/* NOTE: These functions are NOT thread-safe, except that different outboxes can be used from
+ * different threads at the same time (see worker.h). */
+
+#ifndef _OUTBOX_H_
+#define _OUTBOX_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "packet_buffer.h"
+#include "types.h"
+
+/* The compression state is defined in compression.c */
+struct _compression_t;
+
+/* The most bytes that are taken off of the queues at a time */
+#define OUTBOX_WIRE_SIZE 4096
+
+/* The most bytes that can be waiting for one connection before it's shut down */
+#define OUTBOX_LIMIT (1024 * 1024)
+
+/* The most packets that can be sent with one outbox_send().  POSIX only promises 16 iovecs
+ * per write (and Linux allows 1024), but a batch of chat is rarely bigger than this
+ * anyways. */
+#define OUTBOX_GATHER 16
+
+/* The classes, from the first to go out to the last */
+typedef enum
+{
+	/* Keepalives, errors, and the answers to logging in and creating accounts */
+	OUTBOX_CONTROL,
+	/* Chat events, and everything that has to stay in order with them (names and presence) */
+	OUTBOX_CHAT,
+	/* Room lists and user lists, and anything else that can wait */
+	OUTBOX_BULK,
+
+	OUTBOX_CLASSES
+} outbox_class_t;
+
+/* The outbox for one connection.  It's defined in outbox.c. */
+typedef struct _outbox_t outbox_t;
+
+/* Create the outbox for a new connection */
+outbox_t *outbox_create(int socket);
+/* Free the outbox, along with anything that never got written */
+void outbox_destroy(outbox_t *outbox);
+
+/* Start compressing the packets that haven't been written yet with the given compression
+ * state (see compression.h).  The outbox doesn't take it over; it has to outlive the
+ * outbox. */
+void outbox_set_compression(outbox_t *outbox, struct _compression_t *compression);
+
+/* Get the class a packet goes out in, from its code */
+outbox_class_t outbox_get_class(uint8_t code);
+
+/* Send up to OUTBOX_GATHER packets of the given class.  If nothing's waiting, they're
+ * written right away (whatever doesn't fit waits); otherwise, they're copied onto the end of
+ * their queue.  The packets aren't destroyed.  Returns the number of writes it took (0 or
+ * 1), for statistics. */
+size_t outbox_send(outbox_t *outbox, outbox_class_t class, packet_buffer_t **packets, size_t count);
+/* Whether anything is waiting to be written.  If it is, select() should be watching for
+ * the connection to be ready for more, and outbox_flush() should be called when it is. */
+BOOLEAN outbox_waiting(outbox_t *outbox);
+/* Write as much of what's waiting as the connection can take */
+void outbox_flush(outbox_t *outbox);
+
+/* Get everything that's waiting to be written, as the bytes that will go out, so it can be
+ * handed off to a new server (see handoff.h).  Whatever's still in the queues is compressed
+ * and put on the wire first, so the bytes only depend on what's already been written.  The
+ * bytes belong to the outbox, and are only good until it's used again. */
+uint8_t *outbox_get_waiting(outbox_t *outbox, size_t *length);
+/* Put bytes that were waiting to be written by the old server back on the wire, in the new
+ * one */
+void outbox_restore(outbox_t *outbox, uint8_t *data, size_t length);
+
+/* Get the totals so far for one class: the packets sent, how many of them had to wait, how
+ * many are waiting now (and their size), the most bytes that were ever waiting at once,
+ * and how many went ahead of a lower class that was already waiting.  This is for
+ * statistics. */
+void outbox_get_totals(outbox_class_t class, uint32_t *packets, uint32_t *queued, uint32_t *waiting, size_t *waiting_bytes, size_t *peak_bytes, uint32_t *jumped);
+/* Get the number of connections that were shut down for falling too far behind */
+uint32_t outbox_get_dropped();
+
+#endif
+
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 
 #include <ncurses.h>
+#include <pthread.h>
 #include <string.h>
 #include <time.h>
 
@@ -20,7 +21,11 @@
 
 static char *error_levels[] = { "", "DEBUG", "INFO", "NOTICE", "WARNING", "ERROR",  "CRITICAL", "ALERT", "EMERGENCY" };
 
-static char read_buffer[MAX_MESSAGE];
+/* The worker threads can have something to say while they're sending chat (see worker.h),
+ * and curses can only do one thing at a time, so messages take turns */
+static pthread_mutex_t message_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char input_buffer[MAX_MESSAGE];
 static int read_location;
 
 static table_t *user_list;
@@ -116,7 +121,7 @@ void initialize_display()
 	wclrtoeol(input_inner);
 
 	read_location = 0;
-	read_buffer[0] = '\0';
+	input_buffer[0] = '\0';
 
 	/* Display some test data */
 	display_message(ERROR_NONE,      "Test");
@@ -215,8 +220,8 @@ void destroy_display()
  * nicer for the user.  Also, clear everything after the cursor.  */
 static void reset_cursor()
 {
-	mvwprintw(input_inner, 0, 0, "%s", read_buffer);
-	/* Note: have to keep this wmove for the cases where read_buffer is the wrong length
+	mvwprintw(input_inner, 0, 0, "%s", input_buffer);
+	/* Note: have to keep this wmove for the cases where input_buffer is the wrong length
 	 * (happens when they press enter */
 	wmove(input_inner, 0, read_location);
 	wclrtoeol(input_inner);
@@ -242,14 +247,14 @@ char *read_next()
 			read_location = 0;
 			reset_cursor();
 
-			return read_buffer;
+			return input_buffer;
 
 		case 0x07:
 		case 0x7F:
 			if(read_location > 0)
 			{
 				read_location--;
-				read_buffer[read_location] = '\0';
+				input_buffer[read_location] = '\0';
 				reset_cursor();
 			}
 
@@ -257,9 +262,9 @@ char *read_next()
 
 		default:
 
-			read_buffer[read_location] = c;
+			input_buffer[read_location] = c;
 			read_location++;
-			read_buffer[read_location] = '\0';
+			input_buffer[read_location] = '\0';
 
 			if(read_location >= MAX_MESSAGE)
 			{
@@ -270,7 +275,7 @@ char *read_next()
 	
 				read_location = 0;
 	
-				return read_buffer;
+				return input_buffer;
 			}
 
 			reset_cursor();
@@ -385,6 +390,63 @@ void display_channel_event(chatevent_subtype_t subtype, char *username, char *me
 	reset_cursor();
 }
 
+/* Put as many of the names as fit into the string, separated by commas, and say how many
+ * didn't fit */
+static void list_names(char *list, size_t size, char **names, size_t count)
+{
+	size_t length = 0;
+	size_t i;
+
+	list[0] = '\0';
+	for(i = 0; i < count && length + strlen(names[i]) + 32 < size; i++)
+		length += sprintf(list + length, i ? ", %s" : "%s", names[i]);
+
+	if(i < count)
+		sprintf(list + length, " and %u more", (unsigned int) (count - i));
+}
+
+/* A batch of joins and leaves arrived (see SID_PRESENCE).  The first joined_count names
+ * joined, and the rest left.  If everybody is set, the names that joined are everybody in
+ * the channel. */
+void display_presence(char **names, size_t count, size_t joined_count, BOOLEAN everybody)
+{
+	char list[MAX_MESSAGE];
+	size_t i;
+
+	if(everybody)
+	{
+		table_destroy(user_list);
+		user_list = table_create();
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		if(i < joined_count)
+			table_add(user_list, names[i], names[i]);
+		else
+			table_remove(user_list, names[i]);
+	}
+	update_userlist();
+
+	if(joined_count > 0)
+	{
+		list_names(list, MAX_MESSAGE, names, joined_count);
+		if(everybody)
+			display_raw_message(COLOR_GREEN, TRUE, TRUE, TRUE, "In the channel: %s", list);
+		else
+			display_raw_message(COLOR_GREEN, TRUE, TRUE, TRUE, joined_count == 1 ? "%s has joined the channel" : "%s have joined the channel", list);
+	}
+
+	if(count > joined_count)
+	{
+		list_names(list, MAX_MESSAGE, names + joined_count, count - joined_count);
+		display_raw_message(COLOR_GREEN, TRUE, TRUE, TRUE, count - joined_count == 1 ? "%s has left the channel" : "%s have left the channel", list);
+	}
+
+	wrefresh(chat_inner);
+	reset_cursor();
+}
+
 /* NOT thread safe */
 static char *get_timestamp()
 {
@@ -441,6 +503,8 @@ void display_message(error_code_t level, char *message, ...)
 	error_message[MAX_MESSAGE - 1] = '\0';
 	va_end(ap);
 
+	pthread_mutex_lock(&message_mutex);
+
 	set_color(COLOR_WHITE, TRUE, FALSE);
 	wprintw(chat_inner, "[%s] ", get_timestamp());
 
@@ -452,6 +516,8 @@ void display_message(error_code_t level, char *message, ...)
 		
 	wrefresh(chat_inner);
 	reset_cursor();
+
+	pthread_mutex_unlock(&message_mutex);
 }
 
 /* An unrecoverable error or debug condition (?) ha occurred.  Display the message, 
@@ -49,6 +49,10 @@ void set_display_header(char *text);
 /* A channel even occurred, display it.  For the server, we want to display the channel, so we set channel_name.  
  * If it's the client, set channel_name to NULL.  */
 void display_channel_event(chatevent_subtype_t subtype, char *username, char *message, char *channel_name, BOOLEAN its_me);
+/* A batch of joins and leaves arrived (see SID_PRESENCE).  The first joined_count names
+ * joined, and the rest left.  If everybody is set, the names that joined are everybody in
+ * the channel. */
+void display_presence(char **names, size_t count, size_t joined_count, BOOLEAN everybody);
 /* A recoverable error or debug message has occured.  Display the message, and go on 
  * with our lives */
 void display_message(error_code_t level, char *message, ...);
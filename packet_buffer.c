@@ -13,10 +13,23 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 #include "output.h"
 #include "packet_buffer.h"
+#include "tls.h"
 #include "types.h"
 
+/* Strings are sanitized 16 or 32 bytes at a time when the compiler can generate SSE2 or
+ * AVX2 (add -mavx2 to CFLAGS for the latter); otherwise, it's done a byte at a time. */
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#define SANITIZE_AVX2
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SANITIZE_SSE2
+#endif
+
 /* The initial max length of the string */
 #define STARTING_LENGTH 64 
 
@@ -92,6 +105,26 @@ packet_buffer_t *create_buffer_data(uint8_t code, uint16_t length, void *data)
 	return new_buffer;
 }
 
+/* Create a new packet buffer with room for exactly length bytes of data (not including the 
+ * header), and the length already set.  The caller fills in the data through get_buffer(). */
+packet_buffer_t *create_buffer_length(uint8_t code, uint16_t length)
+{
+	packet_buffer_t *new_buffer = malloc(sizeof(packet_buffer_t));
+	assert(new_buffer);
+
+	new_buffer->valid = TRUE;
+	new_buffer->position = 4;
+	new_buffer->max_length = length + 4;
+	new_buffer->data = malloc(new_buffer->max_length);
+	assert(new_buffer->data);
+
+	set_header(new_buffer, (uint8_t)0xFF);
+	set_code(new_buffer, code);
+	set_length(new_buffer, length + 4);
+
+	return new_buffer;
+}
+
 /* Destroy the buffer and free resources.  If this isn't used, memory will leak. */
 void destroy_buffer(packet_buffer_t *buffer)
 {
@@ -197,20 +230,95 @@ uint32_t read_next_int32(packet_buffer_t *buffer)
 
 	return ret;
 }
-char *read_next_ntstring(packet_buffer_t *buffer, char *data_ret, uint16_t max_length)
+
+/* Copy up to length bytes of a string from src to dst, stopping after the '\0' terminator,
+ * and filter out control characters on the way -- anything that isn't '\0' or standard 
+ * ascii (0x20 - 0x7F) becomes a '.'.  This finds the terminator and filters in the same 
+ * pass.  src and dst can be the same; nothing after the terminator is ever written, so
+ * whatever comes after the string in the packet is left alone.  Returns the number of bytes
+ * copied (including the terminator, if it was found); terminated is set to whether or not
+ * it was. */
+uint16_t sanitize_ntstring(char *dst, uint8_t *src, uint16_t length, BOOLEAN *terminated)
 {
-	uint8_t next = 0xFF;
-	uint16_t i;
-	assert(buffer->valid);
-	assert(can_read_ntstring(buffer));
+	uint16_t i = 0;
+	uint8_t next;
+
+	/* Looking at the bytes as signed, the good ones are exactly the ones >= 0x20, since
+	 * 0x80 - 0xFF are negative.  '\0' is bad too, but it's the terminator, so it's kept.
+	 * A whole block is only stored if the terminator isn't in it; the block that has it is
+	 * left for the loop at the end, so nothing past the terminator is touched. */
+#if defined(SANITIZE_AVX2)
+	__m256i space = _mm256_set1_epi8(0x20);
+	__m256i dots = _mm256_set1_epi8('.');
+	__m256i zero = _mm256_setzero_si256();
+	__m256i block, bad;
+
+	for( ; i + 32 <= length; i += 32)
+	{
+		block = _mm256_loadu_si256((__m256i *) (src + i));
+		if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero)))
+			break;
+
+		bad = _mm256_cmpgt_epi8(space, block);
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_blendv_epi8(block, dots, bad));
+	}
+#elif defined(SANITIZE_SSE2)
+	__m128i space = _mm_set1_epi8(0x20);
+	__m128i dots = _mm_set1_epi8('.');
+	__m128i zero = _mm_setzero_si128();
+	__m128i block, bad;
 
-	for(i = 0; i < max_length - 1 && next != '\0'; i++)
+	for( ; i + 16 <= length; i += 16)
 	{
-		next = read_next_int8(buffer);
-		/* Filter out control characters here -- allow '\0' or any standard ascii */
-		data_ret[i] = (next == '\0' || (next >= 0x20 && next <= 0x7F)) ? next : '.';
+		block = _mm_loadu_si128((__m128i *) (src + i));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero)))
+			break;
+
+		bad = _mm_cmpgt_epi8(space, block);
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(_mm_and_si128(bad, dots), _mm_andnot_si128(bad, block)));
+	}
+#endif
+
+	/* Whatever's left over, including the block with the terminator (or everything, without
+	 * SIMD) */
+	for( ; i < length; i++)
+	{
+		next = src[i];
+		dst[i] = (next == '\0' || (next >= 0x20 && next <= 0x7F)) ? next : '.';
+
+		if(next == '\0')
+		{
+			*terminated = TRUE;
+			return i + 1;
+		}
 	}
-	data_ret[i] = '\0';
+
+	*terminated = FALSE;
+	return length;
+}
+
+char *read_next_ntstring(packet_buffer_t *buffer, char *data_ret, uint16_t max_length)
+{
+	uint16_t remaining;
+	uint16_t limit;
+	uint16_t copied;
+	BOOLEAN terminated;
+	assert(buffer->valid);
+
+	/* Copy no more than max_length - 1 characters (leaving room for the terminator), and 
+	 * no more than what's left in the packet */
+	remaining = get_length(buffer) - buffer->position;
+	limit = max_length ? max_length - 1 : 0;
+	if(limit > remaining)
+		limit = remaining;
+
+	copied = sanitize_ntstring(data_ret, buffer->data + buffer->position, limit, &terminated);
+	buffer->position += copied;
+	data_ret[copied] = '\0';
+
+	/* If it stopped without finding the terminator, it had better be because the string
+	 * was too long for data_ret, and the rest of it is in the packet */
+	assert(terminated || (copied < remaining && can_read_ntstring(buffer)));
 
 	return data_ret;
 }
@@ -246,19 +354,17 @@ BOOLEAN can_read_int32(packet_buffer_t *buffer)
 }
 BOOLEAN can_read_ntstring(packet_buffer_t *buffer)
 {
-	int i;
 	assert(buffer->valid);
 
-	for(i = buffer->position; i < get_length(buffer); i++)
-		if(buffer->data[i] == '\0')
-			return TRUE;
-
-	return FALSE;
+	/* memchr() is already vectorized by the C library, so there's no point in doing better */
+	if(buffer->position >= get_length(buffer))
+		return FALSE;
+	return memchr(buffer->data + buffer->position, '\0', get_length(buffer) - buffer->position) != NULL;
 }
 BOOLEAN can_read_bytes(packet_buffer_t *buffer, uint16_t length)
 {
 	assert(buffer->valid);
-	return (buffer->position + length < get_length(buffer));
+	return (buffer->position + length <= get_length(buffer));
 }
 
 static char get_character_from_byte(uint8_t byte)
@@ -330,7 +436,7 @@ uint8_t *get_buffer(packet_buffer_t *buffer)
 /* Receives a full packet from the given socket.  Returns the new buffer, NULL on a recoverable 
  * error, or -1 if the client should be disconnected. 
  * Don't forget to free it! */
-packet_buffer_t *read_buffer(int s)
+packet_buffer_t *read_buffer(int s, size_t *discarded)
 {
 	uint8_t temp_byte;
 
@@ -340,22 +446,52 @@ packet_buffer_t *read_buffer(int s)
 
 	/* TODO: free variables on early returns */
 	char *buf;
-	char *string_buf;
 	int amount;
 
+	/* Used to look ahead for the next header when the stream is out of sync */
+	uint8_t resync_buf[MAX_PACKET];
+	uint8_t *next_header = NULL;
+	int available = 0;
+	ssize_t skip = 0;
+
 	packet_buffer_t *return_buffer;
 
-	if(read(s, &header_byte, 1) != 1)
+	if(discarded)
+		*discarded = 0;
+
+	if(tls_read(s, &header_byte, 1) != 1)
 		return (packet_buffer_t *)-1;
-	while(header_byte != 0xFF)
+	if(header_byte != 0xFF)
 	{
-		display_message(ERROR_WARNING, "Discarding invalid header byte 0x%02x", header_byte);
-		if(read(s, &header_byte, 1) != 1)
+		/* We're out of sync.  Rather than going a byte at a time, look at everything that's 
+		 * already arrived (without waiting for more), find the next 0xFF, and throw away 
+		 * everything before it in one go. */
+		available = tls_peek(s, resync_buf, sizeof(resync_buf));
+		if(available > 0)
+		{
+			next_header = memchr(resync_buf, 0xFF, available);
+			skip = next_header ? next_header - resync_buf : available;
+
+			if(skip > 0 && tls_read(s, resync_buf, skip) != skip)
+				return (packet_buffer_t *)-1;
+		}
+
+		/* Count the byte we already read, too */
+		skip++;
+		display_message(ERROR_WARNING, "Discarded %d bytes of garbage looking for a packet header", (int) skip);
+		if(discarded)
+			*discarded = skip;
+
+		/* If there's no header in what's arrived so far, try again when there's more */
+		if(next_header == NULL)
 			return NULL;
+
+		if(tls_read(s, &header_byte, 1) != 1)
+			return (packet_buffer_t *)-1;
 	}
 	
 	/* TODO: in some cases, read might not return all the bytes at once, we might have to store and wait */
-	if(read(s, &code, 1) != 1)
+	if(tls_read(s, &code, 1) != 1)
 	{
 		display_message(ERROR_ALERT, "Call to read() failed");
 		return NULL;
@@ -363,14 +499,14 @@ packet_buffer_t *read_buffer(int s)
 
 	/* Start reading the length */
 	length = 0;
-	if(read(s, &temp_byte, 1) != 1)
+	if(tls_read(s, &temp_byte, 1) != 1)
 	{
 		display_message(ERROR_ALERT, "Call to read() failed");
 		return NULL;
 	}
 	/* We have the low-order byte of the length */
 	length |= temp_byte;
-	if(read(s, &temp_byte, 1) != 1)
+	if(tls_read(s, &temp_byte, 1) != 1)
 	{
 		display_message(ERROR_ALERT, "Call to read() failed");
 		return NULL;
@@ -396,9 +532,8 @@ packet_buffer_t *read_buffer(int s)
 	length -= 4;
 
 	buf = malloc(length);
-	string_buf = malloc(length);
 
-	amount = read(s, buf, length);
+	amount = tls_read(s, buf, length);
 
 	/* TODO: This isn't a valid problem.  If they don't send the full packet at once, I should store and wait.  But
 	 * that will be for later, if I have time. */
@@ -406,11 +541,12 @@ packet_buffer_t *read_buffer(int s)
 	{
 		display_message(ERROR_ALERT, "Call to read() failed.  The packet probably didn't arrive fully yet...");
 		free(buf);
-		free(string_buf);
 		return NULL;
 	}
 
+	/* That makes its own copy */
 	return_buffer = create_buffer_data(code, length, buf);
+	free(buf);
 #ifdef PRINT_PACKETS
 	printf("RECEIVED:\n");
 	print_buffer(return_buffer);
@@ -430,15 +566,67 @@ ssize_t send_buffer(packet_buffer_t *buffer, int s)
 	print_buffer(buffer);
 #endif
 
-	return write(s, buffer->data, get_length(buffer));
+	return tls_write(s, buffer->data, get_length(buffer));
 }
 
 /*
+#include <sys/time.h>
+
+static void benchmark(uint16_t length, int iterations)
+{
+	packet_buffer_t *buf = create_buffer(0x0F);
+	char *string = malloc(length);
+	char *data = malloc(length);
+	struct timeval start, end;
+	double elapsed;
+	uint16_t i;
+	int j;
+
+	for(i = 0; i < length - 1; i++)
+		string[i] = (i % 61) ? 'a' + (i % 26) : '\t';
+	string[length - 1] = '\0';
+	add_ntstring(buf, string);
+
+	gettimeofday(&start, NULL);
+	for(j = 0; j < iterations; j++)
+	{
+		buf->position = 4;
+		if(can_read_ntstring(buf))
+			read_next_ntstring(buf, data, length);
+	}
+	gettimeofday(&end, NULL);
+
+	elapsed = ((end.tv_sec - start.tv_sec) * 1000000000.0) + ((end.tv_usec - start.tv_usec) * 1000.0);
+	printf("%5u byte strings: %8.1f ns each, %6.2f bytes/ns\n", length, elapsed / iterations, (length * (double) iterations) / elapsed);
+
+	free(string);
+	free(data);
+	destroy_buffer(buf);
+}
+
 int main(int argc, char *argv[])
 {
 	packet_buffer_t *buf = create_buffer(0x0F);
 	char data[16];
 
+	BOOLEAN terminated;
+	uint16_t copied;
+
+	benchmark(40, 10000000);
+	benchmark(9000, 100000);
+
+	add_ntstring(buf, "abcdefghijkl");
+	add_int32(buf, 5);
+	add_int32(buf, 0);
+	add_int32(buf, 0);
+	add_int32(buf, 0);
+	add_int32(buf, 0);
+	copied = sanitize_ntstring((char *) buf->data + 4, buf->data + 4, get_length(buf) - 4, &terminated);
+	buf->position = 4 + copied;
+	printf("Sanitized in place: %u bytes, terminated %d, then %u (should be 13, 1, 5)\n", copied, terminated, read_next_int32(buf));
+	destroy_buffer(buf);
+	buf = create_buffer(0x0F);
+
 	add_ntstring(buf, "ntString #1");
 	add_ntstring(buf, "ntString #2");
 	add_ntstring(buf, "ntString #3");
@@ -42,6 +42,10 @@ packet_buffer_t *create_buffer(uint8_t code);
  * it will be added.  The length is the length of the data, without the header. */
 packet_buffer_t *create_buffer_data(uint8_t code, uint16_t length, void *data);
 
+/* Create a new packet buffer with room for exactly length bytes of data (not including the 
+ * header), and the length already set.  The caller fills in the data through get_buffer(). */
+packet_buffer_t *create_buffer_length(uint8_t code, uint16_t length);
+
 /* Destroy the buffer and free resources.  If this isn't used, memory will leak. */
 void destroy_buffer(packet_buffer_t *buffer);
 
@@ -71,6 +75,13 @@ BOOLEAN can_read_int32(packet_buffer_t *buffer);
 BOOLEAN can_read_ntstring(packet_buffer_t *buffer);
 BOOLEAN can_read_bytes(packet_buffer_t *buffer, uint16_t length);
 
+/* Copy up to length bytes of a string from src to dst, stopping after the '\0' terminator,
+ * and filter out control characters on the way -- anything that isn't '\0' or standard 
+ * ascii (0x20 - 0x7F) becomes a '.'.  src and dst can be the same.  Returns the number of 
+ * bytes copied (including the terminator, if it was found); terminated is set to whether or
+ * not it was. */
+uint16_t sanitize_ntstring(char *dst, uint8_t *src, uint16_t length, BOOLEAN *terminated);
+
 /* Print out the buffer in a nice format */
 void print_buffer(packet_buffer_t *buffer);
 
@@ -86,8 +97,10 @@ uint8_t *get_buffer(packet_buffer_t *buffer);
 /* Receives a full packet from the given socket.  Returns the new buffer if successful. 
  * If NULL is returned, there was a receive error that was already handled.  
  * If -1 is returned, the socket is dead and should not be used again. 
+ * If the stream was out of sync, the garbage before the next packet header is thrown away,
+ * and the number of bytes thrown away is returned in discarded (which can be NULL). 
  * Don't forget to free it! */
-packet_buffer_t *read_buffer(int s);
+packet_buffer_t *read_buffer(int s, size_t *discarded);
 
 /* Sends the full packet over the given socket, and returns the number of bytes
  * sent (see write(2) for return values. */
@@ -0,0 +1,439 @@
+/* presence */
+/* This module tells the people in a room who comes and goes.  Sending every join to
+ * everybody in the room as it happens means that when a whole crowd floods into a room (like
+ * right after a restart), each of them is announced to each of the others, one packet at a
+ * time.  Instead, joins and leaves are saved up for PRESENCE_WINDOW milliseconds, then
+ * everybody in the room gets all of them at once: a single SID_PRESENCE for clients that
+ * asked for it (see PROTOCOL_PRESENCE in protocol.h), or the usual chat events for clients
+ * that didn't.  Somebody who joins then leaves within the window is never mentioned at all.
+ *
+ * Somebody who joined during the window gets everybody in the room instead, so the list
+ * they start with always agrees with the joins and leaves they hear about later.
+ *
+ * Rooms with at least "quiet size" people in them don't announce anything; the people who
+ * join them are just told so, and can ask for the list with SID_REQUEST_ROOM_LIST when they
+ * want it (which is cached, so that's cheap).
+ *
+ * Anything that's sent to a whole room (see room_message() and room_packet()) sends the
+ * waiting joins and leaves first, so nobody hears from somebody they haven't been told
+ * about yet. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#include "broadcast.h"
+#include "packet_buffer.h"
+#include "protocol.h"
+#include "room.h"
+#include "table.h"
+#include "types.h"
+#include "user.h"
+
+#include "presence.h"
+
+/* The starting size of the array of rooms with something waiting; it doubles when it runs
+ * out of space */
+#define STARTING_PENDING 16
+
+/* The most bytes of names that fit in one SID_PRESENCE: everything but the header, the two
+ * varints at their biggest, and the blank name at the end */
+#define MAX_NAME_BYTES (MAX_PACKET - 4 - 5 - 5 - 1)
+
+typedef struct _presence_t
+{
+	/* Where the room sits in the pending array */
+	size_t index;
+
+	/* When the window is over */
+	struct timeval due;
+
+	/* The names of the people who joined and left during the window, and haven't been
+	 * announced yet.  The tables hold a reference to each name, so they're still good if the
+	 * user is gone by the time they're announced. */
+	table_t *joined;
+	table_t *left;
+
+	/* The people who joined during the window, and get everybody in the room instead (each
+	 * element is a user_t) */
+	table_t *newcomers;
+} presence_t;
+
+/* The rooms with something waiting.  Each holds a reference to its room, so the room can't
+ * be reclaimed out from under it. */
+static room_t **pending = NULL;
+static size_t pending_count = 0;
+static size_t pending_size = 0;
+
+/* The number of people that makes a room quiet, or 0 for never */
+static size_t quiet_size = PRESENCE_QUIET_SIZE;
+
+/* The totals, for statistics */
+static uint32_t total_changes = 0;
+static uint32_t total_batches = 0;
+static uint32_t total_sent = 0;
+static uint32_t total_unbatched = 0;
+
+/* Whether the room is too big for joins and leaves to be announced */
+static BOOLEAN is_quiet(room_t *room)
+{
+	return quiet_size && room_get_count(room) >= quiet_size;
+}
+
+/* Get the joins and leaves waiting in the room, starting a new window if there aren't any */
+static presence_t *get_presence(room_t *room)
+{
+	presence_t *presence = room->presence;
+
+	if(presence == NULL)
+	{
+		presence = malloc(sizeof(presence_t));
+		assert(presence); /* Out of memory */
+
+		gettimeofday(&presence->due, NULL);
+		presence->due.tv_usec += PRESENCE_WINDOW * 1000;
+		presence->due.tv_sec += presence->due.tv_usec / 1000000;
+		presence->due.tv_usec %= 1000000;
+
+		presence->joined = table_create();
+		presence->left = table_create();
+		presence->newcomers = table_create();
+
+		if(pending_count == pending_size)
+		{
+			pending_size = pending_size ? pending_size << 1 : STARTING_PENDING;
+			pending = realloc(pending, pending_size * sizeof(room_t *));
+			assert(pending); /* Out of memory */
+		}
+		presence->index = pending_count;
+		pending[pending_count++] = room_hold(room);
+
+		room->presence = presence;
+	}
+
+	return presence;
+}
+
+/* Somebody joined the room */
+void presence_joined(room_t *room, user_t *user)
+{
+	presence_t *presence = get_presence(room);
+	char *name = get_username(user);
+
+	/* The old way, they'd have been announced to everybody (themselves included), then been
+	 * told about everybody else */
+	total_changes++;
+	total_unbatched += room_get_count(room) * 2 - 1;
+
+	table_add(presence->newcomers, name, user);
+
+	/* If they left during the window, then as far as everybody else knows, they never did */
+	if(table_remove(presence->left, name) == NULL && !is_quiet(room))
+		table_add(presence->joined, name, name);
+}
+
+/* Somebody left the room */
+void presence_left(room_t *room, user_t *user)
+{
+	presence_t *presence = get_presence(room);
+	char *name = get_username(user);
+
+	total_changes++;
+	total_unbatched += room_get_count(room);
+
+	table_remove(presence->newcomers, name);
+
+	/* If they joined during the window, nobody else has heard of them yet */
+	if(table_remove(presence->joined, name) == NULL && !is_quiet(room))
+		table_add(presence->left, name, name);
+}
+
+/* Encode the names into SID_PRESENCE packets, as many as it takes.  The first joined_count
+ * names joined, and the rest left.  Only the first packet gets the flags.  The number of
+ * packets is returned in count.  The array and the packets have to be destroyed. */
+static packet_buffer_t **encode_packets(uint32_t flags, char **names, size_t names_count, size_t joined_count, size_t *count)
+{
+	packet_buffer_t **packets;
+	presence_packet_t packet;
+	size_t first = 0;
+	size_t last;
+	size_t size;
+
+	/* Every packet has at least one name, except when there aren't any */
+	packets = malloc((names_count + 1) * sizeof(packet_buffer_t *));
+	assert(packets); /* Out of memory */
+	*count = 0;
+
+	do
+	{
+		for(last = first, size = 0; last < names_count && size + strlen(names[last]) + 1 <= MAX_NAME_BYTES; last++)
+			size += strlen(names[last]) + 1;
+
+		packet.flags = *count ? 0 : flags;
+		packet.joined_count = joined_count > last ? last - first : joined_count > first ? joined_count - first : 0;
+		packet.names = names + first;
+		packet.names_count = last - first;
+		packets[(*count)++] = encode_presence(&packet);
+
+		first = last;
+	}
+	while(first < names_count);
+
+	return packets;
+}
+
+/* Destroy what encode_packets() returned */
+static void destroy_packets(packet_buffer_t **packets, size_t count)
+{
+	size_t i;
+
+	for(i = 0; i < count; i++)
+		destroy_buffer(packets[i]);
+	free(packets);
+}
+
+/* Start a chat event for each of the names.  The array has to be given to end_events(). */
+static outgoing_chatevent_t *begin_events(chatevent_subtype_t subtype, char **names, size_t count)
+{
+	outgoing_chatevent_t *events = malloc((count ? count : 1) * sizeof(outgoing_chatevent_t));
+	size_t i;
+
+	assert(events); /* Out of memory */
+	for(i = 0; i < count; i++)
+		chatevent_begin(&events[i], subtype, names[i], "");
+
+	return events;
+}
+
+/* Finish the chat events that begin_events() started */
+static void end_events(outgoing_chatevent_t *events, size_t count)
+{
+	size_t i;
+
+	for(i = 0; i < count; i++)
+		chatevent_end(&events[i]);
+	free(events);
+}
+
+/* Send the room's waiting joins and leaves right now, if it has any */
+void presence_flush(room_t *room)
+{
+	presence_t *presence = room->presence;
+	user_t **users;
+	size_t users_count;
+	char **everybody;
+	char **joined;
+	size_t joined_count;
+	char **left;
+	size_t left_count;
+	char **changes;
+	packet_buffer_t **change_packets = NULL;
+	size_t change_packets_count = 0;
+	packet_buffer_t **everybody_packets = NULL;
+	size_t everybody_packets_count = 0;
+	outgoing_chatevent_t *join_events = NULL;
+	outgoing_chatevent_t *leave_events = NULL;
+	outgoing_chatevent_t *everybody_events = NULL;
+	outgoing_chatevent_t quiet_event;
+	char quiet_text[128];
+	BOOLEAN quiet;
+	BOOLEAN sent_anything = FALSE;
+	size_t i;
+	size_t j;
+
+	if(presence == NULL)
+		return;
+
+	/* Any messages that are waiting came first */
+	broadcast_flush(room);
+
+	/* Take the room out of the pending array first, so nothing in here can find it.  The last
+	 * room is moved into its place. */
+	pending_count--;
+	pending[presence->index] = pending[pending_count];
+	pending[presence->index]->presence->index = presence->index;
+	room->presence = NULL;
+
+	users = room_get_users(room, &users_count);
+	joined = get_keys(presence->joined, &joined_count);
+	left = get_keys(presence->left, &left_count);
+	quiet = is_quiet(room);
+
+	/* The joins then the leaves, for SID_PRESENCE */
+	changes = malloc((joined_count + left_count + 1) * sizeof(char *));
+	assert(changes); /* Out of memory */
+	memcpy(changes, joined, joined_count * sizeof(char *));
+	memcpy(changes + joined_count, left, left_count * sizeof(char *));
+
+	everybody = malloc((users_count ? users_count : 1) * sizeof(char *));
+	assert(everybody); /* Out of memory */
+	for(i = 0; i < users_count; i++)
+		everybody[i] = get_username(users[i]);
+
+	/* Everything is encoded the first time somebody needs it, so a batch costs the same
+	 * handful of encodes no matter how many people are in the room */
+	for(i = 0; i < users_count; i++)
+	{
+		if(table_find(presence->newcomers, get_username(users[i])) == NULL)
+		{
+			/* They were here already; they get the joins and leaves */
+			if(joined_count + left_count == 0)
+				continue;
+
+			if(get_user_presence_batches(users[i]))
+			{
+				if(change_packets == NULL)
+					change_packets = encode_packets(0, changes, joined_count + left_count, joined_count, &change_packets_count);
+				for(j = 0; j < change_packets_count; j++)
+					user_send(users[i], change_packets[j]);
+				total_sent += change_packets_count;
+			}
+			else
+			{
+				if(join_events == NULL)
+				{
+					join_events = begin_events(EID_USER_JOIN_CHANNEL, joined, joined_count);
+					leave_events = begin_events(EID_USER_LEAVE_CHANNEL, left, left_count);
+				}
+				for(j = 0; j < joined_count; j++)
+					user_send_chatevent(users[i], &join_events[j]);
+				for(j = 0; j < left_count; j++)
+					user_send_chatevent(users[i], &leave_events[j]);
+				total_sent += joined_count + left_count;
+			}
+		}
+		else if(quiet)
+		{
+			/* They just got here, but the room's too big to tell them who's in it */
+			if(get_user_presence_batches(users[i]))
+			{
+				if(everybody_packets == NULL)
+					everybody_packets = encode_packets(PRESENCE_QUIET, NULL, 0, 0, &everybody_packets_count);
+				user_send(users[i], everybody_packets[0]);
+			}
+			else
+			{
+				sprintf(quiet_text, "There are %u people in this channel, which is too many to list", (unsigned int) users_count);
+				chatevent_begin(&quiet_event, EID_INFO, get_username(users[i]), quiet_text);
+				user_send_chatevent(users[i], &quiet_event);
+				chatevent_end(&quiet_event);
+			}
+			total_sent++;
+		}
+		else
+		{
+			/* They just got here, so they get everybody */
+			if(get_user_presence_batches(users[i]))
+			{
+				if(everybody_packets == NULL)
+					everybody_packets = encode_packets(PRESENCE_EVERYBODY, everybody, users_count, users_count, &everybody_packets_count);
+				for(j = 0; j < everybody_packets_count; j++)
+					user_send(users[i], everybody_packets[j]);
+				total_sent += everybody_packets_count;
+			}
+			else
+			{
+				if(everybody_events == NULL)
+					everybody_events = begin_events(EID_USER_IN_CHANNEL, everybody, users_count);
+				for(j = 0; j < users_count; j++)
+					user_send_chatevent(users[i], &everybody_events[j]);
+				total_sent += users_count;
+			}
+		}
+
+		sent_anything = TRUE;
+	}
+
+	if(sent_anything)
+		total_batches++;
+
+	if(change_packets)
+		destroy_packets(change_packets, change_packets_count);
+	if(everybody_packets)
+		destroy_packets(everybody_packets, everybody_packets_count);
+	if(join_events)
+	{
+		end_events(join_events, joined_count);
+		end_events(leave_events, left_count);
+	}
+	if(everybody_events)
+		end_events(everybody_events, users_count);
+
+	free(everybody);
+	free(changes);
+	free(left);
+	free(joined);
+	free(users);
+
+	table_destroy(presence->joined);
+	table_destroy(presence->left);
+	table_destroy(presence->newcomers);
+	free(presence);
+
+	room_release(room);
+}
+
+/* The number of microseconds from now until the room's window is over, or 0 if it already
+ * is */
+static long time_left(room_t *room, struct timeval *now)
+{
+	long left = (room->presence->due.tv_sec - now->tv_sec) * 1000000L + (room->presence->due.tv_usec - now->tv_usec);
+
+	return left > 0 ? left : 0;
+}
+
+/* Send the waiting joins and leaves of every room whose window is over */
+void presence_flush_due()
+{
+	struct timeval now;
+	size_t i;
+
+	gettimeofday(&now, NULL);
+
+	/* Flushing a room moves the last one into its place, so go backwards */
+	for(i = pending_count; i > 0; i--)
+		if(time_left(pending[i - 1], &now) == 0)
+			presence_flush(pending[i - 1]);
+}
+
+/* If a room's window will be over before the given timeout, shorten the timeout to when it
+ * will be */
+void presence_get_timeout(struct timeval *timeout)
+{
+	struct timeval now;
+	long left;
+	size_t i;
+
+	gettimeofday(&now, NULL);
+
+	for(i = 0; i < pending_count; i++)
+	{
+		left = time_left(pending[i], &now);
+		if(left < timeout->tv_sec * 1000000L + timeout->tv_usec)
+		{
+			timeout->tv_sec = left / 1000000;
+			timeout->tv_usec = left % 1000000;
+		}
+	}
+}
+
+/* Set the number of people that makes a room quiet; 0 means no room is ever quiet */
+void presence_set_quiet_size(size_t size)
+{
+	quiet_size = size;
+}
+
+/* Get the totals so far.  This is for statistics. */
+void presence_get_totals(uint32_t *changes, uint32_t *batches, uint32_t *sent, uint32_t *unbatched)
+{
+	*changes = total_changes;
+	*batches = total_batches;
+	*sent = total_sent;
+	*unbatched = total_unbatched;
+}
+
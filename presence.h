@@ -0,0 +1,61 @@
+/* presence */
+/* This module tells the people in a room who comes and goes.  Sending every join to
+ * everybody in the room as it happens means that when a whole crowd floods into a room (like
+ * right after a restart), each of them is announced to each of the others, one packet at a
+ * time.  Instead, joins and leaves are saved up for PRESENCE_WINDOW milliseconds, then
+ * everybody in the room gets all of them at once: a single SID_PRESENCE for clients that
+ * asked for it (see PROTOCOL_PRESENCE in protocol.h), or the usual chat events for clients
+ * that didn't.  Somebody who joins then leaves within the window is never mentioned at all.
+ *
+ * Somebody who joined during the window gets everybody in the room instead, so the list
+ * they start with always agrees with the joins and leaves they hear about later.
+ *
+ * Rooms with at least "quiet size" people in them don't announce anything; the people who
+ * join them are just told so, and can ask for the list with SID_REQUEST_ROOM_LIST when they
+ * want it (which is cached, so that's cheap).
+ *
+ * Anything that's sent to a whole room (see room_message() and room_packet()) sends the
+ * waiting joins and leaves first, so nobody hears from somebody they haven't been told
+ * about yet. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#ifndef _PRESENCE_H_
+#define _PRESENCE_H_
+
+#include <stdint.h>
+
+#include <sys/time.h>
+
+#include "room.h"
+#include "user.h"
+
+/* The number of milliseconds joins and leaves are saved up for */
+#define PRESENCE_WINDOW 250
+
+/* The default number of people that makes a room quiet */
+#define PRESENCE_QUIET_SIZE 1000
+
+/* These are called by the room module when somebody joins or leaves a room.  They shouldn't
+ * be needed anywhere else. */
+void presence_joined(room_t *room, user_t *user);
+void presence_left(room_t *room, user_t *user);
+
+/* Send the room's waiting joins and leaves right now, if it has any */
+void presence_flush(room_t *room);
+/* Send the waiting joins and leaves of every room whose window is over.  This should be
+ * called regularly; it only looks at the rooms that have something waiting. */
+void presence_flush_due();
+/* If a room's window will be over before the given timeout, shorten the timeout to when it
+ * will be, so select() wakes up in time to send it */
+void presence_get_timeout(struct timeval *timeout);
+
+/* Set the number of people that makes a room quiet; 0 means no room is ever quiet */
+void presence_set_quiet_size(size_t size);
+
+/* Get the totals so far: joins and leaves, the number of batches they went out in, the
+ * number of packets it took, and the number of packets it would have taken to send each
+ * one to everybody as it happened.  This is for statistics. */
+void presence_get_totals(uint32_t *changes, uint32_t *batches, uint32_t *sent, uint32_t *unbatched);
+
+#endif
+
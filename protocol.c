@@ -0,0 +1,297 @@
+/* protocol */
+/* This module is the schema for every packet in the protocol (see protocol.h).  All of the
+ * encoders and decoders are generated here from the field lists in protocol.h, so adding a
+ * packet, or a field to one, is just a matter of adding it there. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packet_buffer.h"
+#include "protocol.h"
+#include "types.h"
+
+/* Write a little endian uint32_t */
+static void put_int32(uint8_t *data, uint32_t value)
+{
+	data[0] = (value >> 0)  & 0xFF;
+	data[1] = (value >> 8)  & 0xFF;
+	data[2] = (value >> 16) & 0xFF;
+	data[3] = (value >> 24) & 0xFF;
+}
+/* Read a little endian uint32_t */
+static uint32_t get_int32(uint8_t *data)
+{
+	return ((uint32_t) data[0] << 0) | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+/* The number of bytes a varint takes up */
+static size_t varint_size(uint32_t value)
+{
+	size_t size = 1;
+
+	while(value >= 0x80)
+	{
+		value >>= 7;
+		size++;
+	}
+
+	return size;
+}
+/* Write a varint, and return the number of bytes written */
+static size_t put_varint(uint8_t *data, uint32_t value)
+{
+	size_t size = 0;
+
+	while(value >= 0x80)
+	{
+		data[size++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	data[size++] = value;
+
+	return size;
+}
+/* Read a varint, and return the number of bytes it took up, or 0 if it runs past end or is
+ * longer than a uint32_t can be */
+static size_t get_varint(uint8_t *data, uint8_t *end, uint32_t *value)
+{
+	size_t size = 0;
+
+	*value = 0;
+	do
+	{
+		if(data + size >= end || size == 5)
+			return 0;
+		*value |= (uint32_t) (data[size] & 0x7F) << (7 * size);
+	}
+	while(data[size++] & 0x80);
+
+	return size;
+}
+
+/* Write a string, including its terminator, and return the number of bytes written */
+static size_t put_ntstring(uint8_t *data, char *string)
+{
+	size_t length = strlen(string) + 1;
+
+	memcpy(data, string, length);
+
+	return length;
+}
+/* Sanitize a received string in place, and return the number of bytes it took up (including
+ * the terminator), or 0 if it isn't terminated before end. */
+static size_t get_ntstring(uint8_t *data, uint8_t *end)
+{
+	BOOLEAN terminated;
+	size_t length = sanitize_ntstring((char *) data, data, end - data, &terminated);
+
+	return terminated ? length : 0;
+}
+
+/* The number of bytes a list of strings takes up on the wire, including the blank one at
+ * the end */
+static size_t ntstring_list_size(char **strings, uint16_t count)
+{
+	size_t size = 1;
+	uint16_t i;
+
+	for(i = 0; i < count; i++)
+		size += strlen(strings[i]) + 1;
+
+	return size;
+}
+/* Write a list of strings, and the blank one at the end.  Returns the number of bytes written. */
+static size_t put_ntstring_list(uint8_t *data, char **strings, uint16_t count)
+{
+	size_t size = 0;
+	uint16_t i;
+
+	for(i = 0; i < count; i++)
+		size += put_ntstring(data + size, strings[i]);
+	data[size++] = '\0';
+
+	return size;
+}
+/* Read a list of strings, ending at a blank one.  The array of strings is allocated (the
+ * strings themselves are left in the packet).  Returns the number of bytes the list took up,
+ * or 0 if it's not properly terminated. */
+static size_t get_ntstring_list(uint8_t *data, uint8_t *end, char ***strings, uint16_t *count)
+{
+	uint8_t *position;
+	size_t length;
+	uint16_t i;
+
+	/* Count them, sanitizing as we go */
+	*count = 0;
+	for(position = data; position < end && *position; position += length)
+	{
+		length = get_ntstring(position, end);
+		if(length == 0)
+			return 0;
+		(*count)++;
+	}
+	if(position >= end)
+		return 0;
+
+	/* Then point at them */
+	*strings = malloc((*count ? *count : 1) * sizeof(char *));
+	assert(*strings); /* Out of memory */
+	for(i = 0, position = data; i < *count; i++, position += strlen((char *) position) + 1)
+		(*strings)[i] = (char *) position;
+
+	return (position - data) + 1;
+}
+
+
+/* The smallest number of bytes each kind of field can take up */
+#define MINIMUM_SIZE_INT32(name)          + 4
+#define MINIMUM_SIZE_VARINT(name)         + 1
+#define MINIMUM_SIZE_HASH(name)           + PROTOCOL_HASH_LENGTH
+#define MINIMUM_SIZE_NTSTRING(name)       + 1
+#define MINIMUM_SIZE_NTSTRING_LIST(name)  + 1
+#define MINIMUM_SIZE(kind, name) MINIMUM_SIZE_##kind(name)
+
+/* Whether each kind of field is a string (and so the packet has to end with a '\0') */
+#define HAS_STRINGS_INT32(name)
+#define HAS_STRINGS_VARINT(name)
+#define HAS_STRINGS_HASH(name)
+#define HAS_STRINGS_NTSTRING(name)       || TRUE
+#define HAS_STRINGS_NTSTRING_LIST(name)  || TRUE
+#define HAS_STRINGS(kind, name) HAS_STRINGS_##kind(name)
+
+/* The number of bytes each field of a struct will take up */
+#define ENCODED_SIZE_INT32(name)          + 4
+#define ENCODED_SIZE_VARINT(name)         + varint_size(packet->name)
+#define ENCODED_SIZE_HASH(name)           + PROTOCOL_HASH_LENGTH
+#define ENCODED_SIZE_NTSTRING(name)       + strlen(packet->name) + 1
+#define ENCODED_SIZE_NTSTRING_LIST(name)  + ntstring_list_size(packet->name, packet->name##_count)
+#define ENCODED_SIZE(kind, name) ENCODED_SIZE_##kind(name)
+
+/* Write each field of a struct */
+#define ENCODE_INT32(name)          put_int32(data, packet->name); data += 4;
+#define ENCODE_VARINT(name)         data += put_varint(data, packet->name);
+#define ENCODE_HASH(name)           memcpy(data, packet->name, PROTOCOL_HASH_LENGTH); data += PROTOCOL_HASH_LENGTH;
+#define ENCODE_NTSTRING(name)       data += put_ntstring(data, packet->name);
+#define ENCODE_NTSTRING_LIST(name)  data += put_ntstring_list(data, packet->name, packet->name##_count);
+#define ENCODE(kind, name) ENCODE_##kind(name)
+
+/* Read each field into a struct.  The fixed-size fields have already been bounds checked;
+ * strings are checked as they're scanned. */
+#define DECODE_INT32(name)          packet->name = get_int32(data); data += 4;
+#define DECODE_VARINT(name)         if((length = get_varint(data, end, &packet->name)) == 0) return FALSE; \
+                                    data += length;
+#define DECODE_HASH(name)           packet->name = data; data += PROTOCOL_HASH_LENGTH;
+#define DECODE_NTSTRING(name)       packet->name = (char *) data; \
+                                    if((length = get_ntstring(data, end)) == 0) return FALSE; \
+                                    data += length;
+#define DECODE_NTSTRING_LIST(name)  if((length = get_ntstring_list(data, end, &packet->name, &packet->name##_count)) == 0) return FALSE; \
+                                    data += length;
+#define DECODE(kind, name) DECODE_##kind(name)
+
+/* Free whatever decoding allocated for each field */
+#define FREE_INT32(name)
+#define FREE_VARINT(name)
+#define FREE_HASH(name)
+#define FREE_NTSTRING(name)
+#define FREE_NTSTRING_LIST(name)  free(packet->name);
+#define FREE(kind, name) FREE_##kind(name)
+
+/* Generate the functions for each packet.  "length" is unused in packets without strings or varints. */
+#define PROTOCOL_FUNCTIONS(code, name, FIELDS) \
+	packet_buffer_t *encode_##name(name##_packet_t *packet) \
+	{ \
+		size_t size = 0 FIELDS(ENCODED_SIZE); \
+		packet_buffer_t *buffer; \
+		uint8_t *data; \
+		\
+		assert(size <= MAX_PACKET - 4); \
+		buffer = create_buffer_length(code, size); \
+		data = get_buffer(buffer) + 4; \
+		\
+		FIELDS(ENCODE) \
+		\
+		return buffer; \
+	} \
+	\
+	ssize_t send_##name(int s, name##_packet_t *packet) \
+	{ \
+		packet_buffer_t *buffer = encode_##name(packet); \
+		ssize_t result = send_buffer(buffer, s); \
+		\
+		destroy_buffer(buffer); \
+		\
+		return result; \
+	} \
+	\
+	BOOLEAN decode_##name(packet_buffer_t *buffer, name##_packet_t *packet) \
+	{ \
+		uint8_t *data = get_buffer(buffer) + 4; \
+		uint8_t *end = get_buffer(buffer) + get_length(buffer); \
+		size_t length = 0 FIELDS(MINIMUM_SIZE); \
+		\
+		assert(get_code(buffer) == code); \
+		\
+		/* The one bounds check: everything has to fit, and the last string has to end */ \
+		if(end - data < length || ((0 FIELDS(HAS_STRINGS)) && end[-1] != '\0')) \
+			return FALSE; \
+		\
+		FIELDS(DECODE) \
+		\
+		return TRUE; \
+	} \
+	\
+	void free_##name(name##_packet_t *packet) \
+	{ \
+		FIELDS(FREE) \
+	}
+PROTOCOL_SCHEMA(PROTOCOL_FUNCTIONS)
+
+/*
+#include <stdio.h>
+#include <time.h>
+
+int main(int argc, char *argv[])
+{
+	chatevent_packet_t full;
+	chatevent_id_packet_t compact;
+	packet_buffer_t *packet;
+	clock_t start;
+	double full_time, compact_time;
+	size_t full_size, compact_size;
+	int i;
+	int iterations = 10000000;
+
+	full.subtype = EID_TALK;
+	full.username = "SomeUsername";
+	full.text = "hey, what's up?";
+
+	compact.subtype = EID_TALK;
+	compact.username_id = 300;
+	compact.text_id = 0;
+	compact.text = full.text;
+
+	start = clock();
+	for(i = 0; i < iterations; i++)
+	{
+		packet = encode_chatevent(&full);
+		full_size = get_length(packet);
+		destroy_buffer(packet);
+	}
+	full_time = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+	start = clock();
+	for(i = 0; i < iterations; i++)
+	{
+		packet = encode_chatevent_id(&compact);
+		compact_size = get_length(packet);
+		destroy_buffer(packet);
+	}
+	compact_time = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+	printf("SID_CHATEVENT:    %3u bytes, %.1f ns to encode\n", (unsigned int) full_size, full_time * 1000000000 / iterations);
+	printf("SID_CHATEVENT_ID: %3u bytes, %.1f ns to encode\n", (unsigned int) compact_size, compact_time * 1000000000 / iterations);
+
+	return 0;
+}
+*/
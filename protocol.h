@@ -0,0 +1,235 @@
+/* protocol */
+/* This module is the schema for every packet in the protocol (see packet_codes_t in types.h
+ * for what each of them is for).  Each packet's fields are listed exactly once, below, and
+ * everything else is generated from that list with X-macros:
+ *
+ *  - a struct for the packet, <name>_packet_t, with one member per field
+ *  - encode_<name>(), which turns a struct into a packet_buffer_t
+ *  - send_<name>(), which encodes a struct, sends it, and throws the buffer away
+ *  - decode_<name>(), which turns a received packet_buffer_t into a struct
+ *  - free_<name>(), which frees anything decode_<name>() allocated
+ *
+ * The encoders work out the size of the packet first, allocate it once, and write the
+ * fields straight into it.  The decoders do one bounds check for the whole packet, rather
+ * than one per field; if a packet is too short, or its strings aren't terminated, decoding
+ * fails rather than asserting, so a bad client can't take down the server.
+ *
+ * Decoded strings aren't copied; they point into the packet_buffer_t (and control characters
+ * are replaced with '.' in place), so the packet has to outlive the struct.
+ */
+
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <stdint.h>
+
+#include "packet_buffer.h"
+#include "types.h"
+
+/* The length of the password hashes in SID_LOGIN and SID_CREATE (it's sha1, see password.h) */
+#define PROTOCOL_HASH_LENGTH 20
+
+/* The version in client_version (SID_CLIENT_INFORMATION) and version_useable 
+ * (SID_SERVER_INFORMATION) is in the low 16 bits.  The high bits are optional features: the
+ * client sets the ones it supports, and the server echoes back the ones it's going to use. */
+#define PROTOCOL_VERSION_MASK 0x0000FFFF
+/* Big packets from the server may be compressed into SID_COMPRESSED (see compression.h) */
+#define PROTOCOL_DEFLATE      0x00010000
+/* Chat events may come as SID_CHATEVENT_ID, with names replaced by numbers that were given
+ * out with SID_INTRODUCE_NAME */
+#define PROTOCOL_NAME_IDS     0x00020000
+/* Joins and leaves come batched up in SID_PRESENCE, instead of one chat event each */
+#define PROTOCOL_PRESENCE     0x00040000
+/* A session token comes after logging in, for SID_RESUME next time (see token.h) */
+#define PROTOCOL_RESUME       0x00080000
+
+/* The flags in SID_PRESENCE (see types.h) */
+#define PRESENCE_EVERYBODY    0x00000001
+#define PRESENCE_QUIET        0x00000002
+
+/* The kinds of fields a packet can have:
+ *  INT32          -- (uint32_t), little endian
+ *  VARINT         -- (varint), a uint32_t in 1 to 5 bytes: 7 bits at a time, lowest first,
+ *                    with the high bit set on every byte but the last
+ *  HASH           -- (uint32_t[5]), PROTOCOL_HASH_LENGTH raw bytes.  In the struct, this is a
+ *                    pointer to the bytes
+ *  NTSTRING       -- (ntstring), a '\0'-terminated string
+ *  NTSTRING_LIST  -- (ntstring[]), a series of ntstrings, terminated by a blank one.  In the
+ *                    struct, this is an array of strings (name) and the number of them
+ *                    (name_count)
+ *
+ * NOTE: Fixed-size fields (INT32 and HASH) have to come before any strings, since the single
+ * bounds check only covers the fixed-size part and the strings' terminators.  VARINTs are
+ * checked as they're read, like strings, but the bounds check counts one byte for each. */
+
+/* The fields of each packet, in the order they're sent.  SID_NULL has no fields, so it
+ * doesn't have a schema; it's always just a header.  SID_COMPRESSED doesn't either, since
+ * it's just bytes for zlib (see compression.h). */
+#define CLIENT_INFORMATION_FIELDS(FIELD) \
+	FIELD(INT32, client_token) \
+	FIELD(INT32, current_time) \
+	FIELD(INT32, client_version) \
+	FIELD(NTSTRING, country) \
+	FIELD(NTSTRING, operating_system)
+
+#define SERVER_INFORMATION_FIELDS(FIELD) \
+	FIELD(INT32, server_token) \
+	FIELD(INT32, version_useable) \
+	FIELD(NTSTRING, hash_type) \
+	FIELD(NTSTRING, country) \
+	FIELD(NTSTRING, operating_system)
+
+#define LOGIN_FIELDS(FIELD) \
+	FIELD(HASH, password) \
+	FIELD(NTSTRING, username)
+
+#define LOGIN_RESPONSE_FIELDS(FIELD) \
+	FIELD(INT32, result) \
+	FIELD(NTSTRING, username)
+
+#define CREATE_FIELDS(FIELD) \
+	FIELD(HASH, password) \
+	FIELD(NTSTRING, username)
+
+#define CREATE_RESPONSE_FIELDS(FIELD) \
+	FIELD(INT32, result) \
+	FIELD(NTSTRING, username)
+
+#define REQUEST_ROOM_LIST_FIELDS(FIELD) \
+	FIELD(NTSTRING, room_name)
+
+#define ROOM_LIST_FIELDS(FIELD) \
+	FIELD(NTSTRING_LIST, names)
+
+#define CHATCOMMAND_FIELDS(FIELD) \
+	FIELD(NTSTRING, command)
+
+#define CHATEVENT_FIELDS(FIELD) \
+	FIELD(INT32, subtype) \
+	FIELD(NTSTRING, username) \
+	FIELD(NTSTRING, text)
+
+#define ERROR_FIELDS(FIELD) \
+	FIELD(NTSTRING, description)
+
+#define INTRODUCE_NAME_FIELDS(FIELD) \
+	FIELD(VARINT, id) \
+	FIELD(NTSTRING, name)
+
+#define CHATEVENT_ID_FIELDS(FIELD) \
+	FIELD(VARINT, subtype) \
+	FIELD(VARINT, username_id) \
+	FIELD(VARINT, text_id) \
+	FIELD(NTSTRING, text)
+
+#define PRESENCE_FIELDS(FIELD) \
+	FIELD(VARINT, flags) \
+	FIELD(VARINT, joined_count) \
+	FIELD(NTSTRING_LIST, names)
+
+#define LINK_HELLO_FIELDS(FIELD) \
+	FIELD(INT32, node_id) \
+	FIELD(INT32, port) \
+	FIELD(INT32, version) \
+	FIELD(HASH, challenge)
+
+#define LINK_LOGIN_FIELDS(FIELD) \
+	FIELD(INT32, ip) \
+	FIELD(NTSTRING, username)
+
+#define LINK_LOGOUT_FIELDS(FIELD) \
+	FIELD(NTSTRING, username)
+
+#define LINK_JOIN_FIELDS(FIELD) \
+	FIELD(NTSTRING, username) \
+	FIELD(NTSTRING, room_name)
+
+#define LINK_CHAT_FIELDS(FIELD) \
+	FIELD(INT32, subtype) \
+	FIELD(NTSTRING, room_name) \
+	FIELD(NTSTRING, username) \
+	FIELD(NTSTRING, text)
+
+#define LINK_WHISPER_FIELDS(FIELD) \
+	FIELD(NTSTRING, username) \
+	FIELD(NTSTRING, target) \
+	FIELD(NTSTRING, text)
+
+#define LINK_ROOM_FIELDS(FIELD) \
+	FIELD(INT32, batch_window) \
+	FIELD(NTSTRING, room_name)
+
+#define SESSION_TOKEN_FIELDS(FIELD) \
+	FIELD(INT32, expires) \
+	FIELD(HASH, token)
+
+#define RESUME_FIELDS(FIELD) \
+	FIELD(INT32, expires) \
+	FIELD(HASH, token) \
+	FIELD(NTSTRING, username) \
+	FIELD(NTSTRING, room_name)
+
+#define LINK_AUTH_FIELDS(FIELD) \
+	FIELD(HASH, answer)
+
+/* Every packet with a schema: PACKET(code, name, fields) */
+#define PROTOCOL_SCHEMA(PACKET) \
+	PACKET(SID_CLIENT_INFORMATION, client_information, CLIENT_INFORMATION_FIELDS) \
+	PACKET(SID_SERVER_INFORMATION, server_information, SERVER_INFORMATION_FIELDS) \
+	PACKET(SID_LOGIN, login, LOGIN_FIELDS) \
+	PACKET(SID_LOGIN_RESPONSE, login_response, LOGIN_RESPONSE_FIELDS) \
+	PACKET(SID_CREATE, create, CREATE_FIELDS) \
+	PACKET(SID_CREATE_RESPONSE, create_response, CREATE_RESPONSE_FIELDS) \
+	PACKET(SID_REQUEST_ROOM_LIST, request_room_list, REQUEST_ROOM_LIST_FIELDS) \
+	PACKET(SID_ROOM_LIST, room_list, ROOM_LIST_FIELDS) \
+	PACKET(SID_CHATCOMMAND, chatcommand, CHATCOMMAND_FIELDS) \
+	PACKET(SID_CHATEVENT, chatevent, CHATEVENT_FIELDS) \
+	PACKET(SID_ERROR, error_message, ERROR_FIELDS) \
+	PACKET(SID_INTRODUCE_NAME, introduce_name, INTRODUCE_NAME_FIELDS) \
+	PACKET(SID_CHATEVENT_ID, chatevent_id, CHATEVENT_ID_FIELDS) \
+	PACKET(SID_PRESENCE, presence, PRESENCE_FIELDS) \
+	PACKET(SID_LINK_HELLO, link_hello, LINK_HELLO_FIELDS) \
+	PACKET(SID_LINK_LOGIN, link_login, LINK_LOGIN_FIELDS) \
+	PACKET(SID_LINK_LOGOUT, link_logout, LINK_LOGOUT_FIELDS) \
+	PACKET(SID_LINK_JOIN, link_join, LINK_JOIN_FIELDS) \
+	PACKET(SID_LINK_CHAT, link_chat, LINK_CHAT_FIELDS) \
+	PACKET(SID_LINK_WHISPER, link_whisper, LINK_WHISPER_FIELDS) \
+	PACKET(SID_LINK_ROOM, link_room, LINK_ROOM_FIELDS) \
+	PACKET(SID_SESSION_TOKEN, session_token, SESSION_TOKEN_FIELDS) \
+	PACKET(SID_RESUME, resume, RESUME_FIELDS) \
+	PACKET(SID_LINK_AUTH, link_auth, LINK_AUTH_FIELDS)
+
+
+/* The struct members for each kind of field */
+#define PROTOCOL_MEMBER_INT32(name)          uint32_t name;
+#define PROTOCOL_MEMBER_VARINT(name)         uint32_t name;
+#define PROTOCOL_MEMBER_HASH(name)           uint8_t *name;
+#define PROTOCOL_MEMBER_NTSTRING(name)       char *name;
+#define PROTOCOL_MEMBER_NTSTRING_LIST(name)  char **name; uint16_t name##_count;
+#define PROTOCOL_MEMBER(kind, name) PROTOCOL_MEMBER_##kind(name)
+
+/* Generate the struct for each packet */
+#define PROTOCOL_STRUCT(code, name, FIELDS) \
+	typedef struct \
+	{ \
+		FIELDS(PROTOCOL_MEMBER) \
+	} name##_packet_t;
+PROTOCOL_SCHEMA(PROTOCOL_STRUCT)
+
+/* Generate a union of every packet's struct, for when one of several could have arrived */
+#define PROTOCOL_UNION_MEMBER(code, name, FIELDS) name##_packet_t name;
+typedef union
+{
+	PROTOCOL_SCHEMA(PROTOCOL_UNION_MEMBER)
+} protocol_packet_t;
+
+/* Generate the prototypes for each packet */
+#define PROTOCOL_PROTOTYPES(code, name, FIELDS) \
+	packet_buffer_t *encode_##name(name##_packet_t *packet); \
+	ssize_t send_##name(int s, name##_packet_t *packet); \
+	BOOLEAN decode_##name(packet_buffer_t *buffer, name##_packet_t *packet); \
+	void free_##name(name##_packet_t *packet);
+PROTOCOL_SCHEMA(PROTOCOL_PROTOTYPES)
+
+#endif
+
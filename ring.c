@@ -0,0 +1,183 @@
+/* ring */
+/* This module is a consistent-hash ring, which decides which server is the home of each
+ * room (see ring.h). */
+/* NOTE: These functions are NOT thread-safe. */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+
+#include "ring.h"
+
+/* Mix the bits of a hash around.  FNV-1a on its own leaves the high bits of short, similar
+ * keys (like "room1" and "room2") too close together, and the ring only cares about the high
+ * bits; this is the finalizer from MurmurHash3. */
+static uint32_t mix(uint32_t hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35U;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+/* Hash some bytes with FNV-1a, starting from the given hash */
+static uint32_t hash_bytes(uint32_t hash, uint8_t *bytes, size_t length)
+{
+	size_t i;
+
+	for(i = 0; i < length; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* Get the place of a server's nth point.  The node ID and n are hashed a byte at a time, so
+ * every server works it out the same way, whatever order its bytes are in. */
+static uint32_t point_hash(uint32_t node_id, uint32_t n)
+{
+	uint8_t bytes[8];
+
+	bytes[0] = node_id >> 24;
+	bytes[1] = node_id >> 16;
+	bytes[2] = node_id >> 8;
+	bytes[3] = node_id;
+	bytes[4] = n >> 24;
+	bytes[5] = n >> 16;
+	bytes[6] = n >> 8;
+	bytes[7] = n;
+
+	return mix(hash_bytes(2166136261U, bytes, sizeof(bytes)));
+}
+
+/* Sort points by hash.  If two servers land on the same place (which is unlikely, but can
+ * happen), the lower node ID comes first, so every server still agrees. */
+static int compare_points(const void *a, const void *b)
+{
+	const ring_point_t *first = a;
+	const ring_point_t *second = b;
+
+	if(first->hash != second->hash)
+		return first->hash < second->hash ? -1 : 1;
+	if(first->node_id != second->node_id)
+		return first->node_id < second->node_id ? -1 : 1;
+	return 0;
+}
+
+/* Create a ring */
+ring_t *ring_create()
+{
+	ring_t *ring = malloc(sizeof(ring_t));
+	assert(ring); /* Out of memory */
+
+	ring->points = NULL;
+	ring->point_count = 0;
+	ring->point_size = 0;
+	ring->node_count = 0;
+
+	return ring;
+}
+
+/* Destroy a ring */
+void ring_destroy(ring_t *ring)
+{
+	free(ring->points);
+	free(ring);
+}
+
+/* Whether a server is on the ring.  Its first point is always in the same place, so that's
+ * the only one that has to be looked for. */
+BOOLEAN ring_contains(ring_t *ring, uint32_t node_id)
+{
+	ring_point_t point;
+
+	if(ring->point_count == 0)
+		return FALSE;
+
+	point.hash = point_hash(node_id, 0);
+	point.node_id = node_id;
+
+	return bsearch(&point, ring->points, ring->point_count, sizeof(ring_point_t), compare_points) != NULL;
+}
+
+/* Put a server on the ring */
+void ring_add(ring_t *ring, uint32_t node_id)
+{
+	uint32_t i;
+
+	if(ring_contains(ring, node_id))
+		return;
+
+	if(ring->point_count + RING_POINTS > ring->point_size)
+	{
+		ring->point_size = ring->point_count + RING_POINTS;
+		ring->points = realloc(ring->points, ring->point_size * sizeof(ring_point_t));
+		assert(ring->points); /* Out of memory */
+	}
+
+	for(i = 0; i < RING_POINTS; i++)
+	{
+		ring->points[ring->point_count].hash = point_hash(node_id, i);
+		ring->points[ring->point_count].node_id = node_id;
+		ring->point_count++;
+	}
+
+	qsort(ring->points, ring->point_count, sizeof(ring_point_t), compare_points);
+	ring->node_count++;
+}
+
+/* Take a server off the ring */
+void ring_remove(ring_t *ring, uint32_t node_id)
+{
+	size_t i;
+	size_t kept = 0;
+
+	if(!ring_contains(ring, node_id))
+		return;
+
+	/* The rest of the points stay in order */
+	for(i = 0; i < ring->point_count; i++)
+		if(ring->points[i].node_id != node_id)
+			ring->points[kept++] = ring->points[i];
+
+	ring->point_count = kept;
+	ring->node_count--;
+}
+
+/* Find the server that a key belongs to: the first point at or after the key's hash, or the
+ * first point on the ring if it's past the last one */
+uint32_t ring_find(ring_t *ring, char *key)
+{
+	uint32_t hash = mix(hash_bytes(2166136261U, (uint8_t *) key, strlen(key)));
+	size_t low = 0;
+	size_t high = ring->point_count;
+	size_t middle;
+
+	if(ring->point_count == 0)
+		return 0;
+
+	while(low < high)
+	{
+		middle = low + (high - low) / 2;
+		if(ring->points[middle].hash < hash)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return ring->points[low == ring->point_count ? 0 : low].node_id;
+}
+
+/* Get the number of servers on the ring */
+size_t ring_get_node_count(ring_t *ring)
+{
+	return ring->node_count;
+}
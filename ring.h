@@ -0,0 +1,61 @@
+/* ring */
+/* This module is a consistent-hash ring, which decides which server is the home of each
+ * room when several of them are joined together (see federation.h).  Every server is put on
+ * the ring at RING_POINTS places, picked by hashing its node ID, and a room belongs to the
+ * first server found going around the ring from the hash of the room's name.
+ *
+ * Since every server sees the same ring, they all agree on where each room lives without
+ * asking each other.  When a server is added, it only takes over the rooms that land just
+ * before its points, and when one is removed, only its own rooms move (each to the server
+ * after it), so about 1/N of the rooms move either way.  The more points each server has,
+ * the more evenly the rooms are spread; see ringsim.c to try it out. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "types.h"
+
+/* The number of places each server is put on the ring */
+#define RING_POINTS 128
+
+/* A single place on the ring.  This is prone to change, and should not be referenced */
+typedef struct
+{
+	uint32_t hash;
+	uint32_t node_id;
+} ring_point_t;
+
+/* The ring.  The points are kept sorted by hash. */
+typedef struct _ring_t
+{
+	ring_point_t *points;
+	size_t point_count;
+	size_t point_size;
+
+	/* The number of servers on the ring */
+	size_t node_count;
+} ring_t;
+
+/* Create and destroy a ring.  A new ring is empty. */
+ring_t *ring_create();
+void ring_destroy(ring_t *ring);
+
+/* Put a server on the ring, or take it off.  Adding one that's already there, or removing
+ * one that isn't, does nothing. */
+void ring_add(ring_t *ring, uint32_t node_id);
+void ring_remove(ring_t *ring, uint32_t node_id);
+/* Whether a server is on the ring */
+BOOLEAN ring_contains(ring_t *ring, uint32_t node_id);
+
+/* Find the server that a key (a room name) belongs to.  Returns 0 if the ring is empty. */
+uint32_t ring_find(ring_t *ring, char *key);
+
+/* Get the number of servers on the ring */
+size_t ring_get_node_count(ring_t *ring);
+
+#endif
+
@@ -0,0 +1,153 @@
+/* ringsim */
+/* This is a simulator for the consistent-hash ring (see ring.h).  It puts some servers on a
+ * ring, gives it a lot of rooms, and reports how evenly they're spread, then adds a server
+ * and takes one away, and reports how many rooms had to move each time (and whether any of
+ * them moved when they didn't have to).
+ *
+ * Usage: ./ringsim [servers [rooms [seed]]] */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ring.h"
+
+/* Room names are made up from their number */
+static void room_name(char *buffer, int room)
+{
+	sprintf(buffer, "room-%d", room);
+}
+
+/* Find the home of every room, and time it */
+static void place_rooms(ring_t *ring, uint32_t *homes, int rooms)
+{
+	char name[32];
+	clock_t start = clock();
+	int i;
+
+	for(i = 0; i < rooms; i++)
+	{
+		room_name(name, i);
+		homes[i] = ring_find(ring, name);
+	}
+
+	printf("  %d lookups took %.0fns each\n", rooms, (double) (clock() - start) / CLOCKS_PER_SEC * 1e9 / rooms);
+}
+
+/* Report how evenly the rooms are spread over the servers */
+static void report_balance(uint32_t *nodes, int node_count, uint32_t *homes, int rooms)
+{
+	double mean = (double) rooms / node_count;
+	double variance = 0;
+	int min = rooms;
+	int max = 0;
+	int count;
+	int i;
+	int j;
+
+	for(i = 0; i < node_count; i++)
+	{
+		count = 0;
+		for(j = 0; j < rooms; j++)
+			if(homes[j] == nodes[i])
+				count++;
+
+		if(count < min)
+			min = count;
+		if(count > max)
+			max = count;
+		variance += (count - mean) * (count - mean);
+	}
+
+	printf("  %d servers: %.1f rooms each on average, fewest %d, most %d (%.2fx the average), standard deviation %.1f%%\n", node_count, mean, min, max, max / mean, sqrt(variance / node_count) / mean * 100);
+}
+
+/* Report how many rooms moved, and how many of them moved somewhere they shouldn't have: when
+ * a server is added, rooms should only move to it, and when one is removed, only its rooms
+ * should move */
+static void report_moves(uint32_t *before, uint32_t *after, int rooms, uint32_t node_id, int added, int node_count)
+{
+	int moved = 0;
+	int wrong = 0;
+	int i;
+
+	for(i = 0; i < rooms; i++)
+	{
+		if(before[i] == after[i])
+			continue;
+
+		moved++;
+		if(added ? after[i] != node_id : before[i] != node_id)
+			wrong++;
+	}
+
+	printf("  %d rooms moved (%.2f%%; 1/%d would be %.2f%%), %d of them needlessly\n", moved, moved * 100.0 / rooms, node_count, 100.0 / node_count, wrong);
+}
+
+int main(int argc, char *argv[])
+{
+	int node_count = argc > 1 ? atoi(argv[1]) : 8;
+	int rooms = argc > 2 ? atoi(argv[2]) : 100000;
+	unsigned int seed = argc > 3 ? atoi(argv[3]) : 1;
+	uint32_t *nodes;
+	uint32_t *before;
+	uint32_t *after;
+	ring_t *ring;
+	int i;
+
+	if(node_count < 2 || node_count > 10000 || rooms < 1)
+	{
+		fprintf(stderr, "Usage: %s [servers [rooms [seed]]]\n", argv[0]);
+		fprintf(stderr, "There have to be at least 2 servers, and at least 1 room\n");
+		return 1;
+	}
+
+	srand(seed);
+
+	/* One extra, for the server that's added */
+	nodes = malloc((node_count + 1) * sizeof(uint32_t));
+	before = malloc(rooms * sizeof(uint32_t));
+	after = malloc(rooms * sizeof(uint32_t));
+	if(nodes == NULL || before == NULL || after == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	/* Node IDs are picked the same way the servers pick them (see federation_initialize()) */
+	for(i = 0; i <= node_count; i++)
+		nodes[i] = ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+
+	printf("%d rooms, %d points per server\n", rooms, RING_POINTS);
+
+	ring = ring_create();
+	for(i = 0; i < node_count; i++)
+		ring_add(ring, nodes[i]);
+
+	printf("Starting out:\n");
+	place_rooms(ring, before, rooms);
+	report_balance(nodes, node_count, before, rooms);
+
+	printf("Adding a server:\n");
+	ring_add(ring, nodes[node_count]);
+	place_rooms(ring, after, rooms);
+	report_balance(nodes, node_count + 1, after, rooms);
+	report_moves(before, after, rooms, nodes[node_count], 1, node_count + 1);
+
+	/* The first server goes away, so the one that was added takes its place in the list */
+	printf("Removing a server:\n");
+	ring_remove(ring, nodes[0]);
+	place_rooms(ring, before, rooms);
+	report_moves(after, before, rooms, nodes[0], 0, node_count + 1);
+	nodes[0] = nodes[node_count];
+	report_balance(nodes, node_count, before, rooms);
+
+	ring_destroy(ring);
+	free(nodes);
+	free(before);
+	free(after);
+
+	return 0;
+}
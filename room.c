@@ -5,6 +5,7 @@
  * this module is notified and the data is processed, often mirrored to all the other
  * sockets. */
 
+#include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,24 +15,52 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+#include "broadcast.h"
+#include "epoch.h"
+#include "intern.h"
 #include "output.h"
 #include "packet_buffer.h"
+#include "presence.h"
+#include "protocol.h"
+#include "room_directory.h"
+#include "slab.h"
 #include "table.h"
 #include "user.h"
+#include "worker.h"
 
 #include "room.h"
 
+/* The number of rooms to allocate at a time */
+#define ROOMS_PER_CHUNK 64
+
+/* Every room_t comes from this.  It's created the first time a room is. */
+static slab_t *room_slab = NULL;
+
 /* Create a new room instance with no users, the specified name, and a blank topic */
 room_t *room_create(char *name)
 {
-	room_t *new_room = malloc(sizeof(room_t));
+	room_t *new_room;
+
+	if(room_slab == NULL)
+		room_slab = slab_create("rooms", sizeof(room_t), ROOMS_PER_CHUNK);
+
+	new_room = slab_alloc(room_slab);
 
 	new_room->users = table_create();
+	new_room->references = 1;
 
-	strncpy(new_room->name, name, MAX_ROOM_LENGTH - 1);
-	new_room->name[MAX_ROOM_LENGTH - 1] = '\0';
+	new_room->name = intern_string(name);
 
-	strcpy(new_room->topic, "No topic");
+	new_room->topic = NULL;
+	new_room->user_list = NULL;
+	new_room->presence = NULL;
+	new_room->broadcast = NULL;
+	new_room->batch_window = BROADCAST_WINDOW;
+	new_room->rate_second = 0;
+	new_room->last_rate = 0;
+	new_room->current_rate = 0;
+
+	worker_assign(new_room);
 
 	return new_room;
 }
@@ -39,8 +68,41 @@ room_t *room_create(char *name)
 /* Destroy the room instance */
 void room_destroy(room_t *room)
 {
+	/* Waiting joins, leaves and messages hold a reference, so there can't be any */
+	assert(room->presence == NULL);
+	assert(room->broadcast == NULL);
+
 	table_destroy(room->users);
-	free(room);
+	intern_release(room->name);
+	free(room->topic);
+	if(room->user_list)
+		destroy_buffer(room->user_list);
+	slab_free(room_slab, room);
+}
+
+/* Take another reference to the room */
+room_t *room_hold(room_t *room)
+{
+	room->references++;
+
+	return room;
+}
+
+/* Destroy a room whose epoch is over */
+static void destroy_retired(void *room)
+{
+	room_destroy((room_t *) room);
+}
+
+/* Give up a reference to the room.  When the last one is released, the room is destroyed,
+ * once no other thread can still be looking at it (see epoch.h). */
+void room_release(room_t *room)
+{
+	assert(room->references > 0);
+
+	room->references--;
+	if(room->references == 0)
+		epoch_retire(destroy_retired, room);
 }
 
 /* Get the name */
@@ -52,58 +114,93 @@ char *room_get_name(room_t *room)
 /* Get the topic */
 char *room_get_topic(room_t *room)
 {
-	return room->topic;
+	return room->topic ? room->topic : "No topic";
+}
+
+/* Throw away the room's encoded user list, since somebody joined or left */
+static void forget_user_list(room_t *room)
+{
+	if(room->user_list)
+	{
+		destroy_buffer(room->user_list);
+		room->user_list = NULL;
+	}
 }
 
 /* Add a user to the room.  The given user should already be authenticated, and has 
- * requested to join this room.  A server message should be sent to notify everybody
- * in the room */
-void room_add_user(room_t *room, user_t *user)
+ * requested to join this room.  Everybody in the room (including them) is told a moment
+ * later, by the presence module.  Somebody who was already in the room before a handoff
+ * is put back without telling anybody (see room_restore_user()); add_user() is the part
+ * that both of them do. */
+static void add_user(room_t *room, user_t *user)
 {
+	assert(user->room == NULL);
+
 	table_add(room->users, get_username(user), user);
+	user->room = room_hold(room);
+	forget_user_list(room);
+
+	/* If this is the first user, the room is live again */
+	if(room_get_count(room) == 1)
+		room_directory_room_occupied(room);
 }
+void room_add_user(room_t *room, user_t *user)
+{
+	/* Messages from before they got here aren't for them */
+	broadcast_flush(room);
 
-/* Remove the specified user from the room.  A server message should be sent to notify
- * the users in the room. */
-void room_remove_user(room_t *room, user_t *user)
+	add_user(room, user);
+
+	presence_joined(room, user);
+}
+void room_restore_user(room_t *room, user_t *user)
 {
-	table_remove(room->users, get_username(user));
+	add_user(room, user);
 }
 
-/* Send a message to everybody in the room */
-void room_message(room_t *room, chatevent_subtype_t message_subtype, char *from, char *message)
+/* Remove the specified user from the room.  The users in the room are told a moment later,
+ * by the presence module. */
+void room_remove_user(room_t *room, user_t *user)
 {
-	size_t i;
-	size_t num_users;
-	user_t **users = (user_t **) get_values(room->users, &num_users);
-	packet_buffer_t *packet;
-
-	/* (uint32_t) subtype -- the subtype of the event
-	 * (ntstring) username  -- The username of the person who caused the event, if 
-	 *  applicable
-	 * (ntstring) text -- The text of the event, if applicable */
-	packet = create_buffer(SID_CHATEVENT);
-	add_int32(packet, message_subtype);
-	add_ntstring(packet, from);
-	add_ntstring(packet, message);
+	assert(user->room == room);
 
-	for(i = 0; i < num_users; i++)
-		send_buffer(packet, get_socket(users[i]));
+	/* Messages from before they left are still for them */
+	broadcast_flush(room);
 
+	table_remove(room->users, get_username(user));
+	user->room = NULL;
+	forget_user_list(room);
 
-	destroy_buffer(packet);
-	free(users);
+	/* If that was the last user, the room starts its grace period */
+	if(room_get_count(room) == 0)
+		room_directory_room_emptied(room);
+
+	presence_left(room, user);
+	room_release(room);
+}
+
+/* Send a message to everybody in the room.  "from" has to be interned (see
+ * chatevent_begin()), and the message can't be a name.  It's held back for a moment, so it
+ * can go out in a batch with the messages around it. */
+void room_message(room_t *room, chatevent_subtype_t message_subtype, char *from, char *message)
+{
+	broadcast_message(room, message_subtype, from, message);
 }
 
-/* Send a packet to everybody in the room */
+/* Send a packet to everybody in the room, right away.  Any messages, joins and leaves that
+ * are waiting go first. */
 void room_packet(room_t *room, packet_buffer_t *packet)
 {
 	size_t i;
 	size_t num_users;
-	user_t **users = (user_t **) get_values(room->users, &num_users);
+	user_t **users;
+
+	broadcast_flush(room);
+	presence_flush(room);
 
+	users = (user_t **) get_values(room->users, &num_users);
 	for(i = 0; i < num_users; i++)
-		send_buffer(packet, get_socket(users[i]));
+		user_send(users[i], packet);
 
 	free(users);
 }
@@ -111,8 +208,26 @@ void room_packet(room_t *room, packet_buffer_t *packet)
 /* Set a new topic to the room.  A server message should be broadcast when this occurs. */
 void room_set_topic(room_t *room, char *new_topic)
 {
-	strncpy(room->topic, new_topic, MAX_TOPIC_LENGTH - 1);
-	new_topic[MAX_TOPIC_LENGTH - 1] = '\0';
+	size_t length = strlen(new_topic);
+
+	if(length > MAX_TOPIC_LENGTH - 1)
+		length = MAX_TOPIC_LENGTH - 1;
+
+	free(room->topic);
+	room->topic = malloc(length + 1);
+	memcpy(room->topic, new_topic, length);
+	room->topic[length] = '\0';
+}
+
+/* Set the most milliseconds that chat is held back when the room is busy */
+void room_set_batch_window(room_t *room, uint16_t window)
+{
+	room->batch_window = window;
+}
+/* Get the most milliseconds that chat is held back when the room is busy */
+uint16_t room_get_batch_window(room_t *room)
+{
+	return room->batch_window;
 }
 
 /* Get the number of users in the room */
@@ -128,31 +243,48 @@ user_t **room_get_users(room_t *room, size_t *count)
 	return (user_t **) get_values(room->users, count);
 }
 
-/* This will send the list of users who are currently in the room to the specified socket
- * as a series of "EID_USER_IN_CHANNEL" packets */
-void room_send_users_in_channel(room_t *room, int s)
+/* Get the SID_ROOM_LIST of the users in the room.  It's only encoded again if somebody has
+ * joined or left since the last time.  The packet belongs to the room. */
+packet_buffer_t *room_get_user_list(room_t *room)
 {
 	size_t i;
 	size_t num_users;
-	user_t **users = (user_t **) get_values(room->users, &num_users);
-	packet_buffer_t *packet;
+	user_t **users;
+	char **names;
 
-	for(i = 0; i < num_users; i++)
+	if(room->user_list == NULL)
 	{
-		/* (uint32_t) subtype -- the subtype of the event
-		 * (ntstring) username  -- The username of the person who caused the event, if 
-		 *  applicable
-		 * (ntstring) text -- The text of the event, if applicable */
-		packet = create_buffer(SID_CHATEVENT);
-
-		add_int32(packet, EID_USER_IN_CHANNEL);
-		add_ntstring(packet, get_username(users[i]));
-		add_ntstring(packet, "");
-
-		send_buffer(packet, s);
-		destroy_buffer(packet);
+		users = (user_t **) get_values(room->users, &num_users);
+		names = malloc((num_users ? num_users : 1) * sizeof(char *));
+		assert(names); /* Out of memory */
+
+		for(i = 0; i < num_users; i++)
+			names[i] = get_username(users[i]);
+		room->user_list = room_encode_name_list(names, num_users);
+
+		free(names);
+		free(users);
 	}
 
-	free(users);
+	return room->user_list;
 }
 
+/* Encode a SID_ROOM_LIST with the given names.  If they don't all fit in one packet, the
+ * ones at the end are left out.  It has to be destroyed. */
+packet_buffer_t *room_encode_name_list(char **names, size_t count)
+{
+	room_list_packet_t list;
+	size_t size = 1;
+	size_t i;
+
+	/* Count how many fit, leaving room for the header and the blank name at the end */
+	for(i = 0; i < count && size + strlen(names[i]) + 1 <= MAX_PACKET - 4; i++)
+		size += strlen(names[i]) + 1;
+
+	list.names = names;
+	list.names_count = i;
+
+	return encode_room_list(&list);
+}
+
+
@@ -9,6 +9,7 @@
 #define _ROOM_H_
 
 #include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/select.h>
@@ -23,15 +24,58 @@
 #include "table.h"
 #include "user.h"
 
-typedef struct
+/* The pending joins and leaves are defined in presence.c, and the pending chat in
+ * broadcast.c */
+struct _presence_t;
+struct _broadcast_t;
+
+typedef struct _room_t
 {
 	/* Each element in this list is a user_t */
 	table_t *users;
 
-	/* The name of the channel.  This is set when it's created, then never changed */
-	char name[MAX_ROOM_LENGTH];
-	/* The topic of the channel.  This can be changed at any time by anybody */
-	char topic[MAX_TOPIC_LENGTH];
+	/* The number of references held to this room.  The room table holds one, and every
+	 * user in the room holds one (through user_t's room pointer). */
+	int references;
+
+	/* Where the room sits in the room directory, and when it last became empty.  These
+	 * are looked after by the room_directory module. */
+	size_t directory_index;
+	time_t empty_since;
+
+	/* The name of the channel.  This is set when it's created, then never changed.  It's
+	 * interned (see intern.h), so it's shared with the room directory. */
+	char *name;
+	/* The topic of the channel.  This can be changed at any time by anybody.  Most rooms 
+	 * never get one, so it's only allocated when it's set; NULL means "No topic". */
+	char *topic;
+
+	/* The SID_ROOM_LIST of the users in the room, encoded the last time somebody asked for
+	 * it, or NULL if somebody has joined or left since then */
+	packet_buffer_t *user_list;
+
+	/* The joins and leaves that haven't been sent out yet, or NULL if there aren't any.  This
+	 * is looked after by the presence module. */
+	struct _presence_t *presence;
+
+	/* The chat that hasn't been sent out yet, or NULL if there isn't any.  This is looked
+	 * after by the broadcast module. */
+	struct _broadcast_t *broadcast;
+
+	/* The most milliseconds that chat is held back, so it can be sent in batches, when the
+	 * room is busy (see broadcast.h) */
+	uint16_t batch_window;
+	/* How busy the room is: the number of messages in the last second, and so far in this
+	 * one */
+	time_t rate_second;
+	uint32_t last_rate;
+	uint32_t current_rate;
+
+	/* The worker that sends the room's chat, and how much it's sent for the room lately.
+	 * These are looked after by the worker module (see worker.h). */
+	size_t worker;
+	size_t load;
+	size_t load_period;
 
 } room_t;
 
@@ -46,37 +90,64 @@ typedef enum
 } room_error_codes_t;
 
 
-/* Create a new room instance with no users, the specified name, and a blank topic */
+/* Create a new room instance with no users, the specified name, and a blank topic.  The 
+ * caller owns the first reference to it.  Rooms come from a slab (see slab.h). */
 room_t *room_create(char *name);
-/* Destroy the room instance */
+/* Destroy the room instance.  Normally, room_release() should be used instead */
 void room_destroy(room_t *room);
 
+/* Take another reference to the room */
+room_t *room_hold(room_t *room);
+/* Give up a reference to the room.  When the last one is released, the room is destroyed, but
+ * not until no other thread can still be looking at it (see epoch.h) */
+void room_release(room_t *room);
+
 /* Get the name */
 char *room_get_name(room_t *room);
 /* Get the topic */
 char *room_get_topic(room_t *room);
 
 /* Add a user to the room.  The given user should already be authenticated, and has 
- * requested to join this room.  This will automatically trigger a server message. */
+ * requested to join this room, and shouldn't be in any other room.  The user's room 
+ * pointer is set, and holds a reference to the room.  The join is announced a moment later
+ * (see presence.h). */
 void room_add_user(room_t *room, user_t *user);
-/* Remove the specified user from the room.  This will automatically trigger a server
- * message */
+/* Put a user back in the room after they've been handed off from an old server (see
+ * handoff.h).  It's the same as room_add_user(), except it isn't announced, since everybody
+ * already knows they're there. */
+void room_restore_user(room_t *room, user_t *user);
+/* Remove the specified user from the room.  The user's room pointer is cleared, and its
+ * reference to the room is released.  The leave is announced a moment later (see
+ * presence.h). */
 void room_remove_user(room_t *room, user_t *user);
-/* Send a message to everybody in the room */
+/* Send a message to everybody in the room.  "from" has to be interned (see
+ * chatevent_begin()), and the message can't be a name (so it can't be EID_CHANNEL).  It's
+ * held back for a moment, so it can go out in a batch with the messages around it (see
+ * broadcast.h).  Any joins and leaves that are waiting are sent first, so nobody hears from
+ * somebody they haven't been told is there. */
 void room_message(room_t *room, uint32_t message_subtype, char *from, char *message);
-/* Send a packet to everybody in the room */
+/* Send a packet to everybody in the room, right away.  Any messages, joins and leaves that
+ * are waiting go first. */
 void room_packet(room_t *room, packet_buffer_t *packet);
 /* Set a new topic to the room.  This will automatically broadcast a server message */
 void room_set_topic(room_t *room, char *new_topic);
+/* Set the most milliseconds that chat is held back when the room is busy, or get it */
+void room_set_batch_window(room_t *room, uint16_t window);
+uint16_t room_get_batch_window(room_t *room);
 /* Get the number of users in the room */
 size_t room_get_count(room_t *room);
 
 /* Get the list of users who are currently in the channel.  It has to be freed. */
 user_t **room_get_users(room_t *room, size_t *count);
 
-/* This will send the list of users who are currently in the room to the specified socket
- * as a series of "EID_USER_IN_CHANNEL" packets */
-void room_send_users_in_channel(room_t *room, int s);
+/* Get the SID_ROOM_LIST of the users in the room.  It's only encoded again if somebody has
+ * joined or left since the last time, so it's cheap to ask for over and over.  The packet
+ * belongs to the room, so it must NOT be destroyed or modified, and it's only good until the
+ * next time somebody joins or leaves. */
+packet_buffer_t *room_get_user_list(room_t *room);
+/* Encode a SID_ROOM_LIST with the given names.  If they don't all fit in one packet, the
+ * ones at the end are left out.  It has to be destroyed. */
+packet_buffer_t *room_encode_name_list(char **names, size_t count);
 
 
 #endif
@@ -0,0 +1,220 @@
+/* room_directory */
+/* This module keeps track of every room on the server.  Rooms are created when somebody
+ * joins a room that doesn't exist yet.  When the last user leaves a room, it's kept
+ * around for a short grace period (so somebody who is just switching back and forth
+ * doesn't lose the topic), then it's reclaimed.
+ *
+ * Live rooms (rooms with at least one user) are kept in a compact array, so listing them
+ * is proportional to the number of rooms that actually have somebody in them. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "output.h"
+#include "packet_buffer.h"
+#include "room.h"
+#include "table.h"
+
+#include "room_directory.h"
+
+/* The starting size of the room arrays; they double when they run out of space */
+#define STARTING_ROOMS 16
+
+/* Every room that hasn't been reclaimed yet, by name.  The directory's reference to each
+ * room is the one that room_create() returned. */
+static table_t *rooms_by_name;
+
+/* The rooms with at least one user in them.  Each room knows its own position in this
+ * array, so it can be removed without searching. */
+static room_t **live_rooms;
+static size_t live_count;
+static size_t live_size;
+
+/* The SID_ROOM_LIST of the live rooms, encoded the last time somebody asked for it, or NULL
+ * if the live rooms have changed since then */
+static packet_buffer_t *room_list;
+
+/* The rooms that are empty and waiting out their grace period */
+static room_t **empty_rooms;
+static size_t empty_count;
+static size_t empty_size;
+
+/* Add a room to the end of one of the arrays, growing it if necessary */
+static void array_add(room_t ***array, size_t *count, size_t *size, room_t *room)
+{
+	if(*count == *size)
+	{
+		*size = *size ? *size << 1 : STARTING_ROOMS;
+		*array = realloc(*array, *size * sizeof(room_t *));
+		assert(*array); /* Out of memory */
+	}
+
+	room->directory_index = *count;
+	(*array)[(*count)++] = room;
+}
+
+/* Remove a room from one of the arrays.  The last room is moved into its place, so this
+ * doesn't change the order of anything except that one room. */
+static void array_remove(room_t **array, size_t *count, room_t *room)
+{
+	size_t index = room->directory_index;
+
+	assert(index < *count && array[index] == room);
+
+	(*count)--;
+	array[index] = array[*count];
+	array[index]->directory_index = index;
+}
+
+/* Set up the (empty) directory.  This has to be called before any rooms are created. */
+void room_directory_initialize()
+{
+	rooms_by_name = table_create();
+
+	live_rooms = NULL;
+	live_count = 0;
+	live_size = 0;
+	room_list = NULL;
+
+	empty_rooms = NULL;
+	empty_count = 0;
+	empty_size = 0;
+}
+
+/* Find a room by name.  This may return a room that's empty and waiting to be reclaimed;
+ * joining it will bring it back.  Returns NULL if the room doesn't exist. */
+room_t *room_directory_find(char *name)
+{
+	return table_find(rooms_by_name, name);
+}
+
+/* Create a new room and add it to the directory.  The room starts out empty, and will be
+ * reclaimed if nobody joins it within the grace period. */
+room_t *room_directory_create(char *name)
+{
+	room_t *room = room_create(name);
+
+	table_add(rooms_by_name, room_get_name(room), room);
+
+	room->empty_since = time(NULL);
+	array_add(&empty_rooms, &empty_count, &empty_size, room);
+
+	return room;
+}
+
+/* Get the list of rooms that have at least one user in them.  The number of rooms is
+ * returned in count.  It has to be freed. */
+room_t **room_directory_get_live(size_t *count)
+{
+	room_t **ret = malloc(live_count * sizeof(room_t *));
+
+	memcpy(ret, live_rooms, live_count * sizeof(room_t *));
+	*count = live_count;
+
+	return ret;
+}
+
+/* Get every room that hasn't been reclaimed yet: the live ones, then the empty ones.  It has
+ * to be freed. */
+room_t **room_directory_get_all(size_t *count)
+{
+	room_t **ret = malloc((live_count + empty_count ? live_count + empty_count : 1) * sizeof(room_t *));
+
+	assert(ret); /* Out of memory */
+	memcpy(ret, live_rooms, live_count * sizeof(room_t *));
+	memcpy(ret + live_count, empty_rooms, empty_count * sizeof(room_t *));
+	*count = live_count + empty_count;
+
+	return ret;
+}
+
+/* Get the SID_ROOM_LIST of the rooms that have at least one user in them.  It's only encoded
+ * again when a room gains its first user or loses its last one.  The packet belongs to the
+ * directory. */
+packet_buffer_t *room_directory_get_room_list()
+{
+	size_t i;
+	char **names;
+
+	if(room_list == NULL)
+	{
+		names = malloc((live_count ? live_count : 1) * sizeof(char *));
+		assert(names); /* Out of memory */
+
+		for(i = 0; i < live_count; i++)
+			names[i] = room_get_name(live_rooms[i]);
+		room_list = room_encode_name_list(names, live_count);
+
+		free(names);
+	}
+
+	return room_list;
+}
+
+/* Throw away the encoded list of live rooms, since it changed */
+static void forget_room_list()
+{
+	if(room_list)
+	{
+		destroy_buffer(room_list);
+		room_list = NULL;
+	}
+}
+
+/* Get the number of rooms that have at least one user in them */
+size_t room_directory_get_live_count()
+{
+	return live_count;
+}
+
+/* These are called by the room module when a room gains its first user, or loses its
+ * last one.  They shouldn't be needed anywhere else. */
+void room_directory_room_occupied(room_t *room)
+{
+	array_remove(empty_rooms, &empty_count, room);
+	array_add(&live_rooms, &live_count, &live_size, room);
+	forget_room_list();
+}
+void room_directory_room_emptied(room_t *room)
+{
+	array_remove(live_rooms, &live_count, room);
+	forget_room_list();
+
+	room->empty_since = time(NULL);
+	array_add(&empty_rooms, &empty_count, &empty_size, room);
+}
+
+/* Keep an empty room until the given time.  It's reclaimed once it's been empty for the
+ * grace period, so it's treated as if it became empty that long before then. */
+void room_directory_keep_empty(room_t *room, time_t until)
+{
+	if(room_get_count(room) == 0)
+		room->empty_since = until - ROOM_GRACE_PERIOD;
+}
+
+/* Reclaim every room that's been empty for longer than the grace period.  This should
+ * be called regularly; it only looks at the empty rooms. */
+void room_directory_reap(time_t now)
+{
+	size_t i;
+	room_t *room;
+
+	/* Go backwards, so the room that array_remove() moves into the hole has already
+	 * been looked at */
+	for(i = empty_count; i > 0; i--)
+	{
+		room = empty_rooms[i - 1];
+
+		if(now - room->empty_since >= ROOM_GRACE_PERIOD)
+		{
+			display_message(ERROR_NOTICE, "Reclaiming empty channel '%s'", room_get_name(room));
+
+			array_remove(empty_rooms, &empty_count, room);
+			table_remove(rooms_by_name, room_get_name(room));
+			room_release(room);
+		}
+	}
+}
+
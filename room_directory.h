@@ -0,0 +1,60 @@
+/* room_directory */
+/* This module keeps track of every room on the server.  Rooms are created when somebody
+ * joins a room that doesn't exist yet.  When the last user leaves a room, it's kept
+ * around for a short grace period (so somebody who is just switching back and forth
+ * doesn't lose the topic), then it's reclaimed.
+ *
+ * Live rooms (rooms with at least one user) are kept in a compact array, so listing them
+ * is proportional to the number of rooms that actually have somebody in them. */
+
+#ifndef _ROOM_DIRECTORY_H_
+#define _ROOM_DIRECTORY_H_
+
+#include <time.h>
+
+#include "room.h"
+
+/* The number of seconds that an empty room is kept before it's reclaimed */
+#define ROOM_GRACE_PERIOD 30
+
+/* Set up the (empty) directory.  This has to be called before any rooms are created. */
+void room_directory_initialize();
+
+/* Find a room by name.  This may return a room that's empty and waiting to be reclaimed;
+ * joining it will bring it back.  Returns NULL if the room doesn't exist. */
+room_t *room_directory_find(char *name);
+/* Create a new room and add it to the directory.  The room starts out empty, and will be
+ * reclaimed if nobody joins it within the grace period. */
+room_t *room_directory_create(char *name);
+
+/* Get the list of rooms that have at least one user in them.  The number of rooms is
+ * returned in count.  It has to be freed. */
+room_t **room_directory_get_live(size_t *count);
+/* Get every room that hasn't been reclaimed yet, including the empty ones that are waiting
+ * out their grace period, live ones first.  The number of rooms is returned in count.  It has
+ * to be freed. */
+room_t **room_directory_get_all(size_t *count);
+/* Get the SID_ROOM_LIST of the rooms that have at least one user in them.  It's only encoded
+ * again when a room gains its first user or loses its last one, so it's cheap to ask for
+ * over and over.  The packet belongs to the directory, so it must NOT be destroyed or
+ * modified, and it's only good until the next time the list changes. */
+packet_buffer_t *room_directory_get_room_list();
+/* Get the number of rooms that have at least one user in them */
+size_t room_directory_get_live_count();
+
+/* These are called by the room module when a room gains its first user, or loses its
+ * last one.  They shouldn't be needed anywhere else. */
+void room_directory_room_occupied(room_t *room);
+void room_directory_room_emptied(room_t *room);
+
+/* Keep an empty room until the given time, instead of just for the grace period.  This is
+ * for rooms that are expected to fill up again soon (see snapshot.h).  If it's not empty,
+ * nothing happens. */
+void room_directory_keep_empty(room_t *room, time_t until);
+
+/* Reclaim every room that's been empty for longer than the grace period.  This should
+ * be called regularly; it only looks at the empty rooms. */
+void room_directory_reap(time_t now);
+
+#endif
+
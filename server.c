@@ -12,6 +12,7 @@
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
@@ -25,40 +26,70 @@
 
 #include <netinet/in.h>
 
+#include "broadcast.h"
+#include "compression.h"
+#include "datagram.h"
+#include "epoch.h"
+#include "federation.h"
+#include "handoff.h"
 #include "list.h"
+#include "outbox.h"
 #include "output.h"
 #include "packet_buffer.h"
+#include "presence.h"
+#include "protocol.h"
 #include "room.h"
+#include "room_directory.h"
+#include "snapshot.h"
+#include "tls.h"
+#include "token.h"
 #include "types.h"
 #include "user.h"
+#include "user_directory.h"
+#include "worker.h"
 
 #define KEEPALIVE 60
 
 #define INPUT_LENGTH 1024
 
+/* The number of times a client's stream can get out of sync before they're disconnected.  A 
+ * real client should never do it at all, so this is only here to be forgiving of bugs. */
+#define MAX_RESYNCS 3
+
 /* A list of users that haven't entered a channel yet.  Each element of this list is a user_t object. */
 static list_t *new_users;
 
-/* A list of all users on the server.  This is used for checking if somebody is already logged in.  A
-   user is added to this list and removed from new_users as soon as he authenticates.  The 
-   intersection of new_users and old_users is empty, and their union is all connected users in any
-   state. */
-static table_t *old_users;
-
-/* The table of server rooms.  Each element in this list is a room_t. */
-static table_t *rooms;
+/* Everybody who's logged in is in the user directory (see user_directory.h).  A user is added to it
+   and removed from new_users as soon as he authenticates.  Nobody is in both, and between them they
+   have all connected users in any state. */
 
 /* The socket that listens for connections.  This is module-level so I can close it when a signal 
  * is caught */
 static int listen_socket;
 
+/* The socket that answers room list requests over UDP, on the same port (see datagram.h) */
+static int datagram_socket;
+
+/* The Unix socket a new server connects to when it's taking over (see handoff.h), or -1 if
+ * it couldn't be opened */
+static int handoff_socket = -1;
+
 static struct timeval select_timeout;
 
+/* The signal that told the server to exit, or 0 if none has yet.  The handler only sets this;
+ * the main loop notices it and does the actual exiting (see die_gracefully()). */
+static volatile sig_atomic_t caught_signal = 0;
+
+/* The handler also writes a byte to this pipe, which select() watches, so a signal that
+ * arrives just before select() is called still wakes it up right away */
+static int signal_pipe[2] = { -1, -1 };
+
 
 
 void open_socket(int port)
 {
 	struct sockaddr_in serv_addr;
+	int reuse = 1;
 
 	/* Get the server address */
 	memset((char *) &serv_addr, '\0', sizeof(serv_addr));
@@ -69,6 +100,10 @@ void open_socket(int port)
 	/* Create a socket */
 	listen_socket = socket(AF_INET, SOCK_STREAM, 0);
 
+	/* Let it be opened again right after a restart, while the old connections are still
+	 * winding down; otherwise, the port's tied up for a minute or so */
+	setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
 	/* Bind the socket */
 	if (bind(listen_socket, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
 		display_error(ERROR_EMERGENCY, "Error binding socket [%s]", strerror(errno));
@@ -77,42 +112,141 @@ void open_socket(int port)
 	listen(listen_socket, 20);
 }
 
+/* Send an encoded packet to the user (compressed, if they asked for it), then destroy it */
+static void send_and_destroy(user_t *user, packet_buffer_t *packet)
+{
+	user_send(user, packet);
+	destroy_buffer(packet);
+}
+
 /* Send out an error packet to the specified user, with the specified error text. */
 static void send_error(user_t *user, char *error_text)
 {
-	packet_buffer_t *packet = create_buffer(SID_ERROR);
-
-	add_ntstring(packet, error_text);
+	error_message_packet_t error;
 
-	send_buffer(packet, get_socket(user));
-	destroy_buffer(packet);
+	error.description = error_text;
+	send_and_destroy(user, encode_error_message(&error));
 }
 
 /* Send a chat-style message to a particular user.  This can be a whisper, error, info, etc.
- * Returns FALSE if it fails (user wasn't found) */
+ * "from" has to be interned (see chatevent_begin()).  Returns FALSE if it fails (user wasn't
+ * found) */
 static BOOLEAN send_chat(chatevent_subtype_t subtype, char *to, char *from, char *message)
 {
 	user_t *user;
-	packet_buffer_t *packet;
+	outgoing_chatevent_t event;
 
-	user = table_find(old_users, to);
+	user = user_directory_find(to);
 	if(user == NULL)
 		return FALSE;
 
-	/* (uint32_t) subtype -- the subtype of the event
-	 * (ntstring) username  -- The username of the person who caused the event, if 
-	 *  applicable
-	 * (ntstring) text -- The text of the event, if applicable */
-	packet = create_buffer(SID_CHATEVENT);
+	chatevent_begin(&event, subtype, from, message);
+	user_send_chatevent(user, &event);
+	chatevent_end(&event);
 
-	add_int32(packet, subtype);
-	add_ntstring(packet, from);
-	add_ntstring(packet, message);
+	return TRUE;	
+}
 
-	send_buffer(packet, get_socket(user));
-	destroy_buffer(packet);
+/* Close somebody's connection for good.  They have to be out of the directory and their room
+ * already.  They might still be in the lists that do_select() is going through, so they're
+ * marked DEAD, which it skips, and they're only freed once nothing can still be looking at
+ * them (see epoch.h). */
+static void close_user(user_t *user)
+{
+	set_user_state(user, DEAD);
+	tls_close(get_socket(user));
+	close(get_socket(user));
+	user_retire(user);
+}
 
-	return TRUE;	
+/* Disconnect somebody who's logged in, right away.  They're taken out of the directory and
+ * their room, and their connection is closed. */
+static void kick_user(user_t *user)
+{
+	room_t *room = get_current_room(user);
+
+	if(room)
+		room_remove_user(room, user);
+	user_directory_remove(get_username(user), user);
+
+	close_user(user);
+}
+
+/* Somebody's connection closed.  If they were logged in, they're taken out of the directory
+ * and their room (so nobody tries to talk to the closed socket), and the other servers are
+ * told they're gone; then the connection's closed for good. */
+static void disconnect_user(user_t *user)
+{
+	room_t *room;
+
+	if(user_directory_remove(get_username(user), user))
+	{
+		room = get_current_room(user);
+		if(room)
+			room_remove_user(room, user);
+
+		federation_logged_out(user);
+	}
+
+	close_user(user);
+}
+
+/* A list that's on its way to somebody as a few long EID_INFO lines, rather than one line for
+ * each thing in it.  A line of a few names is too small to be worth compressing (see
+ * compression.h), but a line of dozens is, and each one goes in with everything before it
+ * as the dictionary. */
+typedef struct
+{
+	user_t *user;
+	char line[INPUT_LENGTH];
+	size_t length;
+	BOOLEAN titled; /* The line holds the title and nothing after it yet */
+} info_list_t;
+
+/* Start a list for the user.  The title goes at the start of the first line. */
+static void info_list_begin(info_list_t *list, user_t *user, char *title)
+{
+	list->user = user;
+	list->titled = TRUE;
+
+	strncpy(list->line, title, INPUT_LENGTH - 1);
+	list->line[INPUT_LENGTH - 1] = '\0';
+	list->length = strlen(list->line);
+}
+/* Send the line so far, and start a new one */
+static void info_list_flush(info_list_t *list)
+{
+	send_chat(EID_INFO, get_username(list->user), get_username(list->user), list->line);
+	list->line[0] = '\0';
+	list->length = 0;
+	list->titled = FALSE;
+}
+/* Add something to the list.  It goes on the current line if it fits, or starts a new one. */
+static void info_list_add(info_list_t *list, char *item)
+{
+	size_t length = strlen(item);
+
+	/* Two bytes for the ", " (or the ": " after the title) */
+	if(list->length > 0 && list->length + 2 + length > INPUT_LENGTH - 1)
+		info_list_flush(list);
+
+	if(list->length > 0)
+	{
+		strcpy(list->line + list->length, list->titled ? ": " : ", ");
+		list->length += 2;
+	}
+	if(length > INPUT_LENGTH - 1 - list->length)
+		length = INPUT_LENGTH - 1 - list->length;
+	memcpy(list->line + list->length, item, length);
+	list->length += length;
+	list->line[list->length] = '\0';
+	list->titled = FALSE;
+}
+/* Send whatever's left of the list */
+static void info_list_end(info_list_t *list)
+{
+	if(list->length > 0)
+		info_list_flush(list);
 }
 
 /* Triggered by /rooms or /channels */
@@ -122,6 +256,7 @@ void process_command_rooms(user_t *user, char *param)
 	room_t **room_list;
 	size_t num_rooms;
 	char buffer[INPUT_LENGTH];
+	info_list_t list;
 
 	if(strlen(param) > 0)
 	{
@@ -129,18 +264,20 @@ void process_command_rooms(user_t *user, char *param)
 	}
 	else
 	{
-		room_list = (room_t **) get_values(rooms, &num_rooms);
+		/* Only rooms with somebody in them are in this list */
+		room_list = room_directory_get_live(&num_rooms);
 		
-		send_chat(EID_INFO, get_username(user), get_username(user), "Here is the list of channels");
+		info_list_begin(&list, user, "Here is the list of channels");
 
 		for(i = 0; i < num_rooms; i++)
 		{
-			if(room_get_count(room_list[i]) > 0)
-			{
-				snprintf(buffer, INPUT_LENGTH - 1, "%s <%d users>", room_get_name(room_list[i]), room_get_count(room_list[i]));
-				send_chat(EID_INFO, get_username(user), get_username(user), buffer);
-			}
+			snprintf(buffer, INPUT_LENGTH - 1, "%s <%d users>", room_get_name(room_list[i]), (int) room_get_count(room_list[i]));
+			info_list_add(&list, buffer);
 		}
+
+		info_list_end(&list);
+
+		free(room_list);
 	}
 		
 }
@@ -153,6 +290,7 @@ void process_command_who(user_t *user, char *param)
 	user_t **users;
 	size_t user_count;
 	char buffer[INPUT_LENGTH];
+	info_list_t list;
 
 	if(strlen(param) == 0)
 	{
@@ -162,9 +300,10 @@ void process_command_who(user_t *user, char *param)
 	else
 	{
 		/* Find the target room */
-		target = table_find(rooms, param);
-		/* Make sure the room exists */
-		if(target == NULL)
+		target = room_directory_find(param);
+		/* Make sure the room exists.  An empty room is only waiting to be reclaimed, so it
+		 * doesn't count. */
+		if(target == NULL || room_get_count(target) == 0)
 		{
 			send_chat(EID_ERROR, get_username(user), get_username(user), "Room not found.  If you were searching for a user, not a room, please use /whois <username>");
 		}
@@ -173,25 +312,17 @@ void process_command_who(user_t *user, char *param)
 			/* Get the list of users for the room */
 			users = room_get_users(target, &user_count);
 
-			if(user_count == 0)
+			/* Display the list */
+			snprintf(buffer, INPUT_LENGTH - 1, "Users in room %s", param);
+			info_list_begin(&list, user, buffer);
+
+			for(i = 0; i < user_count; i++)
 			{
-				/* This is a bit of a workaround; if the room has 0 users, that means that somebody at some point
-				 * entered it, but they've since left it and it's empty.  Treat it as if it doesn't exist. */
-				send_chat(EID_ERROR, get_username(user), get_username(user), "Room not found.  If you were searching for a user, not a room, please use /whois <username>");
+				snprintf(buffer, INPUT_LENGTH - 1, "%s <%s>", get_username(users[i]), get_ip(users[i]));
+				info_list_add(&list, buffer);
 			}
-			else
-			{
-				/* Display the list */
-				snprintf(buffer, INPUT_LENGTH - 1, "Users in room %s:", param);
-				send_chat(EID_INFO, get_username(user), get_username(user), buffer);
 
-				for(i = 0; i < user_count; i++)
-				{
-					snprintf(buffer, INPUT_LENGTH - 1, "%s <%s>", get_username(users[i]), get_ip(users[i]));
-					send_chat(EID_INFO, get_username(user), get_username(user), buffer);
-				}
-				
-			}
+			info_list_end(&list);
 
 			free(users);
 		}
@@ -210,7 +341,10 @@ void process_command_finger(user_t *user, char *param)
 	}
 	else
 	{
-		target = table_find(old_users, param);
+		target = user_directory_find(param);
+		/* They might be on another server */
+		if(target == NULL)
+			target = federation_find_user(param);
 
 		if(target == NULL)
 		{
@@ -224,13 +358,48 @@ void process_command_finger(user_t *user, char *param)
 	}
 }
 
+/* Triggered by /batch */
+void process_command_batch(user_t *user, char *param)
+{
+	room_t *room = get_current_room(user);
+	char buffer[INPUT_LENGTH];
+	int window;
+
+	if(room == NULL)
+	{
+		send_chat(EID_ERROR, get_username(user), get_username(user), "You have to be in a room to use /batch");
+	}
+	else if(strlen(param) == 0)
+	{
+		snprintf(buffer, INPUT_LENGTH - 1, "When it's busy, chat in %s is held back for up to %d milliseconds", room_get_name(room), (int) room_get_batch_window(room));
+		send_chat(EID_INFO, get_username(user), get_username(user), buffer);
+	}
+	else
+	{
+		window = atoi(param);
+		if(window < 0 || window > BROADCAST_MAX_WINDOW)
+		{
+			snprintf(buffer, INPUT_LENGTH - 1, "Usage: /batch [milliseconds], from 0 to %d", BROADCAST_MAX_WINDOW);
+			send_chat(EID_ERROR, get_username(user), get_username(user), buffer);
+		}
+		else
+		{
+			room_set_batch_window(room, window);
+			federation_room_changed(room);
+			snprintf(buffer, INPUT_LENGTH - 1, "When it's busy, chat in %s will be held back for up to %d milliseconds", room_get_name(room), window);
+			send_chat(EID_INFO, get_username(user), get_username(user), buffer);
+			display_message(ERROR_NOTICE, "User %s set the batch window in '%s' to %dms", get_username(user), room_get_name(room), window);
+		}
+	}
+}
+
 /* Triggered by either /help, /h, /?*/
 void process_command_help(user_t *user, char *param)
 {
 	if(strlen(param) == 0)
 	{
 		send_chat(EID_INFO, get_username(user), get_username(user), "Here is a list of some of the commands, maybe all:");
-		send_chat(EID_INFO, get_username(user), get_username(user), "/help, /w, /join, /rooms, /who, /finger");
+		send_chat(EID_INFO, get_username(user), get_username(user), "/help, /w, /join, /rooms, /who, /finger, /batch");
 	}
 	else if(!strcasecmp(param, "help") || !strcasecmp(param, "h") || !strcasecmp(param, "?"))
 	{
@@ -274,6 +443,13 @@ void process_command_help(user_t *user, char *param)
 		send_chat(EID_INFO, get_username(user), get_username(user), "Aliases: /rooms, /channels");
 		send_chat(EID_INFO, get_username(user), get_username(user), "Lists all rooms, and the number of users in each of them.");
 	}
+	else if (!strcasecmp(param, "batch"))
+	{
+		send_chat(EID_INFO, get_username(user), get_username(user), "Command: batch");
+		send_chat(EID_INFO, get_username(user), get_username(user), "Usage: /batch [milliseconds]");
+		send_chat(EID_INFO, get_username(user), get_username(user), "Aliases: /batch");
+		send_chat(EID_INFO, get_username(user), get_username(user), "When your channel is busy, chat is held back for a moment, so it can be sent in bigger batches.  This sets the longest it's held back, or, with no parameter, displays it.  The busier the channel, the closer it comes to the longest; a quiet channel isn't held back at all.");
+	}
 /* Triggered by /who, /list */
 /* Triggered by /finger, /whois, or /whereis */
 }
@@ -294,8 +470,14 @@ void process_command_w(user_t *user, char *param)
 	{
 		*message++ = '\0';
 
-		to = table_find(old_users, param);
-		if(to == NULL)
+		to = user_directory_find(param);
+		if(to == NULL && (to = federation_find_user(param)) != NULL)
+		{
+			/* Their own server tells them */
+			federation_whisper(to, get_username(user), message);
+			send_chat(EID_WHISPERTO,   get_username(user), get_username(to),   message);
+		}
+		else if(to == NULL)
 		{
 			send_chat(EID_ERROR, get_username(user), get_username(user), "User not logged on");
 		}
@@ -311,8 +493,7 @@ void process_command_w(user_t *user, char *param)
 /* TODO: Add the command required by the assignment */
 void process_command_join(user_t *user, char *param)
 {
-	char *old_room_name;
-	room_t *old_room = NULL;
+	room_t *old_room;
 	room_t *room;
 
 	if(!strcasecmp(param, "backstage"))
@@ -333,16 +514,11 @@ void process_command_join(user_t *user, char *param)
 	else
 	{
 		/* Get the old room */
-		old_room_name = get_user_room(user);
-		if(old_room_name)
-			old_room = table_find(rooms, old_room_name);
+		old_room = get_current_room(user);
 
-		/* Leave the old room */
+		/* Leave the old room (the people there hear about it a moment later; see presence.h) */
 		if(old_room)
-		{
 			room_remove_user(old_room, user);
-			room_message(old_room, EID_USER_LEAVE_CHANNEL, get_username(user), "");
-		}
 
 		/* Check if they're leaving chat */
 		if(strlen(param) == 0)
@@ -357,63 +533,65 @@ void process_command_join(user_t *user, char *param)
 
 			/* Set their state back to no channel (I don't think this is necessary, but whatever) */
 			set_user_state(user, NOT_IN_CHANNEL);
-
-			/* Move the user out of all rooms, officially */
-			set_user_room(user, NULL);
-
 		}
 		else
 		{
 			/* Find the room in the room table */
-			room = table_find(rooms, param);
+			room = room_directory_find(param);
 			/* If the room doesn't already exist, create it and add it to the list */
 			if(room == NULL)
 			{
 				send_chat(EID_INFO, get_username(user), get_username(user), "Creating new channel for you");
 				display_message(ERROR_NOTICE, "Channel didn't exist, creating");
-				room = room_create(param);
-				table_add(rooms, param, room);
+				room = room_directory_create(param);
 
 			}
 	
 		
 			/* Respond with success */
-			send_chat(EID_CHANNEL, get_username(user), get_username(user), param);
+			send_chat(EID_CHANNEL, get_username(user), get_username(user), room_get_name(room));
 	
 			/* Notify the server */
 			display_message(ERROR_NOTICE, "User %s successfully joined channel '%s'", get_username(user), param);
 	
-			/* Send the list of users in the channel */
-			room_send_users_in_channel(room, get_socket(user));
-	
-			/* Add the user to the room officially */
+			/* Add the user to the room officially.  They get the list of users in the room,
+			 * and everybody else hears about them, a moment later (see presence.h). */
 			set_user_state(user, JOINED_CHANNEL);
-			set_user_room(user, param);
-
 			room_add_user(room, user);
-			room_message(room, EID_USER_JOIN_CHANNEL, get_username(user), "");
 		}
+
+		/* The other servers put them in the same room */
+		federation_joined(user);
 	} 
 }
 
-void process_SID_REQUEST_ROOM_LIST(user_t *user, packet_buffer_t *packet)
+/* This can be sent in any state.  A blank room name asks for the list of rooms; otherwise,
+ * it's the list of users in that room.  Both lists are kept encoded, and only change when
+ * somebody joins or leaves, so answering is just a send. */
+void process_SID_REQUEST_ROOM_LIST(user_t *user, request_room_list_packet_t *packet)
 {
-	send_error(user, "SID_REQUEST_ROOM_LIST Not implemented yet..");
-}
+	room_t *room;
 
-void process_SID_NULL(user_t *user, packet_buffer_t *packet)
-{
+	if(*packet->room_name == '\0')
+	{
+		user_send(user, room_directory_get_room_list());
+	}
+	else
+	{
+		room = room_directory_find(packet->room_name);
+
+		/* An empty room is only waiting to be reclaimed, so it gets an empty list, the same
+		 * as a room that doesn't exist */
+		if(room == NULL || room_get_count(room) == 0)
+			send_and_destroy(user, room_encode_name_list(NULL, 0));
+		else
+			user_send(user, room_get_user_list(room));
+	}
 }
 
-void process_SID_CLIENT_INFORMATION(user_t *user, packet_buffer_t *packet)
+void process_SID_CLIENT_INFORMATION(user_t *user, client_information_packet_t *packet)
 {
-	packet_buffer_t *response;
-	char *string_buffer;
-	 /* (uint32_t) client_token -- Used when hashing the password
-	 * (uint32_t) current_time -- Used to calculate time differences, if that ever comes up 
-	 * (uint32_t) client_version -- Could be used for upgrades and stuff
-	 * (ntstring) country -- Could be used for localized information.  Can be blank. 
-	 * (ntstring) operating_system -- Why not?  Can be blank. */
+	server_information_packet_t response;
 
 	if(get_user_state(user) != CONNECTED)
 	{
@@ -421,48 +599,74 @@ void process_SID_CLIENT_INFORMATION(user_t *user, packet_buffer_t *packet)
 	}
 	else
 	{
-		string_buffer = malloc(get_length(packet));
-
-		set_client_token(user, read_next_int32(packet));
-		read_next_int32(packet);
-		read_next_int32(packet);
-		read_next_ntstring(packet, string_buffer, get_length(packet));
-		read_next_ntstring(packet, string_buffer, get_length(packet));
-	
+		set_client_token(user, packet->client_token);
 		set_user_state(user, SENT_CLIENT_INFORMATION);
 
-	/* (uint32_t) server_token -- Used when hashing the password
-	 * (uint32_t) version_useable -- If this is 0, this version is too old to connect and
-	 *   has to be updated. 
-	 * (ntstring) authentication hash type (should be "sha1")
-	 * (ntstring) country -- This can be blank
-	 * (ntstring) operating_system -- This can be blank */
-		response = create_buffer(SID_SERVER_INFORMATION);
-		add_int32(response, get_server_token(user));
-		add_int32(response, 1);
-		add_ntstring(response, "sha1");
-		add_ntstring(response, "");
-		add_ntstring(response, "");
-		send_buffer(response, get_socket(user));
-		destroy_buffer(response);
-
-		free(string_buffer);
+		response.server_token = get_server_token(user);
+		response.version_useable = 1;
+		response.hash_type = "sha1";
+		response.country = "";
+		response.operating_system = "";
+
+		/* Compress big packets if they can handle it */
+		if(packet->client_version & PROTOCOL_DEFLATE)
+			response.version_useable |= PROTOCOL_DEFLATE;
+		/* Likewise, numbers instead of names in chat events */
+		if(packet->client_version & PROTOCOL_NAME_IDS)
+			response.version_useable |= PROTOCOL_NAME_IDS;
+		/* And joins and leaves batched up */
+		if(packet->client_version & PROTOCOL_PRESENCE)
+			response.version_useable |= PROTOCOL_PRESENCE;
+		/* And a session token when they log in */
+		if(packet->client_version & PROTOCOL_RESUME)
+			response.version_useable |= PROTOCOL_RESUME;
+
+		send_and_destroy(user, encode_server_information(&response));
+
+		/* Everything after the response can be compressed, and can use numbers */
+		if(response.version_useable & PROTOCOL_DEFLATE)
+			enable_user_compression(user);
+		if(response.version_useable & PROTOCOL_NAME_IDS)
+			enable_user_name_ids(user);
+		if(response.version_useable & PROTOCOL_PRESENCE)
+			enable_user_presence_batches(user);
+		if(response.version_useable & PROTOCOL_RESUME)
+			enable_user_session_tokens(user);
 	}
+}
 
-	destroy_buffer(packet);
+/* The user proved who they are (with their password or a session token), they've already
+ * been given the name in the user directory, and they've been told so.  They're taken out of
+ * the new_users list, and if they asked for session tokens, they get a new one (see token.h). */
+static void log_in(user_t *user, char *username)
+{
+	session_token_packet_t token;
+	uint8_t mac[HASH_LENGTH];
+
+	set_username(user, username);
+	display_message(ERROR_DEBUG, "User %s authenticated successfully!", get_username(user));
 
+	/* Set the new state */
+	set_user_state(user, NOT_IN_CHANNEL);
+
+	/* He's in the directory now, so he isn't new any more */
+	list_remove_value(new_users, user);
+
+	/* And the other servers keep anybody else from using the name */
+	federation_logged_in(user);
+
+	if(get_user_session_tokens(user))
+	{
+		token_issue(get_username(user), &token.expires, mac);
+		token.token = mac;
+		send_and_destroy(user, encode_session_token(&token));
+	}
 }
 
-void process_SID_LOGIN(user_t *user, packet_buffer_t *packet)
+void process_SID_LOGIN(user_t *user, login_packet_t *packet)
 {
-	/* (uint32_t[5]) password -- Hash of the client token, server token, and password's hash.  If a 
-	 *  hash is used that is less than 160-bit, it's padded with anything.  If a hash is used
-	 *  that's longer than 160-bit, it's truncated.  The formula is H(ct, st, H(pass)).
-	 * (ntstring) username */
-	uint8_t password_buffer[20];
-	char *username_buffer;
 	login_response_t status;
-	packet_buffer_t *response;
+	login_response_packet_t response;
 
 	if(get_user_state(user) != SENT_CLIENT_INFORMATION)
 	{
@@ -470,54 +674,108 @@ void process_SID_LOGIN(user_t *user, packet_buffer_t *packet)
 	}
 	else
 	{
-		username_buffer = malloc(get_length(packet));
 		display_user_message(ERROR_NOTICE, user, "User attempted authentication");
-		read_next_bytes(packet, password_buffer, 20);
-		read_next_ntstring(packet, username_buffer, get_length(packet) - 1);
 
-		/* Check if the username is already being used */
-		if(table_find(old_users, username_buffer))
+		/* Check if the username is already being used, here or on another server */
+		if(user_directory_find(packet->username) || federation_find_user(packet->username))
 			status = ACCOUNT_IN_USE;
 		else
-			status = account_login(username_buffer, password_buffer, get_client_token(user), get_server_token(user));
+			status = account_login(packet->username, packet->password, get_client_token(user), get_server_token(user));
 
+		/* The name's only really theirs once they're in the directory.  Checking and adding
+		 * happen all at once there, so if somebody else got it while the password was being
+		 * checked, only one of them is let in. */
+		if(status == LOGIN_SUCCESS && !user_directory_add(packet->username, user))
+			status = ACCOUNT_IN_USE;
+
+		response.result = status;
+		response.username = packet->username;
+		send_and_destroy(user, encode_login_response(&response));
 	
-		response = create_buffer(SID_LOGIN_RESPONSE);
-	/* (uint32_t[5]) password -- Hash of the client's password only, without the tokens.  For 
-	 *  information on storing hashes of different sizes, see SID_LOGIN */
-		add_int32(response, status);
-		add_ntstring(response, username_buffer);
-		send_buffer(response, get_socket(user));
-		destroy_buffer(response);
-	
+		if(status == LOGIN_SUCCESS)
+			log_in(user, packet->username);
+		else
+			display_user_message(ERROR_ERROR, user, "User failed authentication");
+	}
+}
+
+/* Close the connection of somebody who's logging back in with a session token, when the old
+ * one hasn't noticed it's dead yet.  It's closed right here, since it won't be in the user
+ * directory to be looked at again. */
+static void replace_user(user_t *user)
+{
+	room_t *room = get_current_room(user);
+
+	display_user_message(ERROR_NOTICE, user, "User %s reconnected; closing their old connection", get_username(user));
+
+	if(room)
+		room_remove_user(room, user);
+	user_directory_remove(get_username(user), user);
+
+	close_user(user);
+}
+
+/* Log in with a session token instead of a password, and go straight back to their room.
+ * The token's checked without looking at their account (see token.h), so this never waits
+ * on the accounts file either. */
+void process_SID_RESUME(user_t *user, resume_packet_t *packet)
+{
+	login_response_t status;
+	login_response_packet_t response;
+	user_t *stale;
+
+	if(get_user_state(user) != SENT_CLIENT_INFORMATION)
+	{
+		send_error(user, "SID_RESUME Invalid in this state");
+	}
+	else
+	{
+		display_user_message(ERROR_NOTICE, user, "User attempted to resume a session");
+
+		/* Somebody here with the same name is their old connection, since only they could
+		 * have the token; somebody on another server is somebody else */
+		stale = user_directory_find(packet->username);
+		if(!token_verify(packet->username, packet->expires, packet->token))
+			status = INVALID_TOKEN;
+		else if(federation_find_user(packet->username))
+			status = ACCOUNT_IN_USE;
+		else
+			status = LOGIN_SUCCESS;
+
+		/* The old connection gives up the name, and the new one takes it */
 		if(status == LOGIN_SUCCESS)
 		{
-			/* The user successfully authenticated */
-			set_username(user, username_buffer);
-			display_message(ERROR_DEBUG, "User %s authenticated successfully!", get_username(user));
+			if(stale)
+				replace_user(stale);
+			if(!user_directory_add(packet->username, user))
+				status = ACCOUNT_IN_USE;
+		}
 
-			/* Set the new state */
-			set_user_state(user, NOT_IN_CHANNEL);
+		response.result = status;
+		response.username = packet->username;
+		send_and_destroy(user, encode_login_response(&response));
 
-			/* Move him from the new_users list to the old_users table */
-			list_remove_value(new_users, user);
-			table_add(old_users, get_username(user), user);
+		if(status == LOGIN_SUCCESS)
+		{
+			log_in(user, packet->username);
+
+			/* If the old connection was in a room, the other servers hear that they've moved
+			 * (or left) either way */
+			if(*packet->room_name)
+				process_command_join(user, packet->room_name);
+			else if(stale)
+				federation_joined(user);
 		}
 		else
 		{
-			display_user_message(ERROR_ERROR, user, "User failed authentication");
+			display_user_message(ERROR_ERROR, user, "User failed to resume a session");
 		}
-
-		free(username_buffer);
 	}
 }
 
-void process_SID_CREATE(user_t *user, packet_buffer_t *packet)
+void process_SID_CREATE(user_t *user, create_packet_t *packet)
 {
-	uint8_t password_buffer[20];
-	char *username_buffer;
-	packet_buffer_t *response;
-	create_response_t create_response;
+	create_response_packet_t response;
 
 	if(get_user_state(user) != SENT_CLIENT_INFORMATION)
 	{
@@ -525,34 +783,18 @@ void process_SID_CREATE(user_t *user, packet_buffer_t *packet)
 	}
 	else
 	{
-		username_buffer = malloc(get_length(packet));
-		/* (uint32_t[5]) password -- Hash of the client's password only, without the tokens.  For 
-		 *  information on storing hashes of different sizes, see SID_LOGIN 
-		 * (ntstring) username */
-		read_next_bytes(packet, password_buffer, 20);
-		read_next_ntstring(packet, username_buffer, get_length(packet) - 1);
-	
-		create_response = account_create(username_buffer, password_buffer);
-	
-	
-		response = create_buffer(SID_CREATE_RESPONSE);
-		/* (uint32_t) result -- see create_response_t in account.h for result codes. 
-		 * (ntstring) username */
-		add_int32(response, create_response);
-		add_ntstring(response, username_buffer);
-		send_buffer(response, get_socket(user));
-		destroy_buffer(response);
-	
-		free(username_buffer);
+		response.result = account_create(packet->username, packet->password);
+		response.username = packet->username;
+		send_and_destroy(user, encode_create_response(&response));
 	}
 }
 
-void process_SID_CHATCOMMAND(user_t *user, packet_buffer_t *packet)
+void process_SID_CHATCOMMAND(user_t *user, chatcommand_packet_t *packet)
 {
 	char *message;
 	char *command;
 	char *parameter;
-	char *room;
+	room_t *room;
 
 	if(get_user_state(user) != JOINED_CHANNEL && get_user_state(user) != NOT_IN_CHANNEL)
 	{
@@ -561,13 +803,10 @@ void process_SID_CHATCOMMAND(user_t *user, packet_buffer_t *packet)
 	else
 	{
 		/* Get the room they're in.  If the room is NULL, then they aren't in a room */
-		room = get_user_room(user);
-
-		/* Get the message they're sending */
-		message = malloc(get_length(packet));
-		read_next_ntstring(packet, message, get_length(packet));
-
+		room = get_current_room(user);
 
+		/* Get the message they're sending.  It's in the packet, so it's ours to chop up. */
+		message = packet->command;
 
 		if(*message == '/')
 		{
@@ -606,6 +845,10 @@ void process_SID_CHATCOMMAND(user_t *user, packet_buffer_t *packet)
 			{
 				process_command_rooms(user, parameter);
 			}
+			else if (!strcasecmp(command, "batch"))
+			{
+				process_command_batch(user, parameter);
+			}
 			else
 			{
 				send_chat(EID_ERROR, get_username(user), get_username(user), "Unknown command; type /help for a command listing");
@@ -620,22 +863,203 @@ void process_SID_CHATCOMMAND(user_t *user, packet_buffer_t *packet)
 			else
 			{
 				/* Distribute the message as a chat message */
-				room_message(table_find(rooms, room), EID_TALK, get_username(user), message);
+				room_message(room, EID_TALK, get_username(user), message);
+				/* And to the other servers with people in the room, once each */
+				federation_message(room, EID_TALK, get_username(user), message);
 			}
 
 		}
+	}
+}
 
-		free(message);
+void process_SID_ERROR(user_t *user, error_message_packet_t *packet)
+{
+	display_user_message(ERROR_ERROR, user, "Client sent an error; message was, '%s'", packet->description);
+}
+
+
+/* Another server connected, and said hello instead of giving its client information (see
+ * federation.h).  If it's one of our peers, it's greeted, and has to answer this server's
+ * challenge next.  Returns FALSE if the connection should be closed. */
+BOOLEAN process_SID_LINK_HELLO(user_t *user, link_hello_packet_t *packet)
+{
+	peer_t *peer;
+
+	if(get_user_state(user) != CONNECTED)
+	{
+		send_error(user, "SID_LINK_HELLO Invalid in this state");
+		return TRUE;
 	}
+
+	peer = federation_find_peer(get_user_address(user), packet->port);
+	if(peer == NULL)
+	{
+		display_user_message(ERROR_WARNING, user, "A server that isn't one of our peers tried to link (it says it's on port %u)", packet->port);
+		return FALSE;
+	}
+
+	if(packet->version != FEDERATION_VERSION)
+	{
+		display_user_message(ERROR_WARNING, user, "Peer %s:%d links with version %u, and this server uses %u; not linking to it", peer->host, peer->port, packet->version, FEDERATION_VERSION);
+		return FALSE;
+	}
+
+	return federation_greet(user, peer, packet);
+}
+
+/* A server that was greeted answered its challenge.  If the answer's right, the connection
+ * becomes the link to it, and it isn't a user anymore.  Returns FALSE if the connection
+ * should be closed. */
+BOOLEAN process_SID_LINK_AUTH(user_t *user, link_auth_packet_t *packet)
+{
+	if(!federation_accept(user, packet))
+		return FALSE;
+
+	/* The socket belongs to the link now */
+	list_remove_value(new_users, user);
+	set_user_state(user, DEAD);
+	user_retire(user);
+
+	return TRUE;
+}
+
+/* Somebody logged in on another server */
+void process_SID_LINK_LOGIN(peer_t *peer, link_login_packet_t *packet)
+{
+	user_t *local = user_directory_find(packet->username);
+	struct in_addr ip;
+
+	if(*packet->username == '\0' || strlen(packet->username) > MAX_NAME)
+		return;
+
+	/* If somebody here has the name too, they both logged in at the same moment.  The server
+	 * with the lower node ID keeps theirs, and the other one lets theirs go. */
+	if(local)
+	{
+		if(federation_get_node_id() < peer->node_id)
+			return;
+
+		display_user_message(ERROR_NOTICE, local, "User %s logged in on another server at the same time, and that one won; disconnecting them", get_username(local));
+		send_chat(EID_ERROR, get_username(local), get_username(local), "You logged in on another server at the same moment; disconnecting");
+		kick_user(local);
+	}
+
+	ip.s_addr = packet->ip;
+	federation_remote_login(peer, packet->username, ip);
+}
+
+/* Somebody said something in a room on another server */
+void process_SID_LINK_CHAT(peer_t *peer, link_chat_packet_t *packet)
+{
+	room_t *room = room_directory_find(packet->room_name);
+	user_t *from = federation_find_user(packet->username);
+
+	/* It has to be from somebody on that server, who's in the room.  Anything else was said
+	 * before something changed, and it's too late for it now. */
+	if(room == NULL || from == NULL || get_user_peer(from) != peer || get_current_room(from) != room || packet->subtype != EID_TALK)
+		return;
+
+	/* It's only for the people here; their server already sent it everywhere else */
+	room_message(room, EID_TALK, get_username(from), packet->text);
+	federation_count_relayed();
+}
+
+/* Somebody on another server whispered somebody here */
+void process_SID_LINK_WHISPER(peer_t *peer, link_whisper_packet_t *packet)
+{
+	user_t *from = federation_find_user(packet->username);
+
+	if(from && get_user_peer(from) == peer)
+		send_chat(EID_WHISPERFROM, packet->target, get_username(from), packet->text);
 }
 
-void process_SID_ERROR(user_t *user, packet_buffer_t *packet)
+/* A room's settings arrived from another server */
+BOOLEAN process_SID_LINK_ROOM(peer_t *peer, link_room_packet_t *packet)
 {
-	char *string_buffer = malloc(get_length(packet));
-	display_user_message(ERROR_ERROR, user, "Client sent an error; message was, '%s'", read_next_ntstring(packet, string_buffer, get_length(packet)));
-	free(string_buffer);
+	if(packet->batch_window > BROADCAST_MAX_WINDOW)
+		return FALSE;
+
+	federation_remote_room(peer, packet->room_name, packet->batch_window);
+
+	return TRUE;
 }
 
+/* Read and handle the next packet from another server.  Returns FALSE if the link closed, or
+ * the other server sent something it shouldn't have, in which case the link should be
+ * dropped. */
+BOOLEAN process_next_link_packet(peer_t *peer)
+{
+	packet_buffer_t *packet;
+	protocol_packet_t decoded;
+	BOOLEAN valid = TRUE;
+
+	packet = read_buffer(peer->socket, NULL);
+
+	if(packet == NULL)
+		return TRUE;
+	else if(packet == (packet_buffer_t *) -1)
+		return FALSE;
+
+	/* Nothing can come before the peer's hello, and the answer to our challenge, except for
+	 * keepalives (which can jump ahead of them in the peer's outbox) */
+	if(!peer->established && get_code(packet) != SID_NULL && get_code(packet) != SID_LINK_HELLO && get_code(packet) != SID_LINK_AUTH)
+		valid = FALSE;
+	else switch(get_code(packet))
+	{
+		case SID_NULL:
+			break;
+
+		case SID_LINK_HELLO:
+			if((valid = decode_link_hello(packet, &decoded.link_hello) && !peer->established))
+				valid = federation_hello(peer, &decoded.link_hello);
+			break;
+
+		case SID_LINK_AUTH:
+			if((valid = decode_link_auth(packet, &decoded.link_auth) && !peer->established))
+				valid = federation_auth(peer, &decoded.link_auth);
+			break;
+
+		case SID_LINK_LOGIN:
+			if((valid = decode_link_login(packet, &decoded.link_login)))
+				process_SID_LINK_LOGIN(peer, &decoded.link_login);
+			break;
+
+		case SID_LINK_LOGOUT:
+			if((valid = decode_link_logout(packet, &decoded.link_logout)))
+				federation_remote_logout(peer, decoded.link_logout.username);
+			break;
+
+		case SID_LINK_JOIN:
+			if((valid = decode_link_join(packet, &decoded.link_join)))
+				federation_remote_join(peer, decoded.link_join.username, decoded.link_join.room_name);
+			break;
+
+		case SID_LINK_CHAT:
+			if((valid = decode_link_chat(packet, &decoded.link_chat)))
+				process_SID_LINK_CHAT(peer, &decoded.link_chat);
+			break;
+
+		case SID_LINK_WHISPER:
+			if((valid = decode_link_whisper(packet, &decoded.link_whisper)))
+				process_SID_LINK_WHISPER(peer, &decoded.link_whisper);
+			break;
+
+		case SID_LINK_ROOM:
+			if((valid = decode_link_room(packet, &decoded.link_room)))
+				valid = process_SID_LINK_ROOM(peer, &decoded.link_room);
+			break;
+
+		default:
+			valid = FALSE;
+	}
+
+	if(!valid)
+		display_message(ERROR_WARNING, "Link to %s:%d sent a packet it shouldn't have (code 0x%02x); dropping it", peer->host, peer->port, get_code(packet));
+
+	destroy_buffer(packet);
+
+	return valid;
+}
 
 /* If everything goes well, return TRUE. 
  * If there's some error that can easily be handled, it handles it and returns TRUE
@@ -645,10 +1069,29 @@ void process_SID_ERROR(user_t *user, packet_buffer_t *packet)
 BOOLEAN process_next_packet(user_t *user)
 {
 	packet_buffer_t *packet;
+	protocol_packet_t decoded;
+	BOOLEAN valid = TRUE;
+	BOOLEAN connected = TRUE;
+	size_t discarded;
 
 	int s = get_socket(user);
 
-	packet = read_buffer(s);
+	/* A connection that starts with a TLS handshake gets TLS (see tls.h), and nothing else
+	 * is read from it until the handshake's done */
+	if(get_user_state(user) == CONNECTED && tls_is_enabled() && !tls_is_secure(s) && tls_is_hello(s))
+		tls_accept(s);
+	if(tls_is_handshaking(s))
+		return tls_handshake(s) >= 0;
+
+	packet = read_buffer(s, &discarded);
+
+	if(discarded && add_user_resync(user) >= MAX_RESYNCS)
+	{
+		display_user_message(ERROR_ERROR, user, "Stream got out of sync too many times; disconnecting");
+		if(packet && packet != (packet_buffer_t *) -1)
+			destroy_buffer(packet);
+		return FALSE;
+	}
 
 	if(packet == NULL)
 		return TRUE;
@@ -656,46 +1099,86 @@ BOOLEAN process_next_packet(user_t *user)
 		return FALSE;
 
 
-	/* This is the heart of the packet process */
-	switch(get_code(packet))
+	/* This is the heart of the packet process.  Each packet is decoded into its struct (see
+	 * protocol.h) before it's handled; if it doesn't decode, it's malformed.  Another server
+	 * that's been greeted can only answer its challenge, though. */
+	if(federation_is_linking(user))
+	{
+		if(get_code(packet) == SID_LINK_AUTH && decode_link_auth(packet, &decoded.link_auth))
+			connected = process_SID_LINK_AUTH(user, &decoded.link_auth);
+		else
+		{
+			display_user_message(ERROR_WARNING, user, "A server that's linking sent something besides its answer (code 0x%02x)", get_code(packet));
+			connected = FALSE;
+		}
+	}
+	else switch(get_code(packet))
 	{
 		case SID_NULL:
-			process_SID_NULL(user, packet);
 			break;
 
 		/* Client -> Server packets (We process these) */ 
 		case SID_CLIENT_INFORMATION:
-			process_SID_CLIENT_INFORMATION(user, packet);
+			if((valid = decode_client_information(packet, &decoded.client_information)))
+				process_SID_CLIENT_INFORMATION(user, &decoded.client_information);
 			break;
 
 		case SID_LOGIN:
-			process_SID_LOGIN(user, packet);
+			if((valid = decode_login(packet, &decoded.login)))
+				process_SID_LOGIN(user, &decoded.login);
 			break;
 
 		case SID_CREATE:
-			process_SID_CREATE(user, packet);
+			if((valid = decode_create(packet, &decoded.create)))
+				process_SID_CREATE(user, &decoded.create);
+			break;
+
+		case SID_RESUME:
+			if((valid = decode_resume(packet, &decoded.resume)))
+				process_SID_RESUME(user, &decoded.resume);
 			break;
 
 		case SID_REQUEST_ROOM_LIST:
-			process_SID_REQUEST_ROOM_LIST(user, packet);
+			if((valid = decode_request_room_list(packet, &decoded.request_room_list)))
+				process_SID_REQUEST_ROOM_LIST(user, &decoded.request_room_list);
 			break;
 
 		case SID_CHATCOMMAND:
-			process_SID_CHATCOMMAND(user, packet);
+			if((valid = decode_chatcommand(packet, &decoded.chatcommand)))
+				process_SID_CHATCOMMAND(user, &decoded.chatcommand);
 			break;
 
 		/* This can go either way */
 		case SID_ERROR:
-			process_SID_ERROR(user, packet);
+			if((valid = decode_error_message(packet, &decoded.error_message)))
+				process_SID_ERROR(user, &decoded.error_message);
 			break;
 
 
+		/* Another server, linking to this one (see federation.h) */
+		case SID_LINK_HELLO:
+			if((valid = decode_link_hello(packet, &decoded.link_hello)))
+				connected = process_SID_LINK_HELLO(user, &decoded.link_hello);
+			break;
+
 		/* Client -> Server packets (We shouldn't get these) */
 		case SID_SERVER_INFORMATION:
 		case SID_LOGIN_RESPONSE:
 		case SID_CREATE_RESPONSE:
 		case SID_ROOM_LIST:
 		case SID_CHATEVENT:
+		case SID_COMPRESSED:
+		case SID_INTRODUCE_NAME:
+		case SID_CHATEVENT_ID:
+		case SID_PRESENCE:
+		case SID_SESSION_TOKEN:
+		case SID_LINK_LOGIN:
+		case SID_LINK_LOGOUT:
+		case SID_LINK_JOIN:
+		case SID_LINK_CHAT:
+		case SID_LINK_WHISPER:
+		case SID_LINK_ROOM:
+		case SID_LINK_AUTH:
 			send_error(user, "Client isn't allowed to send that");
 			break;
 
@@ -703,8 +1186,184 @@ BOOLEAN process_next_packet(user_t *user)
 			send_error(user, "Unknown packet");
 	}
 
+	if(!valid)
+	{
+		display_user_message(ERROR_WARNING, user, "Received a malformed packet (code 0x%02x)", get_code(packet));
+		send_error(user, "Malformed packet");
+	}
 
-	return TRUE;
+	destroy_buffer(packet);
+
+	return connected;
+}
+
+/* Log how well compression is doing, if anything has been compressed yet */
+void print_compression_totals()
+{
+	uint32_t packets;
+	size_t raw_bytes;
+	size_t compressed_bytes;
+	double cpu_seconds;
+
+	compression_get_totals(&packets, &raw_bytes, &compressed_bytes, &cpu_seconds);
+
+	if(packets > 0)
+		display_message(ERROR_NOTICE, "Compression: %u packets, %u bytes down to %u (ratio %.2f), %.3f seconds of CPU", packets, (unsigned int) raw_bytes, (unsigned int) compressed_bytes, (double) raw_bytes / compressed_bytes, cpu_seconds);
+}
+
+/* Log how TLS is doing, if anybody has used it yet */
+void print_tls_totals()
+{
+	uint32_t handshakes;
+	uint32_t resumed;
+	uint32_t failed;
+	uint32_t offloaded;
+	double cpu_seconds;
+
+	tls_get_totals(&handshakes, &resumed, &failed, &offloaded, &cpu_seconds);
+
+	if(handshakes + failed > 0)
+		display_message(ERROR_NOTICE, "TLS: %u handshakes (%u resumed, %u done by the kernel after), %u failed, %.3f seconds of CPU", handshakes, resumed, offloaded, failed, cpu_seconds);
+}
+
+/* Log how many session tokens have been used, if any have been given out */
+void print_token_totals()
+{
+	uint32_t issued;
+	uint32_t accepted;
+	uint32_t rejected;
+
+	token_get_totals(&issued, &accepted, &rejected);
+
+	if(issued + rejected > 0)
+		display_message(ERROR_NOTICE, "Session tokens: %u given out, %u used to log back in, %u rejected", issued, accepted, rejected);
+}
+
+/* Log how much the datagram socket has been used, if at all */
+void print_datagram_totals()
+{
+	uint32_t requests;
+	uint32_t batches;
+	uint32_t answered;
+	uint32_t limited;
+	uint32_t ignored;
+
+	datagram_get_totals(&requests, &batches, &answered, &limited, &ignored);
+
+	if(requests > 0)
+		display_message(ERROR_NOTICE, "Datagrams: %u requests in %u batches (%.1f per batch), %u answered, %u rate limited, %u ignored", requests, batches, (double) requests / batches, answered, limited, ignored);
+}
+
+/* Log how well joins and leaves are being batched, if there have been any */
+void print_presence_totals()
+{
+	uint32_t changes;
+	uint32_t batches;
+	uint32_t sent;
+	uint32_t unbatched;
+
+	presence_get_totals(&changes, &batches, &sent, &unbatched);
+
+	if(changes > 0)
+		display_message(ERROR_NOTICE, "Presence: %u joins and leaves in %u batches, %u packets sent (%u one at a time)", changes, batches, sent, unbatched);
+}
+
+/* Log how well chat is being batched, if there's been any */
+void print_broadcast_totals()
+{
+	uint32_t messages;
+	uint32_t batches;
+	uint32_t writes;
+	uint32_t unbatched;
+	uint32_t split;
+	double total_wait;
+	double longest_wait;
+
+	broadcast_get_totals(&messages, &batches, &writes, &unbatched, &split, &total_wait, &longest_wait);
+
+	if(messages > 0)
+		display_message(ERROR_NOTICE, "Broadcast: %u messages in %u batches (%u split between workers), %u writes (%u one at a time), waited %.3fms on average, %.3fms at most", messages, batches, split, writes, unbatched, total_wait * 1000 / messages, longest_wait * 1000);
+}
+
+/* Log how much has had to wait to be written, for each class (see outbox.h) */
+void print_outbox_totals()
+{
+	const char *names[OUTBOX_CLASSES] = { "control", "chat", "bulk" };
+	uint32_t packets;
+	uint32_t queued;
+	uint32_t waiting;
+	size_t waiting_bytes;
+	size_t peak_bytes;
+	uint32_t jumped;
+	int class;
+
+	for(class = 0; class < OUTBOX_CLASSES; class++)
+	{
+		outbox_get_totals(class, &packets, &queued, &waiting, &waiting_bytes, &peak_bytes, &jumped);
+
+		if(queued > 0)
+			display_message(ERROR_NOTICE, "Outbox (%s): %u packets, %u had to wait, %u waiting now (%u bytes, at most %u), %u went ahead of a lower class", names[class], packets, queued, waiting, (unsigned int) waiting_bytes, (unsigned int) peak_bytes, jumped);
+	}
+
+	if(outbox_get_dropped() > 0)
+		display_message(ERROR_NOTICE, "Outbox: %u connections shut down for falling behind", outbox_get_dropped());
+}
+
+/* Log how the links to other servers are doing, if there are any */
+void print_federation_totals()
+{
+	uint32_t links;
+	uint32_t remote_users;
+	uint32_t forwarded;
+	uint32_t copies;
+	uint32_t relayed;
+
+	federation_get_totals(&links, &remote_users, &forwarded, &copies, &relayed);
+
+	if(federation_get_peer_count() > 0)
+		display_message(ERROR_NOTICE, "Federation: %u of %u links up, %u users on other servers, %u messages forwarded (%u copies), %u relayed from other servers", links, (unsigned int) federation_get_peer_count(), remote_users, forwarded, copies, relayed);
+}
+
+/* Log how the chat's been spread over the workers, if there's more than one */
+void print_worker_totals()
+{
+	uint32_t rounds;
+	uint32_t jobs;
+	uint32_t parallel_jobs;
+	uint32_t moved;
+	double busiest_share;
+
+	worker_get_totals(&rounds, &jobs, &parallel_jobs, &moved, &busiest_share);
+
+	if(jobs > 0)
+		display_message(ERROR_NOTICE, "Workers: %u rooms sent by %u workers (%u by the other threads, in %u rounds), %u rooms moved, the busiest sent %.1f%% of the chat", jobs, (unsigned int) worker_get_count(), parallel_jobs, rounds, moved, busiest_share * 100);
+}
+
+/* Log how often the user directory was changed, and how often that meant waiting for another
+ * thread */
+void print_user_directory_totals()
+{
+	uint32_t changes;
+	uint32_t waits;
+
+	user_directory_get_totals(&changes, &waits);
+
+	if(changes > 0)
+		display_message(ERROR_NOTICE, "User directory: %u logged in, %u names added or removed (%u waited for another thread)", (unsigned int) user_directory_get_count(), changes, waits);
+}
+
+/* Log how many users, rooms, and the like have been freed since they were gone, and how many
+ * are still waiting for the threads that might be looking at them */
+void print_epoch_totals()
+{
+	uint32_t retired;
+	uint32_t freed;
+	uint32_t advances;
+
+	epoch_get_totals(&retired, &freed, &advances);
+
+	if(retired > 0)
+		display_message(ERROR_NOTICE, "Epochs: %u things retired, %u freed (%u waiting), in %u epochs", retired, freed, retired - freed, advances);
 }
 
 /* Sends a keepalive to all clients, new and established */
@@ -717,14 +1376,73 @@ void do_keepalive(user_t **new_user_list, int new_user_count, user_t **old_user_
 
 	/* Send the keepalive to all the new users */
 	for(i = 0; i < new_user_count; i++)
-		send_buffer(keepalive, get_socket(new_user_list[i]));
+		user_send(new_user_list[i], keepalive);
 
 	/* Send the keepalive to all the authenticated users */
 	for(i = 0; i < old_user_count; i++)
-		send_buffer(keepalive, get_socket(old_user_list[i]));
+		user_send(old_user_list[i], keepalive);
 
 	destroy_buffer(keepalive);
 
+	print_compression_totals();
+	print_datagram_totals();
+	print_presence_totals();
+	print_broadcast_totals();
+	print_worker_totals();
+	print_user_directory_totals();
+	print_epoch_totals();
+	print_outbox_totals();
+	print_federation_totals();
+	print_tls_totals();
+	print_token_totals();
+
+	/* Keep the rooms in case the server's restarted (see snapshot.h).  It's written in the
+	 * background, so nobody waits for the disk. */
+	snapshot_save(FALSE);
+
+	/* Try the links that are down again */
+	federation_dial();
+}
+
+/* Take the time since "before" off of the time left until the next keepalive.  Returns TRUE
+ * if it's run out. */
+static BOOLEAN keepalive_due(struct timeval *before)
+{
+	struct timeval now;
+	long left;
+
+	gettimeofday(&now, NULL);
+	left = select_timeout.tv_sec * 1000000L + select_timeout.tv_usec;
+	left -= (now.tv_sec - before->tv_sec) * 1000000L + (now.tv_usec - before->tv_usec);
+
+	if(left <= 0)
+		return TRUE;
+
+	select_timeout.tv_sec = left / 1000000;
+	select_timeout.tv_usec = left % 1000000;
+
+	return FALSE;
+}
+
+/* Whether select() should watch a user's socket for being ready to write: if something's
+ * waiting for it, or its TLS handshake is.  Nothing else goes out until the handshake's
+ * done, so that's all it waits for until then. */
+static BOOLEAN watch_for_writing(user_t *user)
+{
+	if(tls_is_handshaking(get_socket(user)))
+		return tls_wants_write(get_socket(user));
+
+	return user_is_waiting(user);
+}
+
+/* Mark everybody who has data that's been decrypted, but not read yet, as readable */
+static void add_pending(user_t **users, size_t count, fd_set *select_set)
+{
+	size_t i;
+
+	for(i = 0; i < count; i++)
+		if(tls_has_pending(get_socket(users[i])))
+			FD_SET(get_socket(users[i]), select_set);
 }
 
 void do_select()
@@ -733,23 +1451,49 @@ void do_select()
 	int client_length = sizeof(client_address);
 	int new_socket;
 	fd_set select_set;
+	fd_set write_set;
 	int select_return;
 	int i;
-	int biggest_socket = listen_socket;
+	int biggest_socket = listen_socket > datagram_socket ? listen_socket : datagram_socket;
+	struct timeval timeout;
+	struct timeval before;
 
 	user_t **new_user_list;
-	int new_user_count;
+	uint32_t new_user_count;
 
 	user_t **old_user_list;
-	int old_user_count;
+	size_t old_user_count;
 
 	/* Used as a temporary variable when a new connection is made */
 	user_t *new_user;
+	/* Used as a temporary variable for the links to other servers */
+	peer_t *peer;
+	/* The number of connections with data that's been decrypted, but not read (see tls.h) */
+	int pending = 0;
 
-	/* Clear the current socket set */
+	/* The main thread reads everything, so whatever it finds can't be freed until it's done
+	 * (see epoch.h) */
+	epoch_enter(0);
+
+	/* Clear the current socket sets */
 	FD_ZERO(&select_set);
+	FD_ZERO(&write_set);
 	/* Add the listening socket for new connections */
 	FD_SET(listen_socket, &select_set);
+	/* And the datagram socket, for room list requests */
+	FD_SET(datagram_socket, &select_set);
+	/* And the handoff socket, for a new server taking over */
+	if(handoff_socket >= 0)
+	{
+		FD_SET(handoff_socket, &select_set);
+		biggest_socket = handoff_socket > biggest_socket ? handoff_socket : biggest_socket;
+	}
+	/* And the pipe that says a signal's arrived */
+	if(signal_pipe[0] >= 0)
+	{
+		FD_SET(signal_pipe[0], &select_set);
+		biggest_socket = signal_pipe[0] > biggest_socket ? signal_pipe[0] : biggest_socket;
+	}
 
 	/* Retrieve the list of new users */
 	new_user_list = (user_t **) list_get_array(new_users, &new_user_count);
@@ -757,38 +1501,115 @@ void do_select()
 	{
 		biggest_socket = (get_socket(new_user_list[i]) > biggest_socket) ? get_socket(new_user_list[i]) : biggest_socket;
 		FD_SET(get_socket(new_user_list[i]), &select_set);
+		if(watch_for_writing(new_user_list[i]))
+			FD_SET(get_socket(new_user_list[i]), &write_set);
+		if(tls_has_pending(get_socket(new_user_list[i])))
+			pending++;
 	}
 
 	/* Retrieve the list of authenticated users */
-	old_user_list = (user_t **) get_values(old_users, &old_user_count);
+	old_user_list = user_directory_get_all(&old_user_count);
 	for(i = 0; i < old_user_count; i++)
 	{
 		biggest_socket = (get_socket(old_user_list[i]) > biggest_socket) ? get_socket(old_user_list[i]) : biggest_socket;
 		FD_SET(get_socket(old_user_list[i]), &select_set);
+		if(watch_for_writing(old_user_list[i]))
+			FD_SET(get_socket(old_user_list[i]), &write_set);
+		if(tls_has_pending(get_socket(old_user_list[i])))
+			pending++;
 	}
 
-	select_return = select(biggest_socket + 1, &select_set, NULL, NULL, &select_timeout);
+	/* And the links to other servers */
+	for(i = 0; i < federation_get_peer_count(); i++)
+	{
+		peer = federation_get_peer(i);
+		if(peer->socket < 0)
+			continue;
+		biggest_socket = (peer->socket > biggest_socket) ? peer->socket : biggest_socket;
+		FD_SET(peer->socket, &select_set);
+		if(federation_is_waiting(peer))
+			FD_SET(peer->socket, &write_set);
+	}
+
+	/* Wait until it's time for a keepalive, or until some room's chat, joins or leaves are due
+	 * to go out, whichever is first */
+	timeout = select_timeout;
+	broadcast_get_timeout(&timeout);
+	presence_get_timeout(&timeout);
+	/* Anybody with something already decrypted is ready now */
+	if(pending > 0)
+	{
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 0;
+	}
+	gettimeofday(&before, NULL);
+
+	select_return = select(biggest_socket + 1, &select_set, &write_set, NULL, &timeout);
 
 	if(select_return == -1)
 	{
-		display_error(ERROR_EMERGENCY, "Select failed [%s]", strerror(errno));
+		/* A signal interrupted it, so nothing's ready; the main loop will deal with the
+		 * signal once this trip's done */
+		if(errno != EINTR)
+			display_error(ERROR_EMERGENCY, "Select failed [%s]", strerror(errno));
+		select_return = 0;
+		FD_ZERO(&select_set);
+		FD_ZERO(&write_set);
+	}
+
+	/* select() doesn't know about them, so they're added in by hand */
+	if(pending > 0)
+	{
+		add_pending(new_user_list, new_user_count, &select_set);
+		add_pending(old_user_list, old_user_count, &select_set);
+		select_return += pending;
 	}
-	else if(select_return == 0)
+
+	if(keepalive_due(&before))
 	{
 		do_keepalive(new_user_list, new_user_count, old_user_list, old_user_count);
 
 		select_timeout.tv_sec = KEEPALIVE;
 		select_timeout.tv_usec = 0;
 	}
-	else
+
+	if(select_return > 0)
 	{
+		/* Write whatever's been waiting for the sockets that are ready for more, before
+		 * anything new is added to it */
+		for(i = 0; i < old_user_count; i++)
+			if(FD_ISSET(get_socket(old_user_list[i]), &write_set))
+				user_flush(old_user_list[i]);
+		for(i = 0; i < new_user_count; i++)
+			if(FD_ISSET(get_socket(new_user_list[i]), &write_set) && !tls_is_handshaking(get_socket(new_user_list[i])))
+				user_flush(new_user_list[i]);
+		for(i = 0; i < federation_get_peer_count(); i++)
+		{
+			peer = federation_get_peer(i);
+			if(peer->socket >= 0 && FD_ISSET(peer->socket, &write_set))
+				federation_flush(peer);
+		}
+
+		/* If a new server is taking over, hand everything off to it.  Once it has
+		 * everything, this server has to go away without touching any of the sockets, since
+		 * they're the new server's now. */
+		if(handoff_socket >= 0 && FD_ISSET(handoff_socket, &select_set))
+		{
+			if(handoff_give(handoff_socket, listen_socket, datagram_socket, new_users))
+			{
+				display_message(ERROR_NOTICE, "Handed off to the new server; exiting");
+				destroy_display();
+				exit(0);
+			}
+		}
+
 		/* If the listen_socket is set, then we have a new connection */
 		if(FD_ISSET(listen_socket, &select_set))
 		{
 			/* Accept the connection */
 			new_socket = accept(listen_socket, (struct sockaddr *) &client_address, &client_length);
 			/* Create a new user object */
-			new_user = create_user(new_socket, inet_ntoa(client_address.sin_addr));
+			new_user = create_user(new_socket, client_address.sin_addr);
 			/* Add the new user to the list of new users */
 			list_add_end(new_users, new_user);
 			/* Notify the user that there was a conection */
@@ -797,17 +1618,30 @@ void do_select()
 			new_socket = (int)NULL;
 		}
 
+		/* Answer any room list requests that came in over UDP */
+		if(FD_ISSET(datagram_socket, &select_set))
+			datagram_process(datagram_socket);
+
+		/* Look after the other servers before anybody here, since who's logged in there
+		 * decides who can log in here */
+		for(i = 0; i < federation_get_peer_count(); i++)
+		{
+			peer = federation_get_peer(i);
+			if(peer->socket >= 0 && FD_ISSET(peer->socket, &select_set) && !process_next_link_packet(peer))
+				federation_drop(peer);
+		}
+
 		/* Look after the old users first (because a new user might become an old user, but an old user
 		 * will never become a new user, and doing new first might muck things up */
 		for(i = 0; i < old_user_count; i++)
 		{
-			if(FD_ISSET(get_socket(old_user_list[i]), &select_set))
+			/* Anybody who was kicked (see kick_user()) is already closed */
+			if(get_user_state(old_user_list[i]) != DEAD && FD_ISSET(get_socket(old_user_list[i]), &select_set))
 			{
 				if(process_next_packet(old_user_list[i]) == FALSE)
 				{
 					display_message(ERROR_NOTICE, "Connection to socket %s [%s] closed", get_username(old_user_list[i]), get_ip(old_user_list[i]));
-					table_remove(old_users, get_username(old_user_list[i]));
-					close(get_socket(old_user_list[i]));
+					disconnect_user(old_user_list[i]);
 				}
 			}
 		}
@@ -815,13 +1649,14 @@ void do_select()
 		/* Look after the new users */
 		for(i = 0; i < new_user_count; i++)
 		{
-			if(FD_ISSET(get_socket(new_user_list[i]), &select_set))
+			/* A handshake that was waiting to write moves along when it can */
+			if(FD_ISSET(get_socket(new_user_list[i]), &select_set) || (tls_wants_write(get_socket(new_user_list[i])) && FD_ISSET(get_socket(new_user_list[i]), &write_set)))
 			{
 				if(process_next_packet(new_user_list[i]) == FALSE)
 				{
 					display_message(ERROR_NOTICE, "Connection to %s closed", get_ip(new_user_list[i]));
 					list_remove_value(new_users, new_user_list[i]);
-					close(get_socket(new_user_list[i]));
+					disconnect_user(new_user_list[i]);
 				}
 			}
 		}
@@ -829,23 +1664,42 @@ void do_select()
 
 	free(new_user_list);
 	free(old_user_list);
+
+	/* Send out the chat, joins and leaves that have waited long enough */
+	broadcast_flush_due();
+	presence_flush_due();
+
+	/* Get rid of any rooms that have been empty for too long */
+	room_directory_reap(time(NULL));
+
+	/* And free whatever's been gone long enough that no thread can still be using it */
+	epoch_exit(0);
+	epoch_collect();
 }
 
-/* This function will capture a variety of signals.  When any of them occurs, it will display
- * the fact that it happened, then clean up and exit cleanly. */
+/* This function will display the fact that a signal happened, then clean up and exit cleanly.
+ * It's called from the main loop (see catch_signal()), except for a segfault, where there's
+ * no going back to it. */
 void die_gracefully(int signal)
 {
 	int i;
 
 	user_t **new_user_list;
-	int new_user_count;
+	uint32_t new_user_count;
 	user_t **old_user_list;
-	int old_user_count;
+	size_t old_user_count;
 
 	display_message(ERROR_EMERGENCY, "Signal caught, we're gonna die.. closing sockets first");
 
+	/* Keep the rooms for next time, unless something's gone wrong enough that they might
+	 * not make sense anymore */
+	if(signal != SIGSEGV && snapshot_save(TRUE))
+		display_message(ERROR_NOTICE, "Saved the rooms for next time");
+
 	if(listen_socket)
 		close(listen_socket);
+	if(datagram_socket)
+		close(datagram_socket);
 
 	/* Retrieve the list of new users */
 	new_user_list = (user_t **) list_get_array(new_users, &new_user_count);
@@ -853,7 +1707,7 @@ void die_gracefully(int signal)
 		close(get_socket(new_user_list[i]));
 
 	/* Retrieve the list of authenticated users */
-	old_user_list = (user_t **) get_values(old_users, &old_user_count);
+	old_user_list = user_directory_get_all(&old_user_count);
 	for(i = 0; i < old_user_count; i++)
 		close(get_socket(old_user_list[i]));
 
@@ -886,40 +1740,105 @@ void die_gracefully(int signal)
 	}
 }
 
+/* This function will capture a variety of signals.  Since one can arrive in the middle of
+ * anything, including changing a room or allocating memory, all it does is make a note of it,
+ * which the main loop sees at the end of the current trip (select() returns early when a
+ * signal arrives).  A segfault can't wait for that, so it goes straight to die_gracefully(). */
+void catch_signal(int signal)
+{
+	if(signal == SIGSEGV)
+		die_gracefully(signal);
+
+	caught_signal = signal;
+	if(signal_pipe[1] >= 0)
+		write(signal_pipe[1], "", 1);
+}
+
 int main(int argc, char *argv[])
 {
+	int i;
+
 	srand(time(NULL));
 	initialize_display();
 	set_display_header("SERVER");
 
 	new_users = list_create();
-	old_users = table_create();
-	rooms = table_create();
-
-	/* Initialize signals */
-	signal(SIGINT, die_gracefully);
-	signal(SIGQUIT, die_gracefully);
-	signal(SIGSEGV, die_gracefully);
-	signal(SIGTERM, die_gracefully);
+	user_directory_initialize();
+	room_directory_initialize();
+
+	/* Initialize signals.  The pipe is non-blocking, so the handler never waits for it. */
+	if(pipe(signal_pipe) < 0)
+		display_error(ERROR_EMERGENCY, "Couldn't open a pipe [%s]", strerror(errno));
+	fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK);
+	signal(SIGINT, catch_signal);
+	signal(SIGQUIT, catch_signal);
+	signal(SIGSEGV, catch_signal);
+	signal(SIGTERM, catch_signal);
+	/* A client that goes away shows up when its socket's read; OpenSSL doesn't write with
+	 * MSG_NOSIGNAL, so writing to it first mustn't kill the server */
+	signal(SIGPIPE, SIG_IGN);
 
 	if (argc < 2) 
-		display_error(ERROR_EMERGENCY, "Usage: %s <port>", argv[0]);
+		display_error(ERROR_EMERGENCY, "Usage: %s <port> [quiet room size [peer host:port ...]]", argv[0]);
 
-	display_message(ERROR_DEBUG, "Opening socket on port %s", argv[1]);
-	open_socket(atoi(argv[1]));
+	/* Rooms with this many people don't announce joins and leaves (0 means never) */
+	if (argc > 2)
+		presence_set_quiet_size(atoi(argv[2]));
 
-	if (listen_socket < 0) 
-		display_error(ERROR_EMERGENCY, "Error opening socket [%s]", strerror(errno));
+	/* Start the threads that send chat (see worker.h).  Rooms are given to them as they're
+	 * created, so this has to be before any are. */
+	worker_initialize();
 
-	display_message(ERROR_DEBUG, "Socket opened on port %s", argv[1]);
+	/* Pick the secret for session tokens (see token.h).  Like the TLS keys, it's replaced
+	 * by the old server's if this is an upgrade. */
+	token_initialize();
+
+	/* Offer TLS if there's a certificate (see tls.h).  This has to be before the handoff,
+	 * since the old server's ticket keys come with it. */
+	if(tls_initialize_server())
+		display_message(ERROR_NOTICE, "TLS is available (with %s)", TLS_CERTIFICATE);
+
+	/* If there's already a server on the port, this is an upgrade, so take over its sockets
+	 * and users instead of opening new ones */
+	snapshot_initialize(atoi(argv[1]));
+	if(!handoff_take(atoi(argv[1]), &listen_socket, &datagram_socket, new_users))
+	{
+		/* Otherwise, put back the rooms from before the last restart, if there are any */
+		snapshot_load();
+
+		display_message(ERROR_DEBUG, "Opening socket on port %s", argv[1]);
+		open_socket(atoi(argv[1]));
+
+		if (listen_socket < 0) 
+			display_error(ERROR_EMERGENCY, "Error opening socket [%s]", strerror(errno));
+
+		display_message(ERROR_DEBUG, "Socket opened on port %s", argv[1]);
+
+		datagram_socket = datagram_open(atoi(argv[1]));
+		display_message(ERROR_DEBUG, "Datagram socket opened on port %s", argv[1]);
+	}
+
+	/* Let the next upgrade take over from this one */
+	handoff_socket = handoff_open(atoi(argv[1]));
+
+	/* Link up with the other servers, if there are any (see federation.h) */
+	federation_initialize(atoi(argv[1]));
+	if(argc > 3 && !federation_load_key())
+		display_error(ERROR_EMERGENCY, "Peers need a shared secret of at least %d bytes in %s", FEDERATION_KEY_MINIMUM, FEDERATION_KEY);
+	for(i = 3; i < argc; i++)
+		if(!federation_add_peer(argv[i]))
+			display_error(ERROR_EMERGENCY, "Peer %s doesn't make sense; it should be host:port (and there can be up to %d)", argv[i], FEDERATION_MAX_PEERS);
+	federation_dial();
 
 	/* Set up the initial select_timeout */
 	select_timeout.tv_sec = KEEPALIVE;
 	select_timeout.tv_usec = 0;
 
-	while(TRUE)
+	while(!caught_signal)
 		do_select(listen_socket); 
 
+	die_gracefully(caught_signal);
+
 	destroy_display();
 
 	return 0;
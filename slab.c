@@ -0,0 +1,116 @@
+/* slab */
+/* This module is a simple slab allocator.  Each slab hands out objects of a single, fixed
+ * size.  Objects are carved out of big chunks of memory, so there's no per-object malloc()
+ * overhead, and freed objects are kept on a free list to be handed out again.  This is
+ * used for things there are a lot of, like users and rooms. */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+/* Objects are rounded up to this, so that any of them can hold a pointer or a 64-bit value */
+#define SLAB_ALIGNMENT 8
+
+/* The objects in a chunk start after the chunk header, rounded up for alignment */
+#define CHUNK_HEADER (((sizeof(slab_chunk_t) + SLAB_ALIGNMENT - 1) / SLAB_ALIGNMENT) * SLAB_ALIGNMENT)
+
+/* Allocate a new chunk, and put all its objects on the free list */
+static void add_chunk(slab_t *slab)
+{
+	size_t i;
+	uint8_t *objects;
+	slab_chunk_t *chunk = malloc(CHUNK_HEADER + (slab->object_size * slab->objects_per_chunk));
+
+	assert(chunk); /* Out of memory */
+
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+	slab->chunk_count++;
+
+	/* Link them up backwards, so they're handed out in address order */
+	objects = (uint8_t *) chunk + CHUNK_HEADER;
+	for(i = slab->objects_per_chunk; i > 0; i--)
+	{
+		*(void **) (objects + ((i - 1) * slab->object_size)) = slab->free_list;
+		slab->free_list = objects + ((i - 1) * slab->object_size);
+	}
+}
+
+/* Create a new slab for objects of the given size.  Memory is taken from the system
+ * objects_per_chunk objects at a time. */
+slab_t *slab_create(char *name, size_t object_size, size_t objects_per_chunk)
+{
+	slab_t *new_slab = malloc(sizeof(slab_t));
+
+	assert(objects_per_chunk > 0);
+
+	if(object_size < sizeof(void *))
+		object_size = sizeof(void *);
+
+	new_slab->name = name;
+	new_slab->object_size = ((object_size + SLAB_ALIGNMENT - 1) / SLAB_ALIGNMENT) * SLAB_ALIGNMENT;
+	new_slab->objects_per_chunk = objects_per_chunk;
+	new_slab->chunks = NULL;
+	new_slab->chunk_count = 0;
+	new_slab->free_list = NULL;
+	new_slab->in_use = 0;
+
+	return new_slab;
+}
+
+/* Destroy the slab, and every object in it */
+void slab_destroy(slab_t *slab)
+{
+	slab_chunk_t *chunk;
+	slab_chunk_t *old;
+
+	chunk = slab->chunks;
+	while(chunk)
+	{
+		old = chunk;
+		chunk = chunk->next;
+		free(old);
+	}
+	free(slab);
+}
+
+/* Get a new object from the slab.  The memory is NOT cleared. */
+void *slab_alloc(slab_t *slab)
+{
+	void *object;
+
+	if(slab->free_list == NULL)
+		add_chunk(slab);
+
+	object = slab->free_list;
+	slab->free_list = *(void **) object;
+	slab->in_use++;
+
+	return object;
+}
+
+/* Give an object back to the slab */
+void slab_free(slab_t *slab, void *object)
+{
+	assert(slab->in_use > 0);
+
+	*(void **) object = slab->free_list;
+	slab->free_list = object;
+	slab->in_use--;
+}
+
+/* Get the number of objects currently in use */
+size_t slab_get_count(slab_t *slab)
+{
+	return slab->in_use;
+}
+
+/* Get the number of bytes the slab has taken from the system */
+size_t slab_get_bytes(slab_t *slab)
+{
+	return slab->chunk_count * (CHUNK_HEADER + (slab->object_size * slab->objects_per_chunk));
+}
+
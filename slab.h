@@ -0,0 +1,60 @@
+/* slab */
+/* This module is a simple slab allocator.  Each slab hands out objects of a single, fixed
+ * size.  Objects are carved out of big chunks of memory, so there's no per-object malloc()
+ * overhead, and freed objects are kept on a free list to be handed out again.  This is
+ * used for things there are a lot of, like users and rooms.
+ *
+ * Chunks are never given back to the system; a slab only ever grows to the largest number
+ * of objects it has had in use at once. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <sys/types.h>
+
+/* A single chunk of objects.  This is prone to change, and should not be referenced */
+typedef struct _slab_chunk_t
+{
+	struct _slab_chunk_t *next;
+} slab_chunk_t;
+
+/* A definition of a slab.  I shouldn't have to say that any elements of this shouldn't
+ * be messed with. */
+typedef struct
+{
+	/* A short name, for statistics */
+	char *name;
+	/* The size of each object (rounded up for alignment), and the number in each chunk */
+	size_t object_size;
+	size_t objects_per_chunk;
+
+	/* Every chunk that's been allocated */
+	slab_chunk_t *chunks;
+	size_t chunk_count;
+
+	/* Freed objects.  The first bytes of each free object point to the next one */
+	void *free_list;
+
+	/* The number of objects currently handed out */
+	size_t in_use;
+} slab_t;
+
+/* Create a new slab for objects of the given size.  Memory is taken from the system
+ * objects_per_chunk objects at a time. */
+slab_t *slab_create(char *name, size_t object_size, size_t objects_per_chunk);
+/* Destroy the slab, and every object in it */
+void slab_destroy(slab_t *slab);
+
+/* Get a new object from the slab.  The memory is NOT cleared. */
+void *slab_alloc(slab_t *slab);
+/* Give an object back to the slab */
+void slab_free(slab_t *slab, void *object);
+
+/* Get the number of objects currently in use */
+size_t slab_get_count(slab_t *slab);
+/* Get the number of bytes the slab has taken from the system */
+size_t slab_get_bytes(slab_t *slab);
+
+#endif
+
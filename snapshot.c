@@ -0,0 +1,377 @@
+/* snapshot */
+/* This module writes the rooms to a snapshot file, and puts them back from it when the
+ * server restarts (see snapshot.h).  The file's written by a thread of its own, so the main
+ * thread never waits for the disk. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#include "atomic.h"
+#include "broadcast.h"
+#include "output.h"
+#include "room.h"
+#include "room_directory.h"
+#include "types.h"
+
+#include "snapshot.h"
+
+/* The size of the header: the magic, then six uint32_ts (see snapshot.h) */
+#define HEADER_LENGTH (4 + 6 * 4)
+
+/* The starting size of the buffer a snapshot is put together in; it doubles when it runs
+ * out of space */
+#define STARTING_SIZE 4096
+
+/* Where the snapshot goes, and the new one while it's being written */
+static char path[64];
+static char new_path[64];
+
+/* When the server started */
+static time_t started;
+
+/* A snapshot being put together */
+typedef struct
+{
+	uint8_t *data;
+	size_t length;
+	size_t size;
+} builder_t;
+
+/* The last snapshot that was put together.  Once it's been handed to the writer thread, only
+ * that thread touches it until it's done. */
+static builder_t builder;
+
+/* The thread writing the last snapshot to the disk, if "writing" is set, and whether it's
+ * finished yet */
+static pthread_t writer;
+static BOOLEAN writing = FALSE;
+static volatile BOOLEAN writer_done = FALSE;
+
+/* Make room for "length" more bytes */
+static void reserve(builder_t *builder, size_t length)
+{
+	while(builder->length + length > builder->size)
+	{
+		builder->size <<= 1;
+		builder->data = realloc(builder->data, builder->size);
+		assert(builder->data); /* Out of memory */
+	}
+}
+
+/* Add a number, a byte at a time, so it's little endian whatever this machine is */
+static void put_int(builder_t *builder, uint32_t value, size_t bytes)
+{
+	size_t i;
+
+	reserve(builder, bytes);
+	for(i = 0; i < bytes; i++)
+		builder->data[builder->length++] = value >> (i * 8);
+}
+
+/* Add some bytes */
+static void put_bytes(builder_t *builder, void *bytes, size_t length)
+{
+	if(length == 0)
+		return;
+
+	reserve(builder, length);
+	memcpy(builder->data + builder->length, bytes, length);
+	builder->length += length;
+}
+
+/* Get a number that put_int() added */
+static uint32_t get_int(uint8_t *data, size_t bytes)
+{
+	uint32_t value = 0;
+	size_t i;
+
+	for(i = 0; i < bytes; i++)
+		value |= (uint32_t) data[i] << (i * 8);
+
+	return value;
+}
+
+/* Decide where the snapshot goes */
+void snapshot_initialize(int port)
+{
+	sprintf(path, SNAPSHOT_PATH, port);
+	sprintf(new_path, SNAPSHOT_PATH ".new", port);
+	started = time(NULL);
+}
+
+/* Put back one room.  If there's already a room by that name (which can only happen if the
+ * snapshot has it twice), the first one wins. */
+static void restore_room(char *name, char *topic, uint16_t batch_window)
+{
+	room_t *room;
+
+	if(room_directory_find(name))
+		return;
+
+	room = room_directory_create(name);
+	if(*topic)
+		room_set_topic(room, topic);
+	room_set_batch_window(room, batch_window > BROADCAST_MAX_WINDOW ? BROADCAST_MAX_WINDOW : batch_window);
+	room_directory_keep_empty(room, time(NULL) + SNAPSHOT_GRACE_PERIOD);
+}
+
+/* Go through the rooms in a snapshot that's already been checked, putting each one back.
+ * Returns the number of rooms, or -1 if one of them runs past the end (which the checksum
+ * should have caught, so it means the server that wrote it was broken). */
+static long restore_rooms(uint8_t *data, size_t length, uint32_t count)
+{
+	char name[MAX_ROOM_LENGTH + 1];
+	char topic[MAX_TOPIC_LENGTH + 1];
+	size_t name_length;
+	size_t topic_length;
+	uint16_t batch_window;
+	size_t offset = 0;
+	uint32_t i;
+
+	for(i = 0; i < count; i++)
+	{
+		if(offset + 2 + 4 + 1 > length)
+			return -1;
+		batch_window = get_int(data + offset, 2);
+		name_length = data[offset + 2 + 4];
+		offset += 2 + 4 + 1;
+
+		if(name_length == 0 || name_length > MAX_ROOM_LENGTH || offset + name_length + 2 > length)
+			return -1;
+		memcpy(name, data + offset, name_length);
+		name[name_length] = '\0';
+		offset += name_length;
+
+		topic_length = get_int(data + offset, 2);
+		offset += 2;
+		if(topic_length > MAX_TOPIC_LENGTH || offset + topic_length > length)
+			return -1;
+		memcpy(topic, data + offset, topic_length);
+		topic[topic_length] = '\0';
+		offset += topic_length;
+
+		restore_room(name, topic, batch_window);
+	}
+
+	return offset == length ? (long) count : -1;
+}
+
+/* Put back the rooms from the last snapshot.  It's mapped rather than read, so nothing's
+ * copied that doesn't have to be, and the checksum is worked out straight from the file. */
+size_t snapshot_load()
+{
+	struct stat status;
+	struct timeval start;
+	struct timeval end;
+	uint8_t *map;
+	uint8_t *body;
+	uint32_t length;
+	uint32_t saved;
+	uint32_t count;
+	uint32_t people;
+	long restored = 0;
+	int fd;
+
+	gettimeofday(&start, NULL);
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return 0;
+
+	if(fstat(fd, &status) < 0 || status.st_size < HEADER_LENGTH)
+	{
+		display_message(ERROR_WARNING, "Snapshot %s is too short; starting with no rooms", path);
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		display_message(ERROR_WARNING, "Couldn't map snapshot %s [%s]; starting with no rooms", path, strerror(errno));
+		return 0;
+	}
+
+	body = map + HEADER_LENGTH;
+	length = get_int(map + 8, 4);
+	saved = get_int(map + 16, 4);
+	count = get_int(map + 20, 4);
+	people = get_int(map + 24, 4);
+
+	if(memcmp(map, SNAPSHOT_MAGIC, 4) != 0 || get_int(map + 4, 4) != SNAPSHOT_VERSION)
+		display_message(ERROR_WARNING, "Snapshot %s is from a different version; starting with no rooms", path);
+	else if(length != status.st_size - HEADER_LENGTH || crc32(crc32(0L, Z_NULL, 0), body, length) != get_int(map + 12, 4))
+		display_message(ERROR_WARNING, "Snapshot %s is corrupt; starting with no rooms", path);
+	else if((restored = restore_rooms(body, length, count)) < 0)
+		display_message(ERROR_WARNING, "Snapshot %s doesn't make sense; some of its rooms weren't put back", path);
+
+	munmap(map, status.st_size);
+
+	if(restored <= 0)
+		return 0;
+
+	gettimeofday(&end, NULL);
+	display_message(ERROR_NOTICE, "Put back %ld rooms (with %u people in them) from the snapshot taken %ld seconds ago, in %.3fms", restored, people, (long) (time(NULL) - saved), (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_usec - start.tv_usec) / 1000.0);
+
+	return restored;
+}
+
+/* Write a snapshot that's been put together to the disk.  The new one only replaces the old
+ * one once it's all safely there.  The data's freed either way. */
+static BOOLEAN write_snapshot(builder_t *builder)
+{
+	ssize_t written;
+	int fd;
+
+	fd = open(new_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(fd < 0)
+	{
+		display_message(ERROR_WARNING, "Couldn't write snapshot %s [%s]", new_path, strerror(errno));
+		free(builder->data);
+		return FALSE;
+	}
+
+	written = write(fd, builder->data, builder->length);
+	free(builder->data);
+
+	if(written != (ssize_t) builder->length || fsync(fd) < 0)
+	{
+		display_message(ERROR_WARNING, "Couldn't write snapshot %s [%s]", new_path, strerror(errno));
+		close(fd);
+		unlink(new_path);
+		return FALSE;
+	}
+	close(fd);
+
+	if(rename(new_path, path) < 0)
+	{
+		display_message(ERROR_WARNING, "Couldn't replace snapshot %s [%s]", path, strerror(errno));
+		unlink(new_path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* The writer thread: it just writes the snapshot it was given, then says it's done */
+static void *run_writer(void *arg)
+{
+	write_snapshot(arg);
+
+	ATOMIC_BARRIER();
+	writer_done = TRUE;
+
+	return NULL;
+}
+
+/* Wait for the writer thread to finish, if there is one.  Returns FALSE if it's still busy
+ * and "wait" is FALSE. */
+static BOOLEAN finish_writer(BOOLEAN wait)
+{
+	if(!writing)
+		return TRUE;
+	if(!wait && !writer_done)
+		return FALSE;
+
+	pthread_join(writer, NULL);
+	writing = FALSE;
+
+	return TRUE;
+}
+
+/* Write a new snapshot of the rooms.  The header's filled in last, once the length and
+ * checksum are known.  The rooms are only looked at here, on the main thread; all the writer
+ * thread gets is the finished snapshot. */
+BOOLEAN snapshot_save(BOOLEAN wait)
+{
+	sigset_t blocked;
+	sigset_t old;
+	room_t **rooms;
+	size_t count;
+	uint32_t people = 0;
+	size_t length;
+	size_t i;
+	int result;
+
+	/* If the last one's still being written (the disk must be very slow), this one's skipped;
+	 * there'll be another soon enough */
+	if(!finish_writer(wait))
+		return FALSE;
+
+	rooms = room_directory_get_all(&count);
+
+	/* Right after starting, the rooms from the snapshot might not be back yet (or it might
+	 * not have been loaded at all), so a good snapshot is never replaced with an empty one
+	 * until they've had time to be */
+	if(count == 0 && time(NULL) < started + SNAPSHOT_GRACE_PERIOD)
+	{
+		free(rooms);
+		return FALSE;
+	}
+
+	builder.size = STARTING_SIZE;
+	builder.length = HEADER_LENGTH;
+	builder.data = malloc(builder.size);
+	assert(builder.data); /* Out of memory */
+
+	for(i = 0; i < count; i++)
+	{
+		length = strlen(room_get_name(rooms[i]));
+		put_int(&builder, room_get_batch_window(rooms[i]), 2);
+		put_int(&builder, room_get_count(rooms[i]), 4);
+		put_int(&builder, length, 1);
+		put_bytes(&builder, room_get_name(rooms[i]), length);
+
+		length = rooms[i]->topic ? strlen(rooms[i]->topic) : 0;
+		put_int(&builder, length, 2);
+		put_bytes(&builder, rooms[i]->topic, length);
+
+		people += room_get_count(rooms[i]);
+	}
+	free(rooms);
+
+	length = builder.length;
+	builder.length = 0;
+	put_bytes(&builder, SNAPSHOT_MAGIC, 4);
+	put_int(&builder, SNAPSHOT_VERSION, 4);
+	put_int(&builder, length - HEADER_LENGTH, 4);
+	put_int(&builder, crc32(crc32(0L, Z_NULL, 0), builder.data + HEADER_LENGTH, length - HEADER_LENGTH), 4);
+	put_int(&builder, time(NULL), 4);
+	put_int(&builder, count, 4);
+	put_int(&builder, people, 4);
+	builder.length = length;
+
+	if(wait)
+		return write_snapshot(&builder);
+
+	/* Signals are the main thread's to deal with, like they are for the workers */
+	writer_done = FALSE;
+	sigfillset(&blocked);
+	sigprocmask(SIG_BLOCK, &blocked, &old);
+	result = pthread_create(&writer, NULL, run_writer, &builder);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+
+	if(result != 0)
+		return write_snapshot(&builder);
+
+	writing = TRUE;
+	return TRUE;
+}
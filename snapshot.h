@@ -0,0 +1,67 @@
+/* snapshot */
+/* This module keeps the rooms when the server is restarted (as opposed to upgraded; see
+ * handoff.h, which hands over everything that's live).  Every so often, and when the server
+ * is told to exit, every room that hasn't been reclaimed yet is written to a snapshot file:
+ * each one's name, topic, settings, and how many people were in it.  That includes the empty
+ * ones, so a room put back from the last snapshot is kept through the next one, even if
+ * nobody's come back to it yet.  When the server starts, and
+ * there's nobody to take over from, it maps the snapshot into memory and puts the rooms
+ * back, before it accepts anybody, so the people who reconnect find their rooms the way they
+ * left them (and with session tokens, they're put straight back in; see token.h).
+ *
+ * The rooms come back empty, so they're kept for SNAPSHOT_GRACE_PERIOD instead of the usual
+ * grace period (see room_directory.h), to give everybody time to come back.
+ *
+ * The file starts with a header: SNAPSHOT_MAGIC, SNAPSHOT_VERSION, the length and CRC-32 of
+ * the rest, when it was written, the number of rooms, and the number of people in them.  A
+ * snapshot with a different version, or that doesn't add up, is ignored (the server just
+ * starts with no rooms, like it always used to).  It's written to a new file, which then
+ * replaces the old one, so a crash partway through never leaves half of one behind.
+ *
+ * Everything's little endian, like the protocol (see protocol.h).  Each room is:
+ *  (uint16_t) batch window -- See /batch
+ *  (uint32_t) the number of people who were in it
+ *  (uint8_t) the length of the name, then the name (without a terminator)
+ *  (uint16_t) the length of the topic (0 if it doesn't have one), then the topic
+ *
+ * Statistics aren't kept; they start over, like they do after a handoff. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <sys/types.h>
+
+#include "types.h"
+
+/* The name of the snapshot, in the current directory; %d is the port */
+#define SNAPSHOT_PATH "server-%d.snapshot"
+
+/* The first four bytes of every snapshot */
+#define SNAPSHOT_MAGIC "CCsn"
+
+/* This goes up whenever the format changes, so a snapshot from an older server is never
+ * misread */
+#define SNAPSHOT_VERSION 1
+
+/* The number of seconds a room from a snapshot is kept, if nobody comes back to it */
+#define SNAPSHOT_GRACE_PERIOD (5 * 60)
+
+/* Decide where the snapshot goes.  This has to be called before anything else here. */
+void snapshot_initialize(int port);
+
+/* Put back the rooms from the last snapshot, if there is one and it's good.  This should
+ * only be done when the server's starting from nothing (not after a handoff).  Returns the
+ * number of rooms that were put back. */
+size_t snapshot_load();
+/* Write a new snapshot of the rooms.  Writing it can take a while (it has to be on the disk
+ * before it replaces the last one), so unless "wait" is set, that's done by another thread,
+ * and this returns as soon as it's started; if the last one's still being written, this one
+ * is skipped.  With "wait" set, it waits for that, then writes this one itself.  Returns
+ * FALSE if it wasn't written (or started), in which case the last one's still there.  An
+ * empty snapshot is never written until the server's been up for SNAPSHOT_GRACE_PERIOD, so
+ * restarting before everybody's back doesn't lose the rooms. */
+BOOLEAN snapshot_save(BOOLEAN wait);
+
+#endif
+
@@ -1,8 +1,8 @@
 /* table */
-/* This module is an implementation of a hashtable.  For now, I'm going to implement it
- * as a linked list with a linear search.  Definitely not the best solution, not even 
- * close, but I'll go back and fix it if there's time. */
-/* TODO: implement with a hashtable */
+/* This module is an implementation of a hashtable.  The keys are interned (see intern.h),
+ * so the table never makes its own copy of a key, and comparing two keys is just comparing
+ * two pointers.  The hash of every key is calculated once, when it's interned, so finding
+ * the right bucket is free too. */
 
 #include <stdio.h>
 #include <assert.h>
@@ -11,14 +11,71 @@
 
 #include <sys/types.h>
 
+#include "intern.h"
 #include "table.h"
 
+/* The number of buckets a table starts with, once something is added to it.  Most tables
+ * (like the users in a room) are small, so this starts small.  It has to be a power of 2. */
+#define STARTING_BUCKETS 4
+
+/* Get the bucket that an interned key belongs in */
+static table_member_t **get_bucket(table_member_t **buckets, size_t bucket_count, char *key)
+{
+	return &buckets[intern_get_hash(key) & (bucket_count - 1)];
+}
+
+/* Double the number of buckets, and move every entry into its new bucket */
+static void grow_table(table_t *table)
+{
+	size_t i;
+	size_t new_count = table->bucket_count ? table->bucket_count << 1 : STARTING_BUCKETS;
+	table_member_t **new_buckets = calloc(new_count, sizeof(table_member_t *));
+	table_member_t **bucket;
+	table_member_t *node;
+	table_member_t *next;
+
+	assert(new_buckets); /* Out of memory */
+
+	for(i = 0; i < table->bucket_count; i++)
+	{
+		for(node = table->buckets[i]; node; node = next)
+		{
+			next = node->next;
+			bucket = get_bucket(new_buckets, new_count, node->key);
+			node->next = *bucket;
+			*bucket = node;
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = new_buckets;
+	table->bucket_count = new_count;
+}
+
+/* Find the link that points at the entry for the given (interned) key.  If the key isn't 
+ * in the table, NULL is returned. */
+static table_member_t **find_link(table_t *table, char *key)
+{
+	table_member_t **link;
+
+	if(table->bucket_count == 0)
+		return NULL;
+
+	for(link = get_bucket(table->buckets, table->bucket_count, key); *link; link = &(*link)->next)
+		if((*link)->key == key)
+			return link;
+
+	return NULL;
+}
+
 /* Create and return a new table */
 table_t *table_create()
 {
 	table_t *new_table = malloc(sizeof(table_t));
 
-	new_table->first = NULL;
+	new_table->buckets = NULL;
+	new_table->bucket_count = 0;
+	new_table->count = 0;
 
 	return new_table;
 }
@@ -26,17 +83,22 @@ table_t *table_create()
 /* This should be called when a table is no longer being used.  It frees memory and stuff. */
 void table_destroy(table_t *table)
 {
+	size_t i;
 	table_member_t *node;
 	table_member_t *old;
 
-	node = table->first;
-	while(node)
+	for(i = 0; i < table->bucket_count; i++)
 	{
-		old = node;
-		node = node->next;
-		free(old->key);
-		free(old);
+		node = table->buckets[i];
+		while(node)
+		{
+			old = node;
+			node = node->next;
+			intern_release(old->key);
+			free(old);
+		}
 	}
+	free(table->buckets);
 	free(table);
 }
 
@@ -44,113 +106,95 @@ void table_destroy(table_t *table)
  * is replaced */
 void table_add(table_t *table, char *key, void *value)
 {
-	table_member_t *node;
-	table_member_t *old = NULL;
+	table_member_t **link;
+	table_member_t *new;
 
-	table_member_t *new = malloc(sizeof(table_member_t));
-	/* Warning: if strncpy() isn't used, a heap overflow could occur here */
-	new->key = malloc((strlen(key) + 1) * sizeof(char));
-	strncpy(new->key, key, strlen(key) + 1);
-	new->key[strlen(key)] = '\0';
-	new->value = value;
-	new->next = NULL;
+	/* This takes a reference to the key, which belongs to the table from here on */
+	key = intern_string(key);
 
-	node = table->first;
-	while(node)
+	link = find_link(table, key);
+	if(link)
 	{
-		if(!(strcmp(key, node->key)))
-		{
-			node->value = value;
-			return;
-		}
-		old = node;
-		node = node->next;
+		(*link)->value = value;
+		/* The table already had a reference to this key */
+		intern_release(key);
+		return;
 	}
 
-	if(old)
-		old->next = new;
-	else
-		table->first = new;
+	if(table->count >= table->bucket_count)
+		grow_table(table);
 
+	new = malloc(sizeof(table_member_t));
+	new->key = key;
+	new->value = value;
+
+	link = get_bucket(table->buckets, table->bucket_count, key);
+	new->next = *link;
+	*link = new;
+
+	table->count++;
 }
 
 /* Find and return the value for the specified key.  Returns NULL if the key wasn't found */
 void *table_find(table_t *table, char *key)
 {
-	table_member_t *node;
+	table_member_t **link;
 
-	node = table->first;
-	while(node)
-	{
-		if(!strcmp(node->key, key))
-			return node->value;
+	/* If the key isn't interned, nobody can have added it */
+	key = intern_find(key);
+	if(key == NULL)
+		return NULL;
 
-		node = node->next;
-	}
+	link = find_link(table, key);
 
-	return NULL;
+	return link ? (*link)->value : NULL;
 }
 
 /* Remove and return the value for the specified key.  Returns NULL if the key wasn't found */
 void *table_remove(table_t *table, char *key)
 {
+	table_member_t **link;
 	table_member_t *node;
-	table_member_t *old = NULL;
 	void *ret;
 
-	node = table->first;
-	while(node)
-	{
-		if(!(strcmp(key, node->key)))
-		{
-			/* Found it! */
-			if(old)
-				old->next = node->next;
-			else
-				table->first = node->next;
+	key = intern_find(key);
+	if(key == NULL)
+		return NULL;
 
-			ret = node->value;
-			free(node->key);
-			free(node);
+	link = find_link(table, key);
+	if(link == NULL)
+		return NULL;
 
-			return ret;
-		}
+	/* Found it! */
+	node = *link;
+	*link = node->next;
+	table->count--;
 
-		old = node;
-		node = node->next;
-	}
+	ret = node->value;
+	intern_release(node->key);
+	free(node);
 
-	return NULL;
+	return ret;
 }
 
 /* Get an array of all keys in the table, in no particular order.  The number of keys 
  * returned is returned in count. 
- * NOTE: This has to be free'd! Also, this returns pointers to the ACTUAL keys, which will 
- * be free'd when the table is destroyed, so if you intend to use them for long-term make
- * a copy. */
+ * NOTE: This has to be free'd! Also, this returns pointers to the ACTUAL (interned) keys,
+ * which will be released when they're removed from the table, so if you intend to use them
+ * for long-term make a copy (or take a reference with intern_hold()). */
 char **get_keys(table_t *table, size_t *count)
 {
 	table_member_t *node;
 	char **ret;
-	int i;
-
-	*count = 0;
-
-	node = table->first;
-	while(node)
-	{
-		(*count)++;
-		node = node->next;
-	}
+	size_t i;
+	size_t j = 0;
 
+	*count = table->count;
 	ret = malloc(*count * sizeof(char*));
 
-	node = table->first;
-	for(i = 0; i < *count; i++)
-	{
-		ret[i] = node->key;
-		node = node->next;
-	}
+	for(i = 0; i < table->bucket_count; i++)
+		for(node = table->buckets[i]; node; node = node->next)
+			ret[j++] = node->key;
 
 	return ret;	
 }
@@ -162,44 +206,23 @@ void **get_values(table_t *table, size_t *count)
 {
 	table_member_t *node;
 	void **ret;
-	int i;
-
-	*count = 0;
-
-	node = table->first;
-	while(node)
-	{
-		(*count)++;
-		node = node->next;
-	}
+	size_t i;
+	size_t j = 0;
 
+	*count = table->count;
 	ret = malloc(*count * sizeof(void*));
 
-	node = table->first;
-	for(i = 0; i < *count; i++)
-	{
-		ret[i] = node->value;
-		node = node->next;
-	}
+	for(i = 0; i < table->bucket_count; i++)
+		for(node = table->buckets[i]; node; node = node->next)
+			ret[j++] = node->value;
 
 	return ret;	
 }
 
 /* Get the number of entries in the table */
-/* TODO: this implementation sucks.  Find a better way. */
 size_t table_get_count(table_t *table)
 {
-	table_member_t *node;
-	size_t count = 0;
-
-	node = table->first;
-	while(node)
-	{
-		count++;
-		node = node->next;
-	}
-
-	return count;
+	return table->count;
 }
 
 /* Display the table; this is more for debugging than anything, it's not really useful for 
@@ -207,16 +230,16 @@ size_t table_get_count(table_t *table)
 void table_print(table_t *table)
 {
 	table_member_t *node;
-	int i = 0;
-
-	node = table->first;
+	size_t i;
+	int j = 0;
 
-	while(node)
+	for(i = 0; i < table->bucket_count; i++)
 	{
-		i++;
-		printf("%3d - %s ==> %p [%p]\n", i, node->key, node->value, node->next);
-
-		node = node->next;
+		for(node = table->buckets[i]; node; node = node->next)
+		{
+			j++;
+			printf("%3d - %s ==> %p [bucket %u]\n", j, node->key, node->value, (unsigned int) i);
+		}
 	}
 }
 
@@ -1,9 +1,9 @@
 /* table */
-/* This module is an implementation of a hashtable.  For now, I'm going to implement it
- * as a linked list with a linear search.  Definitely not the best solution, not even 
- * close, but I'll go back and fix it if there's time. */
+/* This module is an implementation of a hashtable.  The keys are interned (see intern.h),
+ * so the table never makes its own copy of a key, and comparing two keys is just comparing
+ * two pointers.  The hash of every key is calculated once, when it's interned, so finding
+ * the right bucket is free too. */
 /* NOTE: These functions are NOT thread-safe. */
-/* TODO: implement with a hashtable */
 
 #ifndef _TABLE_H_
 #define _TABLE_H_
@@ -13,8 +13,10 @@
 /* A member of the table.  This is prone to change, and should not be referenced */
 typedef struct _table_member_t
 {
+	/* The key, which is an interned string */
 	char *key;
 	void *value;
+	/* The next member in the same bucket */
 	struct _table_member_t *next;
 } table_member_t;
 
@@ -22,7 +24,11 @@ typedef struct _table_member_t
  * be messed with. */
 typedef struct
 {
-	table_member_t *first;
+	/* The buckets; the number of them is always a power of 2 */
+	table_member_t **buckets;
+	size_t bucket_count;
+	/* The number of entries in the table */
+	size_t count;
 } table_t;
 
 /* Create and return a new table */
@@ -37,20 +43,20 @@ void table_add(table_t *table, char *key, void *value);
 void *table_find(table_t *table, char *key);
 /* Remove and return the value for the specified key.  Returns NULL if the key wasn't found */
 void *table_remove(table_t *table, char *key);
-/* Get an array of all keys in the table, in no paricular order.  The number of keys returned 
- * is returned in count. 
- * NOTE: This has to be free'd! Also, this returns pointers to the ACTUAL keys, which will 
- * be free'd when the table is destroyed, so if you intend to use them for long-term make
- * a copy. */
+/* Get an array of all keys in the table, in no particular order.  The number of keys
+ * returned is returned in count.
+ * NOTE: This has to be free'd! Also, this returns pointers to the ACTUAL (interned) keys,
+ * which will be released when they're removed from the table, so if you intend to use them
+ * for long-term make a copy (or take a reference with intern_hold()). */
 char **get_keys(table_t *table, size_t *count);
-/* Get an array of all values in the table, in no paricular order.  The number of values 
- * returned is returned in count. 
+/* Get an array of all values in the table, in no particular order.  The number of values
+ * returned is returned in count.
  * NOTE: This has to be free'd! */
 void **get_values(table_t *table, size_t *count);
 /* Get the number of entries in the table */
 size_t table_get_count(table_t *table);
 
-/* Display the table; this is more for debugging than anything, it's not really useful for 
+/* Display the table; this is more for debugging than anything, it's not really useful for
  * anything else */
 void table_print(table_t *table);
 
@@ -0,0 +1,739 @@
+/* tls */
+/* This module wraps connections in TLS (with OpenSSL).  Every connection is known by its
+ * socket, and anything that isn't using TLS is passed straight through to the socket (see
+ * tls.h). */
+/* NOTE: These functions are NOT thread-safe. */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#ifdef __sun
+#include <sys/filio.h>
+#endif
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+
+#include "cputime.h"
+#include "output.h"
+#include "packet_buffer.h"
+#include "types.h"
+
+#include "tls.h"
+
+/* The first byte of a TLS handshake record */
+#define HANDSHAKE_RECORD 0x16
+
+/* Identifies this server's sessions, so they aren't resumed somewhere else */
+#define SESSION_CONTEXT "cattle chat"
+
+/* One connection's TLS state */
+typedef struct
+{
+	SSL *ssl;
+
+	/* Whether the handshake is still going, and if so, whether it's waiting to write */
+	BOOLEAN handshaking;
+	BOOLEAN wants_write;
+
+	/* Whether the kernel is doing the encryption for what's written (kTLS) */
+	BOOLEAN offloaded;
+} session_t;
+
+/* Every connection that's using TLS, by socket.  Nothing past FD_SETSIZE can be given to
+ * select() anyways. */
+static session_t *sessions[FD_SETSIZE];
+
+/* Everything the connections have in common (the certificate, the session cache, etc.), or
+ * NULL if TLS isn't being used */
+static SSL_CTX *context = NULL;
+
+/* Totals, for statistics */
+static uint32_t total_handshakes = 0;
+static uint32_t total_resumed = 0;
+static uint32_t total_failed = 0;
+static uint32_t total_offloaded = 0;
+/* In microseconds of the handshaking thread's own CPU time (see cputime.h), so it isn't
+ * mixed up with the workers' compressing */
+static size_t total_cpu = 0;
+
+/* Get a connection's TLS state, or NULL if it isn't using TLS */
+static session_t *find_session(int socket)
+{
+	if(socket < 0 || socket >= FD_SETSIZE)
+		return NULL;
+	return sessions[socket];
+}
+
+/* Log everything OpenSSL has to say about what just went wrong */
+static void log_errors(char *what)
+{
+	unsigned long error;
+	char description[256];
+
+	while((error = ERR_get_error()) != 0)
+	{
+		ERR_error_string_n(error, description, sizeof(description));
+		display_message(ERROR_DEBUG, "%s: %s", what, description);
+	}
+}
+
+/* Set up what the server's and the client's contexts have in common */
+static void create_context(const SSL_METHOD *method)
+{
+	OPENSSL_init_ssl(0, NULL);
+
+	context = SSL_CTX_new(method);
+	if(context == NULL)
+		display_error(ERROR_EMERGENCY, "Couldn't set up TLS");
+
+	SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+	/* Writes are never all-or-nothing (see tls_send_nowait()), and whatever's left is
+	 * written again from wherever the outbox has moved it to */
+	SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+/* Set up the server's side of TLS */
+BOOLEAN tls_initialize_server()
+{
+	if(access(TLS_CERTIFICATE, R_OK) != 0 || access(TLS_KEY, R_OK) != 0)
+		return FALSE;
+
+	create_context(TLS_server_method());
+
+	if(SSL_CTX_use_certificate_chain_file(context, TLS_CERTIFICATE) != 1 || SSL_CTX_use_PrivateKey_file(context, TLS_KEY, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(context) != 1)
+	{
+		log_errors("Loading the certificate");
+		display_error(ERROR_EMERGENCY, "Couldn't load the TLS certificate (%s) and key (%s)", TLS_CERTIFICATE, TLS_KEY);
+	}
+
+	/* Resuming is cheap, so clients get a ticket, and clients that don't take tickets are
+	 * remembered here.  One ticket is plenty, since a client only connects once at a
+	 * time. */
+	SSL_CTX_set_session_id_context(context, (unsigned char *) SESSION_CONTEXT, strlen(SESSION_CONTEXT));
+	SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(context, TLS_SESSION_CACHE);
+	SSL_CTX_set_num_tickets(context, 1);
+
+	return TRUE;
+}
+
+/* A new session arrived from the server; keep it for next time.  It's written so that only
+ * this user can read it, since anybody with it could pretend to be this client. */
+static int save_session(SSL *ssl, SSL_SESSION *session)
+{
+	FILE *file;
+	int fd = open(TLS_SESSION_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+	if(fd < 0)
+		return 0;
+
+	file = fdopen(fd, "w");
+	if(file == NULL)
+	{
+		close(fd);
+		return 0;
+	}
+
+	PEM_write_SSL_SESSION(file, session);
+	fclose(file);
+
+	/* OpenSSL keeps its reference */
+	return 0;
+}
+
+/* Set up the client's side of TLS */
+void tls_initialize_client()
+{
+	create_context(TLS_client_method());
+
+	/* Trust the usual certificate authorities, and the server's own certificate if it's
+	 * here */
+	SSL_CTX_set_default_verify_paths(context);
+	if(access(TLS_CERTIFICATE, R_OK) == 0)
+		SSL_CTX_load_verify_locations(context, TLS_CERTIFICATE, NULL);
+	SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+
+	/* Sessions are kept in TLS_SESSION_FILE, not in memory, since the client only connects
+	 * once per run */
+	SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(context, save_session);
+}
+
+/* Whether the server is offering TLS */
+BOOLEAN tls_is_enabled()
+{
+	return context != NULL;
+}
+
+/* Whether the next byte from a new connection starts a TLS handshake */
+BOOLEAN tls_is_hello(int socket)
+{
+	uint8_t first;
+
+	return recv(socket, &first, 1, MSG_PEEK) == 1 && first == HANDSHAKE_RECORD;
+}
+
+/* Start using TLS on a socket */
+static session_t *create_session(int socket)
+{
+	session_t *session;
+
+	assert(socket >= 0 && socket < FD_SETSIZE && context);
+
+	/* If it was never closed properly, the old one's gone now */
+	tls_close(socket);
+
+	session = malloc(sizeof(session_t));
+	assert(session); /* Out of memory */
+
+	session->ssl = SSL_new(context);
+	assert(session->ssl); /* Out of memory */
+	SSL_set_fd(session->ssl, socket);
+	session->handshaking = TRUE;
+	session->wants_write = FALSE;
+	session->offloaded = FALSE;
+
+	sessions[socket] = session;
+
+	return session;
+}
+
+/* The handshake is done; count it, and see whether the kernel took over */
+static void finish_handshake(session_t *session, int socket)
+{
+	session->handshaking = FALSE;
+	session->wants_write = FALSE;
+
+	total_handshakes++;
+	if(SSL_session_reused(session->ssl))
+		total_resumed++;
+
+#ifdef SSL_OP_ENABLE_KTLS
+	if(BIO_get_ktls_send(SSL_get_wbio(session->ssl)))
+	{
+		session->offloaded = TRUE;
+		total_offloaded++;
+	}
+#endif
+
+	display_message(ERROR_DEBUG, "TLS handshake on socket %d done (%s, %s%s)", socket, SSL_get_version(session->ssl), SSL_get_cipher_name(session->ssl), SSL_session_reused(session->ssl) ? ", resumed" : "");
+}
+
+/* Start the server's side of a handshake on a new connection */
+void tls_accept(int socket)
+{
+	session_t *session = create_session(socket);
+
+	/* The handshake can't wait on anybody */
+	fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+	SSL_set_accept_state(session->ssl);
+}
+
+/* Take the next step of the handshake */
+int tls_handshake(int socket)
+{
+	session_t *session = find_session(socket);
+	size_t start = cputime_get();
+	int result;
+
+	if(session == NULL || !session->handshaking)
+		return session ? 1 : -1;
+
+	result = SSL_do_handshake(session->ssl);
+	total_cpu += cputime_get() - start;
+
+	if(result == 1)
+	{
+		finish_handshake(session, socket);
+		return 1;
+	}
+
+	switch(SSL_get_error(session->ssl, result))
+	{
+		case SSL_ERROR_WANT_READ:
+			session->wants_write = FALSE;
+			return 0;
+
+		case SSL_ERROR_WANT_WRITE:
+			session->wants_write = TRUE;
+			return 0;
+
+		default:
+			log_errors("TLS handshake");
+			display_message(ERROR_NOTICE, "TLS handshake on socket %d failed", socket);
+			total_failed++;
+			return -1;
+	}
+}
+
+/* Do the client's side of a handshake, all at once */
+BOOLEAN tls_connect(int socket, char *host)
+{
+	session_t *session = create_session(socket);
+	SSL_SESSION *saved = NULL;
+	FILE *file;
+
+	SSL_set_tlsext_host_name(session->ssl, host);
+	SSL_set1_host(session->ssl, host);
+
+	/* If the ticket's for another server, or it's expired, it just isn't used */
+	file = fopen(TLS_SESSION_FILE, "r");
+	if(file)
+	{
+		saved = PEM_read_SSL_SESSION(file, NULL, NULL, NULL);
+		fclose(file);
+	}
+	if(saved)
+	{
+		SSL_set_session(session->ssl, saved);
+		SSL_SESSION_free(saved);
+	}
+
+	if(SSL_connect(session->ssl) != 1)
+	{
+		log_errors("TLS handshake");
+		if(SSL_get_verify_result(session->ssl) != X509_V_OK)
+			display_message(ERROR_ERROR, "The server's certificate couldn't be trusted: %s", X509_verify_cert_error_string(SSL_get_verify_result(session->ssl)));
+		tls_close(socket);
+		return FALSE;
+	}
+
+	finish_handshake(session, socket);
+
+	return TRUE;
+}
+
+/* Whether a connection is using TLS */
+BOOLEAN tls_is_secure(int socket)
+{
+	return find_session(socket) != NULL;
+}
+
+/* Whether a connection is still in the middle of its handshake */
+BOOLEAN tls_is_handshaking(int socket)
+{
+	session_t *session = find_session(socket);
+
+	return session && session->handshaking;
+}
+/* And whether it's waiting to write */
+BOOLEAN tls_wants_write(int socket)
+{
+	session_t *session = find_session(socket);
+
+	return session && session->handshaking && session->wants_write;
+}
+
+/* Whether there's data that's been decrypted, but not read yet */
+BOOLEAN tls_has_pending(int socket)
+{
+	session_t *session = find_session(socket);
+
+	return session && !session->handshaking && SSL_pending(session->ssl) > 0;
+}
+
+/* Wait until the socket is ready for reading (or writing), for up to TLS_READ_WAIT seconds.
+ * Returns FALSE if it never was. */
+static BOOLEAN wait_for(int socket, BOOLEAN writing)
+{
+	fd_set set;
+	struct timeval timeout;
+
+	FD_ZERO(&set);
+	FD_SET(socket, &set);
+	timeout.tv_sec = TLS_READ_WAIT;
+	timeout.tv_usec = 0;
+
+	return select(socket + 1, writing ? NULL : &set, writing ? &set : NULL, NULL, &timeout) > 0;
+}
+
+/* Read exactly "length" bytes */
+ssize_t tls_read(int socket, void *buffer, size_t length)
+{
+	session_t *session = find_session(socket);
+	size_t got = 0;
+	int result;
+	int error;
+
+	if(session == NULL)
+		return read(socket, buffer, length);
+	if(session->handshaking)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	while(got < length)
+	{
+		result = SSL_read(session->ssl, (uint8_t *) buffer + got, length - got);
+		if(result > 0)
+		{
+			got += result;
+			continue;
+		}
+
+		error = SSL_get_error(session->ssl, result);
+		if(error == SSL_ERROR_ZERO_RETURN)
+			break;
+		/* Only part of a record has arrived; wait for the rest */
+		if((error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) && wait_for(socket, error == SSL_ERROR_WANT_WRITE))
+			continue;
+
+		log_errors("TLS read");
+		if(got == 0)
+			return -1;
+		break;
+	}
+
+	return got;
+}
+
+/* Look at what's already arrived, without reading it */
+ssize_t tls_peek(int socket, void *buffer, size_t length)
+{
+	session_t *session = find_session(socket);
+	int available = 0;
+	ssize_t result;
+
+	if(session == NULL)
+	{
+		if(ioctl(socket, FIONREAD, &available) != 0 || available <= 0)
+			return 0;
+		result = recv(socket, buffer, (size_t) available < length ? (size_t) available : length, MSG_PEEK);
+		return result < 0 ? 0 : result;
+	}
+
+	/* Only what's left of the record that's been decrypted can be looked at */
+	available = SSL_pending(session->ssl);
+	if(session->handshaking || available <= 0)
+		return 0;
+	result = SSL_peek(session->ssl, buffer, (size_t) available < length ? (size_t) available : length);
+	return result < 0 ? 0 : result;
+}
+
+/* Write all of the bytes, waiting if need be */
+ssize_t tls_write(int socket, void *data, size_t length)
+{
+	session_t *session = find_session(socket);
+	size_t written = 0;
+	int result;
+	int error;
+
+	if(session == NULL)
+		return write(socket, data, length);
+
+	while(written < length)
+	{
+		result = SSL_write(session->ssl, (uint8_t *) data + written, length - written > TLS_RECORD ? TLS_RECORD : length - written);
+		if(result > 0)
+		{
+			written += result;
+			continue;
+		}
+
+		error = SSL_get_error(session->ssl, result);
+		if((error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) || !wait_for(socket, error == SSL_ERROR_WANT_WRITE))
+		{
+			log_errors("TLS write");
+			errno = EPIPE;
+			return -1;
+		}
+	}
+
+	return written;
+}
+
+/* Write as much as the connection will take right now */
+ssize_t tls_send_nowait(int socket, struct iovec *iov, size_t count)
+{
+	session_t *session = find_session(socket);
+	/* Gathered writes are copied here, since a TLS record has to be written in one piece.
+	 * It's on the stack, since chat can be sent from more than one thread (see worker.h). */
+	uint8_t gathered[TLS_RECORD];
+	struct msghdr message;
+	size_t length = 0;
+	size_t i;
+	int result;
+	int error;
+
+	assert(session);
+
+	/* Nothing can be written until the handshake's done; the server only waits for it to
+	 * be readable then (see tls_wants_write()), so this waits too */
+	if(session->handshaking)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* If the kernel's doing the encryption, it can take the pieces as they are */
+	if(session->offloaded)
+	{
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = iov;
+		message.msg_iovlen = count;
+		return sendmsg(socket, &message, MSG_DONTWAIT);
+	}
+
+	/* Otherwise, they're put together into one record.  If the last write didn't go out,
+	 * this starts with the same bytes (the outbox keeps them), and there are at least as
+	 * many of them, which is what OpenSSL needs to finish it. */
+	for(i = 0; i < count && length < TLS_RECORD; i++)
+	{
+		size_t piece = iov[i].iov_len < TLS_RECORD - length ? iov[i].iov_len : TLS_RECORD - length;
+
+		memcpy(gathered + length, iov[i].iov_base, piece);
+		length += piece;
+	}
+
+	if(length == 0)
+		return 0;
+
+	result = SSL_write(session->ssl, gathered, length);
+	if(result > 0)
+		return result;
+
+	error = SSL_get_error(session->ssl, result);
+	if(error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ)
+	{
+		errno = EAGAIN;
+	}
+	else
+	{
+		log_errors("TLS write");
+		errno = EPIPE;
+	}
+
+	return -1;
+}
+
+/* Forget about a connection */
+void tls_close(int socket)
+{
+	session_t *session = find_session(socket);
+
+	if(session == NULL)
+		return;
+
+	/* Say goodbye if it's easy; if it isn't, the other end will figure it out */
+	if(!session->handshaking)
+		SSL_shutdown(session->ssl);
+	ERR_clear_error();
+
+	SSL_free(session->ssl);
+	free(session);
+	sessions[socket] = NULL;
+}
+
+/* Save the session ticket keys into a record */
+void tls_save_keys(packet_buffer_t *record)
+{
+	uint8_t keys[TLS_TICKET_KEYS];
+
+	SSL_CTX_get_tlsext_ticket_keys(context, keys, sizeof(keys));
+	add_bytes(record, keys, sizeof(keys));
+}
+/* Use the ones from a record */
+BOOLEAN tls_restore_keys(packet_buffer_t *record)
+{
+	uint8_t keys[TLS_TICKET_KEYS];
+
+	if(!can_read_bytes(record, sizeof(keys)))
+		return FALSE;
+
+	read_next_bytes(record, keys, sizeof(keys));
+	SSL_CTX_set_tlsext_ticket_keys(context, keys, sizeof(keys));
+
+	return TRUE;
+}
+
+/* Get the totals so far.  This is for statistics. */
+void tls_get_totals(uint32_t *handshakes, uint32_t *resumed, uint32_t *failed, uint32_t *offloaded, double *cpu_seconds)
+{
+	*handshakes = total_handshakes;
+	*resumed = total_resumed;
+	*failed = total_failed;
+	*offloaded = total_offloaded;
+	*cpu_seconds = total_cpu / 1000000.0;
+}
+
+/*
+#include <sys/time.h>
+
+static double now()
+{
+	struct timeval time;
+
+	gettimeofday(&time, NULL);
+	return time.tv_sec + time.tv_usec / 1000000.0;
+}
+
+static SSL_SESSION *handshake(SSL_CTX *client_context, SSL_SESSION *session, int *resumed)
+{
+	int ends[2];
+	SSL *client;
+	SSL *server;
+	int client_done = 0;
+	int server_done = 0;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, ends);
+	fcntl(ends[0], F_SETFL, O_NONBLOCK);
+	fcntl(ends[1], F_SETFL, O_NONBLOCK);
+
+	client = SSL_new(client_context);
+	SSL_set_fd(client, ends[0]);
+	SSL_set_connect_state(client);
+	if(session)
+		SSL_set_session(client, session);
+	server = SSL_new(context);
+	SSL_set_fd(server, ends[1]);
+	SSL_set_accept_state(server);
+
+	while(!client_done || !server_done)
+	{
+		if(!client_done)
+			client_done = SSL_do_handshake(client) == 1;
+		if(!server_done)
+			server_done = SSL_do_handshake(server) == 1;
+	}
+
+	SSL_write(server, "x", 1);
+	SSL_read(client, (char *) &client_done, 1);
+
+	*resumed = SSL_session_reused(client);
+	session = SSL_get1_session(client);
+	SSL_shutdown(client);
+	SSL_shutdown(server);
+	SSL_free(client);
+	SSL_free(server);
+	close(ends[0]);
+	close(ends[1]);
+
+	return session;
+}
+
+static void bulk(BOOLEAN secure, size_t megabytes)
+{
+	int ends[2];
+	SSL_CTX *client_context = SSL_CTX_new(TLS_client_method());
+	SSL *client = NULL;
+	SSL *server = NULL;
+	uint8_t buffer[TLS_RECORD];
+	size_t total = megabytes << 20;
+	size_t sent = 0;
+	size_t received = 0;
+	double start;
+	clock_t cpu;
+	int result;
+	int done = 0;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, ends);
+	fcntl(ends[0], F_SETFL, O_NONBLOCK);
+	fcntl(ends[1], F_SETFL, O_NONBLOCK);
+	memset(buffer, 'x', sizeof(buffer));
+
+	if(secure)
+	{
+		client = SSL_new(client_context);
+		SSL_set_fd(client, ends[0]);
+		SSL_set_connect_state(client);
+		server = SSL_new(context);
+		SSL_set_fd(server, ends[1]);
+		SSL_set_accept_state(server);
+		while(done != 3)
+		{
+			if(!(done & 1) && SSL_do_handshake(client) == 1)
+				done |= 1;
+			if(!(done & 2) && SSL_do_handshake(server) == 1)
+				done |= 2;
+		}
+	}
+
+	start = now();
+	cpu = clock();
+	while(received < total)
+	{
+		if(sent < total)
+		{
+			result = secure ? SSL_write(server, buffer, sizeof(buffer)) : write(ends[1], buffer, sizeof(buffer));
+			if(result > 0)
+				sent += result;
+		}
+		result = secure ? SSL_read(client, buffer, sizeof(buffer)) : read(ends[0], buffer, sizeof(buffer));
+		if(result > 0)
+			received += result;
+	}
+
+	printf("%-10s %4u MB in %.3f seconds (%.0f MB/s), %.3f seconds of CPU\n", secure ? "TLS" : "Plaintext", (unsigned int) megabytes, now() - start, megabytes / (now() - start), (double) (clock() - cpu) / CLOCKS_PER_SEC);
+
+	if(secure)
+	{
+		SSL_free(client);
+		SSL_free(server);
+	}
+	SSL_CTX_free(client_context);
+	close(ends[0]);
+	close(ends[1]);
+}
+
+int main(int argc, char *argv[])
+{
+	SSL_CTX *client_context;
+	SSL_SESSION *session = NULL;
+	SSL_SESSION *next;
+	double start;
+	int resumed;
+	int count = 0;
+	int i;
+
+	if(!tls_initialize_server())
+	{
+		printf("This needs %s and %s in the current directory\n", TLS_CERTIFICATE, TLS_KEY);
+		return 1;
+	}
+	client_context = SSL_CTX_new(TLS_client_method());
+
+	start = now();
+	for(i = 0; i < 500; i++)
+	{
+		next = handshake(client_context, NULL, &resumed);
+		SSL_SESSION_free(next);
+	}
+	printf("Full handshakes:    %6.0f per second\n", 500 / (now() - start));
+
+	session = handshake(client_context, NULL, &resumed);
+	start = now();
+	for(i = 0; i < 500; i++)
+	{
+		next = handshake(client_context, session, &resumed);
+		count += resumed;
+		SSL_SESSION_free(session);
+		session = next;
+	}
+	printf("Resumed handshakes: %6.0f per second (%d of 500 resumed)\n", 500 / (now() - start), count);
+	SSL_SESSION_free(session);
+
+	bulk(FALSE, 256);
+	bulk(TRUE, 256);
+
+	return 0;
+}
+*/
@@ -0,0 +1,123 @@
+/* tls */
+/* This module wraps connections in TLS (with OpenSSL, which was already being linked for
+ * SHA1), so chat and login hashes don't cross the network in the clear.  It's optional: the
+ * server only offers it if it finds TLS_CERTIFICATE and TLS_KEY in the current directory,
+ * and it's offered on the usual port.  A TLS connection starts with a handshake record
+ * (0x16) where everybody else starts with a packet (0xFF), so the server can tell them apart
+ * from the first byte, and clients that don't want TLS don't notice anything.
+ *
+ * Every connection is known by its socket.  Anything that reads or writes a socket goes
+ * through here (tls_read(), tls_write(), tls_send_nowait()), which passes it straight to
+ * the socket if the connection isn't using TLS.
+ *
+ * The server's handshakes never wait: the socket is made non-blocking, and each step of the
+ * handshake is taken when select() says the socket is ready for it (see tls_handshake()).
+ * Once it's done, reading behaves like it does on any other socket (if only part of a
+ * packet has arrived, it waits up to TLS_READ_WAIT seconds for the rest), and writing never
+ * waits, like the outbox expects (see outbox.h).
+ *
+ * Since a handshake costs a lot more than anything else the server does, clients keep a
+ * session ticket (in TLS_SESSION_FILE) and use it the next time they connect, which skips
+ * most of the work.  The keys for the tickets go along with a handoff (see handoff.h), so
+ * when everybody reconnects after an upgrade, they all get to skip it.
+ *
+ * Where the kernel can do the encryption itself (kTLS, on Linux with the tls module
+ * loaded), OpenSSL hands it over once the handshake is done, and what's written goes
+ * straight to the socket, gathered like it is without TLS.
+ *
+ * TLS connections can't be handed off to a new server; they're closed, and the clients have
+ * to reconnect (with their tickets). */
+/* NOTE: These functions are NOT thread-safe, except that tls_send_nowait() can be used from
+ * more than one thread at once, for different connections (see worker.h). */
+
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "packet_buffer.h"
+#include "types.h"
+
+/* The server's certificate (with any intermediate certificates after it) and its private
+ * key, in PEM format, in the current directory.  The client also trusts TLS_CERTIFICATE if
+ * it finds it, for servers with self-signed certificates. */
+#define TLS_CERTIFICATE "server.crt"
+#define TLS_KEY "server.key"
+
+/* Where the client keeps its session ticket */
+#define TLS_SESSION_FILE "client.session"
+
+/* The number of sessions the server remembers (for clients that resume without tickets) */
+#define TLS_SESSION_CACHE 20480
+
+/* The most bytes written at a time; this is the biggest a TLS record can be */
+#define TLS_RECORD 16384
+
+/* The number of seconds a read waits for the rest of a record */
+#define TLS_READ_WAIT 5
+
+/* The size of the session ticket keys that are handed off */
+#define TLS_TICKET_KEYS 80
+
+/* Set up the server's side of TLS.  Returns FALSE if there's no certificate, in which case
+ * TLS isn't offered. */
+BOOLEAN tls_initialize_server();
+/* Set up the client's side of TLS */
+void tls_initialize_client();
+/* Whether the server is offering TLS */
+BOOLEAN tls_is_enabled();
+
+/* Whether the next byte from a new connection starts a TLS handshake.  This doesn't read
+ * anything. */
+BOOLEAN tls_is_hello(int socket);
+/* Start the server's side of a handshake on a new connection.  tls_handshake() has to be
+ * called to move it along. */
+void tls_accept(int socket);
+/* Take the next step of the handshake, whenever select() says the socket is ready for it.
+ * Returns 1 if it's done, 0 if it's still going, or -1 if it failed (in which case the
+ * connection should be closed). */
+int tls_handshake(int socket);
+/* Do the client's side of a handshake with the named server, all at once.  If there's a
+ * session ticket from last time, it's used.  Returns FALSE if it failed. */
+BOOLEAN tls_connect(int socket, char *host);
+
+/* Whether a connection is using TLS */
+BOOLEAN tls_is_secure(int socket);
+/* Whether a connection is still in the middle of its handshake, and whether that handshake is
+ * waiting for the socket to be ready for writing (otherwise, it's waiting for reading) */
+BOOLEAN tls_is_handshaking(int socket);
+BOOLEAN tls_wants_write(int socket);
+/* Whether there's data that's been decrypted, but not read yet.  select() doesn't know about
+ * it, so the connection has to be treated as readable. */
+BOOLEAN tls_has_pending(int socket);
+
+/* Read exactly "length" bytes, like read() on a blocking socket.  Returns the number read,
+ * 0 if the connection closed, or -1 on an error. */
+ssize_t tls_read(int socket, void *buffer, size_t length);
+/* Look at up to "length" bytes of what's already arrived, without reading them or waiting
+ * for more.  Returns the number of bytes. */
+ssize_t tls_peek(int socket, void *buffer, size_t length);
+/* Write all of the bytes, waiting if need be, like write() on a blocking socket */
+ssize_t tls_write(int socket, void *data, size_t length);
+/* Write as much as the connection will take right now, without waiting, like sendmsg() with
+ * MSG_DONTWAIT.  If it can't take anything, -1 is returned, with errno set to EAGAIN. */
+ssize_t tls_send_nowait(int socket, struct iovec *iov, size_t count);
+
+/* Forget about a connection.  This has to be called before its socket is closed, since
+ * sockets are reused. */
+void tls_close(int socket);
+
+/* Save the session ticket keys into a record, and use the ones from a record, for handing off
+ * to a new server (see handoff.h) */
+void tls_save_keys(packet_buffer_t *record);
+BOOLEAN tls_restore_keys(packet_buffer_t *record);
+
+/* Get the totals so far: the handshakes that finished (and how many of them were resumed),
+ * the ones that failed, the connections the kernel is encrypting, and the CPU time spent on
+ * handshakes.  This is for statistics. */
+void tls_get_totals(uint32_t *handshakes, uint32_t *resumed, uint32_t *failed, uint32_t *offloaded, double *cpu_seconds);
+
+#endif
+
@@ -0,0 +1,111 @@
+/* token */
+/* This module gives out session tokens, and checks the ones that come back, with an HMAC
+ * (see token.h). */
+/* NOTE: These functions are NOT thread-safe. */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "account.h"
+#include "output.h"
+#include "packet_buffer.h"
+#include "password.h"
+#include "types.h"
+
+#include "token.h"
+
+/* The secret the tokens are signed with */
+static uint8_t key[TOKEN_KEY_LENGTH];
+
+/* Statistics */
+static uint32_t total_issued = 0;
+static uint32_t total_accepted = 0;
+static uint32_t total_rejected = 0;
+
+/* Pick the secret.  rand() is fine for tokens the client hashes its password with, but not
+ * for this, since anybody who can guess it can be anybody. */
+void token_initialize()
+{
+	if(RAND_bytes(key, sizeof(key)) != 1)
+		display_error(ERROR_EMERGENCY, "Couldn't pick a secret for the session tokens");
+}
+
+/* Work out the HMAC of a username and the time it expires.  The time goes first, a byte at
+ * a time, so the username can't be made to run into it. */
+static void sign(char *username, uint32_t expires, uint8_t *mac)
+{
+	uint8_t data[4 + MAX_NAME];
+	size_t length = strlen(username);
+
+	if(length > MAX_NAME)
+		length = MAX_NAME;
+
+	data[0] = expires >> 24;
+	data[1] = expires >> 16;
+	data[2] = expires >> 8;
+	data[3] = expires;
+	memcpy(data + 4, username, length);
+
+	HMAC(EVP_sha1(), key, sizeof(key), data, 4 + length, mac, NULL);
+}
+
+/* Make a token for the user */
+void token_issue(char *username, uint32_t *expires, uint8_t *mac)
+{
+	*expires = time(NULL) + TOKEN_LIFETIME;
+	sign(username, *expires, mac);
+	total_issued++;
+}
+
+/* Check a token that a client sent back.  The comparison takes the same time however much of
+ * it matches, so it can't be guessed a byte at a time. */
+BOOLEAN token_verify(char *username, uint32_t expires, uint8_t *mac)
+{
+	uint8_t expected[HASH_LENGTH];
+
+	if(strlen(username) > MAX_NAME || expires < (uint32_t) time(NULL))
+	{
+		total_rejected++;
+		return FALSE;
+	}
+
+	sign(username, expires, expected);
+	if(CRYPTO_memcmp(expected, mac, HASH_LENGTH) != 0)
+	{
+		total_rejected++;
+		return FALSE;
+	}
+
+	total_accepted++;
+	return TRUE;
+}
+
+/* Save the secret into a record */
+void token_save_key(packet_buffer_t *record)
+{
+	add_bytes(record, key, sizeof(key));
+}
+/* Use the one from a record */
+BOOLEAN token_restore_key(packet_buffer_t *record)
+{
+	if(!can_read_bytes(record, sizeof(key)))
+		return FALSE;
+
+	read_next_bytes(record, key, sizeof(key));
+
+	return TRUE;
+}
+
+/* Get the totals so far.  This is for statistics. */
+void token_get_totals(uint32_t *issued, uint32_t *accepted, uint32_t *rejected)
+{
+	*issued = total_issued;
+	*accepted = total_accepted;
+	*rejected = total_rejected;
+}
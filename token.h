@@ -0,0 +1,54 @@
+/* token */
+/* This module gives out session tokens, so a client that reconnects (a phone that changed
+ * networks, say) can log back in without the usual back-and-forth.  Normally it takes a
+ * round trip for the client information, another for the login, and a third to join a room;
+ * with a token, the client sends SID_CLIENT_INFORMATION and SID_RESUME together, and gets
+ * everything back at once (see types.h).
+ *
+ * A token is a username, the time it expires, and an HMAC of the two, keyed with a secret
+ * that only the server knows.  Checking one is just working out the HMAC again, so the
+ * accounts file is never touched, and nothing is remembered about the tokens that have been
+ * given out.  A token can't be taken back before it expires, so it has to be looked after
+ * like a password (TLS helps; see tls.h).
+ *
+ * Every server picks its own secret when it starts, so a token only works on the server it
+ * came from.  The secret goes along with a handoff (see handoff.h), so tokens still work
+ * after an upgrade. */
+/* NOTE: These functions are NOT thread-safe. */
+
+#ifndef _TOKEN_H_
+#define _TOKEN_H_
+
+#include <stdint.h>
+
+#include "packet_buffer.h"
+#include "password.h"
+#include "types.h"
+
+/* The number of seconds a token is good for.  Every time one is used, a new one is given
+ * out, so this is really how long a client can be gone. */
+#define TOKEN_LIFETIME (24 * 60 * 60)
+
+/* The size of the secret */
+#define TOKEN_KEY_LENGTH 32
+
+/* Pick the secret.  This has to be done before anything else here. */
+void token_initialize();
+
+/* Make a token for the user; "mac" has to be a buffer of HASH_LENGTH bytes */
+void token_issue(char *username, uint32_t *expires, uint8_t *mac);
+/* Check a token that a client sent back.  Returns FALSE if it's expired, or wasn't made
+ * here. */
+BOOLEAN token_verify(char *username, uint32_t expires, uint8_t *mac);
+
+/* Save the secret into a record, and use the one from a record, for handing off to a new
+ * server (see handoff.h) */
+void token_save_key(packet_buffer_t *record);
+BOOLEAN token_restore_key(packet_buffer_t *record);
+
+/* Get the totals so far: the tokens given out, and the ones that were accepted and
+ * rejected.  This is for statistics. */
+void token_get_totals(uint32_t *issued, uint32_t *accepted, uint32_t *rejected);
+
+#endif
+
@@ -16,6 +16,8 @@ typedef int BOOLEAN;
 #define PROGRAM "Cattle Chat"
 #define VERSION "v1.0"
 
+/* The packet codes, and the layout of each packet.  The layouts here are for reading; the
+ * schema in protocol.h is what the code is generated from, so keep the two in sync. */
 typedef enum
 {
 	/* This is used as a keepalive packet.  
@@ -73,17 +75,19 @@ typedef enum
 	 * (ntstring) username */
 	SID_CREATE_RESPONSE,
 
-	/* This requests a list of who is in a specified room.  This can be sent by anybody at 
-	 * any time, including without authentication.  It can also be sent via the datagram 
-	 * socket. 
+	/* This requests a list of who is in a specified room, or the list of rooms.  This can be
+	 * sent by anybody at any time, including without authentication.  It can also be sent via
+	 * the datagram socket. 
 	 * Structure:
-	 * (ntstring) room_name */
+	 * (ntstring) room_name -- The room, or blank for the list of rooms that have somebody in
+	 *  them */
 	SID_REQUEST_ROOM_LIST,
 
-	/* The response to SID_REQUEST_ROOM_LIST
+	/* The response to SID_REQUEST_ROOM_LIST.  If the room doesn't exist, the list is empty.
+	 * If the names don't all fit in one packet, the rest are left out.
 	 * Structure:
-	 * (ntstring[]) channels -- An array of user names who are in the channel, terminated by
-	 *  a blank username. */
+	 * (ntstring[]) channels -- An array of user names who are in the channel (or of room
+	 *  names), terminated by a blank one. */
 	SID_ROOM_LIST,
 
 	/* Send an outgoing command in chat. 
@@ -103,8 +107,141 @@ typedef enum
 	 * If an unexpected SID_ERROR returned a SID_ERROR, we'd be in an infinite loop.  not good!
 	 * Structure:
 	 * (ntstring) description -- A description, in english, of what caused the error */
-	SID_ERROR
-	
+	SID_ERROR,
+
+	/* A compressed packet.  This is only sent to clients that asked for compression (see
+	 * PROTOCOL_DEFLATE in protocol.h), and only for big packets; see compression.h.
+	 * Structure:
+	 * (bytes) data -- The next chunk of the connection's deflate stream.  Inflating it gives
+	 *  exactly one whole packet, including its header. */
+	SID_COMPRESSED,
+
+	/* Gives a name (a username or a room name) a number, for SID_CHATEVENT_ID.  This is only
+	 * sent to clients that asked for it (see PROTOCOL_NAME_IDS in protocol.h), and only the
+	 * first time the connection needs the name.  A number always means the same name for the
+	 * rest of the connection.
+	 * Structure:
+	 * (varint) id -- The number.  This is never 0.
+	 * (ntstring) name */
+	SID_INTRODUCE_NAME,
+
+	/* The same as SID_CHATEVENT, but with the names replaced by numbers from
+	 * SID_INTRODUCE_NAME.  This is sent instead of SID_CHATEVENT to clients that asked for it.
+	 * Structure:
+	 * (varint) subtype -- See SID_CHATEVENT
+	 * (varint) username_id -- The number of the username
+	 * (varint) text_id -- The number of the text, if it's a name (the room, in EID_CHANNEL);
+	 *  otherwise, 0
+	 * (ntstring) text -- The text, if text_id is 0; otherwise, blank */
+	SID_CHATEVENT_ID,
+
+	/* Who joined and left the room lately, all at once.  This is sent instead of the
+	 * EID_USER_JOIN_CHANNEL, EID_USER_LEAVE_CHANNEL and EID_USER_IN_CHANNEL events to clients
+	 * that asked for it (see PROTOCOL_PRESENCE in protocol.h).  If the names don't all fit in
+	 * one packet, they're split over several, and only the first has the flags.
+	 * Structure:
+	 * (varint) flags -- PRESENCE_EVERYBODY if the names are everybody in the room (because
+	 *  the client just joined it), and the old list should be thrown away; PRESENCE_QUIET if
+	 *  the room is too big for joins and leaves to be sent at all, in which case the names are
+	 *  blank (SID_REQUEST_ROOM_LIST still works)
+	 * (varint) joined_count -- The number of names, from the start, that joined; the rest left
+	 * (ntstring[]) names -- The names, terminated by a blank one */
+	SID_PRESENCE,
+
+	/* The rest are only sent between servers, over the links that join them together (see
+	 * federation.h).  A client that sends one gets a SID_ERROR. */
+
+	/* The first packet on a link, from each end.  A server connects to another server's
+	 * port like a client does, but sends this instead of SID_CLIENT_INFORMATION.
+	 * Structure:
+	 * (uint32_t) node_id -- A random number that's different for every server, used to
+	 *  settle which one wins when they disagree
+	 * (uint32_t) port -- The port the server is listening on
+	 * (uint32_t) version -- FEDERATION_VERSION (see federation.h); a link is only made
+	 *  between servers with the same one
+	 * (uint32_t[5]) challenge -- Random bytes, which the other end has to answer with
+	 *  SID_LINK_AUTH before anything else goes over the link */
+	SID_LINK_HELLO,
+
+	/* Somebody logged in on the sending server.  This is also sent for everybody who's
+	 * already logged in when a link comes up.
+	 * Structure:
+	 * (uint32_t) ip -- The address they connected from, in network order
+	 * (ntstring) username */
+	SID_LINK_LOGIN,
+
+	/* Somebody logged out of the sending server (which takes them out of their room)
+	 * Structure:
+	 * (ntstring) username */
+	SID_LINK_LOGOUT,
+
+	/* Somebody on the sending server joined a room, or left chat
+	 * Structure:
+	 * (ntstring) username
+	 * (ntstring) room_name -- The room, or blank if they left chat */
+	SID_LINK_JOIN,
+
+	/* Somebody on the sending server said something in a room that somebody on this server
+	 * is in.  Only one of these is sent to each server, no matter how many people there are
+	 * in the room on that server.
+	 * Structure:
+	 * (uint32_t) subtype -- See SID_CHATEVENT
+	 * (ntstring) room_name
+	 * (ntstring) username
+	 * (ntstring) text */
+	SID_LINK_CHAT,
+
+	/* Somebody on the sending server whispered somebody on this one
+	 * Structure:
+	 * (ntstring) username -- Who it's from
+	 * (ntstring) target -- Who it's to
+	 * (ntstring) text */
+	SID_LINK_WHISPER,
+
+	/* A room's settings.  Every room has a home server (see ring.h), which keeps the other
+	 * servers' copies of the room up to date with this.  A server that changes a room it
+	 * isn't the home of sends this to the home, which passes it along.  This is also sent
+	 * to a server whenever its first user joins a room.
+	 * Structure:
+	 * (uint32_t) batch_window -- See /batch
+	 * (ntstring) room_name */
+	SID_LINK_ROOM,
+
+	/* Back to packets between clients and servers.  These were added after the links, and
+	 * went at the end so the links' codes stayed the same. */
+
+	/* A session token, which lets the client log back in quickly the next time it connects
+	 * (see token.h).  This is sent right after a successful SID_LOGIN_RESPONSE, to clients
+	 * that asked for it (see PROTOCOL_RESUME in protocol.h), and a new one comes after every
+	 * SID_RESUME that works.
+	 * Structure:
+	 * (uint32_t) expires -- When it stops working, in seconds since 1970
+	 * (uint32_t[5]) token -- Keep this, along with the time and the username */
+	SID_SESSION_TOKEN,
+
+	/* Log in with a session token instead of a password, and join a room, all at once.  This
+	 * is sent in place of SID_LOGIN (it can come right behind SID_CLIENT_INFORMATION, without
+	 * waiting for SID_SERVER_INFORMATION).  The answer is a SID_LOGIN_RESPONSE, which is
+	 * INVALID_TOKEN if the token didn't work (in which case SID_LOGIN can be sent instead);
+	 * otherwise, it's followed by a new SID_SESSION_TOKEN and everything that joining the
+	 * room sends.  If the name's still logged in on this server (from a connection that
+	 * hasn't noticed it's dead yet), that connection is closed.
+	 * Structure:
+	 * (uint32_t) expires -- From SID_SESSION_TOKEN
+	 * (uint32_t[5]) token -- From SID_SESSION_TOKEN
+	 * (ntstring) username
+	 * (ntstring) room_name -- The room to go back to, or blank for none */
+	SID_RESUME,
+
+	/* Between servers again.  The answer to the challenge in the other end's SID_LINK_HELLO,
+	 * which proves that the sender knows the servers' shared secret (see federation.h).  The
+	 * server that was connected to sends this right behind its hello; the one that connected
+	 * only answers once that's checked out.  A link carries nothing else until both ends
+	 * have had a good answer.
+	 * Structure:
+	 * (uint32_t[5]) answer */
+	SID_LINK_AUTH
+
 } packet_codes_t;
 
 
@@ -4,40 +4,119 @@
  * their client/server token
  */
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
 
+#include <arpa/inet.h>
+
+#include "compression.h"
+#include "epoch.h"
+#include "intern.h"
+#include "outbox.h"
+#include "packet_buffer.h"
+#include "protocol.h"
+#include "slab.h"
+#include "tls.h"
 #include "user.h"
 #include "room.h"
 
+/* The number of users (and user details) to allocate at a time */
+#define USERS_PER_CHUNK 256
+
+/* The number of names a connection has room for when it starts getting numbers.  This
+ * doubles whenever a bigger number comes along. */
+#define STARTING_INTRODUCED 32
+
 const char *user_states[] = { "CONNECTED", "SENT_CLIENT_INFORMATION", "SENT_AUTHENTICATION", "JOINED_CHANNEL", "DEAD" };
 
+/* Every user_t and user_details_t comes from one of these.  They're created the first time
+ * a user is. */
+static slab_t *user_slab = NULL;
+static slab_t *details_slab = NULL;
+
 /* Create a new, empty user.  They start in state CONNECTED, with a NULL username, 
  * a blank client token, and a random server token */
-user_t *create_user(int socket, char *ip)
+user_t *create_user(int socket, struct in_addr ip)
 {
-	user_t *new_user = malloc(sizeof(user_t));
-	
+	user_t *new_user;
+
+	if(user_slab == NULL)
+	{
+		user_slab = slab_create("users", sizeof(user_t), USERS_PER_CHUNK);
+		details_slab = slab_create("user details", sizeof(user_details_t), USERS_PER_CHUNK);
+	}
+
+	new_user = slab_alloc(user_slab);
 	new_user->socket = socket;
-	strcpy(new_user->username, "Not logged in");
 	new_user->state = CONNECTED;
-	new_user->client_token = 0;
-	new_user->server_token = rand();
-	strncpy(new_user->ip, ip, IP_LENGTH);
-	new_user->ip[IP_LENGTH - 1] = '\0';
 	new_user->room = NULL;
+	new_user->username = intern_string("Not logged in");
+	new_user->outbox = outbox_create(socket);
+	new_user->peer = NULL;
+	new_user->introduced = NULL;
+	new_user->introduced_size = 0;
+	new_user->presence_batches = FALSE;
+
+	new_user->details = slab_alloc(details_slab);
+	new_user->details->client_token = 0;
+	new_user->details->server_token = rand();
+	new_user->details->ip = ip;
+	new_user->details->resyncs = 0;
+	new_user->details->compression = NULL;
+	new_user->details->session_tokens = FALSE;
+	new_user->details->link_attempt = NULL;
+
+	return new_user;
+}
+/* Create a user who's on another server.  They're logged in, but nothing is ever written to
+ * them, so they don't get an outbox. */
+user_t *create_remote_user(char *username, struct in_addr ip, struct _peer_t *peer)
+{
+	user_t *new_user = create_user(-1, ip);
+
+	outbox_destroy(new_user->outbox);
+	new_user->outbox = NULL;
+	new_user->peer = peer;
+
+	set_username(new_user, username);
+	new_user->state = NOT_IN_CHANNEL;
 
 	return new_user;
 }
 /* Clean up the user */
 void destroy_user(user_t *user)
 {
+	uint32_t i;
+
+	/* Give back the reference to the room */
 	if(user->room)
-		free(user->room);
-	free(user);
+		room_remove_user(user->room, user);
+	intern_release(user->username);
+	if(user->outbox)
+		outbox_destroy(user->outbox);
+	if(user->details->compression)
+		compression_destroy(user->details->compression);
+	for(i = 0; i < user->introduced_size; i++)
+		if(user->introduced[i])
+			intern_release(user->introduced[i]);
+	free(user->introduced);
+	free(user->details->link_attempt);
+	slab_free(details_slab, user->details);
+	slab_free(user_slab, user);
+}
+/* Destroy a user whose epoch is over */
+static void destroy_retired(void *user)
+{
+	destroy_user((user_t *) user);
+}
+/* Clean up the user once no other thread can still be looking at them */
+void user_retire(user_t *user)
+{
+	epoch_retire(destroy_retired, user);
 }
 
 /* Get the user's socket */
@@ -45,22 +124,35 @@ int get_socket(user_t *user)
 {
 	return user->socket;
 }
+/* Get the link to the server the user is on, or NULL if they're on this one */
+struct _peer_t *get_user_peer(user_t *user)
+{
+	return user->peer;
+}
 
 /* Set the username for the user, this should happen after they've authenticated */
 void set_username(user_t *user, char *username)
 {
-	strncpy(user->username, username, MAX_NAME - 1);
-	user->username[MAX_NAME - 1] = '\0';
+	char *old_username = user->username;
+
+	user->username = intern_string(username);
+	intern_release(old_username);
 }
 /* Retrieve the username for the user */
 char *get_username(user_t *user)
 {
 	return user->username;
 }
-/* Retrieve the ip for the user */
+/* Retrieve the ip for the user, as a string.
+ * WARNING: returns a pointer to a static string, which is overwritten by the next call */
 char *get_ip(user_t *user)
 {
-	return user->ip;
+	return inet_ntoa(user->details->ip);
+}
+/* Retrieve the address the user connected from, in binary */
+struct in_addr get_user_address(user_t *user)
+{
+	return user->details->ip;
 }
 /* Set the state for the user.  This module doesn't care what the state is, so make 
  * sure it's a valid transition */
@@ -76,39 +168,416 @@ user_states_t get_user_state(user_t *user)
 /* Set the client token.  This is received when the user sends his information */
 void set_client_token(user_t *user, uint32_t token)
 {
-	user->client_token = token;
+	user->details->client_token = token;
 }
 /* Get the client token that was previously set */
 uint32_t get_client_token(user_t *user)
 {
-	return user->client_token;
+	return user->details->client_token;
 }
 /* Get the server token, this is a random value generated when a user instance is
  * created */
 uint32_t get_server_token(user_t *user)
 {
-	return user->server_token;
+	return user->details->server_token;
+}
+/* Count another time that the user's stream got out of sync, and return the total so far */
+uint32_t add_user_resync(user_t *user)
+{
+	return ++user->details->resyncs;
+}
+/* Start compressing big packets to the user.  This should only happen if they asked for it. */
+void enable_user_compression(user_t *user)
+{
+	if(user->details->compression == NULL)
+	{
+		user->details->compression = compression_create();
+		outbox_set_compression(user->outbox, user->details->compression);
+	}
 }
 
-/* The name of the current chatroom, to save me a lot of time.
- * WARNING: returns a pointer to a static string, don't muck around with it  */
-char *get_user_room(user_t  *user)
+/* Start sending a chat event.  The username has to be interned (get_username() is); so does
+ * the text, for EID_CHANNEL, since it's a room name (room_get_name() is). */
+void chatevent_begin(outgoing_chatevent_t *outgoing, chatevent_subtype_t subtype, char *username, char *text)
 {
-	return user->room;
+	outgoing->event.subtype = subtype;
+	outgoing->event.username = username;
+	outgoing->event.text = text;
+	outgoing->full = NULL;
+	outgoing->compact = NULL;
+}
+/* Free whatever the chat event was encoded into */
+void chatevent_end(outgoing_chatevent_t *outgoing)
+{
+	if(outgoing->full)
+		destroy_buffer(outgoing->full);
+	if(outgoing->compact)
+		destroy_buffer(outgoing->compact);
 }
 
-/* Set the name of hte current room */
-void set_user_room(user_t *user, char *room_name)
+/* Send a packet that was made just for this user, then destroy it */
+static void send_and_destroy(user_t *user, packet_buffer_t *packet)
 {
-	if(user->room)
-		free(user->room);
-	user->room = NULL;
+	user_send(user, packet);
+	destroy_buffer(packet);
+}
+
+/* Whether the text of a chat event is a name (and so is interned, and has a number) */
+static BOOLEAN text_is_name(chatevent_packet_t *event)
+{
+	return event->subtype == EID_CHANNEL && *event->text;
+}
 
-	if(room_name)
-	{	
-		user->room = malloc(strlen(room_name) + 1);
-		strncpy(user->room, room_name, strlen(room_name) + 1);
+/* Start sending the user numbers instead of names in chat events (see SID_CHATEVENT_ID in
+ * types.h).  This should only happen if they asked for it. */
+void enable_user_name_ids(user_t *user)
+{
+	if(user->introduced == NULL)
+	{
+		user->introduced_size = STARTING_INTRODUCED;
+		user->introduced = calloc(STARTING_INTRODUCED, sizeof(char *));
+		assert(user->introduced); /* Out of memory */
+	}
+}
+
+/* If the user hasn't been told what number the given (interned) name has yet, return the
+ * SID_INTRODUCE_NAME that tells them (which has to be sent, then destroyed); otherwise,
+ * NULL */
+static packet_buffer_t *introduce_name(user_t *user, char *name)
+{
+	uint32_t id = intern_get_id(name);
+	uint32_t new_size;
+	introduce_name_packet_t introduction;
+
+	if(id >= user->introduced_size)
+	{
+		for(new_size = user->introduced_size; new_size <= id; new_size <<= 1)
+			;
+		user->introduced = realloc(user->introduced, new_size * sizeof(char *));
+		assert(user->introduced); /* Out of memory */
+		memset(user->introduced + user->introduced_size, 0, (new_size - user->introduced_size) * sizeof(char *));
+		user->introduced_size = new_size;
+	}
+
+	/* Since we hold a reference to every name we've introduced, its number can't have been
+	 * given to anything else */
+	if(user->introduced[id] == name)
+		return NULL;
+	assert(user->introduced[id] == NULL);
+	user->introduced[id] = intern_hold(name);
+
+	introduction.id = id;
+	introduction.name = name;
+
+	return encode_introduce_name(&introduction);
+}
+
+/* Encode the chat event with numbers instead of names (SID_CHATEVENT_ID) */
+static packet_buffer_t *encode_compact(outgoing_chatevent_t *outgoing)
+{
+	chatevent_id_packet_t compact;
+
+	compact.subtype = outgoing->event.subtype;
+	compact.username_id = intern_get_id(outgoing->event.username);
+	if(text_is_name(&outgoing->event))
+	{
+		compact.text_id = intern_get_id(outgoing->event.text);
+		compact.text = "";
+	}
+	else
+	{
+		compact.text_id = 0;
+		compact.text = outgoing->event.text;
 	}
+
+	return encode_chatevent_id(&compact);
+}
+
+/* Encode the chat event both ways right now, instead of the first time each is needed, so
+ * it can be sent from more than one thread at once (see broadcast.h) */
+void chatevent_encode(outgoing_chatevent_t *outgoing)
+{
+	if(outgoing->full == NULL)
+		outgoing->full = encode_chatevent(&outgoing->event);
+	if(outgoing->compact == NULL)
+		outgoing->compact = encode_compact(outgoing);
+}
+
+/* Get the chat event encoded the way the user wants it, encoding it if nobody else has
+ * needed it that way yet.  The packet belongs to the outgoing event. */
+static packet_buffer_t *get_chatevent_packet(user_t *user, outgoing_chatevent_t *outgoing)
+{
+	if(user->introduced == NULL)
+	{
+		if(outgoing->full == NULL)
+			outgoing->full = encode_chatevent(&outgoing->event);
+		return outgoing->full;
+	}
+
+	if(outgoing->compact == NULL)
+		outgoing->compact = encode_compact(outgoing);
+	return outgoing->compact;
+}
+
+/* Send a chat event to the user.  If they get numbers, any names they haven't been told
+ * about yet are introduced first. */
+void user_send_chatevent(user_t *user, outgoing_chatevent_t *outgoing)
+{
+	packet_buffer_t *introduction;
+
+	/* Their own server tells them */
+	if(user->peer)
+		return;
+
+	if(user->introduced)
+	{
+		if((introduction = introduce_name(user, outgoing->event.username)))
+			send_and_destroy(user, introduction);
+		if(text_is_name(&outgoing->event) && (introduction = introduce_name(user, outgoing->event.text)))
+			send_and_destroy(user, introduction);
+	}
+
+	user_send(user, get_chatevent_packet(user, outgoing));
+}
+
+/* Packets on their way to a user, to be sent together */
+typedef struct
+{
+	packet_buffer_t *packets[OUTBOX_GATHER];
+	/* Whether each packet was made just for this user (an introduction), and has to be
+	 * destroyed once it's sent */
+	BOOLEAN owned[OUTBOX_GATHER];
+	size_t count;
+	/* The number of writes so far */
+	size_t writes;
+} gather_t;
+
+/* Send everything that's been gathered, and start over */
+static void gather_flush(user_t *user, gather_t *gather)
+{
+	size_t i;
+
+	gather->writes += outbox_send(user->outbox, OUTBOX_CHAT, gather->packets, gather->count);
+
+	for(i = 0; i < gather->count; i++)
+		if(gather->owned[i])
+			destroy_buffer(gather->packets[i]);
+	gather->count = 0;
+}
+
+/* Add a packet to what's being gathered.  If owned is set, the packet is destroyed once it's
+ * sent. */
+static void gather_add(user_t *user, gather_t *gather, packet_buffer_t *packet, BOOLEAN owned)
+{
+	if(gather->count == OUTBOX_GATHER)
+		gather_flush(user, gather);
+
+	gather->packets[gather->count] = packet;
+	gather->owned[gather->count] = owned;
+	gather->count++;
+}
+
+/* Send a series of chat events to the user, with as few writes as possible (one, unless
+ * there are more than OUTBOX_GATHER packets, or something was already waiting to go out, in
+ * which case it's none).  Returns the number of writes it took. */
+size_t user_send_chatevents(user_t *user, outgoing_chatevent_t *outgoing, size_t count)
+{
+	gather_t gather;
+	packet_buffer_t *introduction;
+	size_t i;
+
+	gather.count = 0;
+	gather.writes = 0;
+
+	if(user->peer)
+		return 0;
+
+	for(i = 0; i < count; i++)
+	{
+		if(user->introduced)
+		{
+			if((introduction = introduce_name(user, outgoing[i].event.username)))
+				gather_add(user, &gather, introduction, TRUE);
+			if(text_is_name(&outgoing[i].event) && (introduction = introduce_name(user, outgoing[i].event.text)))
+				gather_add(user, &gather, introduction, TRUE);
+		}
+
+		gather_add(user, &gather, get_chatevent_packet(user, &outgoing[i]), FALSE);
+	}
+	gather_flush(user, &gather);
+
+	return gather.writes;
+}
+
+/* Start sending the user joins and leaves in SID_PRESENCE, instead of one chat event each.
+ * This should only happen if they asked for it. */
+void enable_user_presence_batches(user_t *user)
+{
+	user->presence_batches = TRUE;
+}
+/* Whether the user gets SID_PRESENCE */
+BOOLEAN get_user_presence_batches(user_t *user)
+{
+	return user->presence_batches;
+}
+
+/* Give the user a session token whenever they log in.  This should only happen if they asked
+ * for it. */
+void enable_user_session_tokens(user_t *user)
+{
+	user->details->session_tokens = TRUE;
+}
+/* Whether the user gets session tokens */
+BOOLEAN get_user_session_tokens(user_t *user)
+{
+	return user->details->session_tokens;
+}
+
+/* Set or get the link attempt the user is making, if they're another server */
+void set_user_link_attempt(user_t *user, struct _link_attempt_t *attempt)
+{
+	user->details->link_attempt = attempt;
+}
+struct _link_attempt_t *get_user_link_attempt(user_t *user)
+{
+	return user->details->link_attempt;
+}
+
+/* Send a packet to the user, in the class that goes with its code (see outbox.h).  It's
+ * compressed if they asked for compression and it's big enough (see compression.h).  The
+ * packet isn't destroyed. */
+void user_send(user_t *user, packet_buffer_t *packet)
+{
+	if(user->peer)
+		return;
+
+	outbox_send(user->outbox, outbox_get_class(get_code(packet)), &packet, 1);
+}
+
+/* Whether the user has anything waiting to be written */
+BOOLEAN user_is_waiting(user_t *user)
+{
+	return user->outbox && outbox_waiting(user->outbox);
+}
+/* Write as much of what's waiting for the user as their connection will take */
+void user_flush(user_t *user)
+{
+	outbox_flush(user->outbox);
+}
+
+/* The flags that say what a saved user asked for */
+#define SAVED_NAME_IDS 0x01
+#define SAVED_PRESENCE_BATCHES 0x02
+#define SAVED_COMPRESSION 0x04
+#define SAVED_SESSION_TOKENS 0x08
+
+/* Save the user into a record, for handing them off to a new server */
+BOOLEAN user_save(user_t *user, packet_buffer_t *record)
+{
+	uint8_t flags = 0;
+
+	/* OpenSSL's state for the connection can't be saved (see tls.h) */
+	if(tls_is_secure(user->socket))
+		return FALSE;
+
+	if(user->introduced)
+		flags |= SAVED_NAME_IDS;
+	if(user->presence_batches)
+		flags |= SAVED_PRESENCE_BATCHES;
+	if(user->details->compression)
+		flags |= SAVED_COMPRESSION;
+	if(user->details->session_tokens)
+		flags |= SAVED_SESSION_TOKENS;
+
+	add_int8(record, user->state);
+	add_ntstring(record, user->username);
+	add_int32(record, user->details->ip.s_addr);
+	add_int32(record, user->details->client_token);
+	add_int32(record, user->details->server_token);
+	add_int32(record, user->details->resyncs);
+	add_int8(record, flags);
+
+	if(user->details->compression)
+		return compression_save(user->details->compression, record);
+
+	return TRUE;
+}
+
+/* Create a user from a record that user_save() made */
+user_t *user_restore(int socket, packet_buffer_t *record)
+{
+	user_t *user;
+	char username[MAX_NAME + 1];
+	struct in_addr ip;
+	uint8_t state;
+	uint8_t flags;
+
+	if(!can_read_int8(record))
+		return NULL;
+	state = read_next_int8(record);
+	if(state > JOINED_CHANNEL || !can_read_ntstring(record))
+		return NULL;
+	read_next_ntstring(record, username, MAX_NAME + 1);
+	if(!can_read_bytes(record, 4 * 4 + 1))
+		return NULL;
+	ip.s_addr = read_next_int32(record);
+
+	user = create_user(socket, ip);
+	set_username(user, username);
+	user->state = state;
+	user->details->client_token = read_next_int32(record);
+	user->details->server_token = read_next_int32(record);
+	user->details->resyncs = read_next_int32(record);
+
+	/* Names are numbered differently in every server, so they start over; anything they're
+	 * sent by number from now on is introduced again first */
+	flags = read_next_int8(record);
+	if(flags & SAVED_NAME_IDS)
+		enable_user_name_ids(user);
+	if(flags & SAVED_PRESENCE_BATCHES)
+		enable_user_presence_batches(user);
+	if(flags & SAVED_SESSION_TOKENS)
+		enable_user_session_tokens(user);
+	if(flags & SAVED_COMPRESSION)
+	{
+		user->details->compression = compression_restore(record);
+		if(user->details->compression == NULL)
+		{
+			destroy_user(user);
+			return NULL;
+		}
+		outbox_set_compression(user->outbox, user->details->compression);
+	}
+
+	return user;
+}
+
+/* Get everything that's waiting to be written to the user, for handing them off */
+uint8_t *user_get_waiting(user_t *user, size_t *length)
+{
+	return outbox_get_waiting(user->outbox, length);
+}
+/* Put what was waiting for the user in the old server back */
+void user_restore_waiting(user_t *user, uint8_t *data, size_t length)
+{
+	outbox_restore(user->outbox, data, length);
+}
+
+/* The name of the current chatroom, to save me a lot of time.  NULL if they aren't in one. 
+ * WARNING: returns a pointer to the room's own name, don't muck around with it  */
+char *get_user_room(user_t  *user)
+{
+	if(user->room == NULL)
+		return NULL;
+
+	return room_get_name(user->room);
+}
+
+/* The room the user is currently in, or NULL if they aren't in one.  To change it, use 
+ * room_add_user() and room_remove_user() */
+room_t *get_current_room(user_t *user)
+{
+	return user->room;
 }
 
 /* Display the user; for debugging */
@@ -116,10 +585,21 @@ void print_user(user_t *user)
 {
 	printf("Username: %s\n", user->username);
 	printf("State: %d\n", user->state);
-	printf("Client/server tokens: %08x/%08x\n\n", user->client_token, user->server_token);
+	printf("Client/server tokens: %08x/%08x\n\n", get_client_token(user), get_server_token(user));
 	
 }
 
+/* Get the number of users that currently exist, and the number of bytes that have been 
+ * set aside for them.  This is for statistics. */
+size_t user_get_count()
+{
+	return user_slab ? slab_get_count(user_slab) : 0;
+}
+size_t user_get_bytes()
+{
+	return user_slab ? slab_get_bytes(user_slab) + slab_get_bytes(details_slab) : 0;
+}
+
 /* Turn the user state into a string.  This string may NOT be modified! */
 const char *get_user_state_string(user_t *user)
 {
@@ -133,14 +613,29 @@ const char *get_user_state_string(user_t *user)
 /*
 int main(int argc, char *argv[])
 {
+	struct in_addr ip;
+	user_t *user;
+	size_t counts[] = { 10000, 100000 };
+	size_t i, j;
+
 	srand(time(NULL));
-	user_t *user = create_user(0);
+	ip.s_addr = htonl(0x7f000001);
+	user = create_user(0, ip);
 
 	print_user(user);
 	set_client_token(user, 0xbaadf00d);
-	set_state(user, SENT_CLIENT_INFORMATION);
+	set_user_state(user, SENT_CLIENT_INFORMATION);
 	set_username(user, "This is a username");
 	print_user(user);
+	destroy_user(user);
+
+	for(i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+	{
+		for(j = user_get_count(); j < counts[i]; j++)
+			create_user(j, ip);
+
+		printf("%u idle connections: %u bytes each\n", (unsigned int) user_get_count(), (unsigned int) (user_get_bytes() / user_get_count()));
+	}
 
 	return 0;
 }
@@ -10,9 +10,23 @@
 
 #include <stdint.h>
 
+#include <netinet/in.h>
+
 #include "account.h"
+#include "packet_buffer.h"
+#include "protocol.h"
+#include "types.h"
 
-#define IP_LENGTH 20
+/* The room structure is defined in room.h, which needs user_t itself */
+struct _room_t;
+/* The compression state is defined in compression.c */
+struct _compression_t;
+/* The outbox is defined in outbox.c */
+struct _outbox_t;
+/* The links to other servers are defined in federation.h */
+struct _peer_t;
+/* A link that another server is still proving itself on is defined in federation.c */
+struct _link_attempt_t;
 
 typedef enum
 {
@@ -31,39 +45,105 @@ typedef enum
 	NOT_IN_CHANNEL,
 
 	/* They've joined a channel, and they are now ready to go */
-	JOINED_CHANNEL
+	JOINED_CHANNEL,
+
+	/* They've disconnected, or been disconnected, and they're only waiting to be freed (see
+	 * user_retire()).  Nothing should be done with them. */
+	DEAD
 
 } user_states_t;
 
+/* The parts of a user that are only needed once in a while (when they log in, or when 
+ * somebody asks about them).  These are kept apart from user_t, so that the parts that are
+ * used for every packet are packed tightly together. */
 typedef struct
 {
-	int socket;
+	uint32_t client_token;
+	uint32_t server_token;
+
+	/* The address they connected from, stored in binary */
+	struct in_addr ip;
+
+	/* The number of times their stream has gotten out of sync, and had to be resynchronized */
+	uint32_t resyncs;
+
+	/* Their deflate stream, if they asked for compression, or NULL.  Their outbox has its own
+	 * pointer to it, so this is only needed to set it up, hand it off and clean it up. */
+	struct _compression_t *compression;
+
+	/* Whether they get a session token when they log in (see token.h) */
+	BOOLEAN session_tokens;
 
-	char username[MAX_NAME];
+	/* If they're really another server that's trying to link to this one, what's needed to
+	 * check its answer (see federation_greet()); otherwise, NULL.  This is freed with the
+	 * user. */
+	struct _link_attempt_t *link_attempt;
+} user_details_t;
+
+/* Everything that's looked at whenever something's sent to a user is in here (it's 64 bytes
+ * on a 64-bit machine), so sending to somebody never has to look at their details. */
+typedef struct
+{
+	int socket;
 	user_states_t state;
-	int client_token;
-	int server_token;
-	char *room;
 
-	char ip[IP_LENGTH];
-	
+	/* The room the user is currently in, or NULL.  This is a counted reference, and it's only
+	 * ever changed by room_add_user() and room_remove_user() */
+	struct _room_t *room;
+
+	/* The username is interned (see intern.h), so it's shared with every table the user
+	 * is in */
+	char *username;
+
+	/* Whatever's waiting to be written to them (see outbox.h), or NULL if they're on
+	 * another server */
+	struct _outbox_t *outbox;
+
+	/* The link to the server they're really on, if it isn't this one (see federation.h), or
+	 * NULL */
+	struct _peer_t *peer;
+
+	/* If they asked for numeric IDs, the names they've been introduced to, indexed by
+	 * number (NULL for the ones they haven't); otherwise, NULL.  Each of these holds a
+	 * reference to the interned name, so its number can't be given to another name while
+	 * they still know it by that number. */
+	char **introduced;
+	uint32_t introduced_size;
+
+	/* Whether they get joins and leaves batched up in SID_PRESENCE (see presence.h) */
+	BOOLEAN presence_batches;
+
+	user_details_t *details;
 } user_t;
 
 /* Create a new, empty user.  They start in state CONNECTED, with a NULL username, 
- * a blank client token, and a random server token */
-user_t *create_user(int socket, char *ip);
+ * a blank client token, and a random server token.  Users come from a slab (see slab.h), 
+ * so they have to be cleaned up with destroy_user(). */
+user_t *create_user(int socket, struct in_addr ip);
+/* Create a user who's logged in on another server, and is only here so they can be in
+ * rooms with the people on this one (see federation.h).  They don't have a socket, and
+ * anything that's sent to them is ignored, since their own server sends it to them. */
+user_t *create_remote_user(char *username, struct in_addr ip, struct _peer_t *peer);
 /* Clean up the user */
 void destroy_user(user_t *user);
+/* Clean up the user once no other thread can still be looking at them (see epoch.h).  They
+ * have to be gone already: out of their room, and anywhere else they can be found. */
+void user_retire(user_t *user);
 
 /* Get the user's socket */
 int get_socket(user_t *user);
+/* Get the link to the server the user is on, or NULL if they're on this one */
+struct _peer_t *get_user_peer(user_t *user);
 
 /* Set the username for the user, this should happen after they've authenticated */
 void set_username(user_t *user, char *username);
 /* Retrieve the username for the user */
 char *get_username(user_t *user);
-/* Retrieve the ip for the user */
+/* Retrieve the ip for the user, as a string.
+ * WARNING: returns a pointer to a static string, which is overwritten by the next call */
 char *get_ip(user_t *user);
+/* Retrieve the address the user connected from, in binary */
+struct in_addr get_user_address(user_t *user);
 /* Set the state for the user.  This module doesn't care what the state is, so make 
  * sure it's a valid transition */
 void set_user_state(user_t *user, user_states_t new_state);
@@ -78,16 +158,99 @@ uint32_t get_client_token(user_t *user);
 /* Get the server token, this is a random value generated when a user instance is
  * created */
 uint32_t get_server_token(user_t *user);
+/* Count another time that the user's stream got out of sync, and return the total so far */
+uint32_t add_user_resync(user_t *user);
+/* Start compressing big packets to the user.  This should only happen if they asked for it. */
+void enable_user_compression(user_t *user);
+
+/* A chat event on its way to one or more users.  It's encoded as a SID_CHATEVENT for the
+ * users that get names, and as a SID_CHATEVENT_ID for the ones that get numbers, but only
+ * the first time each is needed, so sending one event to a whole room costs at most two
+ * encodes. */
+typedef struct
+{
+	chatevent_packet_t event;
+	packet_buffer_t *full;
+	packet_buffer_t *compact;
+} outgoing_chatevent_t;
+
+/* Start sending a chat event.  The username has to be interned (get_username() is); so does
+ * the text, for EID_CHANNEL, since it's a room name (room_get_name() is). */
+void chatevent_begin(outgoing_chatevent_t *outgoing, chatevent_subtype_t subtype, char *username, char *text);
+/* Free whatever the chat event was encoded into */
+void chatevent_end(outgoing_chatevent_t *outgoing);
+/* Encode the chat event both ways right now, so it can be sent to different users from more
+ * than one thread at once (see broadcast.h); otherwise, it's encoded as it's needed */
+void chatevent_encode(outgoing_chatevent_t *outgoing);
 
-/* The name of the current chatroom, to save me a lot of time.
- * WARNING: returns a pointer to a static string, don't muck around with it  */
+/* Start sending the user numbers instead of names in chat events (see SID_CHATEVENT_ID in
+ * types.h).  This should only happen if they asked for it. */
+void enable_user_name_ids(user_t *user);
+/* Send a chat event to the user.  If they get numbers, any names they haven't been told
+ * about yet are introduced first. */
+void user_send_chatevent(user_t *user, outgoing_chatevent_t *outgoing);
+/* Send a series of chat events to the user, with as few writes as possible (one, unless
+ * there are a lot of them, or none if something was already waiting for them).  Returns
+ * the number of writes it took. */
+size_t user_send_chatevents(user_t *user, outgoing_chatevent_t *outgoing, size_t count);
+
+/* Start sending the user joins and leaves in SID_PRESENCE, instead of one chat event each.
+ * This should only happen if they asked for it. */
+void enable_user_presence_batches(user_t *user);
+/* Whether the user gets SID_PRESENCE */
+BOOLEAN get_user_presence_batches(user_t *user);
+
+/* Give the user a new session token whenever they log in (see token.h).  This should only
+ * happen if they asked for it. */
+void enable_user_session_tokens(user_t *user);
+/* Whether the user gets session tokens */
+BOOLEAN get_user_session_tokens(user_t *user);
+
+/* Set or get the link attempt the user is making, if they're another server (see
+ * federation.h).  The attempt has to be allocated with malloc(), and it's freed when the
+ * user is destroyed. */
+void set_user_link_attempt(user_t *user, struct _link_attempt_t *attempt);
+struct _link_attempt_t *get_user_link_attempt(user_t *user);
+
+/* Send a packet to the user, compressing it if they asked for compression and it's big 
+ * enough (see compression.h).  Keepalives, errors and login answers go ahead of anything
+ * else that's waiting for them (see outbox.h).  The packet isn't destroyed. */
+void user_send(user_t *user, packet_buffer_t *packet);
+/* Whether the user has anything waiting to be written.  If they do, select() should watch
+ * for their socket to be ready for writing, and call user_flush() when it is. */
+BOOLEAN user_is_waiting(user_t *user);
+/* Write as much of what's waiting for the user as their connection will take */
+void user_flush(user_t *user);
+
+/* Save the user into a record, for handing them off to a new server (see handoff.h):
+ * their state, name, address, tokens, and what they asked for.  Their room isn't saved
+ * here.  Returns FALSE if they can't be handed off (if they're using TLS, or see
+ * compression_save()). */
+BOOLEAN user_save(user_t *user, packet_buffer_t *record);
+/* Create a user on the given socket from a record that user_save() made, reading it from
+ * the record.  Returns NULL if the record is corrupt. */
+user_t *user_restore(int socket, packet_buffer_t *record);
+/* Get everything that's waiting to be written to the user, as the bytes that will go out
+ * (see outbox_get_waiting()) */
+uint8_t *user_get_waiting(user_t *user, size_t *length);
+/* Put bytes that were waiting to be written to the user by the old server back */
+void user_restore_waiting(user_t *user, uint8_t *data, size_t length);
+
+/* The name of the current chatroom, to save me a lot of time.  NULL if they aren't in one. 
+ * WARNING: returns a pointer to the room's own name, don't muck around with it  */
 char *get_user_room(user_t *user);
-/* Set the name of hte current room */
-void set_user_room(user_t *user, char *room_name);
+/* The room the user is currently in, or NULL if they aren't in one.  To change it, use 
+ * room_add_user() and room_remove_user() */
+struct _room_t *get_current_room(user_t *user);
 
 /* Display the user; for debugging */
 void print_user(user_t *user);
 
+/* Get the number of users that currently exist, and the number of bytes that have been 
+ * set aside for them.  This is for statistics. */
+size_t user_get_count();
+size_t user_get_bytes();
+
 
 #endif
 
@@ -0,0 +1,427 @@
+/* user_directory */
+/* This module keeps track of everybody who's logged in here, by name, with a lock for each
+ * stripe of names, and lookups that don't lock anything (see user_directory.h). */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "atomic.h"
+#include "epoch.h"
+#include "types.h"
+#include "user.h"
+
+#include "user_directory.h"
+
+/* The number of buckets a stripe starts with, once something is added to it.  It doubles
+ * whenever there are more names than buckets.  It has to be a power of 2. */
+#define STARTING_BUCKETS 16
+
+/* One person in the directory.  The name is kept right after the node, in the same block.
+ * Nothing but "next" ever changes once it's in a bucket. */
+typedef struct _node_t
+{
+	char *name;
+	uint32_t hash;
+	user_t *user;
+	struct _node_t *volatile next;
+} node_t;
+
+/* A stripe's buckets.  They never move: when there are too many names for them, a new set is
+ * made, with a copy of every node, and put in place of the old one all at once, so somebody
+ * who's looking through the old one still finds everything that was there.  The buckets are
+ * kept right after this, in the same block. */
+typedef struct
+{
+	size_t bucket_count;
+	node_t *volatile *buckets;
+} generation_t;
+
+/* One stripe: a little hashtable of its own.  Its lock is only taken to change it, or to go
+ * through all of it; the totals are only changed with the lock held, so they don't need to be
+ * atomic. */
+typedef struct
+{
+	pthread_mutex_t lock;
+	generation_t *volatile generation;
+	size_t count;
+	uint32_t changes;
+	uint32_t waits;
+} stripe_t;
+
+/* Each stripe is padded out to a couple of cache lines, so that a thread using one stripe
+ * doesn't slow down a thread using the one next to it */
+typedef union
+{
+	stripe_t stripe;
+	char padding[128];
+} padded_stripe_t;
+
+static padded_stripe_t stripes[USER_DIRECTORY_STRIPES];
+
+/* Hash a name (this is FNV-1a).  The low bits pick the stripe, and the rest pick the bucket. */
+static uint32_t hash_name(char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while(*name)
+	{
+		hash ^= (uint8_t) *name++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* Get the bucket that a hash belongs in */
+static node_t *volatile *get_bucket(generation_t *generation, uint32_t hash)
+{
+	return &generation->buckets[(hash / USER_DIRECTORY_STRIPES) & (generation->bucket_count - 1)];
+}
+
+/* Make a node for a name */
+static node_t *create_node(char *name, uint32_t hash, user_t *user)
+{
+	node_t *node = malloc(sizeof(node_t) + strlen(name) + 1);
+
+	assert(node); /* Out of memory */
+	node->name = (char *) (node + 1);
+	strcpy(node->name, name);
+	node->hash = hash;
+	node->user = user;
+	node->next = NULL;
+
+	return node;
+}
+
+/* Get the stripe a hash belongs to, and lock it to change it.  If somebody else has it, that's
+ * counted before waiting for them. */
+static stripe_t *lock_stripe(uint32_t hash)
+{
+	stripe_t *stripe = &stripes[hash & (USER_DIRECTORY_STRIPES - 1)].stripe;
+
+	if(pthread_mutex_trylock(&stripe->lock) != 0)
+	{
+		pthread_mutex_lock(&stripe->lock);
+		stripe->waits++;
+	}
+	stripe->changes++;
+
+	return stripe;
+}
+
+/* Find the link that points at the node for a name, in a stripe that's locked.  If the name
+ * isn't there, NULL is returned. */
+static node_t *volatile *find_link(stripe_t *stripe, char *name, uint32_t hash)
+{
+	node_t *volatile *link;
+
+	if(stripe->generation == NULL)
+		return NULL;
+
+	for(link = get_bucket(stripe->generation, hash); *link; link = &(*link)->next)
+		if((*link)->hash == hash && strcmp((*link)->name, name) == 0)
+			return link;
+
+	return NULL;
+}
+
+/* Double the number of buckets in a stripe that's locked.  The new buckets get a copy of
+ * every node, and once they're in place, the old ones (and the old nodes) are retired, since
+ * somebody might still be looking through them. */
+static void grow_stripe(stripe_t *stripe)
+{
+	generation_t *old = stripe->generation;
+	size_t new_count = old ? old->bucket_count << 1 : STARTING_BUCKETS;
+	generation_t *new = calloc(1, sizeof(generation_t) + new_count * sizeof(node_t *));
+	node_t *volatile *bucket;
+	node_t *copy;
+	node_t *node;
+	size_t i;
+
+	assert(new); /* Out of memory */
+	new->bucket_count = new_count;
+	new->buckets = (node_t *volatile *) (new + 1);
+
+	for(i = 0; old && i < old->bucket_count; i++)
+	{
+		for(node = old->buckets[i]; node; node = node->next)
+		{
+			copy = create_node(node->name, node->hash, node->user);
+			bucket = get_bucket(new, copy->hash);
+			copy->next = *bucket;
+			*bucket = copy;
+		}
+	}
+
+	/* Everything in the new buckets has to be there before anybody can find them */
+	ATOMIC_BARRIER();
+	stripe->generation = new;
+
+	if(old == NULL)
+		return;
+	for(i = 0; i < old->bucket_count; i++)
+		for(node = old->buckets[i]; node; node = node->next)
+			epoch_retire(free, node);
+	epoch_retire(free, old);
+}
+
+/* Set up the (empty) directory */
+void user_directory_initialize()
+{
+	size_t i;
+
+	for(i = 0; i < USER_DIRECTORY_STRIPES; i++)
+	{
+		memset(&stripes[i], 0, sizeof(padded_stripe_t));
+		pthread_mutex_init(&stripes[i].stripe.lock, NULL);
+	}
+}
+
+/* Give a name to somebody who's logging in, if nobody has it yet */
+BOOLEAN user_directory_add(char *name, user_t *user)
+{
+	uint32_t hash = hash_name(name);
+	stripe_t *stripe = lock_stripe(hash);
+	node_t *volatile *bucket;
+	node_t *node;
+
+	if(find_link(stripe, name, hash))
+	{
+		pthread_mutex_unlock(&stripe->lock);
+		return FALSE;
+	}
+
+	if(stripe->generation == NULL || stripe->count >= stripe->generation->bucket_count)
+		grow_stripe(stripe);
+
+	node = create_node(name, hash, user);
+	bucket = get_bucket(stripe->generation, hash);
+	node->next = *bucket;
+
+	/* The node has to be all there before anybody can find it */
+	ATOMIC_BARRIER();
+	*bucket = node;
+	stripe->count++;
+
+	pthread_mutex_unlock(&stripe->lock);
+
+	return TRUE;
+}
+
+/* Find whoever has the given name.  Nothing's locked: whatever's been removed or grown out of
+ * is only retired (see epoch.h), so the buckets and nodes that are found here are still good
+ * until the caller leaves its epoch, even if they're replaced meanwhile. */
+user_t *user_directory_find(char *name)
+{
+	uint32_t hash = hash_name(name);
+	generation_t *generation = stripes[hash & (USER_DIRECTORY_STRIPES - 1)].stripe.generation;
+	node_t *node;
+
+	if(generation == NULL)
+		return NULL;
+
+	for(node = *get_bucket(generation, hash); node; node = node->next)
+		if(node->hash == hash && strcmp(node->name, name) == 0)
+			return node->user;
+
+	return NULL;
+}
+
+/* Take somebody out of the directory, if they're still in it under the given name */
+BOOLEAN user_directory_remove(char *name, user_t *user)
+{
+	uint32_t hash = hash_name(name);
+	stripe_t *stripe = lock_stripe(hash);
+	node_t *volatile *link = find_link(stripe, name, hash);
+	node_t *node;
+
+	if(link == NULL || (*link)->user != user)
+	{
+		pthread_mutex_unlock(&stripe->lock);
+		return FALSE;
+	}
+
+	node = *link;
+	*link = node->next;
+	stripe->count--;
+
+	pthread_mutex_unlock(&stripe->lock);
+
+	/* Somebody might have found it just before it was taken out */
+	epoch_retire(free, node);
+
+	return TRUE;
+}
+
+/* Get everybody in the directory.  The stripes are locked one at a time, so if anybody logs
+ * in or out on another thread meanwhile, they might or might not be in the list. */
+user_t **user_directory_get_all(size_t *count)
+{
+	user_t **users = NULL;
+	size_t size = 0;
+	stripe_t *stripe;
+	node_t *node;
+	size_t i;
+	size_t j;
+
+	*count = 0;
+	for(i = 0; i < USER_DIRECTORY_STRIPES; i++)
+	{
+		stripe = &stripes[i].stripe;
+		pthread_mutex_lock(&stripe->lock);
+
+		if(*count + stripe->count > size)
+		{
+			size = (*count + stripe->count) * 2;
+			users = realloc(users, size * sizeof(user_t *));
+			assert(users); /* Out of memory */
+		}
+
+		for(j = 0; stripe->generation && j < stripe->generation->bucket_count; j++)
+			for(node = stripe->generation->buckets[j]; node; node = node->next)
+				users[(*count)++] = node->user;
+
+		pthread_mutex_unlock(&stripe->lock);
+	}
+
+	/* Whoever gets the list frees it, even if it's empty */
+	if(users == NULL)
+	{
+		users = malloc(sizeof(user_t *));
+		assert(users); /* Out of memory */
+	}
+
+	return users;
+}
+
+/* Get the number of people in the directory */
+size_t user_directory_get_count()
+{
+	size_t count = 0;
+	size_t i;
+
+	for(i = 0; i < USER_DIRECTORY_STRIPES; i++)
+	{
+		pthread_mutex_lock(&stripes[i].stripe.lock);
+		count += stripes[i].stripe.count;
+		pthread_mutex_unlock(&stripes[i].stripe.lock);
+	}
+
+	return count;
+}
+
+/* Get the totals so far */
+void user_directory_get_totals(uint32_t *changes, uint32_t *waits)
+{
+	size_t i;
+
+	*changes = 0;
+	*waits = 0;
+	for(i = 0; i < USER_DIRECTORY_STRIPES; i++)
+	{
+		pthread_mutex_lock(&stripes[i].stripe.lock);
+		*changes += stripes[i].stripe.changes;
+		*waits += stripes[i].stripe.waits;
+		pthread_mutex_unlock(&stripes[i].stripe.lock);
+	}
+}
+
+/* This is how fast the directory is with more and more threads using it at once.  There are
+ * 10000 people logged in, and each thread looks up names at random, in batches of 100, each
+ * in an epoch of its own; one time in 100, it logs one of its own people out and back in
+ * instead.  The first thread frees what's been retired between batches.  Build it with
+ * USER_DIRECTORY_STRIPES set to 1 to see what one lock for all the changes would cost.
+#include <stdio.h>
+#include <sys/time.h>
+
+#define PEOPLE 10000
+#define OPERATIONS 2000000
+#define BATCH 100
+
+static char names[PEOPLE][16];
+
+static void *hammer(void *argument)
+{
+	size_t thread = (size_t) argument;
+	uint32_t seed = thread * 2654435761U + 1;
+	size_t found = 0;
+	size_t own;
+	size_t i;
+
+	for(i = 0; i < OPERATIONS; i++)
+	{
+		if(i % BATCH == 0)
+		{
+			if(i > 0)
+				epoch_exit(thread);
+			if(thread == 0)
+				epoch_collect();
+			epoch_enter(thread);
+		}
+
+		seed = seed * 1103515245 + 12345;
+		if((seed >> 16) % 100 == 0)
+		{
+			own = (thread + 32 * ((seed >> 8) % (PEOPLE / 32))) % PEOPLE;
+			assert(user_directory_remove(names[own], (user_t *) names[own]));
+			assert(user_directory_add(names[own], (user_t *) names[own]));
+		}
+		else if(user_directory_find(names[(seed >> 8) % PEOPLE]))
+		{
+			found++;
+		}
+	}
+	epoch_exit(thread);
+
+	return (void *) found;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[32];
+	struct timeval start;
+	struct timeval end;
+	uint32_t changes;
+	uint32_t waits;
+	uint32_t retired;
+	uint32_t freed;
+	uint32_t advances;
+	uint32_t last_changes = 0;
+	uint32_t last_waits = 0;
+	double seconds;
+	size_t count;
+	size_t i;
+
+	user_directory_initialize();
+	for(i = 0; i < PEOPLE; i++)
+	{
+		sprintf(names[i], "user%05u", (unsigned int) i);
+		assert(user_directory_add(names[i], (user_t *) names[i]));
+	}
+	assert(!user_directory_add(names[0], NULL));
+
+	for(count = 1; count <= 32; count <<= 1)
+	{
+		gettimeofday(&start, NULL);
+		for(i = 0; i < count; i++)
+			pthread_create(&threads[i], NULL, hammer, (void *) i);
+		for(i = 0; i < count; i++)
+			pthread_join(threads[i], NULL);
+		gettimeofday(&end, NULL);
+
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+		user_directory_get_totals(&changes, &waits);
+		epoch_get_totals(&retired, &freed, &advances);
+		printf("%2u threads: %6.2fM operations/s (%u of %u changes waited; %u of %u retired nodes freed)\n", (unsigned int) count, count * OPERATIONS / seconds / 1000000, waits - last_waits, changes - last_changes, freed, retired);
+		last_changes = changes;
+		last_waits = waits;
+	}
+
+	assert(user_directory_get_count() == PEOPLE);
+
+	return 0;
+}
+*/
@@ -0,0 +1,56 @@
+/* user_directory */
+/* This module keeps track of everybody who's logged in here, by name.  It's what used to be
+ * the old_users table in server.c; it's used to find somebody to whisper to or /finger, and
+ * to keep two people from logging in with the same name.
+ *
+ * Unlike the rest of the server, this can be used from any thread at once.  The names are
+ * split into USER_DIRECTORY_STRIPES stripes by their hash, and each stripe has its own lock,
+ * so two threads only ever wait for each other if they're changing names in the same stripe
+ * at the same moment; with 64 stripes, that hardly ever happens.  Looking somebody up
+ * doesn't lock anything at all, and never waits for anybody: nothing in the directory is
+ * changed once it can be found, only replaced, and whatever's replaced is retired (see
+ * epoch.h) rather than freed.  The hash is worked out here, not by the intern pool (see
+ * intern.h), since that isn't thread-safe, and each name is copied into the directory, so
+ * nothing here points at anybody else's memory.
+ *
+ * Adding somebody only works if nobody has the name yet, and the check and the add happen
+ * under the same lock, so of two people logging in with the same name at the same moment,
+ * exactly one gets it.  That's what makes the ACCOUNT_IN_USE check right. */
+
+#ifndef _USER_DIRECTORY_H_
+#define _USER_DIRECTORY_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "types.h"
+#include "user.h"
+
+/* The number of stripes.  This has to be a power of 2. */
+#define USER_DIRECTORY_STRIPES 64
+
+/* Set up the (empty) directory.  This has to be called before anybody logs in. */
+void user_directory_initialize();
+
+/* Give a name to somebody who's logging in.  Returns FALSE, without changing anything, if
+ * somebody already has the name. */
+BOOLEAN user_directory_add(char *name, user_t *user);
+/* Find whoever has the given name.  Returns NULL if nobody does.  The caller has to be in an
+ * epoch (see epoch.h), and the user is only good until it leaves it. */
+user_t *user_directory_find(char *name);
+/* Take somebody out of the directory, if they're still in it under the given name (they
+ * might not be, if they were replaced or kicked).  Returns FALSE if they weren't. */
+BOOLEAN user_directory_remove(char *name, user_t *user);
+
+/* Get everybody in the directory, in no particular order.  The number of users is returned
+ * in count.  It has to be freed. */
+user_t **user_directory_get_all(size_t *count);
+/* Get the number of people in the directory */
+size_t user_directory_get_count();
+
+/* Get the totals so far: the number of names added and removed, and how many of those had to
+ * wait for another thread to finish with the stripe.  This is for statistics. */
+void user_directory_get_totals(uint32_t *changes, uint32_t *waits);
+
+#endif
+
@@ -0,0 +1,446 @@
+/* worker */
+/* This module sends chat from more than one thread, with each room belonging to one worker
+ * (see worker.h). */
+/* NOTE: These functions are NOT thread-safe; they're only used from the main thread. */
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "atomic.h"
+#include "epoch.h"
+#include "intern.h"
+#include "output.h"
+#include "room.h"
+#include "room_directory.h"
+#include "types.h"
+
+#include "worker.h"
+
+/* Something for a worker to do for a room */
+typedef struct
+{
+	size_t (*function)(void *);
+	void *argument;
+	room_t *room;
+} job_t;
+
+typedef struct
+{
+	pthread_t thread;
+
+	/* The jobs waiting for this worker.  "tail" is only moved by the main thread, once it's
+	 * added a job, and "head" only by the worker, once it's done one; the queue is empty
+	 * when they're the same.  They only ever go up, and are wrapped around the array when
+	 * they're used. */
+	job_t jobs[WORKER_QUEUE];
+	volatile size_t head;
+	volatile size_t tail;
+
+	/* Set by the main thread when there's something in the queue, and cleared by the worker
+	 * when it starts on it */
+	BOOLEAN woken;
+
+	/* How much the worker has sent since the last rebalance, and before that */
+	size_t load;
+	size_t total_load;
+} worker_t;
+
+/* The workers; the first is the main thread */
+static worker_t *workers = NULL;
+static size_t count = 1;
+
+/* The other workers wait on "wake" until there's something for them, and the main thread
+ * waits on "done" until there are no workers left "running" */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static size_t running = 0;
+
+/* The number of jobs added since the last worker_finish() */
+static size_t added = 0;
+
+/* The rooms' loads are only good for one period (between rebalances); a room whose period
+ * is out of date hasn't sent anything in this one */
+static size_t period = 1;
+static time_t last_rebalance = 0;
+
+/* The totals, for statistics */
+static uint32_t total_rounds = 0;
+static uint32_t total_jobs = 0;
+static uint32_t total_parallel_jobs = 0;
+static uint32_t total_moved = 0;
+
+/* Do a job, and count what it sent toward its room and the worker that did it */
+static void run_job(worker_t *worker, job_t *job)
+{
+	size_t load = job->function(job->argument);
+	room_t *room = job->room;
+
+	worker->load += load;
+	if(room == NULL)
+		return;
+
+	if(room->load_period != period)
+	{
+		room->load = 0;
+		room->load_period = period;
+	}
+	room->load += load;
+}
+
+/* Do everything in a worker's queue */
+static void run_jobs(worker_t *worker)
+{
+	while(worker->head != worker->tail)
+	{
+		/* The job was all there before the tail moved past it; don't look at it any sooner */
+		ATOMIC_BARRIER();
+		run_job(worker, &worker->jobs[worker->head & (WORKER_QUEUE - 1)]);
+		ATOMIC_BARRIER();
+		worker->head++;
+	}
+}
+
+/* What each of the other workers does, until the server exits */
+static void *run_worker(void *argument)
+{
+	worker_t *worker = (worker_t *) argument;
+
+	while(TRUE)
+	{
+		pthread_mutex_lock(&mutex);
+		while(!worker->woken)
+			pthread_cond_wait(&wake, &mutex);
+		worker->woken = FALSE;
+		pthread_mutex_unlock(&mutex);
+
+		/* The people and rooms it sends to can't be freed until it's done (see epoch.h).  The
+		 * main thread is already in an epoch whenever it sends. */
+		epoch_enter(worker - workers);
+		run_jobs(worker);
+		epoch_exit(worker - workers);
+
+		pthread_mutex_lock(&mutex);
+		if(--running == 0)
+			pthread_cond_signal(&done);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	return NULL;
+}
+
+/* Start the workers */
+void worker_initialize()
+{
+	sigset_t blocked;
+	sigset_t old;
+	long cores = WORKER_COUNT ? WORKER_COUNT : sysconf(_SC_NPROCESSORS_ONLN);
+	size_t i;
+
+	if(cores < 1)
+		cores = 1;
+	if(cores > WORKER_MAX)
+		cores = WORKER_MAX;
+	count = cores;
+
+	workers = calloc(count, sizeof(worker_t));
+	assert(workers); /* Out of memory */
+
+	/* Signals are the main thread's to deal with (see catch_signal() in server.c), so
+	 * the other workers start out with all of them blocked */
+	sigfillset(&blocked);
+	sigprocmask(SIG_BLOCK, &blocked, &old);
+	for(i = 1; i < count; i++)
+		if(pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0)
+			display_error(ERROR_EMERGENCY, "Couldn't start worker %u", (unsigned int) i);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+
+	if(count > 1)
+		display_message(ERROR_NOTICE, "Sending chat from %u workers", (unsigned int) count);
+}
+
+/* Get the number of workers */
+size_t worker_get_count()
+{
+	return count;
+}
+
+/* Give a new room to a worker.  The hash of its name is already known, and spreads the rooms
+ * out evenly. */
+void worker_assign(room_t *room)
+{
+	room->worker = intern_get_hash(room->name) % count;
+	room->load = 0;
+	room->load_period = 0;
+}
+
+/* Add a job to a worker's queue.  "room" is NULL if it isn't one room's. */
+static void add(worker_t *worker, room_t *room, size_t (*function)(void *), void *argument)
+{
+	job_t *job;
+	job_t full;
+
+	total_jobs++;
+
+	/* If the queue's full, the job's done right now; it's still only this thread sending to
+	 * the people it's for, so it's no different than the worker doing it */
+	if(worker->tail - worker->head == WORKER_QUEUE)
+	{
+		full.function = function;
+		full.argument = argument;
+		full.room = room;
+		run_job(worker, &full);
+		return;
+	}
+
+	job = &worker->jobs[worker->tail & (WORKER_QUEUE - 1)];
+	job->function = function;
+	job->argument = argument;
+	job->room = room;
+
+	/* The job has to be all there before the worker can see it */
+	ATOMIC_BARRIER();
+	worker->tail++;
+	added++;
+}
+
+/* Add a job for the room's worker */
+void worker_add(room_t *room, size_t (*function)(void *), void *argument)
+{
+	add(&workers[room->worker], room, function, argument);
+}
+/* Add a job for a particular worker */
+void worker_add_to(size_t worker, size_t (*function)(void *), void *argument)
+{
+	assert(worker < count);
+	add(&workers[worker], NULL, function, argument);
+}
+
+/* Move the busiest room that can go from the busiest worker to the least busy one, if the
+ * busiest is over its share */
+static void rebalance()
+{
+	worker_t *busiest = &workers[0];
+	worker_t *idlest = &workers[0];
+	room_t **rooms;
+	room_t *best = NULL;
+	size_t room_count;
+	size_t total = 0;
+	size_t i;
+
+	for(i = 0; i < count; i++)
+	{
+		total += workers[i].load;
+		if(workers[i].load > busiest->load)
+			busiest = &workers[i];
+		if(workers[i].load < idlest->load)
+			idlest = &workers[i];
+	}
+
+	if(busiest->load * count * 100 > total * WORKER_IMBALANCE)
+	{
+		/* A room that's as busy as the difference between the two would just make the idlest
+		 * one the busiest */
+		rooms = room_directory_get_live(&room_count);
+		for(i = 0; i < room_count; i++)
+			if(&workers[rooms[i]->worker] == busiest && rooms[i]->load_period == period && rooms[i]->load < busiest->load - idlest->load && (best == NULL || rooms[i]->load > best->load))
+				best = rooms[i];
+		free(rooms);
+
+		if(best)
+		{
+			display_message(ERROR_DEBUG, "Moving room %s (%u sent) from worker %u (%u sent) to worker %u (%u sent)", room_get_name(best), (unsigned int) best->load, (unsigned int) (busiest - workers), (unsigned int) busiest->load, (unsigned int) (idlest - workers), (unsigned int) idlest->load);
+			best->worker = idlest - workers;
+			total_moved++;
+		}
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		workers[i].total_load += workers[i].load;
+		workers[i].load = 0;
+	}
+	period++;
+}
+
+/* Do every job that's been added, and wait for all of them to be done */
+void worker_finish()
+{
+	time_t now;
+	size_t i;
+
+	if(added > 0)
+	{
+		pthread_mutex_lock(&mutex);
+		for(i = 1; i < count; i++)
+		{
+			if(workers[i].head != workers[i].tail)
+			{
+				total_parallel_jobs += workers[i].tail - workers[i].head;
+				workers[i].woken = TRUE;
+				running++;
+			}
+		}
+		if(running > 0)
+		{
+			pthread_cond_broadcast(&wake);
+			total_rounds++;
+		}
+		pthread_mutex_unlock(&mutex);
+
+		/* The main thread does its own share while it waits */
+		run_jobs(&workers[0]);
+
+		pthread_mutex_lock(&mutex);
+		while(running > 0)
+			pthread_cond_wait(&done, &mutex);
+		pthread_mutex_unlock(&mutex);
+
+		added = 0;
+	}
+
+	now = time(NULL);
+	if(count > 1 && now - last_rebalance >= WORKER_REBALANCE)
+	{
+		last_rebalance = now;
+		rebalance();
+	}
+}
+
+/* Get the totals so far.  This is for statistics. */
+void worker_get_totals(uint32_t *rounds, uint32_t *jobs, uint32_t *parallel_jobs, uint32_t *moved, double *busiest_share)
+{
+	size_t busiest = 0;
+	size_t total = 0;
+	size_t i;
+
+	for(i = 0; i < count; i++)
+	{
+		total += workers ? workers[i].total_load : 0;
+		if(workers && workers[i].total_load > busiest)
+			busiest = workers[i].total_load;
+	}
+
+	*rounds = total_rounds;
+	*jobs = total_jobs;
+	*parallel_jobs = total_parallel_jobs;
+	*moved = total_moved;
+	*busiest_share = total ? (double) busiest / total : 0;
+}
+
+/* A thousand rooms of eight, over socketpairs, all talking at once; the hot ones say fifty
+ * times as much, and all start out on worker 0, so it's overloaded until some are moved.  Set
+ * WORKER_COUNT to the number of workers to try. */
+/*
+#include <stdio.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "broadcast.h"
+#include "user.h"
+
+#define BENCHMARK_ROOMS 1000
+#define BENCHMARK_PEOPLE 8
+#define BENCHMARK_HOT 10
+#define BENCHMARK_SECONDS 5
+
+static double now()
+{
+	struct timeval time;
+
+	gettimeofday(&time, NULL);
+	return time.tv_sec + time.tv_usec / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	static int readers[BENCHMARK_ROOMS * BENCHMARK_PEOPLE];
+	static room_t *rooms[BENCHMARK_ROOMS];
+	static int hot[BENCHMARK_ROOMS];
+	size_t hot_count = 0;
+	struct in_addr address;
+	struct rlimit limit;
+	char buffer[65536];
+	char name[32];
+	int ends[2];
+	user_t *user;
+	double start;
+	double sending = 0;
+	double sent = 0;
+	size_t i;
+	size_t j;
+	uint32_t rounds;
+	uint32_t jobs;
+	uint32_t parallel_jobs;
+	uint32_t moved;
+	double busiest_share;
+
+	limit.rlim_cur = limit.rlim_max = BENCHMARK_ROOMS * BENCHMARK_PEOPLE * 2 + 64;
+	if(setrlimit(RLIMIT_NOFILE, &limit) < 0)
+	{
+		printf("This needs to be able to open %u files\n", (unsigned int) limit.rlim_cur);
+		return 1;
+	}
+
+	worker_initialize();
+	room_directory_initialize();
+	address.s_addr = 0;
+
+	for(i = 0; i < BENCHMARK_ROOMS; i++)
+	{
+		sprintf(name, "room%u", (unsigned int) i);
+		rooms[i] = room_directory_create(name);
+		room_set_batch_window(rooms[i], 0);
+
+		if(rooms[i]->worker == 0 && hot_count < BENCHMARK_HOT)
+		{
+			hot[i] = 1;
+			hot_count++;
+		}
+
+		for(j = 0; j < BENCHMARK_PEOPLE; j++)
+		{
+			socketpair(AF_UNIX, SOCK_STREAM, 0, ends);
+			readers[i * BENCHMARK_PEOPLE + j] = ends[1];
+
+			sprintf(name, "person%u", (unsigned int) (i * BENCHMARK_PEOPLE + j));
+			user = create_user(ends[0], address);
+			set_username(user, name);
+			room_add_user(rooms[i], user);
+		}
+	}
+
+	start = now();
+	while(now() - start < BENCHMARK_SECONDS)
+	{
+		for(i = 0; i < BENCHMARK_ROOMS; i++)
+		{
+			for(j = 0; j < (hot[i] ? 50 : 1); j++)
+			{
+				broadcast_message(rooms[i], EID_TALK, room_get_name(rooms[i]), "Hello, everybody in the room!");
+				sent += BENCHMARK_PEOPLE;
+			}
+		}
+
+		sending -= now();
+		broadcast_flush_due();
+		sending += now();
+
+		for(i = 0; i < BENCHMARK_ROOMS * BENCHMARK_PEOPLE; i++)
+			while(recv(readers[i], buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+				;
+	}
+
+	worker_get_totals(&rounds, &jobs, &parallel_jobs, &moved, &busiest_share);
+	printf("%2u workers: %.0f messages delivered per second of sending, %u rooms moved, the busiest worker sent %.1f%%\n", (unsigned int) worker_get_count(), sent / sending, moved, busiest_share * 100);
+
+	return 0;
+}
+*/
@@ -0,0 +1,88 @@
+/* worker */
+/* This module spreads the sending of chat over more than one core.
+ *
+ * Everything else still happens on the main thread: reading, logging in, joining and
+ * leaving, the room directory, the links to other servers, and so on.  None of those modules
+ * are thread-safe, and they don't need to be, since none of them take long.  What does take
+ * long is sending: one message in is a writev() out for everybody in the room (and a deflate,
+ * for everybody who asked for compression), so in a busy server that's where the time goes.
+ *
+ * So every room belongs to a worker (chosen by the hash of its name), and at the end of each
+ * trip through the select() loop, each room whose chat is due (see broadcast.h) is handed to
+ * its worker as a job.  Each worker has a queue that only the main thread adds to and only
+ * the worker takes from, so neither of them ever has to lock it.  The main thread is worker
+ * 0; it sends its own rooms' chat, then waits for the others to finish theirs before it goes
+ * back to select().
+ *
+ * Nobody is ever in more than one room, and a room's chat is only ever sent by one worker (or,
+ * for a room that's too big for one, each person in it is only sent to by one; see
+ * BROADCAST_SPLIT in broadcast.h), so no two threads ever write to the same connection.  That
+ * means that outboxes, compression streams and the names each connection has been told about
+ * don't need locks; only the totals that every connection adds to do (see atomic.h).  It also
+ * means that the same connections are written from the same core every time, so they stay in
+ * its cache.
+ *
+ * A room doesn't stay on its worker for good, though.  Every WORKER_REBALANCE seconds, if the
+ * busiest worker sent more than WORKER_IMBALANCE percent of its share of the chat (counting
+ * one message to one person as one), the busiest of its rooms that can go somewhere else
+ * without making that the busiest instead is moved to the least busy worker.  Rooms only move
+ * between trips through the loop, when nothing is being sent.
+ *
+ * With only one worker, or fewer than WORKER_MIN_ROOMS rooms due at once, everything's done
+ * on the main thread like it always was, since waking the other threads would cost more than
+ * it saves. */
+/* NOTE: These functions are NOT thread-safe; they're only used from the main thread. */
+
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "room.h"
+
+/* The number of workers, counting the main thread; 0 means one per core */
+#define WORKER_COUNT 0
+/* The most workers there can be; each one needs an epoch of its own (see EPOCH_THREADS in
+ * epoch.h) */
+#define WORKER_MAX 64
+
+/* The number of jobs each worker's queue has room for.  This has to be a power of 2.  If a
+ * queue is full, the main thread does the job itself. */
+#define WORKER_QUEUE 4096
+
+/* The fewest rooms due at once that are worth waking the other workers for */
+#define WORKER_MIN_ROOMS 2
+
+/* The number of seconds between looking for rooms to move, and how much busier than its
+ * share (in percent) a worker has to be for one of its rooms to be moved */
+#define WORKER_REBALANCE 1
+#define WORKER_IMBALANCE 125
+
+/* Start the workers (see WORKER_COUNT).  This has to be done before any rooms are created. */
+void worker_initialize();
+/* Get the number of workers, counting the main thread */
+size_t worker_get_count();
+
+/* Give a new room to a worker */
+void worker_assign(room_t *room);
+
+/* Add a job for the room's worker: the function is called with the argument, and returns
+ * how much it sent (the number of messages times the number of people they went to), which
+ * counts toward how busy the room is.  It isn't necessarily done until worker_finish(). */
+void worker_add(room_t *room, size_t (*function)(void *), void *argument);
+/* Add a job for a particular worker (numbered from 0 to worker_get_count() - 1), that isn't
+ * any one room's, like a piece of a room that's too big for one worker (see broadcast.h).
+ * What it sends only counts toward the worker. */
+void worker_add_to(size_t worker, size_t (*function)(void *), void *argument);
+/* Do every job that's been added, and wait for all of them to be done.  Once every
+ * WORKER_REBALANCE seconds, this also moves a room, if one of the workers is too busy. */
+void worker_finish();
+
+/* Get the totals so far: the number of times the other workers were woken up, the jobs done
+ * (and how many were done by the other workers), the rooms that were moved, and the share of
+ * everything sent that the busiest worker sent.  This is for statistics. */
+void worker_get_totals(uint32_t *rounds, uint32_t *jobs, uint32_t *parallel_jobs, uint32_t *moved, double *busiest_share);
+
+#endif
+